@@ -9,28 +9,89 @@
  *
  * @date    16 Sep 2023
  *
- * @TODO    Switch to an interrupt-driven ADC framework that uses DMA to read/
- *          store data from each of the 7 channels when triggered. This special
- *          approach is required since the ADC SFRs are not labeled by channel,
- *          i.e. otherwise we cannot tell which ADC value was read by which
- *          ADC channel (values are mixed up).
+ * TIM2 (see timers.c) puts out a trigger pulse every millisecond, and each
+ * one converts all seven channels in the order of scanChannels. The DMA
+ * stores them in two frames in circular mode: the half transfer interrupt
+ * means the first frame is complete, the transfer complete interrupt the
+ * second, and the DMA carries on into the other frame.
+ *
+ * Readers find the latest complete frame from frameCount alone, without
+ * locking: scans go into the two frames in turn starting with the first, so
+ * scan n is in frame (n - 1) % 2. The DMA only gets back to a frame a whole
+ * scan after finishing it, so a copy is good as long as frameCount didn't
+ * move while it was taken (a sequence lock).
+ *
+ * Capture mode borrows ADC1 for one channel at an audio rate: TIM5's CC1
+ * edge triggers each conversion, and the DMA fills two blocks in turn the
+ * same way, handing each full one to the capture callback.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include "ADC.h"
+#ifndef ADC_SIM_TEST
+#include "timers.h"
+#endif
 
 
 /*  PROTOTYPES  */
+#ifndef ADC_SIM_TEST
 static int8_t ADC_ConfigPins(void);
 static int8_t ADC_ConfigClks(void);
+static int8_t ADC_ConfigScan(void);
+static int8_t ADC_ConfigCapture(uint32_t channel);
+static int8_t ADC_ConfigTrigger(uint32_t period);
+static uint32_t ADC_TimerClock(void);
+#endif
+static uint32_t ADC_CapturePeriod(uint32_t timerClock, uint32_t rate);
+static void ADC_ResumeFrames(void);
+static void ADC_FrameDone(void);
+static void ADC_BlockDone(uint8_t block);
 
 
 /*  MODULE-LEVEL DEFINITIONS, MACROS    */
+// DMA mapping for ADC1 (RM0383 Table 28: DMA2 request mapping)
+#define ADC_DMA_STREAM DMA2_Stream0
+#define ADC_DMA_CHANNEL DMA_CHANNEL_0
+#define ADC_DMA_IRQn DMA2_Stream0_IRQn
+
+#define ADC_FRAMES 2
+#define ADC_LATEST_FRAME(count) (((count) - 1) % ADC_FRAMES)
+
+// Capture conversions: (56 + 12) cycles at 21 MHz is 3.2 us, plenty of room at ADC_CAPTURE_MAX_RATE.
+#define ADC_CAPTURE_SAMPLETIME ADC_SAMPLETIME_56CYCLES
+
+// Memory barrier, DMB on the Cortex-M4, a full fence when built on a host for testing.
+#if defined(__arm__)
+#define ADC_BARRIER() __asm volatile ("dmb" ::: "memory")
+#else
+#define ADC_BARRIER() __sync_synchronize()
+#endif
+
+#ifndef ADC_SIM_TEST
 static int8_t initStatus = FALSE;
+static DMA_HandleTypeDef hdma_adc1;
+static TIM_HandleTypeDef htim5;
+#endif
+
+// Conversion order of a scan, and so the order of the values in a frame.
+static const uint32_t scanChannels[ADC_NUM_CHANNELS] = {
+    ADC_0, ADC_1, POT, ADC_2, ADC_3, ADC_4, ADC_5
+};
+
+static volatile uint16_t frames[ADC_FRAMES][ADC_NUM_CHANNELS];  // Written by the DMA.
+static volatile uint32_t frameCount = 0;                        // Scans completed.
+
+// Capture mode, see ADC_StartCapture().
+static uint16_t captureBlocks[2][ADC_CAPTURE_BLOCK_SIZE];       // Written by the DMA.
+static volatile uint8_t isCapturing = FALSE;
+static ADC_CaptureCallback captureCallback = NULL;
+static uint32_t captureRate = 0;
+static volatile uint32_t blockCount = 0;
 
 
 /*  FUNCTIONS   */
+#ifndef ADC_SIM_TEST
 /** ADC_ConfigPins()
  *
  * Configure pins for use with the ADC.
@@ -55,47 +116,62 @@ static int8_t ADC_ConfigPins(void)
 
 /** ADC_ConfigClks()
  *
- * Configure clocks for use with the ADC.
+ * Configure clocks for use with the ADC and its DMA.
  *
  * @return  (int8_t)    [SUCCESS, ERROR]
  */
 static int8_t ADC_ConfigClks(void)
 {
     __HAL_RCC_ADC1_CLK_ENABLE();
+    __HAL_RCC_DMA2_CLK_ENABLE();
 
     return SUCCESS;
 }
 
 /** ADC_Start()
  *
- * Start ADC convesions.
+ * Start the timer-triggered scans.
  *
  * @return  (int8_t)    [SUCCESS, ERROR]
  */
 int8_t ADC_Start(void)
 {
-    HAL_ADC_Start(&hadc1);
+    ADC_ResumeFrames();
+    if (HAL_ADC_Start_DMA(&hadc1, (uint32_t *) frames, ADC_FRAMES * ADC_NUM_CHANNELS) != HAL_OK)
+    {
+        return ERROR;
+    }
 
     return SUCCESS;
 }
 
 /** ADC_End()
  *
- * Disables the A/D subsystem and releases the pins used.
+ * Disables the A/D subsystem and releases the pins used, stopping a capture
+ * first so that a later ADC_Init() starts back on the scans.
  *
  * @return  (int8_t)    [SUCCESS, ERROR]
  */
 int8_t ADC_End(void)
 {
-    HAL_ADC_Stop(&hadc1);
-	HAL_ADC_DeInit(&hadc1);
+    if (isCapturing)
+    {
+        HAL_TIM_PWM_Stop(&htim5, TIM_CHANNEL_1);
+        isCapturing = FALSE;
+        captureCallback = NULL;
+    }
+    HAL_ADC_Stop_DMA(&hadc1);
+    HAL_ADC_DeInit(&hadc1);
+    HAL_DMA_DeInit(&hdma_adc1);
+    initStatus = FALSE;
 
     return SUCCESS;
 }
+#endif  /*  ADC_SIM_TEST    */
 
 /** ADC_Read(channel)
  *
- * Selects ADC channel and returns 12-bit reading.
+ * Returns the channel's value from the latest scan.
  *
  * @param   channel (uint32_t)  Select ADC channel:
  *                                  [ADC_0, ADC_1, ..., ADC_5, POT]
@@ -103,23 +179,61 @@ int8_t ADC_End(void)
  */
 uint16_t ADC_Read(uint32_t channel)
 {
-	// Select channel and sampling time.
-	ADC_ChannelConfTypeDef sConfig = {0};
-	sConfig.Channel = channel;
-	sConfig.Rank = 1;
-	sConfig.SamplingTime = ADC_SAMPLETIME_3CYCLES;
-	HAL_ADC_ConfigChannel(&hadc1, &sConfig);
-	
-	// Start ADC Conversion, wait for conversion and return value.
-    ADC_Start();
-	HAL_ADC_PollForConversion(&hadc1, 1);
+    // One halfword load, it can't be torn, so no need for the sequence lock.
+    uint32_t count = frameCount;
+    for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++)
+    {
+        if (scanChannels[i] == channel)
+        {
+            return count == 0 ? 0 : frames[ADC_LATEST_FRAME(count)][i];
+        }
+    }
+    return 0;
+}
 
-	return HAL_ADC_GetValue(&hadc1);
+/** ADC_GetFrame(values)
+ *
+ * Copies out the latest scan.
+ *
+ * @param   values  (uint16_t *)    ADC_NUM_CHANNELS values, in scan order.
+ * @return          (uint32_t)      Number of the scan, 0 if none yet.
+ */
+uint32_t ADC_GetFrame(uint16_t *values)
+{
+    uint32_t count;
+    do
+    {
+        count = frameCount;
+        if (count == 0)
+        {
+            return 0;
+        }
+        ADC_BARRIER();
+        const volatile uint16_t *frame = frames[ADC_LATEST_FRAME(count)];
+        for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++)
+        {
+            values[i] = frame[i];
+        }
+        ADC_BARRIER();
+    } while (frameCount != count);
+
+    return count;
+}
+
+/** ADC_GetFrameCount()
+ *
+ * @return  (uint32_t)  Scans completed. It carries on when the scans are
+ *                      restarted (after a capture), rounded up to even.
+ */
+uint32_t ADC_GetFrameCount(void)
+{
+    return frameCount;
 }
 
+#ifndef ADC_SIM_TEST
 /** ADC_Init()
  *
- * Initializes the ADC subsystem with an interrupt; selects ADC Pin4 by default.
+ * Initializes the ADC subsystem and starts scanning all channels on TIM2.
  * 
  * @return  (int8_t)    [SUCCESS, ERROR]
  */
@@ -130,40 +244,43 @@ int8_t ADC_Init(void)
         ADC_ConfigPins();
         ADC_ConfigClks();
 
-        /**
-         * Configure the global features of the ADC (clock, resolution, data
-         * alignment and number of conversions).
-         */
+        // The scans are triggered by TIM2's update, once a millisecond.
+        if (TIMER_Init() != SUCCESS)
+        {
+            return ERROR;
+        }
+
         hadc1.Instance = ADC1;
-        hadc1.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV4;
-        hadc1.Init.Resolution = ADC_RESOLUTION_12B;
-        hadc1.Init.ScanConvMode = DISABLE;
-        hadc1.Init.ContinuousConvMode = ENABLE;
-        hadc1.Init.DiscontinuousConvMode = DISABLE;
-        hadc1.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
-        hadc1.Init.ExternalTrigConv = ADC_SOFTWARE_START;
-        hadc1.Init.DataAlign = ADC_DATAALIGN_RIGHT;
-		hadc1.Init.NbrOfConversion = 1;
-        hadc1.Init.DMAContinuousRequests = DISABLE;
-        hadc1.Init.EOCSelection = ADC_EOC_SINGLE_CONV;
-
-        if (HAL_ADC_Init(&hadc1) != HAL_OK)
-        {
-          return ERROR;
-        }
-
-		// By default, select onboard potentiometer.
-        ADC_ChannelConfTypeDef sConfig = {0};
-		sConfig.Channel = POT;
-		sConfig.Rank = 1;
-		sConfig.SamplingTime = ADC_SAMPLETIME_3CYCLES;
-		if (HAL_ADC_ConfigChannel(&hadc1, &sConfig) != HAL_OK)
-        {
-			return ERROR;
-		}
+        if (ADC_ConfigScan() != SUCCESS)
+        {
+            return ERROR;
+        }
+
+        // DMA for the scans (and captures), round and round over both frames.
+        hdma_adc1.Instance = ADC_DMA_STREAM;
+        hdma_adc1.Init.Channel = ADC_DMA_CHANNEL;
+        hdma_adc1.Init.Direction = DMA_PERIPH_TO_MEMORY;
+        hdma_adc1.Init.PeriphInc = DMA_PINC_DISABLE;
+        hdma_adc1.Init.MemInc = DMA_MINC_ENABLE;
+        hdma_adc1.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+        hdma_adc1.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+        hdma_adc1.Init.Mode = DMA_CIRCULAR;
+        hdma_adc1.Init.Priority = DMA_PRIORITY_LOW;
+        hdma_adc1.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+        if (HAL_DMA_Init(&hdma_adc1) != HAL_OK)
+        {
+            return ERROR;
+        }
+        __HAL_LINKDMA(&hadc1, DMA_Handle, hdma_adc1);
+        // Subpriority, there are no preemption bits under NVIC_PRIORITYGROUP_0 (HAL_MspInit()).
+        HAL_NVIC_SetPriority(ADC_DMA_IRQn, 0, 7);
+        HAL_NVIC_EnableIRQ(ADC_DMA_IRQn);
 
         // Start ADC.
-        ADC_Start();
+        if (ADC_Start() != SUCCESS)
+        {
+            return ERROR;
+        }
 
         // Complete initialization.
         initStatus = TRUE;
@@ -172,6 +289,317 @@ int8_t ADC_Init(void)
 	return SUCCESS;
 }
 
+/** ADC_StartCapture(channel, rate, callback)
+ *
+ * Stops the scans and samples one channel at the given rate.
+ *
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t ADC_StartCapture(uint32_t channel, uint32_t rate, ADC_CaptureCallback callback)
+{
+    uint32_t period = ADC_CapturePeriod(ADC_TimerClock(), rate);
+
+    if (initStatus == FALSE || isCapturing || callback == NULL || period == 0)
+    {
+        return ERROR;
+    }
+
+    HAL_ADC_Stop_DMA(&hadc1);
+    captureCallback = callback;
+    captureRate = ADC_TimerClock() / period;
+    blockCount = 0;
+    isCapturing = TRUE;
+
+    // The timer starts last, nothing is converted before the DMA is ready.
+    if (ADC_ConfigCapture(channel) != SUCCESS
+            || ADC_ConfigTrigger(period) != SUCCESS
+            || HAL_ADC_Start_DMA(&hadc1, (uint32_t *) captureBlocks, 2 * ADC_CAPTURE_BLOCK_SIZE) != HAL_OK
+            || HAL_TIM_PWM_Start(&htim5, TIM_CHANNEL_1) != HAL_OK)
+    {
+        ADC_StopCapture();
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+/** ADC_StopCapture()
+ *
+ * Stops capturing and goes back to scanning.
+ *
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t ADC_StopCapture(void)
+{
+    if (!isCapturing)
+    {
+        return SUCCESS;
+    }
+
+    HAL_TIM_PWM_Stop(&htim5, TIM_CHANNEL_1);
+    HAL_ADC_Stop_DMA(&hadc1);
+    isCapturing = FALSE;
+    captureCallback = NULL;
+    if (ADC_ConfigScan() != SUCCESS)
+    {
+        return ERROR;
+    }
+
+    return ADC_Start();
+}
+
+/** ADC_ConfigScan()
+ *
+ * Sets up ADC1 for the timer-triggered scans of every channel.
+ *
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+static int8_t ADC_ConfigScan(void)
+{
+    /**
+     * Configure the global features of the ADC (clock, resolution, data
+     * alignment and number of conversions): one scan of every channel
+     * per trigger, each conversion handed to the DMA.
+     */
+    hadc1.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV4;
+    hadc1.Init.Resolution = ADC_RESOLUTION_12B;
+    hadc1.Init.ScanConvMode = ENABLE;
+    hadc1.Init.ContinuousConvMode = DISABLE;
+    hadc1.Init.DiscontinuousConvMode = DISABLE;
+    hadc1.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_RISING;
+    hadc1.Init.ExternalTrigConv = ADC_EXTERNALTRIGCONV_T2_TRGO;
+    hadc1.Init.DataAlign = ADC_DATAALIGN_RIGHT;
+    hadc1.Init.NbrOfConversion = ADC_NUM_CHANNELS;
+    hadc1.Init.DMAContinuousRequests = ENABLE;
+    hadc1.Init.EOCSelection = ADC_EOC_SEQ_CONV;
+
+    if (HAL_ADC_Init(&hadc1) != HAL_OK)
+    {
+        return ERROR;
+    }
+
+    /**
+     * Scan order. There is time for a long sample: 7 * (84 + 12) cycles
+     * at 21 MHz is 32 us of every millisecond, and it lets the inputs
+     * (the pot especially) settle instead of reading low.
+     */
+    ADC_ChannelConfTypeDef sConfig = {0};
+    sConfig.SamplingTime = ADC_SAMPLETIME_84CYCLES;
+    for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++)
+    {
+        sConfig.Channel = scanChannels[i];
+        sConfig.Rank = i + 1;
+        if (HAL_ADC_ConfigChannel(&hadc1, &sConfig) != HAL_OK)
+        {
+            return ERROR;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/** ADC_ConfigCapture(channel)
+ *
+ * Sets up ADC1 to convert one channel on every TIM5 CC1 edge.
+ *
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+static int8_t ADC_ConfigCapture(uint32_t channel)
+{
+    hadc1.Init.ScanConvMode = DISABLE;
+    hadc1.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_RISING;
+    hadc1.Init.ExternalTrigConv = ADC_EXTERNALTRIGCONV_T5_CC1;
+    hadc1.Init.NbrOfConversion = 1;
+    hadc1.Init.EOCSelection = ADC_EOC_SINGLE_CONV;
+    if (HAL_ADC_Init(&hadc1) != HAL_OK)
+    {
+        return ERROR;
+    }
+
+    ADC_ChannelConfTypeDef sConfig = {0};
+    sConfig.Channel = channel;
+    sConfig.Rank = 1;
+    sConfig.SamplingTime = ADC_CAPTURE_SAMPLETIME;
+    if (HAL_ADC_ConfigChannel(&hadc1, &sConfig) != HAL_OK)
+    {
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+/** ADC_ConfigTrigger(period)
+ *
+ * Sets up TIM5 to trigger a conversion every period timer clocks.
+ *
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+static int8_t ADC_ConfigTrigger(uint32_t period)
+{
+    /**
+     * TIM5 is 32 bits, so no prescaler is needed and the rate is as close as
+     * the clock allows. Its CC1 edge, halfway through each period, starts a
+     * conversion. The output isn't routed to a pin.
+     */
+    __HAL_RCC_TIM5_CLK_ENABLE();
+    htim5.Instance = TIM5;
+    htim5.Init.Prescaler = 0;
+    htim5.Init.CounterMode = TIM_COUNTERMODE_UP;
+    htim5.Init.Period = period - 1;
+    htim5.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+    htim5.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
+    if (HAL_TIM_PWM_Init(&htim5) != HAL_OK)
+    {
+        return ERROR;
+    }
+
+    TIM_OC_InitTypeDef sConfigOC = {0};
+    sConfigOC.OCMode = TIM_OCMODE_PWM1;
+    sConfigOC.Pulse = period / 2;
+    sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
+    sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
+    if (HAL_TIM_PWM_ConfigChannel(&htim5, &sConfigOC, TIM_CHANNEL_1) != HAL_OK)
+    {
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+/** ADC_TimerClock()
+ *
+ * TIM5's clock: PCLK1, doubled when APB1 is divided down (RM0383 6.2).
+ *
+ * @return  (uint32_t)  Hz
+ */
+static uint32_t ADC_TimerClock(void)
+{
+    uint32_t clock = HAL_RCC_GetPCLK1Freq();
+    if ((RCC->CFGR & RCC_CFGR_PPRE1) != RCC_CFGR_PPRE1_DIV1)
+    {
+        clock *= 2;
+    }
+    return clock;
+}
+#endif  /*  ADC_SIM_TEST    */
+
+/** ADC_GetCaptureRate()
+ *
+ * @return  (uint32_t)  Actual capture rate in Hz, 0 when not capturing.
+ */
+uint32_t ADC_GetCaptureRate(void)
+{
+    return isCapturing ? captureRate : 0;
+}
+
+/** ADC_GetBlockCount()
+ *
+ * @return  (uint32_t)  Blocks captured since ADC_StartCapture().
+ */
+uint32_t ADC_GetBlockCount(void)
+{
+    return blockCount;
+}
+
+/** ADC_CapturePeriod(timerClock, rate)
+ *
+ * Timer periods between two samples, rounded to the nearest so the rate is
+ * as close as it gets either way.
+ *
+ * @return  (uint32_t)  Timer clocks per sample, 0 if rate is out of range.
+ */
+static uint32_t ADC_CapturePeriod(uint32_t timerClock, uint32_t rate)
+{
+    if (rate < ADC_CAPTURE_MIN_RATE || rate > ADC_CAPTURE_MAX_RATE)
+    {
+        return 0;
+    }
+    return (timerClock + rate / 2) / rate;
+}
+
+/** ADC_ResumeFrames()
+ *
+ * Gets the frames ready for the DMA to start over at the first one, keeping
+ * the latest scan readable meanwhile. frameCount carries on instead of going
+ * back to 0 (ADC_Read() would say 0 until the next scan, every time a capture
+ * stops), rounded up to even: the next scan is odd and lands in the first
+ * frame. If the latest scan is in the first frame it is copied to the second
+ * before the count moves, as the DMA overwrites the first frame first.
+ */
+static void ADC_ResumeFrames(void)
+{
+    uint32_t count = frameCount;
+    if (count % ADC_FRAMES == 0)
+    {
+        return;
+    }
+    for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++)
+    {
+        frames[1][i] = frames[0][i];
+    }
+    ADC_BARRIER();
+    frameCount = count + 1;
+}
+
+/*  INTERRUPTS  */
+/** ADC_FrameDone()
+ *
+ * A scan is complete, publish it once its values are in memory.
+ */
+static void ADC_FrameDone(void)
+{
+    ADC_BARRIER();
+    frameCount++;
+}
+
+/** ADC_BlockDone(block)
+ *
+ * A capture block is full, the DMA has moved on to the other one.
+ */
+static void ADC_BlockDone(uint8_t block)
+{
+    blockCount++;
+    if (captureCallback != NULL)
+    {
+        captureCallback(captureBlocks[block], ADC_CAPTURE_BLOCK_SIZE);
+    }
+}
+
+#ifndef ADC_SIM_TEST
+// The ADC's DMA stream is private to this module, so its handler lives here
+// instead of stm32f4xx_it.c
+void DMA2_Stream0_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_adc1);
+}
+
+void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef *hadc)
+{
+    if (hadc->Instance == ADC1)
+    {
+        if (isCapturing)
+        {
+            ADC_BlockDone(0);
+        } else {
+            ADC_FrameDone();
+        }
+    }
+}
+
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc)
+{
+    if (hadc->Instance == ADC1)
+    {
+        if (isCapturing)
+        {
+            ADC_BlockDone(1);
+        } else {
+            ADC_FrameDone();
+        }
+    }
+}
+#endif  /*  ADC_SIM_TEST    */
+
 
 /** ADC_TEST
  * 
@@ -202,7 +630,8 @@ int main(void)
 			printf("ADC_2 = %d\r\n", ADC_Read(ADC_2));
 			printf("ADC_3 = %d\r\n", ADC_Read(ADC_3));
 			printf("ADC_4 = %d\r\n", ADC_Read(ADC_4));
-			printf("ADC_5 = %d\r\n\r\n", ADC_Read(ADC_5));
+			printf("ADC_5 = %d\r\n", ADC_Read(ADC_5));
+			printf("%lu scans\r\n\r\n", ADC_GetFrameCount());
 			HAL_Delay(500);
 		}
 	} else {
@@ -212,3 +641,296 @@ int main(void)
 
 
 #endif  /*  ADC_TEST    */
+
+
+//#define ADC_CAPTURE_TEST
+#ifdef ADC_CAPTURE_TEST // ADC CAPTURE (LEVEL METER) TEST
+// Captures ADC_0 at 44.1 kHz for a few seconds, printing the level of each second's last block as a bar
+// (a microphone or line-in biased to mid-scale on ADC_0), then goes back to scanning.
+// SUCCESS - about 172 blocks a second at 44094 Hz, the bar follows the sound, and POT reads again after.
+
+#include <stdio.h>
+#include <math.h>
+#include <Board.h>
+#include <ADC.h>
+
+#define CAPTURE_SECONDS 5
+
+static volatile uint16_t peak = 0;
+static volatile uint16_t rms = 0;
+
+// Runs in the DMA interrupt, about 6 ms of samples per call at 44.1 kHz.
+static void Level(const uint16_t *block, uint16_t length)
+{
+    uint16_t blockPeak = 0;
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        int16_t sample = (int16_t) block[i] - (ADC_MAX + 1) / 2;
+        uint16_t magnitude = sample < 0 ? -sample : sample;
+        blockPeak = magnitude > blockPeak ? magnitude : blockPeak;
+        sum += (uint32_t) (sample * sample);
+    }
+    peak = blockPeak;
+    rms = (uint16_t) sqrtf((float) sum / length);
+}
+
+int main(void)
+{
+	BOARD_Init();
+	if (ADC_Init() == ERROR || ADC_StartCapture(ADC_0, 44100, Level) == ERROR)
+    {
+		printf("ADC capture init error\r\n");
+		while (TRUE);
+	}
+	printf("Capturing at %lu Hz\r\n", ADC_GetCaptureRate());
+
+	for (uint8_t second = 0; second < CAPTURE_SECONDS; second++)
+    {
+		uint32_t blocks = ADC_GetBlockCount();
+		HAL_Delay(1000);
+		char bar[33] = {0};
+		for (uint8_t i = 0; i < 32 && i < rms / 64; i++)
+        {
+			bar[i] = '#';
+		}
+		printf("%3lu blocks/s  peak %4u  rms %4u  |%-32s|\r\n", ADC_GetBlockCount() - blocks, peak, rms, bar);
+	}
+
+	ADC_StopCapture();
+	HAL_Delay(10);
+	printf("Scanning again, POT = %d\r\n", ADC_Read(POT));
+	while (TRUE);
+}
+
+
+#endif  /*  ADC_CAPTURE_TEST    */
+
+
+//#define ADC_SIM_TEST
+#ifdef ADC_SIM_TEST // ADC SIMULATED DMA TEST
+// Runs on a host, a thread stands in for the DMA and its interrupt, writing scans into the frames one
+// conversion at a time and calling ADC_FrameDone() like the half/full transfer callbacks do:
+//   gcc -O2 -I. -DADC_SIM_TEST -pthread ADC.c -o adc_sim && ./adc_sim
+// Each value holds its scan number and channel, so a frame mixing two scans can be spotted. The simulated
+// DMA runs flat out, with no pause between scans, which is much harder on the readers than the 1 ms of
+// the real trigger.
+// SUCCESS - ADC_GetFrame() never returns a mixed frame and its scan numbers match the values and only go
+// up, while copying the latest frame directly (no sequence lock) does get mixed frames.
+// The capture mode is then run on a simulated 84 MHz timer clock for a second at each of the usual audio
+// rates, a conversion every ADC_CapturePeriod() clocks and each sample numbered.
+// SUCCESS - every rate is within 0.1% of the one asked for and matches ADC_GetCaptureRate(), each block
+// passed to the callback holds the next ADC_CAPTURE_BLOCK_SIZE samples in order, and a block is still
+// intact one sample period short of a whole block later (but not a block later).
+
+#include <pthread.h>
+#include <time.h>
+
+#define SIM_SECONDS 2
+#define SIM_VALUE(scan, channel) ((uint16_t) ((((scan) & 0x1FF) << 3) | (channel)))
+
+#define SIM_TIMER_CLOCK 84000000
+
+static volatile uint8_t isRunning = TRUE;
+
+// Capture handoff, checked by the callback and after each simulated conversion. The blocks handed over
+// are followed for a while after, as if a slow consumer were still working on them.
+typedef struct {
+    const uint16_t *block;
+    uint16_t first;     // Its first sample number when handed over.
+    uint32_t age;       // Samples converted since.
+} HeldBlock;
+
+static HeldBlock held[2];
+static uint32_t nextSample, outOfOrder, shortBlocks, heldIntact, heldOverrun, heldChecks, lateChecks;
+
+static uint8_t IsIntact(const HeldBlock *h)
+{
+    for (uint16_t i = 0; i < ADC_CAPTURE_BLOCK_SIZE; i++)
+    {
+        if (h->block[i] != (uint16_t) (h->first + i))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void Capture(const uint16_t *block, uint16_t length)
+{
+    shortBlocks += length != ADC_CAPTURE_BLOCK_SIZE;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        outOfOrder += block[i] != (uint16_t) nextSample++;
+    }
+    held[ADC_GetBlockCount() % 2] = (HeldBlock) {block, block[0], 0};
+}
+
+static void *Dma(void *arg)
+{
+    (void) arg;
+    uint32_t scan = 1;
+    while (isRunning)
+    {
+        for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++)
+        {
+            frames[ADC_LATEST_FRAME(scan)][i] = SIM_VALUE(scan, i);
+        }
+        ADC_FrameDone();
+        scan++;
+    }
+    return NULL;
+}
+
+// TRUE if all values come from one scan, in scan order.
+static int IsWhole(const uint16_t *values)
+{
+    for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++)
+    {
+        if ((values[i] & 0x7) != i || (values[i] >> 3) != (values[0] >> 3))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+int main(void)
+{
+    uint16_t values[ADC_NUM_CHANNELS];
+    uint32_t reads = 0, mixed = 0, backwards = 0, lastScan = 0;
+    uint32_t directReads = 0, directMixed = 0, potErrors = 0;
+    pthread_t dma;
+
+    printf("Before the first scan: frame %lu, POT %u\r\n", (unsigned long) ADC_GetFrame(values), ADC_Read(POT));
+    pthread_create(&dma, NULL, Dma, NULL);
+
+    time_t end = time(NULL) + SIM_SECONDS;
+    while (time(NULL) < end)
+    {
+        uint32_t scan = ADC_GetFrame(values);
+        if (scan == 0)
+        {
+            continue;
+        }
+        reads++;
+        mixed += !IsWhole(values);
+        // The low 9 bits of the scan number are in the values.
+        backwards += scan < lastScan || (values[0] >> 3) != (scan & 0x1FF);
+        lastScan = scan;
+
+        // The same copy without the sequence lock.
+        const volatile uint16_t *frame = frames[ADC_LATEST_FRAME(ADC_GetFrameCount())];
+        for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++)
+        {
+            values[i] = frame[i];
+        }
+        directReads++;
+        directMixed += !IsWhole(values);
+
+        potErrors += (ADC_Read(POT) & 0x7) != 2;
+    }
+    isRunning = FALSE;
+    pthread_join(dma, NULL);
+
+    printf("%lu scans by the simulated DMA\r\n", (unsigned long) ADC_GetFrameCount());
+    printf("ADC_GetFrame():  %lu reads, %lu mixed frames, %lu out of order\r\n", (unsigned long) reads,
+            (unsigned long) mixed, (unsigned long) backwards);
+    printf("Direct copy:     %lu reads, %lu mixed frames\r\n", (unsigned long) directReads,
+            (unsigned long) directMixed);
+    printf("ADC_Read(POT):   %lu from another channel\r\n", (unsigned long) potErrors);
+    int success = reads > 0 && mixed == 0 && backwards == 0 && potErrors == 0;
+
+    // Back to the scans after a capture, ADC_StopCapture() -> ADC_Start() -> ADC_ResumeFrames(): straight
+    // after it the last scan still reads back, whichever frame it is in (scan 1 with nothing in the other),
+    // and the next scan the DMA puts in the first frame is the one read after it.
+    uint32_t lastScans[] = {1, 2, lastScan | 1, (lastScan | 1) + 1};
+    uint32_t restartErrors = 0;
+    for (uint8_t n = 0; n < sizeof(lastScans) / sizeof(lastScans[0]); n++)
+    {
+        uint32_t last = lastScans[n];
+        for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++)
+        {
+            frames[ADC_LATEST_FRAME(last)][i] = SIM_VALUE(last, i);
+            frames[ADC_LATEST_FRAME(last + 1)][i] = last > 1 ? SIM_VALUE(last - 1, i) : 0;
+        }
+        frameCount = last;
+        ADC_ResumeFrames();
+        uint32_t count = ADC_GetFrame(values);
+        restartErrors += count < last || count % 2 != 0 || !IsWhole(values) || (values[0] >> 3) != (last & 0x1FF)
+                || ADC_Read(POT) != SIM_VALUE(last, 2);
+        for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++)
+        {
+            frames[0][i] = SIM_VALUE(count + 1, i);
+        }
+        ADC_FrameDone();
+        restartErrors += ADC_GetFrameCount() != count + 1 || ADC_Read(POT) != SIM_VALUE(count + 1, 2);
+    }
+    printf("Scans restarted: %lu wrong reads\r\n", (unsigned long) restartErrors);
+    success = success && restartErrors == 0;
+
+    // Capture, as set up by ADC_StartCapture().
+    static const uint32_t rates[] = {8000, 22050, 32000, 44100, 48000, ADC_CAPTURE_MAX_RATE};
+    captureCallback = Capture;
+    isCapturing = TRUE;
+    for (uint8_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+    {
+        uint32_t period = ADC_CapturePeriod(SIM_TIMER_CLOCK, rates[r]);
+        uint32_t samples = 0;
+        captureRate = SIM_TIMER_CLOCK / period;
+        blockCount = nextSample = outOfOrder = shortBlocks = heldIntact = heldOverrun = 0;
+        heldChecks = lateChecks = 0;
+        held[0].block = held[1].block = NULL;
+
+        // One second of timer clocks, a conversion on every CC1 edge.
+        for (uint32_t clock = period / 2; clock < SIM_TIMER_CLOCK; clock += period)
+        {
+            uint32_t index = samples % (2 * ADC_CAPTURE_BLOCK_SIZE);
+            captureBlocks[index / ADC_CAPTURE_BLOCK_SIZE][index % ADC_CAPTURE_BLOCK_SIZE] = (uint16_t) samples;
+            samples++;
+            for (uint8_t h = 0; h < 2; h++)
+            {
+                if (held[h].block != NULL)
+                {
+                    held[h].age++;
+                    if (held[h].age == ADC_CAPTURE_BLOCK_SIZE - 1)
+                    {
+                        heldIntact += IsIntact(&held[h]);
+                        heldChecks++;
+                    } else if (held[h].age == ADC_CAPTURE_BLOCK_SIZE + 1) {
+                        heldOverrun += !IsIntact(&held[h]);
+                        lateChecks++;
+                    }
+                }
+            }
+            if (index == ADC_CAPTURE_BLOCK_SIZE - 1)
+            {
+                ADC_BlockDone(0);
+            } else if (index == 2 * ADC_CAPTURE_BLOCK_SIZE - 1) {
+                ADC_BlockDone(1);
+            }
+        }
+
+        double error = 100.0 * ((double) samples - rates[r]) / rates[r];
+        uint32_t blocks = samples / ADC_CAPTURE_BLOCK_SIZE;
+        printf("Capture %6lu Hz: %4lu clocks, %6lu samples/s (%+.3f%%), reported %6lu, %3lu blocks, "
+                "%lu out of order, %lu short, %lu/%lu held intact, %lu/%lu overrun a block later\r\n",
+                (unsigned long) rates[r], (unsigned long) period, (unsigned long) samples, error,
+                (unsigned long) ADC_GetCaptureRate(), (unsigned long) ADC_GetBlockCount(),
+                (unsigned long) outOfOrder, (unsigned long) shortBlocks, (unsigned long) heldIntact,
+                (unsigned long) heldChecks, (unsigned long) heldOverrun, (unsigned long) lateChecks);
+        success = success && error < 0.1 && error > -0.1 && samples == ADC_GetCaptureRate()
+                && ADC_GetBlockCount() == blocks && outOfOrder == 0 && shortBlocks == 0
+                && heldChecks > 0 && heldIntact == heldChecks && lateChecks > 0 && heldOverrun == lateChecks;
+    }
+    printf("Out of range: %lu Hz -> %lu, %lu Hz -> %lu\r\n", (unsigned long) ADC_CAPTURE_MIN_RATE - 1,
+            (unsigned long) ADC_CapturePeriod(SIM_TIMER_CLOCK, ADC_CAPTURE_MIN_RATE - 1),
+            (unsigned long) ADC_CAPTURE_MAX_RATE + 1,
+            (unsigned long) ADC_CapturePeriod(SIM_TIMER_CLOCK, ADC_CAPTURE_MAX_RATE + 1));
+    success = success && ADC_CapturePeriod(SIM_TIMER_CLOCK, ADC_CAPTURE_MIN_RATE - 1) == 0
+            && ADC_CapturePeriod(SIM_TIMER_CLOCK, ADC_CAPTURE_MAX_RATE + 1) == 0;
+    printf("%s\r\n", success ? "SUCCESS" : "ERROR");
+    return !success;
+}
+
+#endif  /*  ADC_SIM_TEST    */
@@ -9,18 +9,29 @@
  *
  * @date    16 Sep 2023
  *
- * @TODO    Switch to an interrupt-driven ADC framework that uses DMA to read/
- *          store data from each of the 7 channels when triggered. This special
- *          approach is required since the ADC SFRs are not labeled by channel,
- *          i.e. otherwise we cannot tell which ADC value was read by which
- *          ADC channel (values are mixed up).
+ * All seven channels are converted as one scan every millisecond, triggered
+ * by TIM2 (the timers module tick), and the DMA stores each scan in rank
+ * order, so every value is labeled by its position. The DMA alternates
+ * between two frames: while it fills one, the other holds the latest
+ * complete scan. Reading a channel is just a load from that frame, no
+ * conversion is started and nothing waits.
  */
 #ifndef ADC_H
 #define	ADC_H
 
 #include <stdint.h>
+#ifndef ADC_SIM_TEST // The simulated DMA test runs on a host, without the HAL.
 #include "stm32f4xx_hal.h"
 #include "stm32f4xx_hal_adc.h"
+#else
+#define ADC_CHANNEL_0 0x0U
+#define ADC_CHANNEL_1 0x1U
+#define ADC_CHANNEL_4 0x4U
+#define ADC_CHANNEL_10 0xAU
+#define ADC_CHANNEL_11 0xBU
+#define ADC_CHANNEL_12 0xCU
+#define ADC_CHANNEL_13 0xDU
+#endif
 
 
 /*  MODULE-LEVEL VARIABLES, MACROS  */
@@ -34,6 +45,11 @@
 #define ADC_NUM_CHANNELS    7
 #define ADC_MIN             0
 #define ADC_MAX             4095
+#define ADC_SAMPLE_RATE     1000            // Scans per second, one per TIM2 tick.
+
+#define ADC_CAPTURE_BLOCK_SIZE  256         // Samples per capture callback.
+#define ADC_CAPTURE_MIN_RATE    100         // Hz
+#define ADC_CAPTURE_MAX_RATE    100000      // Hz, a conversion is 3.2 us.
 
 #ifndef FALSE
 #define FALSE ((int8_t) 0)
@@ -48,13 +64,23 @@
 #define SUCCESS ((int8_t) 1)
 #endif  /*  SUCCESS */
 
+#ifndef ADC_SIM_TEST
 ADC_HandleTypeDef hadc1;
+#endif
+
+/** ADC_CaptureCallback(block, length)
+ *
+ * Called from the DMA interrupt with each full block of samples, oldest
+ * first. The block is only stable until the next one is full, so it has to
+ * be used (or copied) within ADC_CAPTURE_BLOCK_SIZE sample periods.
+ */
+typedef void (*ADC_CaptureCallback)(const uint16_t *block, uint16_t length);
 
 
 /*  PROTOTYPES  */
 /** ADC_Start()
  *
- * Start ADC conversions for polling.
+ * Start the timer-triggered scans, ADC_Init() already does.
  *
  * @return  (int8_t)    [SUCCESS, ERROR]
  */
@@ -62,7 +88,7 @@ int8_t ADC_Start(void);
 
 /** ADC_End()
  *
- * Disables the A/D subsystem and releases the pins used.
+ * Disables the A/D subsystem and releases the pins used, stops a capture too.
  *
  * @return  (int8_t)    [SUCCESS, ERROR]
  */
@@ -70,17 +96,77 @@ int8_t ADC_End(void);
 
 /** ADC_Read(channel)
  *
- * Selects ADC channel and returns 12-bit reading.
+ * Returns the channel's value from the latest scan, at most a millisecond
+ * old. There are no scans while a capture runs (ADC_StartCapture()), the
+ * value is then the one from the last scan before it, however long ago.
+ * Safe to call from interrupts.
  *
  * @param   channel (uint32_t)  Select ADC channel
  *                                  (ADC_0, ADC_1, ..., ADC_5, POT)
- * @return          (uint16_t)  12-bit ADC reading.
+ * @return          (uint16_t)  12-bit ADC reading, 0 for an unknown channel
+ *                              or before the first scan.
  */
 uint16_t ADC_Read(uint32_t channel);
 
+/** ADC_GetFrame(values)
+ *
+ * Copies out the latest scan, all seven channels from the same instant.
+ * Lock-free: if the DMA moves on to a newer scan during the copy, the copy
+ * is taken again. Not for interrupts that preempt the DMA interrupt. The
+ * scan number stands still while a capture runs, like the values.
+ *
+ * @param   values  (uint16_t *)    ADC_NUM_CHANNELS values, in the order
+ *                                  ADC_0, ADC_1, POT, ADC_2, ..., ADC_5.
+ * @return          (uint32_t)      Number of the scan, 0 if there hasn't
+ *                                  been one yet (values untouched).
+ */
+uint32_t ADC_GetFrame(uint16_t *values);
+
+/** ADC_GetFrameCount()
+ *
+ * @return  (uint32_t)  Scans completed. It carries on when the scans are
+ *                      restarted (after a capture), rounded up to even.
+ */
+uint32_t ADC_GetFrameCount(void);
+
+/** ADC_StartCapture(channel, rate, callback)
+ *
+ * Stops the scans and converts one channel at the given rate, triggered by
+ * TIM5, passing every ADC_CAPTURE_BLOCK_SIZE samples to callback. The rate
+ * is rounded to a whole number of timer clocks, see ADC_GetCaptureRate().
+ *
+ * @param   channel     (uint32_t)  Select ADC channel (ADC_0, ..., POT)
+ * @param   rate        (uint32_t)  Samples per second, ADC_CAPTURE_MIN_RATE
+ *                                  to ADC_CAPTURE_MAX_RATE.
+ * @param   callback    (ADC_CaptureCallback)   Block handler.
+ * @return              (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t ADC_StartCapture(uint32_t channel, uint32_t rate, ADC_CaptureCallback callback);
+
+/** ADC_StopCapture()
+ *
+ * Stops capturing and goes back to scanning all channels.
+ *
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t ADC_StopCapture(void);
+
+/** ADC_GetCaptureRate()
+ *
+ * @return  (uint32_t)  The actual capture rate in Hz, 0 when not capturing.
+ */
+uint32_t ADC_GetCaptureRate(void);
+
+/** ADC_GetBlockCount()
+ *
+ * @return  (uint32_t)  Blocks captured since ADC_StartCapture().
+ */
+uint32_t ADC_GetBlockCount(void);
+
 /** ADC_Init()
  *
- * Initializes the ADC subsystem with an interrupt; selects ADC Pin4 by default.
+ * Initializes the ADC subsystem, starts TIM2 if it isn't running yet and
+ * starts scanning.
  * 
  * @return  (int8_t)    [SUCCESS, ERROR]
  */
@@ -13,8 +13,17 @@
 #include <stdio.h>
 #include <I2C.h>
 #include <BNO055.h> 
+#include <Profile.h>
+#ifndef BNO055_SIM_TEST // The simulated register map test stands in for the board.
 #include <timers.h>
 #include <Board.h>
+#else
+int8_t BOARD_Init(void);
+char TIMER_Init(void);
+uint32_t TIMERS_GetMicroSeconds(void);
+#define __disable_irq()
+#define __enable_irq()
+#endif
 
 
 /*  MODULE-LEVEL DEFINITIONS, MACROS    */
@@ -241,8 +250,21 @@ static enum
 } BNO055_opmode;
 
 
+// State of the asynchronous burst read, rawData is written by the DMA.
+static uint8_t rawData[BNO055_DATA_SIZE];
+static BNO055_Data *asyncData = NULL;
+static BNO055_Callback asyncCallback = NULL;
+static volatile uint8_t isReading = FALSE; // rawData is in use until the read finishes.
+
+// Profiling zones, empty unless built with PROFILE_ENABLED (see Profile.h).
+PROFILE_ZONE(readAllZone, "BNO055_ReadAll");
+PROFILE_ZONE(readAllAsyncZone, "BNO055_ReadAllAsync");
+PROFILE_ZONE(finishReadZone, "BNO055_FinishRead");
+
+
 /*  PROTOTYPES  */
 void DelayMicros(uint32_t microsec);
+static void BNO055_FinishRead(int8_t status);
 
 
 /*  FUNCTIONS   */
@@ -440,6 +462,88 @@ int BNO055_ReadMagZ(void)
     return (I2C_ReadInt(BNO055_ADDRESS_A, BNO055_MAG_DATA_Z_LSB_ADDR, 0));
 }
 
+/** BNO055_ReadAll(data)
+ *
+ * Reads all nine raw sensor axes in a single I2C burst.
+ *
+ * @param   data    (BNO055_Data *) Filled in with the sample.
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t BNO055_ReadAll(BNO055_Data *data)
+{
+    uint8_t raw[BNO055_DATA_SIZE];
+    PROFILE_BEGIN(readAllZone);
+    int8_t result = I2C_ReadBytes(BNO055_ADDRESS_A, BNO055_ACCEL_DATA_X_LSB_ADDR, raw, BNO055_DATA_SIZE);
+    if (result == SUCCESS)
+    {
+        BNO055_ParseData(raw, data);
+    }
+    PROFILE_END(readAllZone);
+    return result;
+}
+
+/** BNO055_ReadAllAsync(data, callback)
+ *
+ * Starts the same burst as BNO055_ReadAll() through the I2C DMA.
+ *
+ * @param   data        (BNO055_Data *) Filled in with the sample.
+ * @param   callback    (BNO055_Callback) Called from the interrupt when done.
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t BNO055_ReadAllAsync(BNO055_Data *data, BNO055_Callback callback)
+{
+    // Can be called from a timer interrupt, so the check and the claim are one step.
+    __disable_irq();
+    uint8_t wasReading = isReading;
+    isReading = TRUE;
+    __enable_irq();
+    if (wasReading)
+    {
+        return ERROR;
+    }
+
+    asyncData = data;
+    asyncCallback = callback;
+    // High priority: the read goes out as soon as the transfer on the bus is done.
+    PROFILE_BEGIN(readAllAsyncZone);
+    int8_t result = I2C_ReadBytesAsync(
+        BNO055_ADDRESS_A,
+        BNO055_ACCEL_DATA_X_LSB_ADDR,
+        rawData,
+        BNO055_DATA_SIZE,
+        I2C_PRIORITY_HIGH,
+        BNO055_FinishRead
+    );
+    PROFILE_END(readAllAsyncZone);
+    if (result != SUCCESS)
+    {
+        asyncCallback = NULL;
+        isReading = FALSE;
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/** BNO055_ParseData(raw, data)
+ *
+ * Unpacks the data registers, little endian pairs in register order.
+ *
+ * @param   raw     (const uint8_t *) Registers 0x08 to 0x19.
+ * @param   data    (BNO055_Data *) Filled in with the sample.
+ */
+void BNO055_ParseData(const uint8_t *raw, BNO055_Data *data)
+{
+    data->accelX = (int16_t) (raw[0] | (raw[1] << 8));
+    data->accelY = (int16_t) (raw[2] | (raw[3] << 8));
+    data->accelZ = (int16_t) (raw[4] | (raw[5] << 8));
+    data->magX = (int16_t) (raw[6] | (raw[7] << 8));
+    data->magY = (int16_t) (raw[8] | (raw[9] << 8));
+    data->magZ = (int16_t) (raw[10] | (raw[11] << 8));
+    data->gyroX = (int16_t) (raw[12] | (raw[13] << 8));
+    data->gyroY = (int16_t) (raw[14] | (raw[15] << 8));
+    data->gyroZ = (int16_t) (raw[16] | (raw[17] << 8));
+}
+
 /** BNO055_ReadTemp()
  *
  * @brief Reads sensor axis as given by name.
@@ -459,6 +563,27 @@ void DelayMicros(uint32_t microsec)
     while ((TIMERS_GetMicroSeconds() - curr_us) < microsec);
 }
 
+/** BNO055_FinishRead(status)
+ *
+ * I2C callback for BNO055_ReadAllAsync(): unpack the burst and pass it on.
+ */
+static void BNO055_FinishRead(int8_t status)
+{
+    PROFILE_BEGIN(finishReadZone);
+    BNO055_Callback callback = asyncCallback;
+    asyncCallback = NULL;
+    if (status == SUCCESS)
+    {
+        BNO055_ParseData(rawData, asyncData);
+    }
+    isReading = FALSE;
+    if (callback != NULL)
+    {
+        callback(status);
+    }
+    PROFILE_END(finishReadZone);
+}
+
 
 /** BNO055_TEST
  * 
@@ -525,3 +650,157 @@ int main(void)
 
 
 #endif  /*  BNO055_TEST */
+
+
+/** BNO055_SIM_TEST
+ *
+ * Uncomment the below "#define" to run the BNO055_SIM_TEST. It runs on a host
+ * against a simulated register map standing in for the I2C module:
+ *   gcc -I. -DBNO055_SIM_TEST BNO055.c -o bno055_sim && ./bno055_sim
+ *
+ * SUCCESS - BNO055_ReadAll() and BNO055_ReadAllAsync() match the nine single
+ * axis reads for random register contents, in one bus transaction.
+ */
+//#define BNO055_SIM_TEST
+#ifdef BNO055_SIM_TEST
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_TRIALS 10000
+
+static uint8_t registers[0x80]; // Page 0 of the simulated BNO055.
+static uint32_t transactions = 0;
+static uint32_t busBytes = 0;
+static uint32_t simMicros = 0;
+static volatile int8_t asyncStatus = 0;
+
+// The I2C module, on the register map. Transactions and bytes are counted the
+// way I2C.c puts them on the bus.
+int8_t I2C_Init(void)
+{
+    return SUCCESS;
+}
+
+unsigned char I2C_ReadRegister(unsigned char I2CAddress, unsigned char deviceRegisterAddress)
+{
+    (void) I2CAddress;
+    transactions += 2; // Register write, then a separate read.
+    busBytes += 4;
+    return registers[deviceRegisterAddress];
+}
+
+unsigned char I2C_WriteReg(unsigned char I2CAddress, unsigned char deviceRegisterAddress, uint8_t data)
+{
+    (void) I2CAddress;
+    transactions++;
+    busBytes += 3;
+    registers[deviceRegisterAddress] = data;
+    return SUCCESS;
+}
+
+int I2C_ReadInt(char I2CAddress, char deviceRegisterAddress, char isBigEndian)
+{
+    // Same as I2C.c: two single register reads, the BNO055 is little endian.
+    (void) isBigEndian;
+    short data = I2C_ReadRegister(I2CAddress, deviceRegisterAddress);
+    data |= I2C_ReadRegister(I2CAddress, deviceRegisterAddress + 1) << 8;
+    return data;
+}
+
+int8_t I2C_ReadBytes(uint8_t I2CAddress, uint8_t deviceRegisterAddress, uint8_t *data, uint16_t length)
+{
+    (void) I2CAddress;
+    transactions++;
+    busBytes += 3 + length;
+    memcpy(data, &registers[deviceRegisterAddress], length);
+    return SUCCESS;
+}
+
+int8_t I2C_ReadBytesAsync(uint8_t I2CAddress, uint8_t deviceRegisterAddress, uint8_t *data, uint16_t length,
+        I2C_Priority priority, I2C_Callback callback)
+{
+    // The DMA finishes straight away, nothing else is on the bus to go ahead of.
+    (void) priority;
+    I2C_ReadBytes(I2CAddress, deviceRegisterAddress, data, length);
+    callback(SUCCESS);
+    return SUCCESS;
+}
+
+int8_t BOARD_Init(void)
+{
+    return SUCCESS;
+}
+
+char TIMER_Init(void)
+{
+    return SUCCESS;
+}
+
+uint32_t TIMERS_GetMicroSeconds(void)
+{
+    return simMicros++;
+}
+
+static void AsyncDone(int8_t status)
+{
+    asyncStatus = status;
+}
+
+static int CompareSample(const BNO055_Data *a, const BNO055_Data *b)
+{
+    return a->accelX != b->accelX || a->accelY != b->accelY || a->accelZ != b->accelZ ||
+            a->magX != b->magX || a->magY != b->magY || a->magZ != b->magZ ||
+            a->gyroX != b->gyroX || a->gyroY != b->gyroY || a->gyroZ != b->gyroZ;
+}
+
+int main(void)
+{
+    static BNO055_Data asyncSample;
+    BNO055_Data single, burst;
+    uint32_t singleTransactions = 0, singleBytes = 0, burstTransactions = 0, burstBytes = 0;
+    int errors = 0;
+
+    srand(1);
+    for (int trial = 0; trial < SIM_TRIALS; trial++)
+    {
+        for (size_t i = 0; i < sizeof(registers); i++)
+        {
+            registers[i] = rand();
+        }
+
+        transactions = 0;
+        busBytes = 0;
+        single.accelX = BNO055_ReadAccelX();
+        single.accelY = BNO055_ReadAccelY();
+        single.accelZ = BNO055_ReadAccelZ();
+        single.magX = BNO055_ReadMagX();
+        single.magY = BNO055_ReadMagY();
+        single.magZ = BNO055_ReadMagZ();
+        single.gyroX = BNO055_ReadGyroX();
+        single.gyroY = BNO055_ReadGyroY();
+        single.gyroZ = BNO055_ReadGyroZ();
+        singleTransactions = transactions;
+        singleBytes = busBytes;
+
+        transactions = 0;
+        busBytes = 0;
+        errors += BNO055_ReadAll(&burst) != SUCCESS;
+        burstTransactions = transactions;
+        burstBytes = busBytes;
+
+        asyncStatus = 0;
+        errors += BNO055_ReadAllAsync(&asyncSample, AsyncDone) != SUCCESS || asyncStatus != SUCCESS;
+
+        errors += CompareSample(&single, &burst) + CompareSample(&single, &asyncSample);
+    }
+
+    printf("Single axis reads: %lu transactions, %lu bus bytes per sample\r\n",
+            (unsigned long) singleTransactions, (unsigned long) singleBytes);
+    printf("BNO055_ReadAll:    %lu transactions, %lu bus bytes per sample\r\n",
+            (unsigned long) burstTransactions, (unsigned long) burstBytes);
+    printf("%d samples, %d mismatches, %s\r\n", SIM_TRIALS, errors, errors == 0 ? "SUCCESS" : "ERROR");
+    return errors != 0;
+}
+
+#endif  /*  BNO055_SIM_TEST */
@@ -33,6 +33,24 @@
 #define ACC_CONFIG_PARAMS (0x18) // +/-2g, 62.5 Hz BW
 #define GYRO_CONFIG_PARAMS_0 (0x33)
 #define UNITS_PARAM (0x01)
+/** Accel, mag and gyro data registers (0x08 to 0x19) read as one block. **/
+#define BNO055_DATA_SIZE (18)
+
+/** One sample of every raw sensor axis, as read by BNO055_ReadAll(). **/
+typedef struct BNO055_Data {
+    int16_t accelX;
+    int16_t accelY;
+    int16_t accelZ;
+    int16_t magX;
+    int16_t magY;
+    int16_t magZ;
+    int16_t gyroX;
+    int16_t gyroY;
+    int16_t gyroZ;
+} BNO055_Data;
+
+/** Called from interrupt context when BNO055_ReadAllAsync() is done, status is SUCCESS or ERROR. **/
+typedef void (*BNO055_Callback)(int8_t status);
 
 
 /*  PROTOTYPES  */
@@ -120,6 +138,41 @@ int BNO055_ReadMagY(void);
  */
 int BNO055_ReadMagZ(void);
 
+/** BNO055_ReadAll(data)
+ *
+ * Reads all nine raw sensor axes in a single I2C burst, instead of the two
+ * transactions per axis the BNO055_Read* functions above take. The axes all
+ * come from the same sample.
+ *
+ * @param   data    (BNO055_Data *) Filled in with the sample.
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t BNO055_ReadAll(BNO055_Data *data);
+
+/** BNO055_ReadAllAsync(data, callback)
+ *
+ * Queues the same burst as BNO055_ReadAll() at I2C_PRIORITY_HIGH and returns
+ * straight away, so it waits for at most the transfer already on the bus
+ * (one OLED page). data is filled in before callback (can be NULL) runs, so
+ * it can't live on the stack.
+ *
+ * @param   data        (BNO055_Data *) Filled in with the sample.
+ * @param   callback    (BNO055_Callback) Called from the interrupt when done.
+ * @return  (int8_t)    [SUCCESS, ERROR] ERROR if the last read hasn't
+ *                      finished yet or the I2C queue is full.
+ */
+int8_t BNO055_ReadAllAsync(BNO055_Data *data, BNO055_Callback callback);
+
+/** BNO055_ParseData(raw, data)
+ *
+ * Unpacks the BNO055_DATA_SIZE data registers (little endian pairs, accel
+ * then mag then gyro) into a sample.
+ *
+ * @param   raw     (const uint8_t *) Registers 0x08 to 0x19.
+ * @param   data    (BNO055_Data *) Filled in with the sample.
+ */
+void BNO055_ParseData(const uint8_t *raw, BNO055_Data *data);
+
 /** BNO055_ReadTemp()
  *
  * @brief Reads sensor axis as given by name.
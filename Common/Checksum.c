@@ -0,0 +1,123 @@
+/*
+ * File:   Checksum.c
+ * Author: Derrick Lai
+ *
+ * Packet checksum shared by the STM32 and the PC, see Checksum.h.
+ *
+ * Every step depends on the result of the one before it, so the bytes can't be processed in parallel (no table
+ * or SIMD trick helps, the rotate is already one instruction). What the fast path removes is the overhead around
+ * the steps: one 32-bit load instead of four byte loads (LDRB is 2 cycles on the Cortex-M4) and one loop branch
+ * every four bytes. On a PC both paths run at about the same speed, the compiler already does this to the
+ * reference loop.
+ *
+ * Created on March 22, 2025
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <Checksum.h>
+
+// One step on a 32-bit register, the rotate is written so the compiler emits a single rotate instruction.
+#define CHECKSUM_STEP(c, b) ((uint8_t) (((c) >> 1) | ((c) << 7)) + (uint8_t) (b))
+
+uint8_t Checksum_ComputeReference(const uint8_t *data, uint32_t length, uint8_t checksum) {
+    for (uint32_t i = 0; i < length; i++) {
+        checksum = CHECKSUM_UPDATE(checksum, data[i]);
+    }
+    return checksum;
+}
+
+uint8_t Checksum_Compute(const uint8_t *data, uint32_t length, uint8_t checksum) {
+    uint32_t c = checksum;
+    uint32_t i = 0;
+
+    // Four bytes per word, memcpy keeps unaligned payloads legal and compiles to a single load.
+    for (; i + 4 <= length; i += 4) {
+        uint32_t word;
+        memcpy(&word, &data[i], sizeof(word));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        c = CHECKSUM_STEP(c, word >> 24) & 0xFF;
+        c = CHECKSUM_STEP(c, word >> 16) & 0xFF;
+        c = CHECKSUM_STEP(c, word >> 8) & 0xFF;
+        c = CHECKSUM_STEP(c, word) & 0xFF;
+#else
+        c = CHECKSUM_STEP(c, word) & 0xFF;
+        c = CHECKSUM_STEP(c, word >> 8) & 0xFF;
+        c = CHECKSUM_STEP(c, word >> 16) & 0xFF;
+        c = CHECKSUM_STEP(c, word >> 24) & 0xFF;
+#endif
+    }
+
+    // Leftover bytes
+    for (; i < length; i++) {
+        c = CHECKSUM_STEP(c, data[i]) & 0xFF;
+    }
+    return (uint8_t) c;
+}
+
+
+//#define CHECKSUM_TEST
+#ifdef CHECKSUM_TEST // CHECKSUM TEST HARNESS AND BENCHMARK
+// No hardware dependencies, so this runs on a host:
+//   gcc -O2 -I. -DCHECKSUM_TEST Checksum.c -o checksum_test && ./checksum_test
+// SUCCESS - both paths agree on every payload (and on the known 0x1D packet), the throughput of each path is printed
+// for payloads of 1 to 127 bytes.
+
+#include <stdlib.h>
+#include <time.h>
+
+static double NowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void) {
+    uint8_t payload[128];
+    int errors = 0;
+
+    // Known packet from bluefruit_uart_test3.c: ID 0x00, data 0x00 0x25 0x7D 0x96
+    const uint8_t known[] = {0x00, 0x00, 0x25, 0x7D, 0x96};
+    if (Checksum_Compute(known, sizeof(known), 0) != 0x1D || Checksum_ComputeReference(known, sizeof(known), 0) != 0x1D) {
+        errors++;
+    }
+
+    // Agreement on random payloads, every length and starting offset (for unaligned loads)
+    srand(121);
+    for (int n = 0; n < 20000; n++) {
+        for (size_t i = 0; i < sizeof(payload); i++) {
+            payload[i] = rand();
+        }
+        int offset = rand() % 4;
+        int length = rand() % (sizeof(payload) - offset);
+        uint8_t start = rand();
+        if (Checksum_Compute(&payload[offset], length, start) != Checksum_ComputeReference(&payload[offset], length, start)) {
+            errors++;
+        }
+    }
+    printf("Checksum mismatches: %d\r\n", errors);
+
+    // Throughput
+    volatile uint8_t sink = 0;
+    printf("%8s %16s %16s\r\n", "bytes", "reference MB/s", "fast MB/s");
+    for (int length = 1; length <= 127; length = (length == 64) ? 127 : length * 2) {
+        const long iterations = 20000000L / length;
+        double start = NowSeconds();
+        for (long i = 0; i < iterations; i++) {
+            sink += Checksum_ComputeReference(payload, length, sink);
+        }
+        double reference = NowSeconds() - start;
+
+        start = NowSeconds();
+        for (long i = 0; i < iterations; i++) {
+            sink += Checksum_Compute(payload, length, sink);
+        }
+        double fast = NowSeconds() - start;
+
+        double megabytes = (double) iterations * length / 1e6;
+        printf("%8d %16.1f %16.1f\r\n", length, megabytes / reference, megabytes / fast);
+    }
+    return errors != 0;
+}
+#endif
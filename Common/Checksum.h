@@ -0,0 +1,44 @@
+/*
+ * File:   Checksum.h
+ * Author: Derrick Lai
+ *
+ * Packet checksum shared by the STM32 and the PC (protocol.py). For every byte of the payload (ID included)
+ * the running checksum is rotated right by one bit and the byte is added to it, keeping the bottom 8 bits.
+ *
+ * This file has no hardware dependencies, it is also compiled into the Python extension (Python/Native).
+ *
+ * Created on March 22, 2025
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+
+/**
+ * One step of the checksum, for code that wants to checksum bytes while it is copying them.
+ * Example:
+ *   checksum = CHECKSUM_UPDATE(checksum, byte);
+ */
+#define CHECKSUM_UPDATE(checksum, data) \
+    ((uint8_t) ((((uint8_t) (checksum)) >> 1) + (((uint8_t) (checksum)) << 7) + (uint8_t) (data)))
+
+/**
+ * @function Checksum_ComputeReference(data, length, checksum)
+ * @param data - Bytes to checksum
+ * @param length - Number of bytes
+ * @param checksum - Checksum of the bytes before these (0 to start)
+ * @return The new checksum
+ * @brief Byte at a time, written the same way as Protocol.__compute_iterative_checksum. Use it to check Checksum_Compute() */
+uint8_t Checksum_ComputeReference(const uint8_t *data, uint32_t length, uint8_t checksum);
+
+/**
+ * @function Checksum_Compute(data, length, checksum)
+ * @param data - Bytes to checksum
+ * @param length - Number of bytes
+ * @param checksum - Checksum of the bytes before these (0 to start)
+ * @return The new checksum
+ * @brief Same result as Checksum_ComputeReference(), unrolled to cut the loop overhead on whole payloads */
+uint8_t Checksum_Compute(const uint8_t *data, uint32_t length, uint8_t checksum);
+
+#endif
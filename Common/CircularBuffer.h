@@ -0,0 +1,144 @@
+/*
+ * File:   CircularBuffer.h
+ * Author: Derrick Lai
+ *
+ * Single-producer/single-consumer byte ring buffer. One side (e.g. an interrupt) only writes and the
+ * other side (e.g. the main loop) only reads, so no locking is needed as long as that rule is kept.
+ *
+ * The capacity has to be a power of two. The head and tail are free running 16-bit counters that are
+ * masked into the array, so a full buffer and an empty buffer can be told apart without extra flags
+ * and every slot of the array is usable.
+ *
+ * Bulk access is done with spans: CircularBuffer_WriteSpan()/CircularBuffer_ReadSpan() return a pointer
+ * to the largest contiguous region (stopping at the end of the array), which can be handed straight to
+ * memcpy or a DMA transfer, then CircularBuffer_CommitWrite()/CircularBuffer_ConsumeRead() publish it.
+ *
+ * Created on March 20, 2025
+ */
+
+#ifndef CIRCULAR_BUFFER_H
+#define CIRCULAR_BUFFER_H
+
+#include <stdint.h>
+
+/**
+ * Largest supported capacity, the free running 16-bit counters must be able to tell full from empty.
+ */
+#define CIRCULAR_BUFFER_MAX_SIZE 32768
+
+typedef struct CircularBuffer {
+    uint8_t *data; // Storage, CircularBuffer_Size() bytes long
+    uint16_t mask; // Capacity - 1, used instead of % for the wraparound
+    volatile uint16_t head; // Where to read from the buffer, only written by the consumer
+    volatile uint16_t tail; // Where to write to the buffer, only written by the producer
+} CircularBuffer;
+
+/**
+ * Defines a buffer with compile-time capacity along with its storage. A capacity that isn't a power of
+ * two fails to compile.
+ * Example:
+ *   CIRCULAR_BUFFER_DEFINE(tx_buffer, 256);
+ */
+#define CIRCULAR_BUFFER_DEFINE(name, size) \
+    _Static_assert((size) > 1 && (size) <= CIRCULAR_BUFFER_MAX_SIZE && ((size) & ((size) - 1)) == 0, \
+                   #name " size must be a power of two"); \
+    static uint8_t name##_data[(size)]; \
+    static CircularBuffer name = { name##_data, (size) - 1, 0, 0 }
+
+/**
+ * @function CircularBuffer_Init(buffer, data, size)
+ * @param buffer - Buffer to set up
+ * @param data - Storage for the buffer, size bytes long
+ * @param size - Capacity, must be a power of two
+ * @return SUCCESS or ERROR
+ * @brief Sets up a buffer at run time and empties it, use CIRCULAR_BUFFER_DEFINE when the size is known */
+int8_t CircularBuffer_Init(CircularBuffer *buffer, uint8_t *data, uint16_t size);
+
+/**
+ * @function CircularBuffer_Reset(buffer)
+ * @param buffer - Buffer to empty
+ * @return None
+ * @brief Empties the buffer, only safe while neither side is using it */
+void CircularBuffer_Reset(CircularBuffer *buffer);
+
+/**
+ * @function CircularBuffer_Size(buffer)
+ * @param buffer - Buffer to query
+ * @return Capacity of the buffer in bytes */
+uint16_t CircularBuffer_Size(const CircularBuffer *buffer);
+
+/**
+ * @function CircularBuffer_Count(buffer)
+ * @param buffer - Buffer to query
+ * @return Number of bytes waiting to be read */
+uint16_t CircularBuffer_Count(const CircularBuffer *buffer);
+
+/**
+ * @function CircularBuffer_Free(buffer)
+ * @param buffer - Buffer to query
+ * @return Number of bytes that can still be written */
+uint16_t CircularBuffer_Free(const CircularBuffer *buffer);
+
+/**
+ * @function CircularBuffer_Put(buffer, data)
+ * @param buffer - Buffer to write to (producer side)
+ * @param data - Byte to write
+ * @return SUCCESS or ERROR if the buffer is full */
+int8_t CircularBuffer_Put(CircularBuffer *buffer, uint8_t data);
+
+/**
+ * @function CircularBuffer_Get(buffer, data)
+ * @param buffer - Buffer to read from (consumer side)
+ * @param data - Where to store the byte
+ * @return SUCCESS or ERROR if the buffer is empty */
+int8_t CircularBuffer_Get(CircularBuffer *buffer, uint8_t *data);
+
+/**
+ * @function CircularBuffer_WriteSpan(buffer, span)
+ * @param buffer - Buffer to write to (producer side)
+ * @param span - Set to the start of the contiguous free region
+ * @return Length of the contiguous free region, 0 if the buffer is full
+ * @brief Nothing is published until CircularBuffer_CommitWrite() is called */
+uint16_t CircularBuffer_WriteSpan(CircularBuffer *buffer, uint8_t **span);
+
+/**
+ * @function CircularBuffer_CommitWrite(buffer, length)
+ * @param buffer - Buffer written to (producer side)
+ * @param length - Number of bytes filled in, may cover more than one span as long as it fits CircularBuffer_Free()
+ * @return None
+ * @brief Makes the written bytes visible to the consumer */
+void CircularBuffer_CommitWrite(CircularBuffer *buffer, uint16_t length);
+
+/**
+ * @function CircularBuffer_ReadSpan(buffer, span)
+ * @param buffer - Buffer to read from (consumer side)
+ * @param span - Set to the start of the contiguous readable region
+ * @return Length of the contiguous readable region, 0 if the buffer is empty
+ * @brief The bytes stay in the buffer until CircularBuffer_ConsumeRead() is called */
+uint16_t CircularBuffer_ReadSpan(CircularBuffer *buffer, uint8_t **span);
+
+/**
+ * @function CircularBuffer_ConsumeRead(buffer, length)
+ * @param buffer - Buffer read from (consumer side)
+ * @param length - Number of bytes that are done with, at most CircularBuffer_Count()
+ * @return None
+ * @brief Gives the space back to the producer */
+void CircularBuffer_ConsumeRead(CircularBuffer *buffer, uint16_t length);
+
+/**
+ * @function CircularBuffer_Write(buffer, data, length)
+ * @param buffer - Buffer to write to (producer side)
+ * @param data - Bytes to copy in
+ * @param length - Number of bytes to copy
+ * @return Number of bytes written, less than length if the buffer filled up */
+uint16_t CircularBuffer_Write(CircularBuffer *buffer, const uint8_t *data, uint16_t length);
+
+/**
+ * @function CircularBuffer_Read(buffer, data, length)
+ * @param buffer - Buffer to read from (consumer side)
+ * @param data - Where to copy the bytes to
+ * @param length - Maximum number of bytes to copy
+ * @return Number of bytes read */
+uint16_t CircularBuffer_Read(CircularBuffer *buffer, uint8_t *data, uint16_t length);
+
+#endif
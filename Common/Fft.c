@@ -0,0 +1,379 @@
+/*
+ * File:   Fft.c
+ * Author: Derrick Lai
+ *
+ * Fixed-point FFT and spectrum bands, see Fft.h.
+ *
+ * Created on April 11, 2025
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <Fft.h>
+
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+#include "stm32f4xx.h" // CMSIS intrinsics
+#define FFT_USE_DSP
+#endif
+
+// Boolean defines for TRUE, FALSE, SUCCESS and ERROR
+#ifndef FALSE
+#define FALSE ((int8_t) 0)
+#define TRUE ((int8_t) 1)
+#endif
+#ifndef ERROR
+#define ERROR ((int8_t) -1)
+#define SUCCESS ((int8_t) 1)
+#endif
+
+// ADC samples are 12 bits, shifted up to use most of q15 once the mean is off.
+#define FFT_SAMPLE_SHIFT 3
+
+// Added to the q30 twiddle products so they round to q15 instead of always going down.
+#define FFT_ROUND (1 << 14)
+
+/**
+ * sin(2 pi k / FFT_MAX_SIZE) in q15 for the first quarter turn, k = 0 to FFT_MAX_SIZE / 4. The twiddles and
+ * the window only need the first half turn, the rest of it is the same values backwards.
+ */
+static const int16_t quarterSine[FFT_MAX_SIZE / 4 + 1] = {
+        0,   804,  1608,  2411,  3212,  4011,  4808,  5602,
+     6393,  7180,  7962,  8740,  9512, 10279, 11039, 11793,
+    12540, 13279, 14010, 14733, 15447, 16151, 16846, 17531,
+    18205, 18868, 19520, 20160, 20788, 21403, 22006, 22595,
+    23170, 23732, 24279, 24812, 25330, 25833, 26320, 26791,
+    27246, 27684, 28106, 28511, 28899, 29269, 29622, 29957,
+    30274, 30572, 30853, 31114, 31357, 31581, 31786, 31972,
+    32138, 32286, 32413, 32522, 32610, 32679, 32729, 32758,
+    32767,
+};
+
+// Function prototypes for private functions.
+static int16_t Fft_Sin(uint16_t k);
+static int16_t Fft_Cos(uint16_t k);
+static uint16_t Fft_Sqrt(uint32_t value);
+
+int8_t Fft_Init(Fft *fft, uint16_t size, uint8_t numBands) {
+    uint8_t log2Size = 0;
+    while ((1U << log2Size) < size) {
+        log2Size++;
+    }
+    if (fft == NULL || size < FFT_MIN_SIZE || size > FFT_MAX_SIZE || (1U << log2Size) != size ||
+            numBands < FFT_MIN_BANDS || numBands > FFT_MAX_BANDS || numBands >= size / 2) {
+        return ERROR;
+    }
+    fft->size = size;
+    fft->log2Size = log2Size;
+    fft->numBands = numBands;
+
+    // Bins 1 to size / 2 - 1 (0 is the mean), split at powers of (size / 2) ^ (1 / numBands). The low bands
+    // would be narrower than a bin, so each band starts at least one bin after the last and leaves at least
+    // one bin for every band above it.
+    uint16_t bins = size / 2;
+    fft->bandStart[0] = 1;
+    for (uint8_t b = 1; b < numBands; b++) {
+        uint16_t start = (uint16_t) lround(pow(bins, (double) b / numBands));
+        if (start <= fft->bandStart[b - 1]) {
+            start = fft->bandStart[b - 1] + 1;
+        }
+        if (start > bins - (numBands - b)) {
+            start = bins - (numBands - b);
+        }
+        fft->bandStart[b] = start;
+    }
+    fft->bandStart[numBands] = bins;
+    return SUCCESS;
+}
+
+void Fft_Transform(const Fft *fft, Fft_Complex *data) {
+    uint16_t size = fft->size;
+
+    // Bit reversed order in, so the butterflies can work in place and the result comes out in order.
+    for (uint16_t i = 1, j = 0; i < size; i++) {
+        uint16_t bit = size >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j |= bit;
+        if (i < j) {
+            int32_t swap = data[i].packed;
+            data[i].packed = data[j].packed;
+            data[j].packed = swap;
+        }
+    }
+
+    for (uint16_t half = 1; half < size; half <<= 1) {
+        // Twiddle k of this stage is e^(-2 pi i k / (2 half)), a step of FFT_MAX_SIZE / (2 half) in the table.
+        uint16_t stride = FFT_MAX_SIZE / (2 * half);
+        for (uint16_t k = 0; k < half; k++) {
+            int16_t c = Fft_Cos(k * stride);
+            int16_t s = Fft_Sin(k * stride);
+#ifdef FFT_USE_DSP
+            uint32_t w = __PKHBT(c, s, 16);
+#endif
+            for (uint16_t j = k; j < size; j += 2 * half) {
+                Fft_Complex *a = &data[j];
+                Fft_Complex *b = &data[j + half];
+#ifdef FFT_USE_DSP
+                // t = b (c - i s): re = b.re c + b.im s, im = b.im c - b.re s
+                int32_t re = (int32_t) __SMLAD(b->packed, w, FFT_ROUND) >> 15;
+                int32_t im = (int32_t) __SMLSDX(w, b->packed, FFT_ROUND) >> 15;
+                uint32_t t = __PKHBT(re, im, 16);
+                uint32_t sum = __SHADD16(a->packed, t);
+                b->packed = __SHSUB16(a->packed, t);
+                a->packed = sum;
+#else
+                int16_t re = (int16_t) (((int32_t) b->re * c + (int32_t) b->im * s + FFT_ROUND) >> 15);
+                int16_t im = (int16_t) (((int32_t) b->im * c - (int32_t) b->re * s + FFT_ROUND) >> 15);
+                int16_t aRe = a->re;
+                int16_t aIm = a->im;
+                a->re = (int16_t) ((aRe + re) >> 1);
+                a->im = (int16_t) ((aIm + im) >> 1);
+                b->re = (int16_t) ((aRe - re) >> 1);
+                b->im = (int16_t) ((aIm - im) >> 1);
+#endif
+            }
+        }
+    }
+}
+
+void Fft_Bands(Fft *fft, const uint16_t *samples, uint16_t *bands) {
+    uint16_t size = fft->size;
+    uint16_t stride = FFT_MAX_SIZE / size;
+
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < size; i++) {
+        sum += samples[i];
+    }
+    int32_t mean = (int32_t) (sum >> fft->log2Size);
+
+    // Hann window, (1 - cos(2 pi i / size)) / 2, so a tone between two bins doesn't smear over the whole
+    // spectrum.
+    for (uint16_t i = 0; i < size; i++) {
+        int32_t x = ((int32_t) samples[i] - mean) << FFT_SAMPLE_SHIFT;
+        int32_t window = (32767 - Fft_Cos(i * stride)) >> 1;
+        fft->work[i].re = (int16_t) ((x * window) >> 15);
+        fft->work[i].im = 0;
+    }
+    Fft_Transform(fft, fft->work);
+
+    // The input is real, so bins above size / 2 mirror the ones below. Loudest bin of each band, compared
+    // squared so there is only one square root per band.
+    for (uint8_t b = 0; b < fft->numBands; b++) {
+        uint32_t peak = 0;
+        for (uint16_t k = fft->bandStart[b]; k < fft->bandStart[b + 1]; k++) {
+            int32_t re = fft->work[k].re;
+            int32_t im = fft->work[k].im;
+            uint32_t power = (uint32_t) (re * re) + (uint32_t) (im * im);
+            if (power > peak) {
+                peak = power;
+            }
+        }
+        bands[b] = Fft_Sqrt(peak);
+    }
+}
+
+/**
+ * @function Fft_Sin(k)
+ * @param k - Angle in FFT_MAX_SIZE steps to the turn, 0 to FFT_MAX_SIZE / 2
+ * @return sin(2 pi k / FFT_MAX_SIZE) in q15 */
+static int16_t Fft_Sin(uint16_t k) {
+    return k <= FFT_MAX_SIZE / 4 ? quarterSine[k] : quarterSine[FFT_MAX_SIZE / 2 - k];
+}
+
+/**
+ * @function Fft_Cos(k)
+ * @param k - Angle in FFT_MAX_SIZE steps to the turn, 0 to FFT_MAX_SIZE
+ * @return cos(2 pi k / FFT_MAX_SIZE) in q15 */
+static int16_t Fft_Cos(uint16_t k) {
+    if (k > FFT_MAX_SIZE / 2) {
+        k = FFT_MAX_SIZE - k;
+    }
+    return k <= FFT_MAX_SIZE / 4 ? quarterSine[FFT_MAX_SIZE / 4 - k] : -quarterSine[k - FFT_MAX_SIZE / 4];
+}
+
+/**
+ * @function Fft_Sqrt(value)
+ * @param value - Number to take the root of
+ * @return The integer square root, rounded down, one bit at a time */
+static uint16_t Fft_Sqrt(uint32_t value) {
+    uint32_t root = 0;
+    for (uint32_t bit = 1UL << 30; bit != 0; bit >>= 2) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return (uint16_t) root;
+}
+
+
+//#define FFT_TEST
+#ifdef FFT_TEST // FFT TEST HARNESS AND BENCHMARK
+// No hardware dependencies, so this runs on a host (the plain C butterflies, which match the M4 ones bit for
+// bit):
+//   gcc -O2 -I. -DFFT_TEST Fft.c -lm -o fft_test && ./fft_test
+// Every size is checked against a double precision DFT of the same q15 input, divided by the size like the
+// fixed-point one, on tones on and between bins, two tones, an impulse, a full-scale square wave and noise.
+// Then Fft_Bands() is given ADC-like blocks of a tone and the loudest band has to be the one holding the
+// tone's bin, with every other band well below it.
+// SUCCESS - every bin within log2(size) / 2 + 1 q15 steps of the reference (each halving stage rounds down),
+// every tone in its band, and the benchmark prints the time per transform.
+
+#include <stdlib.h>
+#include <time.h>
+
+#define FFT_TEST_BENCH_RUNS 200000
+#define FFT_TEST_PI 3.14159265358979323846
+
+typedef struct {
+    const char *name;
+    double (*signal)(int i, int size);
+} Signal;
+
+static unsigned int seed = 1;
+
+static double OnBin(int i, int size) {
+    return 30000 * cos(2 * FFT_TEST_PI * 5 * i / size);
+}
+
+static double BetweenBins(int i, int size) {
+    return 30000 * sin(2 * FFT_TEST_PI * 10.5 * i / size);
+}
+
+static double TwoTones(int i, int size) {
+    return 16000 * sin(2 * FFT_TEST_PI * 3 * i / size) + 300 * cos(2 * FFT_TEST_PI * (size / 2 - 7) * i / size);
+}
+
+static double Impulse(int i, int size) {
+    (void) size;
+    return i == 1 ? 32767 : 0;
+}
+
+static double Square(int i, int size) {
+    (void) size;
+    return (i / 4) % 2 ? -32768 : 32767;
+}
+
+static double Noise(int i, int size) {
+    (void) i;
+    (void) size;
+    return rand_r(&seed) % 65536 - 32768;
+}
+
+static const Signal signals[] = {
+    {"tone on bin 5", OnBin},
+    {"tone at bin 10.5", BetweenBins},
+    {"loud + quiet tones", TwoTones},
+    {"impulse", Impulse},
+    {"square, period 8", Square},
+    {"white noise", Noise},
+};
+
+int main(void) {
+    static Fft fft;
+    Fft_Complex data[FFT_MAX_SIZE];
+    int errors = 0;
+
+    printf("Transform against a double DFT, worst bin error in q15 steps:\r\n");
+    for (uint16_t size = FFT_MIN_SIZE; size <= FFT_MAX_SIZE; size *= 2) {
+        Fft_Init(&fft, size, FFT_MIN_BANDS);
+        for (uint8_t s = 0; s < sizeof(signals) / sizeof(signals[0]); s++) {
+            for (int i = 0; i < size; i++) {
+                data[i].re = (int16_t) lround(signals[s].signal(i, size));
+                data[i].im = 0;
+            }
+            double in[FFT_MAX_SIZE];
+            for (int i = 0; i < size; i++) {
+                in[i] = data[i].re;
+            }
+            Fft_Transform(&fft, data);
+
+            double worst = 0, signalPower = 0, errorPower = 0;
+            for (int k = 0; k < size; k++) {
+                double re = 0, im = 0;
+                for (int i = 0; i < size; i++) {
+                    re += in[i] * cos(2 * FFT_TEST_PI * k * i / size);
+                    im -= in[i] * sin(2 * FFT_TEST_PI * k * i / size);
+                }
+                re /= size;
+                im /= size;
+                double error = hypot(data[k].re - re, data[k].im - im);
+                worst = error > worst ? error : worst;
+                signalPower += re * re + im * im;
+                errorPower += error * error;
+            }
+            int isOk = worst <= fft.log2Size / 2.0 + 1;
+            errors += !isOk;
+            printf("  %3u points, %-20s worst %.2f, SNR %5.1f dB %s\r\n", size, signals[s].name, worst,
+                    10 * log10(signalPower / errorPower), isOk ? "" : "<- ERROR");
+        }
+    }
+
+    printf("Bands, 12-bit samples with a full-scale tone:\r\n");
+    for (uint16_t size = FFT_MIN_SIZE; size <= FFT_MAX_SIZE; size *= 2) {
+        for (uint8_t numBands = FFT_MIN_BANDS; numBands <= FFT_MAX_BANDS && numBands < size / 2; numBands += 8) {
+            Fft_Init(&fft, size, numBands);
+            int misplaced = 0, leaks = 0;
+            uint16_t top = 0;
+            for (uint16_t bin = 1; bin < size / 2; bin++) {
+                uint16_t samples[FFT_MAX_SIZE], bands[FFT_MAX_BANDS];
+                for (int i = 0; i < size; i++) {
+                    samples[i] = (uint16_t) lround(2048 + 2047 * sin(2 * FFT_TEST_PI * bin * i / size));
+                }
+                Fft_Bands(&fft, samples, bands);
+
+                uint8_t expected = 0;
+                while (bin >= fft.bandStart[expected + 1]) {
+                    expected++;
+                }
+                uint8_t loudest = 0;
+                for (uint8_t b = 0; b < numBands; b++) {
+                    loudest = bands[b] > bands[loudest] ? b : loudest;
+                }
+                misplaced += loudest != expected;
+                // The Hann window reaches a bin either side, further bands must be 40 dB down.
+                for (uint8_t b = 0; b < numBands; b++) {
+                    uint8_t isNear = b + 1 >= expected && b <= expected + 1;
+                    leaks += !isNear && bands[b] * 100 > bands[loudest];
+                }
+                top = bands[loudest] > top ? bands[loudest] : top;
+            }
+            errors += misplaced + leaks;
+            printf("  %3u points, %2u bands (top bands from bin", size, numBands);
+            for (uint8_t b = numBands - 4; b < numBands; b++) {
+                printf(" %u", fft.bandStart[b]);
+            }
+            printf("): %d misplaced, %d leaked, peak level %u\r\n", misplaced, leaks, top);
+        }
+    }
+    errors += Fft_Init(&fft, 96, 16) != ERROR;
+    errors += Fft_Init(&fft, 512, 16) != ERROR;
+    errors += Fft_Init(&fft, 64, 32) != ERROR;
+    errors += Fft_Init(&fft, 256, 8) != ERROR;
+
+    printf("Benchmark (host):\r\n");
+    for (uint16_t size = FFT_MIN_SIZE; size <= FFT_MAX_SIZE; size *= 2) {
+        uint16_t samples[FFT_MAX_SIZE], bands[FFT_MAX_BANDS];
+        for (int i = 0; i < size; i++) {
+            samples[i] = rand_r(&seed) % 4096;
+        }
+        Fft_Init(&fft, size, FFT_MIN_BANDS);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int run = 0; run < FFT_TEST_BENCH_RUNS; run++) {
+            Fft_Bands(&fft, samples, bands);
+            samples[run % size] ^= bands[run % FFT_MIN_BANDS] & 1; // Keep the runs from being optimized away
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / FFT_TEST_BENCH_RUNS;
+        printf("  %3u points: %.2f us per Fft_Bands()\r\n", size, ns / 1000);
+    }
+
+    printf("%d errors, %s\r\n", errors, errors == 0 ? "SUCCESS" : "ERROR");
+    return errors != 0;
+}
+#endif
@@ -0,0 +1,79 @@
+/*
+ * File:   Fft.h
+ * Author: Derrick Lai
+ *
+ * Fixed-point FFT for the spectrum display: turns a block of ADC samples into a handful of log-spaced
+ * frequency bands.
+ *
+ * The transform is an in-place radix-2 decimation-in-time FFT on q15 complex values (a real and an imaginary
+ * 16-bit half packed into one 32-bit word). Every stage halves its results so nothing can overflow, which
+ * makes the output the DFT divided by the size. On the Cortex-M4 a butterfly is a handful of DSP instructions
+ * on the packed words (SMLAD/SMLSDX for the twiddle product, accumulating onto a half so the product is
+ * rounded rather than truncated, SHADD16/SHSUB16 for the halving add and subtract). Everywhere else a plain C
+ * version does the same arithmetic with the same rounding, so a host build gives bit for bit what the board
+ * does.
+ *
+ * The bands group the bins geometrically from the lowest one up to half the sample rate, each at least one bin
+ * wide, like the ear hears them. A band's level is the magnitude of its loudest bin.
+ *
+ * This file has no hardware dependencies, feed it blocks from ADC_StartCapture().
+ *
+ * Created on April 11, 2025
+ */
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <stdint.h>
+
+#define FFT_MIN_SIZE 64
+#define FFT_MAX_SIZE 256 // Also the resolution of the twiddle table
+#define FFT_MIN_BANDS 16
+#define FFT_MAX_BANDS 32
+
+// A q15 complex value, re in the low half so the M4 can work on both halves of the word at once.
+typedef union {
+    int32_t packed;
+    struct {
+        int16_t re;
+        int16_t im;
+    };
+} Fft_Complex;
+
+typedef struct Fft {
+    uint16_t size; // Points, a power of 2 from FFT_MIN_SIZE to FFT_MAX_SIZE
+    uint8_t log2Size;
+    uint8_t numBands;
+    uint16_t bandStart[FFT_MAX_BANDS + 1]; // First bin of each band, the last entry is size / 2
+    Fft_Complex work[FFT_MAX_SIZE]; // Fft_Bands() transforms in here
+} Fft;
+
+/**
+ * @function Fft_Init(fft, size, numBands)
+ * @param fft - FFT to set up
+ * @param size - Points per transform, a power of 2 from FFT_MIN_SIZE to FFT_MAX_SIZE
+ * @param numBands - Bands for Fft_Bands(), FFT_MIN_BANDS to FFT_MAX_BANDS, and less than size / 2
+ * @return SUCCESS or ERROR
+ * @brief Works out the band edges */
+int8_t Fft_Init(Fft *fft, uint16_t size, uint8_t numBands);
+
+/**
+ * @function Fft_Transform(fft, data)
+ * @param fft - Sets the size
+ * @param data - fft->size values with a magnitude up to 32767, replaced by their DFT divided by fft->size,
+ *               in frequency order
+ * @return None
+ * @brief Forward transform in place */
+void Fft_Transform(const Fft *fft, Fft_Complex *data);
+
+/**
+ * @function Fft_Bands(fft, samples, bands)
+ * @param fft - FFT to use, its work buffer is overwritten
+ * @param samples - fft->size unsigned 12-bit ADC samples, the mean is taken off
+ * @param bands - Gets fft->numBands levels, lowest band first: the peak magnitude in q15 of the Hann
+ *                windowed transform, about 4095 for a full-scale sine
+ * @return None
+ * @brief Spectrum of one block of samples */
+void Fft_Bands(Fft *fft, const uint16_t *samples, uint16_t *bands);
+
+#endif
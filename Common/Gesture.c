@@ -0,0 +1,215 @@
+/*
+ * File:   Gesture.c
+ * Author: Derrick Lai
+ *
+ * Shake detection on the BNO055 accelerometer, see Gesture.h.
+ *
+ * Created on April 4, 2025
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <Gesture.h>
+
+// Boolean defines for TRUE, FALSE, SUCCESS and ERROR
+#ifndef FALSE
+#define FALSE ((int8_t) 0)
+#define TRUE ((int8_t) 1)
+#endif
+#ifndef ERROR
+#define ERROR ((int8_t) -1)
+#define SUCCESS ((int8_t) 1)
+#endif
+
+// The gravity filter is an exponential average with a weight of 1 / 2^GESTURE_FILTER_SHIFT, 160 ms at 100 Hz.
+// It's kept scaled up by the same factor so no precision is lost to the shift.
+#define GESTURE_FILTER_SHIFT 4
+
+static uint8_t hasSample = FALSE;
+static int32_t gravity[3]; // Low-passed acceleration of each axis, scaled by 2^GESTURE_FILTER_SHIFT
+static uint8_t isArmed = TRUE; // The motion has settled since the last jolt
+static uint32_t joltTimes[GESTURE_SHAKE_JOLTS]; // The last few jolts, oldest at joltIndex once full
+static uint8_t joltIndex = 0;
+static uint8_t joltCount = 0;
+static uint8_t isHoldingOff = FALSE;
+static uint32_t holdoffStart = 0;
+
+void Gesture_Init(void) {
+    hasSample = FALSE;
+    isArmed = TRUE;
+    joltIndex = 0;
+    joltCount = 0;
+    isHoldingOff = FALSE;
+}
+
+Gesture Gesture_Update(const BNO055_Data *sample, uint32_t timeMs) {
+    int32_t axes[3] = {sample->accelX, sample->accelY, sample->accelZ};
+    int32_t motion = 0;
+    int i;
+
+    // The first sample is taken as the resting orientation.
+    if (!hasSample) {
+        for (i = 0; i < 3; i++) {
+            gravity[i] = axes[i] << GESTURE_FILTER_SHIFT;
+        }
+        hasSample = TRUE;
+        return GESTURE_NONE;
+    }
+
+    for (i = 0; i < 3; i++) {
+        gravity[i] += axes[i] - (gravity[i] >> GESTURE_FILTER_SHIFT);
+        motion += abs(axes[i] - (gravity[i] >> GESTURE_FILTER_SHIFT));
+    }
+
+    if (isHoldingOff) {
+        if (timeMs - holdoffStart < GESTURE_HOLDOFF_MS) {
+            return GESTURE_NONE;
+        }
+        isHoldingOff = FALSE;
+    }
+
+    // Only the rising edge is a jolt, it has to settle back down before the next one counts.
+    if (motion < GESTURE_JOLT_THRESHOLD / 2) {
+        isArmed = TRUE;
+    }
+    if (!isArmed || motion < GESTURE_JOLT_THRESHOLD) {
+        return GESTURE_NONE;
+    }
+    isArmed = FALSE;
+
+    joltTimes[joltIndex] = timeMs;
+    joltIndex = (joltIndex + 1) % GESTURE_SHAKE_JOLTS;
+    if (joltCount < GESTURE_SHAKE_JOLTS) {
+        joltCount++;
+    }
+
+    // Enough jolts, and the oldest of them recent enough (it is the next one to be overwritten).
+    if (joltCount == GESTURE_SHAKE_JOLTS && timeMs - joltTimes[joltIndex] <= GESTURE_SHAKE_WINDOW_MS) {
+        joltCount = 0;
+        isHoldingOff = TRUE;
+        holdoffStart = timeMs;
+        return GESTURE_SHAKE;
+    }
+    return GESTURE_NONE;
+}
+
+
+//#define GESTURE_TEST
+#ifdef GESTURE_TEST // GESTURE TEST HARNESS
+// No hardware dependencies, so this runs on a host:
+//   gcc -O2 -I. -DGESTURE_TEST Gesture.c -o gesture_test -lm && ./gesture_test
+// SUCCESS - recorded-like motions at 100 Hz (resting, walking with the remote, a tap, putting it down, shakes)
+// give exactly the expected number of shakes.
+
+#include <math.h>
+
+#define SAMPLE_MS 10
+#define ONE_G 1000
+
+typedef struct {
+    const char *name;
+    int expected;
+    int durationMs;
+    void (*motion)(int timeMs, double *x, double *y, double *z);
+} Scenario;
+
+static unsigned int seed = 1;
+
+static double Noise(void) {
+    return (double) (rand_r(&seed) % 61 - 30); // The sensor noise is about +/-30 mg
+}
+
+static void Resting(int t, double *x, double *y, double *z) {
+    (void) t;
+    *x = 0;
+    *y = 0;
+    *z = ONE_G;
+}
+
+static void Walking(int t, double *x, double *y, double *z) {
+    *x = 150 * sin(2 * M_PI * 0.9 * t / 1000.0);
+    *y = 0;
+    *z = ONE_G + 400 * sin(2 * M_PI * 1.8 * t / 1000.0);
+}
+
+static void Tap(int t, double *x, double *y, double *z) {
+    Resting(t, x, y, z);
+    if (t >= 1000 && t < 1030) {
+        *x = 1900;
+    }
+}
+
+static void PutDown(int t, double *x, double *y, double *z) {
+    // Tipped over onto its side in 300 ms, with a bump when it lands.
+    double angle = t < 1000 ? 0 : t < 1300 ? (t - 1000) / 300.0 * M_PI / 2 : M_PI / 2;
+    *x = ONE_G * sin(angle);
+    *y = 0;
+    *z = ONE_G * cos(angle);
+    if (t >= 1300 && t < 1320) {
+        *x += 1200;
+    }
+}
+
+static void Shake(int t, double *x, double *y, double *z) {
+    // Half a second of shaking at 5 Hz.
+    Resting(t, x, y, z);
+    if (t >= 1000 && t < 1500) {
+        *x = 1800 * sin(2 * M_PI * 5 * (t - 1000) / 1000.0);
+    }
+}
+
+static void TwoShakes(int t, double *x, double *y, double *z) {
+    Resting(t, x, y, z);
+    if ((t >= 1000 && t < 1600) || (t >= 3000 && t < 3600)) {
+        *y = 1800 * sin(2 * M_PI * 6 * t / 1000.0);
+    }
+}
+
+static void LongShake(int t, double *x, double *y, double *z) {
+    // Two and a half seconds of shaking skips once per holdoff, not once per swing.
+    Resting(t, x, y, z);
+    if (t >= 1000 && t < 3500) {
+        *x = 1800 * sin(2 * M_PI * 5 * (t - 1000) / 1000.0);
+    }
+}
+
+static int16_t Clip(double value) {
+    // +/-2 g range
+    value += Noise();
+    return (int16_t) (value > 2000 ? 2000 : value < -2000 ? -2000 : value);
+}
+
+int main(void) {
+    const Scenario scenarios[] = {
+        {"Resting", 0, 5000, Resting},
+        {"Walking", 0, 10000, Walking},
+        {"Tap", 0, 3000, Tap},
+        {"Put down", 0, 3000, PutDown},
+        {"Shake", 1, 3000, Shake},
+        {"Two shakes", 2, 5000, TwoShakes},
+        {"Long shake", 2, 5000, LongShake},
+    };
+    int failures = 0;
+
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+        int shakes = 0;
+        Gesture_Init();
+        for (int t = 0; t < scenarios[s].durationMs; t += SAMPLE_MS) {
+            double x, y, z;
+            BNO055_Data sample = {0};
+            scenarios[s].motion(t, &x, &y, &z);
+            sample.accelX = Clip(x);
+            sample.accelY = Clip(y);
+            sample.accelZ = Clip(z);
+            if (Gesture_Update(&sample, t) == GESTURE_SHAKE) {
+                shakes++;
+            }
+        }
+        printf("%-12s %d shakes (expected %d)\r\n", scenarios[s].name, shakes, scenarios[s].expected);
+        failures += shakes != scenarios[s].expected;
+    }
+    printf("%s\r\n", failures == 0 ? "SUCCESS" : "ERROR");
+    return failures != 0;
+}
+#endif
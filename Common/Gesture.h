@@ -0,0 +1,48 @@
+/*
+ * File:   Gesture.h
+ * Author: Derrick Lai
+ *
+ * Shake detection on the BNO055 accelerometer, used as shake-to-skip.
+ *
+ * Gravity and slow tilting are removed with a low-pass filter on each axis, what is left is the motion of the
+ * hand. A jolt is that motion going over GESTURE_JOLT_THRESHOLD after having settled back below half of it, so
+ * every swing of a shake counts once and a single push counts once however long it lasts. GESTURE_SHAKE_JOLTS
+ * jolts within GESTURE_SHAKE_WINDOW_MS make a shake.
+ *
+ * This file has no hardware dependencies, feed it samples from BNO055_ReadAll()/BNO055_ReadAllAsync().
+ *
+ * Created on April 4, 2025
+ */
+
+#ifndef GESTURE_H
+#define GESTURE_H
+
+#include <stdint.h>
+#include <BNO055.h>
+
+// Accelerations are in mg (BNO055 UNITS_PARAM), the samples are expected at around 100 Hz.
+#define GESTURE_JOLT_THRESHOLD 800 // Motion (sum over the axes) that counts as a jolt
+#define GESTURE_SHAKE_JOLTS 4 // Jolts that make a shake
+#define GESTURE_SHAKE_WINDOW_MS 800 // ... when they all happen within this long
+#define GESTURE_HOLDOFF_MS 1000 // Nothing is detected for this long after a shake
+
+typedef enum {
+    GESTURE_NONE,
+    GESTURE_SHAKE
+} Gesture;
+
+/**
+ * @function Gesture_Init()
+ * @param None
+ * @return None
+ * @brief Forgets every sample seen so far, the next one starts the filter again */
+void Gesture_Init(void);
+
+/**
+ * @function Gesture_Update(sample, timeMs)
+ * @param sample - The latest accelerometer sample (only accelX/Y/Z are used)
+ * @param timeMs - When it was taken, in milliseconds
+ * @return GESTURE_SHAKE on the sample that completes a shake, GESTURE_NONE otherwise */
+Gesture Gesture_Update(const BNO055_Data *sample, uint32_t timeMs);
+
+#endif
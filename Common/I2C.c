@@ -8,9 +8,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#ifndef I2C_SIM // The simulated bus at the end of this file stands in for the peripheral.
 #include "stm32f4xx_hal.h"
 #include "stm32f4xx_hal_i2c.h"
+#endif
 #include "I2C.h"
+#include "I2CQueue.h"
+#ifndef I2C_SIM
+#include "timers.h"
+#endif
+#include "Profile.h"
 
 
 /*  MODULE-LEVEL DEFINITIONS, MACROS    */
@@ -28,37 +35,251 @@
 #define SUCCESS ((int8_t) 1)
 #endif  /*  SUCCESS */
 
+// DMA mapping for I2C2 TX (RM0383 Table 27: DMA1 request mapping)
+#define I2C_TX_DMA_STREAM DMA1_Stream7
+#define I2C_TX_DMA_CHANNEL DMA_CHANNEL_7
+#define I2C_TX_DMA_IRQn DMA1_Stream7_IRQn
+#define I2C_RX_DMA_STREAM DMA1_Stream2
+#define I2C_RX_DMA_CHANNEL DMA_CHANNEL_7
+#define I2C_RX_DMA_IRQn DMA1_Stream2_IRQn
+
+// I2C2 pins, driven by hand to free a stuck bus (see I2C_ResetBus()).
+#define I2C_GPIO_PORT GPIOB
+#define I2C_SCL_PIN GPIO_PIN_10
+#define I2C_SDA_PIN GPIO_PIN_9
+#define I2C_RESET_CLOCKS 9 // Enough for a slave to finish the byte it's sending
+#define I2C_RESET_HALF_PERIOD_US 5 // 100 kHz
+
+// Errors that leave the bus in an unknown state. A NACK doesn't, the HAL sends a STOP after it.
+#define I2C_BUS_ERRORS (HAL_I2C_ERROR_BERR | HAL_I2C_ERROR_ARLO | HAL_I2C_ERROR_OVR | HAL_I2C_ERROR_TIMEOUT \
+        | HAL_I2C_ERROR_DMA)
+
+// Clock control limits (RM0383 18.6.2, 18.6.8): FREQ is PCLK1 in MHz, CCR 12 bits.
+#define I2C_MAX_PCLK1 50000000
+#define I2C_MIN_PCLK1_STANDARD 2000000
+#define I2C_MIN_PCLK1_FAST 4000000
+#define I2C_MAX_CCR 0xFFF
+#define I2C_MIN_CCR_STANDARD 4
+
+// Bus bytes for a register transaction on top of its data: address and register.
+#define I2C_TRANSACTION_OVERHEAD 2
+// A register read also repeats the address after the restart.
+#define I2C_READ_OVERHEAD 3
+
+#ifdef I2C_SIM
+/*  MOCK HAL, the parts of it this file uses (see I2C_SIM at the end of the file) */
+typedef enum {
+    HAL_OK,
+    HAL_ERROR,
+    HAL_BUSY,
+    HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef struct {
+    uint32_t ClockSpeed;
+    uint32_t DutyCycle;
+    uint32_t OwnAddress1;
+    uint32_t AddressingMode;
+    uint32_t DualAddressMode;
+    uint32_t OwnAddress2;
+    uint32_t GeneralCallMode;
+    uint32_t NoStretchMode;
+} I2C_InitTypeDef;
+
+typedef struct {
+    void *Instance;
+    I2C_InitTypeDef Init;
+    volatile uint32_t ErrorCode;
+} I2C_HandleTypeDef;
+
+typedef struct {
+    void *Instance;
+} DMA_HandleTypeDef;
+
+#define I2C2 ((void *) 0x40005800UL)
+#define HAL_I2C_ERROR_BERR 0x01
+#define HAL_I2C_ERROR_ARLO 0x02
+#define HAL_I2C_ERROR_AF 0x04
+#define HAL_I2C_ERROR_OVR 0x08
+#define HAL_I2C_ERROR_DMA 0x10
+#define HAL_I2C_ERROR_TIMEOUT 0x20
+#define I2C_DUTYCYCLE_2 0x0000
+#define I2C_DUTYCYCLE_16_9 0x4000
+#define I2C_ADDRESSINGMODE_7BIT 0x4000
+#define I2C_DUALADDRESS_DISABLE 0
+#define I2C_GENERALCALL_DISABLE 0
+#define I2C_NOSTRETCH_DISABLE 0
+#define I2C_MEMADD_SIZE_8BIT 1
+
+uint32_t HAL_RCC_GetPCLK1Freq(void);
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *hi2c);
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *hi2c);
+HAL_StatusTypeDef HAL_I2C_Master_Transmit(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData,
+        uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_I2C_Master_Receive(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData,
+        uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_I2C_Mem_Write(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+        uint16_t MemAddSize, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+        uint16_t MemAddSize, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_I2C_Mem_Write_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+        uint16_t MemAddSize, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_I2C_Mem_Read_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+        uint16_t MemAddSize, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef *hdma);
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c);
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c);
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c);
+#endif  /*  I2C_SIM */
+
 I2C_HandleTypeDef hi2c2;
+static DMA_HandleTypeDef hdma_i2c2_tx;
+static DMA_HandleTypeDef hdma_i2c2_rx;
 
 static uint8_t initStatus = FALSE;
+static volatile uint32_t busByteCount = 0;          // Bytes put on the bus, see I2C_GetBusByteCount().
+static volatile uint32_t resetCount = 0;            // See I2C_GetResetCount().
+static uint32_t bitRate = 0;                        // See I2C_GetBitRate().
+
+// Profiling zones, empty unless built with PROFILE_ENABLED (see Profile.h).
+PROFILE_ZONE(readIntZone, "I2C_ReadInt"); // Each BNO055_Read axis function is one of these
+
+
+/*  PROTOTYPES  */
+static uint32_t I2C_BitRate(uint32_t pclk1, uint32_t speed, I2C_DutyCycle dutyCycle);
+static void I2C_Claim(void);
+static void I2C_Release(HAL_StatusTypeDef ret);
+static int8_t I2C_StartJob(const I2CQueue_Job *job);
+static void I2C_ResetBus(void);
+#ifndef I2C_SIM
+static void I2C_DelayMicros(uint32_t micros);
+#endif
+
+// The queue reaches the hardware through these.
+static const I2CQueue_Driver queueDriver = { I2C_StartJob, I2C_ResetBus, TIMERS_GetMilliSeconds };
 
 
 /*  FUNCTIONS   */
 /** I2C_Init()
  *
- * Initializes the I2C System at standard speed (100Kbps).
+ * Initializes the I2C System at standard speed (100Kbps), unless it is
+ * already running.
  *
  * @return SUCCESS or ERROR
  */
 int8_t I2C_Init(void)
 {
-    if (initStatus == FALSE)
+    if (initStatus == TRUE)
     {
-        hi2c2.Instance = I2C2;
-        hi2c2.Init.ClockSpeed = 100000;
-        hi2c2.Init.DutyCycle = I2C_DUTYCYCLE_2;
-        hi2c2.Init.OwnAddress1 = 0;
-        hi2c2.Init.AddressingMode = I2C_ADDRESSINGMODE_7BIT;
-        hi2c2.Init.DualAddressMode = I2C_DUALADDRESS_DISABLE;
-        hi2c2.Init.OwnAddress2 = 0;
-        hi2c2.Init.GeneralCallMode = I2C_GENERALCALL_DISABLE;
-        hi2c2.Init.NoStretchMode = I2C_NOSTRETCH_DISABLE;
-        if (HAL_I2C_Init(&hi2c2) != HAL_OK)
+        return SUCCESS;
+    }
+    return I2C_InitSpeed(I2C_SPEED_STANDARD, I2C_DUTY_2);
+}
+
+/** I2C_InitSpeed(speed, dutyCycle)
+ *
+ * Initializes the I2C System at the given bus speed, or changes the speed
+ * between two transfers if it is already running. Not for use in interrupts.
+ *
+ * @param   speed       (uint32_t)  Bit rate in Hz, up to I2C_SPEED_FAST.
+ * @param   dutyCycle   (I2C_DutyCycle) SCL duty cycle in Fast-mode.
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t I2C_InitSpeed(uint32_t speed, I2C_DutyCycle dutyCycle)
+{
+    uint32_t newBitRate = I2C_BitRate(HAL_RCC_GetPCLK1Freq(), speed, dutyCycle);
+    if (newBitRate == 0)
+    {
+        return ERROR;
+    }
+
+    if (initStatus == TRUE)
+    {
+        // HAL_I2C_Init() only reprograms the registers once the handle is set
+        // up, the pins and the DMA stay as they are.
+        I2C_Claim();
+        hi2c2.Init.ClockSpeed = speed;
+        hi2c2.Init.DutyCycle = dutyCycle == I2C_DUTY_16_9 ? I2C_DUTYCYCLE_16_9 : I2C_DUTYCYCLE_2;
+        HAL_StatusTypeDef ret = HAL_I2C_Init(&hi2c2);
+        I2CQueue_Release();
+        if (ret != HAL_OK)
         {
             return ERROR;
         }
-        initStatus = TRUE;
+        bitRate = newBitRate;
+        return SUCCESS;
+    }
+
+    hi2c2.Instance = I2C2;
+    hi2c2.Init.ClockSpeed = speed;
+    hi2c2.Init.DutyCycle = dutyCycle == I2C_DUTY_16_9 ? I2C_DUTYCYCLE_16_9 : I2C_DUTYCYCLE_2;
+    hi2c2.Init.OwnAddress1 = 0;
+    hi2c2.Init.AddressingMode = I2C_ADDRESSINGMODE_7BIT;
+    hi2c2.Init.DualAddressMode = I2C_DUALADDRESS_DISABLE;
+    hi2c2.Init.OwnAddress2 = 0;
+    hi2c2.Init.GeneralCallMode = I2C_GENERALCALL_DISABLE;
+    hi2c2.Init.NoStretchMode = I2C_NOSTRETCH_DISABLE;
+    if (HAL_I2C_Init(&hi2c2) != HAL_OK)
+    {
+        return ERROR;
+    }
+
+#ifndef I2C_SIM // The simulated DMA needs no setting up.
+    // DMA for asynchronous writes, the whole block goes out without the CPU.
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    hdma_i2c2_tx.Instance = I2C_TX_DMA_STREAM;
+    hdma_i2c2_tx.Init.Channel = I2C_TX_DMA_CHANNEL;
+    hdma_i2c2_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_i2c2_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_i2c2_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_i2c2_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_i2c2_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_i2c2_tx.Init.Mode = DMA_NORMAL;
+    hdma_i2c2_tx.Init.Priority = DMA_PRIORITY_LOW;
+    hdma_i2c2_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_i2c2_tx) != HAL_OK)
+    {
+        return ERROR;
+    }
+    __HAL_LINKDMA(&hi2c2, hdmatx, hdma_i2c2_tx);
+
+    // And for asynchronous reads.
+    hdma_i2c2_rx.Instance = I2C_RX_DMA_STREAM;
+    hdma_i2c2_rx.Init.Channel = I2C_RX_DMA_CHANNEL;
+    hdma_i2c2_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_i2c2_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_i2c2_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_i2c2_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_i2c2_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_i2c2_rx.Init.Mode = DMA_NORMAL;
+    hdma_i2c2_rx.Init.Priority = DMA_PRIORITY_LOW;
+    hdma_i2c2_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_i2c2_rx) != HAL_OK)
+    {
+        return ERROR;
     }
+    __HAL_LINKDMA(&hi2c2, hdmarx, hdma_i2c2_rx);
+
+    // The address and register phases of a DMA transfer run on the I2C
+    // event interrupt, the data phase on the DMA interrupt. HAL_MspInit()
+    // picks NVIC_PRIORITYGROUP_0, which has no preemption bits, so the
+    // level is the subpriority: nothing preempts, it only decides which
+    // pending interrupt goes first.
+    HAL_NVIC_SetPriority(I2C_TX_DMA_IRQn, 0, 6);
+    HAL_NVIC_EnableIRQ(I2C_TX_DMA_IRQn);
+    HAL_NVIC_SetPriority(I2C_RX_DMA_IRQn, 0, 6);
+    HAL_NVIC_EnableIRQ(I2C_RX_DMA_IRQn);
+    HAL_NVIC_SetPriority(I2C2_EV_IRQn, 0, 6);
+    HAL_NVIC_EnableIRQ(I2C2_EV_IRQn);
+    HAL_NVIC_SetPriority(I2C2_ER_IRQn, 0, 6);
+    HAL_NVIC_EnableIRQ(I2C2_ER_IRQn);
+#endif  /*  I2C_SIM */
+
+    busByteCount = 0;
+    resetCount = 0;
+    I2CQueue_Init(&queueDriver);
+    bitRate = newBitRate;
+    initStatus = TRUE;
     return SUCCESS;
 }
 
@@ -81,16 +302,22 @@ unsigned char I2C_ReadRegister(
     I2CAddress = I2CAddress << 1; // use 8-bit address
     uint8_t* data = &deviceRegisterAddress;
 
+    I2C_Claim();
+
     // Start condition; wait for it to end, this is internal and cannot stall.
-    ret = HAL_I2C_Master_Transmit(&hi2c2, I2CAddress, data, 1, HAL_MAX_DELAY);
+    ret = HAL_I2C_Master_Transmit(&hi2c2, I2CAddress, data, 1, I2C_QUEUE_TIMEOUT_MS);
+    busByteCount += 2;
     if (ret != HAL_OK)
     {
+        I2C_Release(ret);
         printf("I2C Tx Error on read start condition\r\n");
         return 0;
     }
 
     // Get byte; wait for it to end, this is internal and cannot stall.
-    ret = HAL_I2C_Master_Receive(&hi2c2, I2CAddress, data, 1, HAL_MAX_DELAY);
+    ret = HAL_I2C_Master_Receive(&hi2c2, I2CAddress, data, 1, I2C_QUEUE_TIMEOUT_MS);
+    busByteCount += 2;
+    I2C_Release(ret);
     if (ret != HAL_OK)
     {
         printf("I2C Rx Error on read byte\r\n");
@@ -121,6 +348,7 @@ unsigned char I2C_WriteReg(
     HAL_StatusTypeDef ret;
     I2CAddress = I2CAddress << 1; // Use 8-bit address.
 
+    I2C_Claim();
     ret = HAL_I2C_Mem_Write(
         &hi2c2,
         I2CAddress,
@@ -128,8 +356,10 @@ unsigned char I2C_WriteReg(
         I2C_MEMADD_SIZE_8BIT,
         &data,
         1,
-        HAL_MAX_DELAY
+        I2C_QUEUE_TIMEOUT_MS
     );
+    busByteCount += I2C_TRANSACTION_OVERHEAD + 1;
+    I2C_Release(ret);
     if (ret != HAL_OK)
     {
         printf("I2C Tx Error on write data\r\n");
@@ -159,6 +389,7 @@ int I2C_ReadInt(
 )
 {
     short data = 0; // 16-bit return value.
+    PROFILE_BEGIN(readIntZone);
     
     // Get first byte.
     unsigned char byte = I2C_ReadRegister(I2CAddress, deviceRegisterAddress);
@@ -177,5 +408,803 @@ int I2C_ReadInt(
     } else {
         data |= byte << 8;
     }
+    PROFILE_END(readIntZone);
     return data;
 }
+
+/** I2C_WriteBytes(I2CAddress, deviceRegisterAddress, data, length)
+ *
+ * Writes a block of bytes to a device in one transaction (address, register,
+ * then every data byte), blocking until it is done.
+ *
+ * @param   I2CAddress              (uint8_t)   7-bit address of I2C device
+ * @param   deviceRegisterAddress   (uint8_t)   8-bit register (or control
+ *                                              byte) the data is written to.
+ * @param   data                    (uint8_t *) Bytes to write
+ * @param   length                  (uint16_t)  Number of bytes
+ * @return                          (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t I2C_WriteBytes(
+    uint8_t I2CAddress,
+    uint8_t deviceRegisterAddress,
+    const uint8_t *data,
+    uint16_t length
+)
+{
+    // Wait for any asynchronous transfer to let go of the bus first.
+    I2C_Claim();
+
+    HAL_StatusTypeDef ret = HAL_I2C_Mem_Write(
+        &hi2c2,
+        I2CAddress << 1,
+        deviceRegisterAddress,
+        I2C_MEMADD_SIZE_8BIT,
+        (uint8_t *) data,
+        length,
+        I2C_QUEUE_TIMEOUT_MS
+    );
+    busByteCount += I2C_TRANSACTION_OVERHEAD + length;
+    I2C_Release(ret);
+    if (ret != HAL_OK)
+    {
+        printf("I2C Tx Error on write block\r\n");
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+/** I2C_WriteBytesAsync(I2CAddress, deviceRegisterAddress, data, length, priority, callback)
+ *
+ * Queues the same transaction as I2C_WriteBytes(), it goes out through the
+ * DMA once the bus is free. data must stay untouched until callback runs.
+ *
+ * @return                          (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t I2C_WriteBytesAsync(
+    uint8_t I2CAddress,
+    uint8_t deviceRegisterAddress,
+    const uint8_t *data,
+    uint16_t length,
+    I2C_Priority priority,
+    I2C_Callback callback
+)
+{
+    if (initStatus == FALSE)
+    {
+        return ERROR;
+    }
+
+    I2CQueue_Job job = {I2CAddress, deviceRegisterAddress, (uint8_t *) data, length, FALSE, callback};
+    return I2CQueue_Submit(&job, priority);
+}
+
+/** I2C_ReadBytes(I2CAddress, deviceRegisterAddress, data, length)
+ *
+ * Reads a block of consecutive registers in one transaction (address,
+ * register, restart, address, then every data byte), blocking until done.
+ *
+ * @param   I2CAddress              (uint8_t)   7-bit address of I2C device
+ * @param   deviceRegisterAddress   (uint8_t)   8-bit address of the first
+ *                                              register.
+ * @param   data                    (uint8_t *) Where to store the bytes
+ * @param   length                  (uint16_t)  Number of bytes
+ * @return                          (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t I2C_ReadBytes(
+    uint8_t I2CAddress,
+    uint8_t deviceRegisterAddress,
+    uint8_t *data,
+    uint16_t length
+)
+{
+    // Wait for any asynchronous transfer to let go of the bus first.
+    I2C_Claim();
+
+    HAL_StatusTypeDef ret = HAL_I2C_Mem_Read(
+        &hi2c2,
+        I2CAddress << 1,
+        deviceRegisterAddress,
+        I2C_MEMADD_SIZE_8BIT,
+        data,
+        length,
+        I2C_QUEUE_TIMEOUT_MS
+    );
+    busByteCount += I2C_READ_OVERHEAD + length;
+    I2C_Release(ret);
+    if (ret != HAL_OK)
+    {
+        printf("I2C Rx Error on read block\r\n");
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+/** I2C_ReadBytesAsync(I2CAddress, deviceRegisterAddress, data, length, priority, callback)
+ *
+ * Queues the same transaction as I2C_ReadBytes(), it goes out through the
+ * DMA once the bus is free. data holds the registers once callback runs.
+ *
+ * @return                          (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t I2C_ReadBytesAsync(
+    uint8_t I2CAddress,
+    uint8_t deviceRegisterAddress,
+    uint8_t *data,
+    uint16_t length,
+    I2C_Priority priority,
+    I2C_Callback callback
+)
+{
+    if (initStatus == FALSE)
+    {
+        return ERROR;
+    }
+
+    I2CQueue_Job job = {I2CAddress, deviceRegisterAddress, data, length, TRUE, callback};
+    return I2CQueue_Submit(&job, priority);
+}
+
+/** I2C_IsBusy()
+ *
+ * @return  (uint8_t)   TRUE while a transfer is using the bus.
+ */
+uint8_t I2C_IsBusy(void)
+{
+    return I2CQueue_IsBusy();
+}
+
+/** I2C_CheckTimeout()
+ *
+ * Gives up on an asynchronous transfer that has run too long.
+ */
+void I2C_CheckTimeout(void)
+{
+    I2CQueue_CheckTimeout();
+}
+
+/** I2C_GetBitRate()
+ *
+ * @return  (uint32_t)  SCL frequency in Hz, 0 before initialization.
+ */
+uint32_t I2C_GetBitRate(void)
+{
+    return bitRate;
+}
+
+/** I2C_GetResetCount()
+ *
+ * @return  (uint32_t)  Bus resets since I2C_Init().
+ */
+uint32_t I2C_GetResetCount(void)
+{
+    return resetCount;
+}
+
+/** I2C_GetBusByteCount()
+ *
+ * @return  (uint32_t)  Bytes put on the bus since I2C_Init().
+ */
+uint32_t I2C_GetBusByteCount(void)
+{
+    return busByteCount;
+}
+
+/*  PRIVATE FUNCTIONS   */
+/** I2C_BitRate(pclk1, speed, dutyCycle)
+ *
+ * Works out the SCL frequency the peripheral will run at, the same way
+ * HAL_I2C_Init() programs CCR: the divider is rounded up, so the bit rate is
+ * never above the one asked for.
+ *  + Standard mode: SCL high and low are CCR periods of PCLK1 each, CCR >= 4.
+ *  + Fast-mode 2:1: high is CCR periods and low 2 * CCR.
+ *  + Fast-mode 16:9: high is 9 * CCR periods and low 16 * CCR.
+ *
+ * @return  (uint32_t)  Bit rate in Hz, or 0 if the speed can't be set up
+ *                      with this PCLK1.
+ */
+static uint32_t I2C_BitRate(uint32_t pclk1, uint32_t speed, I2C_DutyCycle dutyCycle)
+{
+    uint32_t periods, ccr;
+
+    if (speed == 0 || speed > I2C_SPEED_FAST || pclk1 > I2C_MAX_PCLK1)
+    {
+        return 0;
+    }
+    if (speed <= I2C_SPEED_STANDARD)
+    {
+        if (pclk1 < I2C_MIN_PCLK1_STANDARD)
+        {
+            return 0;
+        }
+        periods = 2;
+    } else {
+        if (pclk1 < I2C_MIN_PCLK1_FAST)
+        {
+            return 0;
+        }
+        periods = dutyCycle == I2C_DUTY_16_9 ? 25 : 3;
+    }
+
+    ccr = (pclk1 - 1) / (speed * periods) + 1;
+    if (speed <= I2C_SPEED_STANDARD && ccr < I2C_MIN_CCR_STANDARD)
+    {
+        ccr = I2C_MIN_CCR_STANDARD;
+    }
+    if (ccr > I2C_MAX_CCR)
+    {
+        return 0;
+    }
+    return pclk1 / (periods * ccr);
+}
+
+/** I2C_Claim()
+ *
+ * Waits for the bus and takes it, for the blocking transfers. Not for use in
+ * interrupts, the transfer holding the bus may be the one interrupted.
+ */
+static void I2C_Claim(void)
+{
+    while (!I2CQueue_TryClaim())
+    {
+        I2CQueue_CheckTimeout();
+    }
+}
+
+/** I2C_Release(ret)
+ *
+ * Ends a blocking transfer, resetting the bus first if it failed in a way
+ * that can leave it stuck, then lets the queued transfers go.
+ */
+static void I2C_Release(HAL_StatusTypeDef ret)
+{
+    if (ret == HAL_TIMEOUT || (ret != HAL_OK && (hi2c2.ErrorCode & I2C_BUS_ERRORS) != 0))
+    {
+        I2C_ResetBus();
+    }
+    I2CQueue_Release();
+}
+
+/** I2C_StartJob(job)
+ *
+ * Puts a queued transfer on the bus, I2CQueue_Finish() is called from the
+ * interrupts when it is done.
+ *
+ * @return  (int8_t)    [SUCCESS, ERROR]
+ */
+static int8_t I2C_StartJob(const I2CQueue_Job *job)
+{
+    HAL_StatusTypeDef ret;
+    if (job->isRead)
+    {
+        busByteCount += I2C_READ_OVERHEAD + job->length;
+        ret = HAL_I2C_Mem_Read_DMA(&hi2c2, job->address << 1, job->reg, I2C_MEMADD_SIZE_8BIT, job->data,
+                job->length);
+    } else {
+        busByteCount += I2C_TRANSACTION_OVERHEAD + job->length;
+        ret = HAL_I2C_Mem_Write_DMA(&hi2c2, job->address << 1, job->reg, I2C_MEMADD_SIZE_8BIT, job->data,
+                job->length);
+    }
+    return ret == HAL_OK ? SUCCESS : ERROR;
+}
+
+/** I2C_ResetBus()
+ *
+ * Gets the bus back after a bus error or a transfer that never finished. The
+ * peripheral is stopped, then SCL is clocked by hand until a slave that was
+ * cut off in the middle of a byte lets go of SDA, and a STOP ends whatever it
+ * thought was going on. Initializing the peripheral again also resets it
+ * (SWRST) and gives the pins back to it.
+ */
+static void I2C_ResetBus(void)
+{
+    HAL_DMA_Abort(&hdma_i2c2_tx);
+    HAL_DMA_Abort(&hdma_i2c2_rx);
+    HAL_I2C_DeInit(&hi2c2);
+
+#ifndef I2C_SIM // Nothing holds the simulated bus.
+    GPIO_InitTypeDef GPIO_InitStruct = {0};
+    HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SCL_PIN | I2C_SDA_PIN, GPIO_PIN_SET);
+    GPIO_InitStruct.Pin = I2C_SCL_PIN | I2C_SDA_PIN;
+    GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_OD;
+    GPIO_InitStruct.Pull = GPIO_NOPULL;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+    HAL_GPIO_Init(I2C_GPIO_PORT, &GPIO_InitStruct);
+    I2C_DelayMicros(I2C_RESET_HALF_PERIOD_US);
+
+    for (uint8_t i = 0; i < I2C_RESET_CLOCKS
+            && HAL_GPIO_ReadPin(I2C_GPIO_PORT, I2C_SDA_PIN) == GPIO_PIN_RESET; i++)
+    {
+        HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SCL_PIN, GPIO_PIN_RESET);
+        I2C_DelayMicros(I2C_RESET_HALF_PERIOD_US);
+        HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SCL_PIN, GPIO_PIN_SET);
+        I2C_DelayMicros(I2C_RESET_HALF_PERIOD_US);
+    }
+
+    // STOP: SDA rises while SCL is high.
+    HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SCL_PIN, GPIO_PIN_RESET);
+    I2C_DelayMicros(I2C_RESET_HALF_PERIOD_US);
+    HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SDA_PIN, GPIO_PIN_RESET);
+    I2C_DelayMicros(I2C_RESET_HALF_PERIOD_US);
+    HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SCL_PIN, GPIO_PIN_SET);
+    I2C_DelayMicros(I2C_RESET_HALF_PERIOD_US);
+    HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SDA_PIN, GPIO_PIN_SET);
+    I2C_DelayMicros(I2C_RESET_HALF_PERIOD_US);
+#endif  /*  I2C_SIM */
+
+    HAL_I2C_Init(&hi2c2);
+    resetCount++;
+}
+
+#ifndef I2C_SIM
+/** I2C_DelayMicros(micros)
+ *
+ * Busy wait, short enough to be used from the error interrupt.
+ */
+static void I2C_DelayMicros(uint32_t micros)
+{
+    uint32_t start = TIMERS_GetMicroSeconds();
+    while (TIMERS_GetMicroSeconds() - start < micros);
+}
+#endif  /*  I2C_SIM */
+
+/*  INTERRUPTS  */
+#ifndef I2C_SIM // The simulated DMA calls the callbacks below itself.
+// The I2C2 interrupts and its DMA stream are private to this module, so their
+// handlers live here instead of stm32f4xx_it.c
+void I2C2_EV_IRQHandler(void)
+{
+    HAL_I2C_EV_IRQHandler(&hi2c2);
+}
+
+void I2C2_ER_IRQHandler(void)
+{
+    HAL_I2C_ER_IRQHandler(&hi2c2);
+}
+
+void DMA1_Stream7_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_i2c2_tx);
+}
+
+void DMA1_Stream2_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_i2c2_rx);
+}
+#endif  /*  I2C_SIM */
+
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+    if (hi2c->Instance == I2C2)
+    {
+        I2CQueue_Finish(SUCCESS);
+    }
+}
+
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+    if (hi2c->Instance == I2C2)
+    {
+        I2CQueue_Finish(SUCCESS);
+    }
+}
+
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
+{
+    if (hi2c->Instance == I2C2)
+    {
+        // A NACK only fails the transfer, anything else may have left the bus stuck.
+        if ((hi2c->ErrorCode & I2C_BUS_ERRORS) != 0)
+        {
+            I2C_ResetBus();
+        }
+        I2CQueue_Finish(ERROR);
+    }
+}
+
+
+//#define I2C_SIM
+#ifdef I2C_SIM // I2C SIMULATED BUS
+/* Not a test on its own, it is built into the host runs of the drivers on the
+ * bus (the OLED_*_TEST harnesses in Oled.c, MARQUEE_TEST), e.g.
+ *   gcc -O2 -Wall -I. -DI2C_SIM -DOLED_DIRTY_TEST Oled.c OledDriver.c I2C.c I2CQueue.c Ascii.c -o oled_dirty
+ *
+ * The HAL calls above land on a mock bus with an SSD1306 at 0x3C, which keeps
+ * its display RAM the way the chip does: control bytes, the command parser,
+ * the column/page window and the addressing modes. It powers up full of
+ * garbage. Every other address NACKs, and reads return zeros. With
+ * I2C_SimSetLogging() on, every transaction is printed as it lands.
+ *
+ * The bus runs on a simulated clock. A byte is 9 SCL periods (the ACK
+ * included) plus the rise time of the lines for each bit, 0 unless
+ * I2C_SimSetRiseTime() says otherwise. The SCL period is worked out from
+ * hi2c2.Init the way HAL_I2C_Init() programs CCR, with PCLK1 at 42 MHz like
+ * the board. A blocking transfer moves the clock on by its time on the bus. A
+ * DMA transfer ends that long after it was started: its data lands in the
+ * display RAM then and its completion "interrupt" runs at the first clock read
+ * from then on. Each clock read is a microsecond of CPU time.
+ */
+#include <string.h>
+
+#define SIM_PCLK1 42000000
+#define SIM_BYTE_BITS 9
+#define SIM_READ_NS 1000 // CPU time of a clock read
+#define SIM_OLED_ADDRESS 0x3C
+#define SIM_OLED_COLUMNS 128
+#define SIM_OLED_PAGES 8 // Of display RAM, the 32 row panel shows the first 4
+
+// SSD1306 control byte bits and the commands that move the RAM pointer.
+#define SIM_CONTROL_CONTINUATION 0x80
+#define SIM_CONTROL_DATA 0x40
+#define SIM_COMMAND_ADDRESSING_MODE 0x20
+#define SIM_COMMAND_COLUMN_WINDOW 0x21
+#define SIM_COMMAND_PAGE_WINDOW 0x22
+#define SIM_MODE_HORIZONTAL 0
+#define SIM_MODE_VERTICAL 1
+#define SIM_MODE_PAGE 2
+
+static uint64_t simNanos = 0;
+static uint32_t sclClocks = 420; // PCLK1 periods per SCL period
+static uint32_t riseNanos = 0;
+static uint8_t isLogging = FALSE;
+static uint8_t isInInterrupt = FALSE;
+
+// The DMA transfer on the bus.
+static uint8_t isDmaBusy = FALSE;
+static uint64_t dmaEnd;
+static uint8_t dmaAddress;
+static uint8_t dmaReg;
+static uint8_t *dmaData;
+static uint16_t dmaLength;
+static uint8_t dmaIsRead;
+
+// The SSD1306.
+static uint8_t isPoweredUp = FALSE;
+static uint8_t oledRam[SIM_OLED_PAGES * SIM_OLED_COLUMNS];
+static uint8_t oledCommand[7]; // The command being received, with its arguments so far
+static uint8_t oledCommandLength = 0;
+static uint8_t oledMode = SIM_MODE_PAGE;
+static uint8_t oledColumnStart = 0;
+static uint8_t oledColumnEnd = SIM_OLED_COLUMNS - 1;
+static uint8_t oledPageStart = 0;
+static uint8_t oledPageEnd = SIM_OLED_PAGES - 1;
+static uint8_t oledColumn = 0;
+static uint8_t oledPage = 0;
+
+// Bytes in a command, its arguments included (SSD1306 datasheet, 9).
+static uint8_t SimCommandSize(uint8_t command)
+{
+    switch (command)
+    {
+        case SIM_COMMAND_COLUMN_WINDOW:
+        case SIM_COMMAND_PAGE_WINDOW:
+        case 0xA3: // Vertical scroll area
+            return 3;
+        case SIM_COMMAND_ADDRESSING_MODE:
+        case 0x81: // Contrast
+        case 0x8D: // Charge pump
+        case 0xA8: // Multiplex ratio
+        case 0xD3: // Display offset
+        case 0xD5: // Clock divide
+        case 0xD9: // Precharge
+        case 0xDA: // COM pins
+        case 0xDB: // VCOMH level
+            return 2;
+        case 0x29: // Vertical and horizontal scroll setup
+        case 0x2A:
+            return 6;
+        case 0x26: // Horizontal scroll setup
+        case 0x27:
+            return 7;
+        default:
+            return 1;
+    }
+}
+
+static void SimOledCommand(uint8_t byte)
+{
+    oledCommand[oledCommandLength++] = byte;
+    if (oledCommandLength < SimCommandSize(oledCommand[0]))
+    {
+        return;
+    }
+    oledCommandLength = 0;
+
+    uint8_t command = oledCommand[0];
+    if (command == SIM_COMMAND_ADDRESSING_MODE)
+    {
+        oledMode = oledCommand[1] & 0x03;
+    } else if (command == SIM_COMMAND_COLUMN_WINDOW) {
+        oledColumnStart = oledCommand[1] & 0x7F;
+        oledColumnEnd = oledCommand[2] & 0x7F;
+        oledColumn = oledColumnStart;
+    } else if (command == SIM_COMMAND_PAGE_WINDOW) {
+        oledPageStart = oledCommand[1] & 0x07;
+        oledPageEnd = oledCommand[2] & 0x07;
+        oledPage = oledPageStart;
+    } else if (oledMode == SIM_MODE_PAGE && command <= 0x0F) {
+        oledColumn = (oledColumn & 0xF0) | command;
+    } else if (oledMode == SIM_MODE_PAGE && command >= 0x10 && command <= 0x1F) {
+        oledColumn = (oledColumn & 0x0F) | ((command & 0x07) << 4);
+    } else if (oledMode == SIM_MODE_PAGE && command >= 0xB0 && command <= 0xB7) {
+        oledPage = command & 0x07;
+    }
+    // The rest (on/off, inversion, the charge pump, ...) don't touch the RAM.
+}
+
+// Stores a byte at the RAM pointer and moves the pointer on as the addressing mode says.
+static void SimOledData(uint8_t byte)
+{
+    oledRam[oledPage * SIM_OLED_COLUMNS + oledColumn] = byte;
+    if (oledMode == SIM_MODE_PAGE)
+    {
+        oledColumn = (oledColumn + 1) % SIM_OLED_COLUMNS;
+    } else if (oledMode == SIM_MODE_VERTICAL) {
+        if (oledPage++ == oledPageEnd)
+        {
+            oledPage = oledPageStart;
+            oledColumn = oledColumn == oledColumnEnd ? oledColumnStart : oledColumn + 1;
+        }
+    } else {
+        if (oledColumn++ == oledColumnEnd)
+        {
+            oledColumn = oledColumnStart;
+            oledPage = oledPage == oledPageEnd ? oledPageStart : oledPage + 1;
+        }
+    }
+}
+
+// A write transaction to the SSD1306: the register byte is the first control
+// byte. With the continuation bit set it covers one byte and another control
+// byte follows, without it the rest of the transaction.
+static void SimOledWrite(uint8_t control, const uint8_t *data, uint16_t length)
+{
+    uint16_t i = 0;
+    while (i < length)
+    {
+        uint8_t isData = (control & SIM_CONTROL_DATA) != 0;
+        uint16_t end = (control & SIM_CONTROL_CONTINUATION) ? i + 1 : length;
+        for (; i < end; i++)
+        {
+            if (isData)
+            {
+                SimOledData(data[i]);
+            } else {
+                SimOledCommand(data[i]);
+            }
+        }
+        if (i < length)
+        {
+            control = data[i++];
+        }
+    }
+}
+
+// Time on the bus for a number of bytes.
+static uint64_t SimBusNanos(uint32_t bytes)
+{
+    uint64_t bits = (uint64_t) bytes * SIM_BYTE_BITS;
+    return bits * sclClocks * 1000000000 / SIM_PCLK1 + bits * riseNanos;
+}
+
+// The device side of a transaction, with the 8-bit address as the HAL takes it.
+static HAL_StatusTypeDef SimTransfer(uint16_t DevAddress, uint8_t reg, uint8_t *data, uint16_t length,
+        uint8_t isRead)
+{
+    uint8_t address = DevAddress >> 1;
+    if (isLogging)
+    {
+        printf("  I2C %s 0x%02X reg 0x%02X, %3u bytes:", isRead ? "read " : "write", address, reg, length);
+        for (uint16_t i = 0; i < length && i < 8 && !isRead; i++)
+        {
+            printf(" %02X", data[i]);
+        }
+        printf(length > 8 && !isRead ? " ...\r\n" : "\r\n");
+    }
+    if (address != SIM_OLED_ADDRESS)
+    {
+        hi2c2.ErrorCode = HAL_I2C_ERROR_AF;
+        return HAL_ERROR;
+    }
+    if (isRead)
+    {
+        memset(data, 0, length);
+    } else {
+        SimOledWrite(reg, data, length);
+    }
+    return HAL_OK;
+}
+
+// The DMA's completion interrupt, once the transfer on the bus has had its time.
+static void SimRunInterrupts(void)
+{
+    if (isInInterrupt)
+    {
+        return;
+    }
+    isInInterrupt = TRUE;
+    while (isDmaBusy && simNanos >= dmaEnd)
+    {
+        isDmaBusy = FALSE;
+        if (SimTransfer(dmaAddress, dmaReg, dmaData, dmaLength, dmaIsRead) != HAL_OK)
+        {
+            HAL_I2C_ErrorCallback(&hi2c2);
+        } else if (dmaIsRead) {
+            HAL_I2C_MemRxCpltCallback(&hi2c2);
+        } else {
+            HAL_I2C_MemTxCpltCallback(&hi2c2);
+        }
+    }
+    isInInterrupt = FALSE;
+}
+
+static HAL_StatusTypeDef SimStartDma(uint16_t DevAddress, uint16_t MemAddress, uint8_t *pData, uint16_t Size,
+        uint8_t isRead)
+{
+    if (isDmaBusy)
+    {
+        return HAL_BUSY;
+    }
+    isDmaBusy = TRUE;
+    dmaEnd = simNanos + SimBusNanos(Size + (isRead ? I2C_READ_OVERHEAD : I2C_TRANSACTION_OVERHEAD));
+    dmaAddress = DevAddress;
+    dmaReg = MemAddress;
+    dmaData = pData;
+    dmaLength = Size;
+    dmaIsRead = isRead;
+    return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+    return SIM_PCLK1;
+}
+
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *hi2c)
+{
+    uint32_t speed = hi2c->Init.ClockSpeed;
+    uint32_t periods, ccr;
+
+    // The display RAM holds whatever it powered up with.
+    if (!isPoweredUp)
+    {
+        uint32_t noise = 12345;
+        for (uint16_t i = 0; i < sizeof(oledRam); i++)
+        {
+            noise = noise * 1103515245 + 12345;
+            oledRam[i] = noise >> 16;
+        }
+        isPoweredUp = TRUE;
+    }
+
+    // RM0383 18.6.8: CCR is rounded up, at least 4 in standard mode and 1 in Fast-mode.
+    if (speed == 0 || speed > I2C_SPEED_FAST)
+    {
+        return HAL_ERROR;
+    }
+    if (speed <= I2C_SPEED_STANDARD)
+    {
+        periods = 2;
+    } else {
+        periods = hi2c->Init.DutyCycle == I2C_DUTYCYCLE_16_9 ? 25 : 3;
+    }
+    ccr = (SIM_PCLK1 - 1) / (speed * periods) + 1;
+    if (speed <= I2C_SPEED_STANDARD && ccr < I2C_MIN_CCR_STANDARD)
+    {
+        ccr = I2C_MIN_CCR_STANDARD;
+    }
+    sclClocks = periods * ccr;
+    hi2c->ErrorCode = 0;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *hi2c)
+{
+    (void) hi2c;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef *hdma)
+{
+    (void) hdma;
+    isDmaBusy = FALSE;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Master_Transmit(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData,
+        uint16_t Size, uint32_t Timeout)
+{
+    (void) hi2c;
+    (void) Timeout;
+    simNanos += SimBusNanos(1 + Size);
+    // The register pointer of a read, nothing the display keeps.
+    return SimTransfer(DevAddress, pData[0], pData, 0, FALSE);
+}
+
+HAL_StatusTypeDef HAL_I2C_Master_Receive(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData,
+        uint16_t Size, uint32_t Timeout)
+{
+    (void) hi2c;
+    (void) Timeout;
+    simNanos += SimBusNanos(1 + Size);
+    return SimTransfer(DevAddress, 0, pData, Size, TRUE);
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Write(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+        uint16_t MemAddSize, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+    (void) hi2c;
+    (void) MemAddSize;
+    (void) Timeout;
+    simNanos += SimBusNanos(I2C_TRANSACTION_OVERHEAD + Size);
+    return SimTransfer(DevAddress, MemAddress, pData, Size, FALSE);
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+        uint16_t MemAddSize, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+    (void) hi2c;
+    (void) MemAddSize;
+    (void) Timeout;
+    simNanos += SimBusNanos(I2C_READ_OVERHEAD + Size);
+    return SimTransfer(DevAddress, MemAddress, pData, Size, TRUE);
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Write_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+        uint16_t MemAddSize, uint8_t *pData, uint16_t Size)
+{
+    (void) hi2c;
+    (void) MemAddSize;
+    return SimStartDma(DevAddress, MemAddress, pData, Size, FALSE);
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Read_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+        uint16_t MemAddSize, uint8_t *pData, uint16_t Size)
+{
+    (void) hi2c;
+    (void) MemAddSize;
+    return SimStartDma(DevAddress, MemAddress, pData, Size, TRUE);
+}
+
+// The board and timer modules, on the simulated clock.
+int8_t BOARD_Init(void)
+{
+    return SUCCESS;
+}
+
+char TIMER_Init(void)
+{
+    return SUCCESS;
+}
+
+uint32_t TIMERS_GetMicroSeconds(void)
+{
+    simNanos += SIM_READ_NS;
+    SimRunInterrupts();
+    return simNanos / 1000;
+}
+
+uint32_t TIMERS_GetMilliSeconds(void)
+{
+    simNanos += SIM_READ_NS;
+    SimRunInterrupts();
+    return simNanos / 1000000;
+}
+
+const uint8_t *I2C_SimGetDisplayRam(void)
+{
+    return oledRam;
+}
+
+void I2C_SimSetRiseTime(uint32_t nanoseconds)
+{
+    riseNanos = nanoseconds;
+}
+
+void I2C_SimSetLogging(uint8_t isOn)
+{
+    isLogging = isOn;
+}
+
+#endif  /*  I2C_SIM */
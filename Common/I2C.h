@@ -1,5 +1,5 @@
 /**
- * @file    I2C.c
+ * @file    I2C.h
  * @author  Adam Korycki
  *
  * @date    3 Oct 2023
@@ -8,15 +8,76 @@
 #ifndef I2C_H
 #define	I2C_H
 
+#include <stdint.h>
+
+/**
+ * Called from interrupt context when an asynchronous transfer finishes.
+ * status is SUCCESS, or ERROR if the device didn't acknowledge or the bus failed.
+ */
+typedef void (*I2C_Callback)(int8_t status);
+
+/**
+ * Asynchronous transfers wait in a queue (see I2CQueue.h). The next one to go
+ * is the oldest of the highest priority, so short time critical reads (the
+ * IMU) use HIGH and go out between the long display bursts, which use LOW.
+ */
+typedef enum {
+    I2C_PRIORITY_HIGH,
+    I2C_PRIORITY_LOW,
+    I2C_PRIORITY_COUNT
+} I2C_Priority;
+
+// Bus speeds of the F411's I2C peripheral (RM0383 18.3), both devices on the
+// bus go up to Fast-mode. Fast-mode Plus (1 MHz) needs the FMPI2C peripheral,
+// which the F411 doesn't have.
+#define I2C_SPEED_STANDARD 100000
+#define I2C_SPEED_FAST 400000
+
+/**
+ * SCL low/high ratio in Fast-mode. 2:1 gets 400 kHz out of any PCLK1 that is
+ * a multiple of 1.2 MHz, 16:9 needs a multiple of 10 MHz but leaves a longer
+ * high time for a heavily loaded bus. Standard mode is always 1:1.
+ */
+typedef enum {
+    I2C_DUTY_2,
+    I2C_DUTY_16_9
+} I2C_DutyCycle;
+
 
 /** I2C_Init()
  *
- * Initializes the I2C System at standard speed (100Kbps).
+ * Initializes the I2C System at standard speed (100Kbps), unless it is
+ * already running (at whatever speed I2C_InitSpeed() set).
  *
  * @return SUCCESS or ERROR
  */
 int8_t I2C_Init(void);
 
+/** I2C_InitSpeed(speed, dutyCycle)
+ *
+ * Initializes the I2C System at the given bus speed, or changes the speed if
+ * it is already running (the transfer on the bus is let finish first). The
+ * speed is checked against PCLK1: the clock control register only divides
+ * PCLK1, so the bit rate is rounded down to the nearest one it can make.
+ *
+ * @param   speed       (uint32_t)  Bit rate in Hz, up to I2C_SPEED_FAST.
+ * @param   dutyCycle   (I2C_DutyCycle) SCL duty cycle in Fast-mode, ignored
+ *                                  up to I2C_SPEED_STANDARD.
+ * @return  (int8_t)    [SUCCESS, ERROR] ERROR if the speed is out of range
+ *                      (Fast-mode Plus included) or PCLK1 is too slow for it.
+ *                      Nothing is changed then.
+ */
+int8_t I2C_InitSpeed(uint32_t speed, I2C_DutyCycle dutyCycle);
+
+/** I2C_GetBitRate()
+ *
+ * The SCL frequency actually set up, PCLK1 over the clock control divider.
+ * The rise time of the bus lines stretches it a little on top of that.
+ *
+ * @return  (uint32_t)  Bit rate in Hz, 0 before initialization.
+ */
+uint32_t I2C_GetBitRate(void);
+
 /** I2C_ReadRegister(I2CAddress, deviceRegisterAddress)
  *
  * Reads one device register on chosen I2C device.
@@ -58,5 +119,160 @@ unsigned char I2C_WriteReg(unsigned char I2CAddress, unsigned char deviceRegiste
  */
 int I2C_ReadInt(char I2CAddress, char deviceRegisterAddress, char isBigEndian);
 
+/** I2C_WriteBytes(I2CAddress, deviceRegisterAddress, data, length)
+ *
+ * Writes a block of bytes to a device in one transaction (address, register,
+ * then every data byte), blocking until it is done.
+ *
+ * @param   I2CAddress              (uint8_t)   7-bit address of I2C device
+ * @param   deviceRegisterAddress   (uint8_t)   8-bit register (or control
+ *                                              byte) the data is written to.
+ * @param   data                    (uint8_t *) Bytes to write
+ * @param   length                  (uint16_t)  Number of bytes
+ * @return                          (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t I2C_WriteBytes(uint8_t I2CAddress, uint8_t deviceRegisterAddress, const uint8_t *data, uint16_t length);
+
+/** I2C_WriteBytesAsync(I2CAddress, deviceRegisterAddress, data, length, priority, callback)
+ *
+ * Queues the same transaction as I2C_WriteBytes(), to go out through the DMA
+ * once the bus is free, and returns straight away. data must stay untouched
+ * until callback runs, so it can't live on the stack.
+ *
+ * @param   I2CAddress              (uint8_t)   7-bit address of I2C device
+ * @param   deviceRegisterAddress   (uint8_t)   8-bit register (or control
+ *                                              byte) the data is written to.
+ * @param   data                    (uint8_t *) Bytes to write
+ * @param   length                  (uint16_t)  Number of bytes
+ * @param   priority                (I2C_Priority) Place in the queue.
+ * @param   callback                (I2C_Callback) Called from the interrupt
+ *                                              when done, can be NULL.
+ * @return                          (int8_t)    [SUCCESS, ERROR] ERROR if the
+ *                                              queue is full or I2C is not
+ *                                              initialized.
+ */
+int8_t I2C_WriteBytesAsync(uint8_t I2CAddress, uint8_t deviceRegisterAddress, const uint8_t *data, uint16_t length,
+        I2C_Priority priority, I2C_Callback callback);
+
+/** I2C_ReadBytes(I2CAddress, deviceRegisterAddress, data, length)
+ *
+ * Reads a block of consecutive registers in one transaction (address,
+ * register, restart, address, then every data byte), blocking until done.
+ * Much cheaper than reading them one at a time with I2C_ReadRegister().
+ *
+ * @param   I2CAddress              (uint8_t)   7-bit address of I2C device
+ * @param   deviceRegisterAddress   (uint8_t)   8-bit address of the first
+ *                                              register.
+ * @param   data                    (uint8_t *) Where to store the bytes
+ * @param   length                  (uint16_t)  Number of bytes
+ * @return                          (int8_t)    [SUCCESS, ERROR]
+ */
+int8_t I2C_ReadBytes(uint8_t I2CAddress, uint8_t deviceRegisterAddress, uint8_t *data, uint16_t length);
+
+/** I2C_ReadBytesAsync(I2CAddress, deviceRegisterAddress, data, length, priority, callback)
+ *
+ * Queues the same transaction as I2C_ReadBytes(), to go out through the DMA
+ * once the bus is free, and returns straight away. data is filled in by the
+ * time callback runs, so it can't live on the stack.
+ *
+ * @param   I2CAddress              (uint8_t)   7-bit address of I2C device
+ * @param   deviceRegisterAddress   (uint8_t)   8-bit address of the first
+ *                                              register.
+ * @param   data                    (uint8_t *) Where to store the bytes
+ * @param   length                  (uint16_t)  Number of bytes
+ * @param   priority                (I2C_Priority) Place in the queue.
+ * @param   callback                (I2C_Callback) Called from the interrupt
+ *                                              when done, can be NULL.
+ * @return                          (int8_t)    [SUCCESS, ERROR] ERROR if the
+ *                                              queue is full or I2C is not
+ *                                              initialized.
+ */
+int8_t I2C_ReadBytesAsync(uint8_t I2CAddress, uint8_t deviceRegisterAddress, uint8_t *data, uint16_t length,
+        I2C_Priority priority, I2C_Callback callback);
+
+/** I2C_IsBusy()
+ *
+ * Every transfer, blocking or not, owns the bus until it is done. The
+ * blocking functions wait for it, the asynchronous ones queue behind it.
+ *
+ * @return  (uint8_t)   TRUE while a transfer is using the bus.
+ */
+uint8_t I2C_IsBusy(void);
+
+/** I2C_CheckTimeout()
+ *
+ * Gives up on an asynchronous transfer that has run for I2C_QUEUE_TIMEOUT_MS
+ * (a slave holding the bus, a lost interrupt): the bus is reset, the
+ * transfer's callback gets ERROR and the queue moves on. Submitting a
+ * transfer checks too, call it from loops that wait on a callback.
+ */
+void I2C_CheckTimeout(void);
+
+/** I2C_GetResetCount()
+ *
+ * Bus errors and timeouts reset the peripheral and clock out a slave that
+ * may be holding SDA low. A NACK only fails its own transfer.
+ *
+ * @return  (uint32_t)  Bus resets since I2C_Init().
+ */
+uint32_t I2C_GetResetCount(void);
+
+/** I2C_GetBusByteCount()
+ *
+ * Number of bytes put on the bus since I2C_Init(): the address byte, the
+ * register byte and the data of every transaction. Read it before and after
+ * an operation to see what it costs.
+ *
+ * @return  (uint32_t)  Bytes counted so far.
+ */
+uint32_t I2C_GetBusByteCount(void);
+
+
+#ifdef I2C_SIM
+/* Host builds (gcc -DI2C_SIM): I2C.c runs on a mock HAL, a simulated bus and
+ * clock with an SSD1306 on it (see the end of I2C.c), which also stands in for
+ * the board and timer modules. */
+#ifndef FALSE
+#define FALSE ((int8_t) 0)
+#define TRUE ((int8_t) 1)
+#endif
+#ifndef ERROR
+#define ERROR ((int8_t) -1)
+#define SUCCESS ((int8_t) 1)
+#endif
+#define __disable_irq()
+#define __enable_irq()
+
+int8_t BOARD_Init(void);
+char TIMER_Init(void);
+uint32_t TIMERS_GetMilliSeconds(void);
+uint32_t TIMERS_GetMicroSeconds(void);
+
+/** I2C_SimGetDisplayRam()
+ *
+ * @return  (const uint8_t *)   The simulated SSD1306's display RAM, page after
+ *                              page the way rgbOledBmp is laid out.
+ */
+const uint8_t *I2C_SimGetDisplayRam(void);
+
+/** I2C_SimSetRiseTime(nanoseconds)
+ *
+ * The time SDA and SCL take to rise through the pull-ups, added to every bit
+ * on the simulated bus (SCL is held low until the line is seen high).
+ *
+ * @param   nanoseconds (uint32_t)  Per bit, 0 at start up.
+ */
+void I2C_SimSetRiseTime(uint32_t nanoseconds);
+
+/** I2C_SimSetLogging(isOn)
+ *
+ * Prints every transaction (address, register and the first data bytes) as
+ * it reaches the simulated bus while on.
+ *
+ * @param   isOn    (uint8_t)   TRUE or FALSE
+ */
+void I2C_SimSetLogging(uint8_t isOn);
+#endif  /*  I2C_SIM */
+
 
 #endif
@@ -0,0 +1,441 @@
+/*
+ * File:   I2CQueue.c
+ * Author: Derrick Lai
+ *
+ * Transfer queue for the shared I2C bus, see I2CQueue.h.
+ *
+ * Jobs are submitted from the main loop, from timer interrupts and from the completion callbacks of other
+ * jobs, so every change to the queue is made with interrupts off. Interrupts are saved and restored rather
+ * than turned back on, the callers may already have them off.
+ *
+ * isBusy stays set while a job's callback runs. A job submitted from the callback only joins the queue,
+ * and the next job is picked once the callback is done, which is what lets a chain of OLED pages and a
+ * sensor read take turns.
+ *
+ * Created on April 8, 2025
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <I2CQueue.h>
+
+// Boolean defines for TRUE, FALSE, SUCCESS and ERROR
+#ifndef FALSE
+#define FALSE ((int8_t) 0)
+#define TRUE ((int8_t) 1)
+#endif
+#ifndef ERROR
+#define ERROR ((int8_t) -1)
+#define SUCCESS ((int8_t) 1)
+#endif
+
+// Critical sections, PRIMASK on the Cortex-M4. The host test is single threaded.
+#if defined(__arm__)
+static inline uint32_t I2CQueue_Lock(void) {
+    uint32_t primask;
+    __asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask) :: "memory");
+    return primask;
+}
+
+static inline void I2CQueue_Unlock(uint32_t primask) {
+    __asm volatile ("msr primask, %0" :: "r" (primask) : "memory");
+}
+#else
+static inline uint32_t I2CQueue_Lock(void) {
+    return 0;
+}
+
+static inline void I2CQueue_Unlock(uint32_t primask) {
+    (void) primask;
+}
+#endif
+
+typedef struct JobFifo {
+    I2CQueue_Job jobs[I2C_QUEUE_DEPTH];
+    uint8_t head;
+    uint8_t count;
+} JobFifo;
+
+static const I2CQueue_Driver *driver = NULL;
+static JobFifo queues[I2C_PRIORITY_COUNT];
+static I2CQueue_Job current; // The job on the bus
+static volatile uint8_t isBusy = FALSE;
+static volatile uint8_t isBlocking = FALSE; // The bus is held by a blocking transfer, not a job
+static uint32_t startTime; // When the current job started, for the timeout
+static uint32_t resetCount = 0;
+
+static void I2CQueue_StartNext(void);
+
+void I2CQueue_Init(const I2CQueue_Driver *newDriver) {
+    uint32_t primask = I2CQueue_Lock();
+    driver = newDriver;
+    for (uint8_t i = 0; i < I2C_PRIORITY_COUNT; i++) {
+        queues[i].head = 0;
+        queues[i].count = 0;
+    }
+    isBusy = FALSE;
+    isBlocking = FALSE;
+    resetCount = 0;
+    I2CQueue_Unlock(primask);
+}
+
+int8_t I2CQueue_Submit(const I2CQueue_Job *job, I2C_Priority priority) {
+    if (driver == NULL || priority >= I2C_PRIORITY_COUNT) {
+        return ERROR;
+    }
+    I2CQueue_CheckTimeout();
+
+    JobFifo *fifo = &queues[priority];
+    uint32_t primask = I2CQueue_Lock();
+    if (fifo->count == I2C_QUEUE_DEPTH) {
+        I2CQueue_Unlock(primask);
+        return ERROR;
+    }
+    fifo->jobs[(fifo->head + fifo->count) % I2C_QUEUE_DEPTH] = *job;
+    fifo->count++;
+    I2CQueue_Unlock(primask);
+
+    I2CQueue_StartNext();
+    return SUCCESS;
+}
+
+void I2CQueue_Finish(int8_t status) {
+    uint32_t primask = I2CQueue_Lock();
+    if (!isBusy || isBlocking) {
+        // Nothing running, or the bus is being reset after a timeout
+        I2CQueue_Unlock(primask);
+        return;
+    }
+    I2C_Callback callback = current.callback;
+    current.callback = NULL;
+    I2CQueue_Unlock(primask);
+
+    if (callback != NULL) {
+        callback(status);
+    }
+
+    isBusy = FALSE;
+    I2CQueue_StartNext();
+}
+
+uint8_t I2CQueue_TryClaim(void) {
+    uint8_t claimed = FALSE;
+    uint32_t primask = I2CQueue_Lock();
+    if (!isBusy) {
+        isBusy = TRUE;
+        isBlocking = TRUE;
+        claimed = TRUE;
+    }
+    I2CQueue_Unlock(primask);
+    return claimed;
+}
+
+void I2CQueue_Release(void) {
+    uint32_t primask = I2CQueue_Lock();
+    if (isBlocking) {
+        isBlocking = FALSE;
+        isBusy = FALSE;
+    }
+    I2CQueue_Unlock(primask);
+    I2CQueue_StartNext();
+}
+
+void I2CQueue_CheckTimeout(void) {
+    if (driver == NULL) {
+        return;
+    }
+    // Blocking transfers have their own timeout in the HAL.
+    uint32_t primask = I2CQueue_Lock();
+    uint8_t isLate = isBusy && !isBlocking && driver->milliseconds() - startTime > I2C_QUEUE_TIMEOUT_MS;
+    if (isLate) {
+        // Keeps a completion interrupt from finishing the job while the bus is reset
+        isBlocking = TRUE;
+    }
+    I2CQueue_Unlock(primask);
+
+    if (isLate) {
+        driver->reset();
+        resetCount++;
+        isBlocking = FALSE;
+        I2CQueue_Finish(ERROR);
+    }
+}
+
+uint8_t I2CQueue_IsBusy(void) {
+    return isBusy;
+}
+
+uint8_t I2CQueue_Count(void) {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < I2C_PRIORITY_COUNT; i++) {
+        count += queues[i].count;
+    }
+    return count;
+}
+
+uint32_t I2CQueue_GetResetCount(void) {
+    return resetCount;
+}
+
+/**
+ * @function I2CQueue_StartNext()
+ * @param None
+ * @return None
+ * @brief Puts the oldest job of the highest priority on the bus, if the bus is free */
+static void I2CQueue_StartNext(void) {
+    uint32_t primask = I2CQueue_Lock();
+    if (isBusy) {
+        I2CQueue_Unlock(primask);
+        return;
+    }
+    JobFifo *fifo = NULL;
+    for (uint8_t i = 0; i < I2C_PRIORITY_COUNT; i++) {
+        if (queues[i].count > 0) {
+            fifo = &queues[i];
+            break;
+        }
+    }
+    if (fifo == NULL) {
+        I2CQueue_Unlock(primask);
+        return;
+    }
+    current = fifo->jobs[fifo->head];
+    fifo->head = (fifo->head + 1) % I2C_QUEUE_DEPTH;
+    fifo->count--;
+    isBusy = TRUE;
+    startTime = driver->milliseconds();
+    I2CQueue_Unlock(primask);
+
+    if (driver->start(&current) != SUCCESS) {
+        I2CQueue_Finish(ERROR);
+    }
+}
+
+
+//#define I2C_QUEUE_TEST
+#ifdef I2C_QUEUE_TEST // I2C QUEUE TEST HARNESS
+// No hardware dependencies, the HAL is replaced by a mock bus on a simulated clock, so this runs on a host
+// and every run schedules the same way:
+//   gcc -O2 -I. -DI2C_QUEUE_TEST I2CQueue.c -o i2c_queue_test && ./i2c_queue_test
+// SUCCESS - a sensor read waits for at most the OLED page on the bus, NACKs fail only their job, a stuck
+// transfer is reset after the timeout, and the queue keeps going after each of them.
+// The mock bus here only keeps time at 100 kHz. I2C.c has the full simulation (I2C_SIM): the HAL, the bus timing
+// at each speed and an SSD1306 model, used by the OLED tests.
+
+#include <string.h>
+
+#define BYTE_US 90 // One byte at 100 kHz, with the ACK
+#define OLED_ADDRESS 0x3C
+#define BNO055_ADDRESS 0x28
+#define MISSING_ADDRESS 0x30 // Nobody answers, NACK
+#define STUCK_ADDRESS 0x7F // A slave holding SDA low, the transfer never ends
+#define OLED_PAGE_BYTES 128
+#define OLED_PAGES 4
+#define SENSOR_BYTES 18
+
+static uint32_t now = 0; // Microseconds
+static uint8_t isOnBus = FALSE;
+static uint32_t busEnd;
+static I2CQueue_Job busJob;
+static uint8_t failStarts = FALSE;
+static int resets = 0;
+static int errors = 0;
+
+static int8_t MockStart(const I2CQueue_Job *job) {
+    if (failStarts) {
+        return ERROR;
+    }
+    busJob = *job;
+    isOnBus = TRUE;
+    busEnd = now + (job->length + (job->isRead ? 3 : 2)) * BYTE_US;
+    return SUCCESS;
+}
+
+static void MockReset(void) {
+    isOnBus = FALSE;
+    resets++;
+}
+
+static uint32_t MockMilliseconds(void) {
+    return now / 1000;
+}
+
+static const I2CQueue_Driver mockDriver = { MockStart, MockReset, MockMilliseconds };
+
+// Moves the clock on by a microsecond, finishing the transfer on the bus when its time is up.
+static void Tick(void) {
+    now++;
+    if (isOnBus && now >= busEnd && busJob.address != STUCK_ADDRESS) {
+        isOnBus = FALSE;
+        I2CQueue_Finish(busJob.address == MISSING_ADDRESS ? ERROR : SUCCESS);
+    }
+    if (now % 1000 == 0) {
+        I2CQueue_CheckTimeout();
+    }
+}
+
+static void RunUntilIdle(void) {
+    while (I2CQueue_IsBusy() || I2CQueue_Count() > 0) {
+        Tick();
+    }
+}
+
+static void Check(int condition, const char *what) {
+    if (!condition) {
+        printf("  FAILED: %s\n", what);
+        errors++;
+    }
+}
+
+// Everything a test records: the order jobs finish in and how they went.
+static char order[64];
+static int logLength = 0;
+static int8_t lastStatus;
+
+static void Record(char c, int8_t status) {
+    order[logLength++] = status == SUCCESS ? c : c - 'A' + 'a';
+    order[logLength] = '\0';
+    lastStatus = status;
+}
+
+static void OledDone(int8_t status) { Record('O', status); }
+static void SensorDone(int8_t status) { Record('S', status); }
+static void OtherDone(int8_t status) { Record('X', status); }
+
+static uint8_t page[OLED_PAGE_BYTES];
+static uint8_t sensor[SENSOR_BYTES];
+
+static I2CQueue_Job OledPage(void) {
+    I2CQueue_Job job = { OLED_ADDRESS, 0x40, page, OLED_PAGE_BYTES, FALSE, OledDone };
+    return job;
+}
+
+static I2CQueue_Job SensorRead(void) {
+    I2CQueue_Job job = { BNO055_ADDRESS, 0x08, sensor, SENSOR_BYTES, TRUE, SensorDone };
+    return job;
+}
+
+static void Reset(void) {
+    I2CQueue_Init(&mockDriver);
+    isOnBus = FALSE;
+    failStarts = FALSE;
+    resets = 0;
+    logLength = 0;
+    order[0] = '\0';
+}
+
+// A whole OLED frame queued at once, then a sensor read 1 ms later. Returns how long the read took.
+static uint32_t SensorLatency(I2C_Priority sensorPriority) {
+    Reset();
+    I2CQueue_Job oled = OledPage();
+    I2CQueue_Job read = SensorRead();
+    for (int i = 0; i < OLED_PAGES; i++) {
+        I2CQueue_Submit(&oled, I2C_PRIORITY_LOW);
+    }
+    while (now % 1000 != 999) {
+        Tick();
+    }
+    Tick();
+    uint32_t submitted = now;
+    I2CQueue_Submit(&read, sensorPriority);
+    while (logLength == 0 || strchr(order, 'S') == NULL) {
+        Tick();
+    }
+    uint32_t latency = now - submitted;
+    RunUntilIdle();
+    return latency;
+}
+
+// Transfers chained from their own callback, the way the OLED driver sends its pages.
+static uint8_t chainCount = 0;
+
+static void ChainDone(int8_t status) {
+    Record('C', status);
+    if (++chainCount < 3) {
+        I2CQueue_Job next = { BNO055_ADDRESS, 0x08, sensor, SENSOR_BYTES, TRUE, ChainDone };
+        I2CQueue_Submit(&next, I2C_PRIORITY_LOW);
+    }
+}
+
+int main(void) {
+    uint32_t pageUs = (OLED_PAGE_BYTES + 2) * BYTE_US;
+    uint32_t readUs = (SENSOR_BYTES + 3) * BYTE_US;
+
+    printf("Priority: a 4 page OLED frame queued, a sensor read submitted 1 ms into the first page\n");
+    uint32_t lowLatency = SensorLatency(I2C_PRIORITY_LOW);
+    printf("  read at LOW priority:  %lu us (%s)\n", (unsigned long) lowLatency, order);
+    uint32_t highLatency = SensorLatency(I2C_PRIORITY_HIGH);
+    printf("  read at HIGH priority: %lu us (%s)\n", (unsigned long) highLatency, order);
+    Check(strcmp(order, "OSOOO") == 0, "the read goes between the first two pages");
+    Check(highLatency <= pageUs + readUs, "the read waits for at most one page");
+    Check(lowLatency >= OLED_PAGES * pageUs - 1000, "at LOW it waits for the whole frame");
+
+    printf("Chained callbacks: a callback that submits its follow up keeps its place\n");
+    Reset();
+    chainCount = 0;
+    I2CQueue_Job chain = { BNO055_ADDRESS, 0x08, sensor, SENSOR_BYTES, TRUE, ChainDone };
+    I2CQueue_Job other = { OLED_ADDRESS, 0x40, page, 8, FALSE, OtherDone };
+    I2CQueue_Submit(&chain, I2C_PRIORITY_LOW);
+    I2CQueue_Submit(&other, I2C_PRIORITY_LOW);
+    RunUntilIdle();
+    printf("  %s\n", order);
+    Check(strcmp(order, "CXCC") == 0, "jobs of the same priority take turns in submission order");
+
+    printf("NACK: a read from a missing device fails alone\n");
+    Reset();
+    I2CQueue_Job missing = { MISSING_ADDRESS, 0x00, sensor, 1, TRUE, OtherDone };
+    I2CQueue_Job read = SensorRead();
+    I2CQueue_Submit(&missing, I2C_PRIORITY_HIGH);
+    I2CQueue_Submit(&read, I2C_PRIORITY_HIGH);
+    RunUntilIdle();
+    printf("  %s, %d bus resets\n", order, resets);
+    Check(strcmp(order, "xS") == 0, "the NACKed job gets ERROR, the next one runs");
+    Check(resets == 0, "a NACK doesn't reset the bus");
+
+    printf("Timeout: a transfer that never ends\n");
+    Reset();
+    I2CQueue_Job stuck = { STUCK_ADDRESS, 0x00, sensor, 4, TRUE, OtherDone };
+    uint32_t start = now;
+    I2CQueue_Submit(&stuck, I2C_PRIORITY_LOW);
+    I2CQueue_Submit(&read, I2C_PRIORITY_HIGH);
+    RunUntilIdle();
+    printf("  %s, %d bus resets, given up after %lu ms\n", order, resets, (unsigned long) (now - start) / 1000);
+    Check(strcmp(order, "xS") == 0, "the stuck job gets ERROR, the next one runs");
+    Check(resets == 1 && I2CQueue_GetResetCount() == 1, "the bus is reset once");
+    Check(now - start <= (I2C_QUEUE_TIMEOUT_MS + 2) * 1000 + readUs, "it is given up on in time");
+
+    printf("Start failure: the driver refuses a transfer\n");
+    Reset();
+    failStarts = TRUE;
+    I2CQueue_Submit(&read, I2C_PRIORITY_HIGH);
+    failStarts = FALSE;
+    I2CQueue_Submit(&read, I2C_PRIORITY_HIGH);
+    RunUntilIdle();
+    printf("  %s\n", order);
+    Check(strcmp(order, "sS") == 0, "the refused job gets ERROR, the next one runs");
+
+    printf("Blocking transfers: jobs wait for the bus, and the queue fills up\n");
+    Reset();
+    I2CQueue_Job oled = OledPage();
+    Check(I2CQueue_TryClaim(), "the free bus can be claimed");
+    Check(!I2CQueue_TryClaim(), "a held bus can't be claimed");
+    int accepted = 0;
+    for (int i = 0; i < I2C_QUEUE_DEPTH + 1; i++) {
+        accepted += I2CQueue_Submit(&oled, I2C_PRIORITY_LOW) == SUCCESS;
+    }
+    Check(I2CQueue_Submit(&read, I2C_PRIORITY_HIGH) == SUCCESS, "the other priority still has room");
+    for (uint32_t i = 0; i < 5 * pageUs; i++) {
+        Tick();
+    }
+    Check(logLength == 0 && !isOnBus, "nothing starts while the bus is held");
+    I2CQueue_Release();
+    RunUntilIdle();
+    printf("  %d of %d accepted, then %s\n", accepted, I2C_QUEUE_DEPTH + 1, order);
+    Check(accepted == I2C_QUEUE_DEPTH, "a full queue refuses the job");
+    Check(strcmp(order, "SOOOOOOOO") == 0, "everything runs once the bus is released");
+
+    printf("%s - %d errors\n", errors == 0 ? "SUCCESS" : "FAILURE", errors);
+    return errors != 0;
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * File:   I2CQueue.h
+ * Author: Derrick Lai
+ *
+ * Transfer queue for the I2C bus shared by the OLED and the BNO055.
+ *
+ * Asynchronous transfers are queued as jobs with a priority and run one after the other, each one started
+ * from the completion interrupt of the one before. The next job is always the oldest of the highest
+ * priority waiting, so a sensor read (I2C_PRIORITY_HIGH) goes out between two OLED page bursts
+ * (I2C_PRIORITY_LOW) instead of after the whole frame. A job's callback runs before the next job is picked,
+ * so a chain of transfers (a callback queuing its follow up) keeps its place against the other jobs.
+ *
+ * The blocking transfers in I2C.c take the bus with I2CQueue_TryClaim() and give it back with
+ * I2CQueue_Release(), the queue waits for them.
+ *
+ * A job that takes longer than I2C_QUEUE_TIMEOUT_MS is given up on by I2CQueue_CheckTimeout(): the bus is
+ * reset, the job's callback gets ERROR and the queue carries on.
+ *
+ * This file has no hardware dependencies, the hardware is reached through an I2CQueue_Driver (I2C.c on the
+ * STM32, a mock in the I2C_QUEUE_TEST harness).
+ *
+ * Created on April 8, 2025
+ */
+
+#ifndef I2C_QUEUE_H
+#define I2C_QUEUE_H
+
+#include <stdint.h>
+#include <I2C.h>
+
+#define I2C_QUEUE_DEPTH 8 // Jobs that can wait at each priority
+#define I2C_QUEUE_TIMEOUT_MS 25 // Longer than any transfer takes at 100 kHz (256 bytes is 23 ms)
+
+typedef struct I2CQueue_Job {
+    uint8_t address; // 7-bit device address
+    uint8_t reg; // Register (or control byte)
+    uint8_t *data; // Bytes to write or where to read to, must stay valid until the callback
+    uint16_t length;
+    uint8_t isRead;
+    I2C_Callback callback; // Called from interrupt context when the job is done, can be NULL
+} I2CQueue_Job;
+
+typedef struct I2CQueue_Driver {
+    int8_t (*start)(const I2CQueue_Job *job); // Start the transfer, its end is reported with I2CQueue_Finish()
+    void (*reset)(void); // Abort the transfer and get the bus back to idle
+    uint32_t (*milliseconds)(void); // Clock for the timeout
+} I2CQueue_Driver;
+
+/**
+ * @function I2CQueue_Init(driver)
+ * @param driver - How to reach the hardware, must stay valid
+ * @return None
+ * @brief Empties the queue */
+void I2CQueue_Init(const I2CQueue_Driver *driver);
+
+/**
+ * @function I2CQueue_Submit(job, priority)
+ * @param job - The transfer, copied into the queue
+ * @param priority - I2C_PRIORITY_HIGH or I2C_PRIORITY_LOW
+ * @return SUCCESS, or ERROR if that priority's queue is full
+ * @brief Starts the job straight away if the bus is free, safe to call from interrupts and callbacks */
+int8_t I2CQueue_Submit(const I2CQueue_Job *job, I2C_Priority priority);
+
+/**
+ * @function I2CQueue_Finish(status)
+ * @param status - SUCCESS or ERROR
+ * @return None
+ * @brief Called by the driver when the running job is done: runs its callback and starts the next job */
+void I2CQueue_Finish(int8_t status);
+
+/**
+ * @function I2CQueue_TryClaim()
+ * @param None
+ * @return TRUE if the bus was free and is now held for a blocking transfer
+ * @brief I2CQueue_Release() must follow, jobs submitted in the meantime wait for it */
+uint8_t I2CQueue_TryClaim(void);
+
+/**
+ * @function I2CQueue_Release()
+ * @param None
+ * @return None
+ * @brief Ends a blocking transfer and starts the next job */
+void I2CQueue_Release(void);
+
+/**
+ * @function I2CQueue_CheckTimeout()
+ * @param None
+ * @return None
+ * @brief Gives up on a job that has run over I2C_QUEUE_TIMEOUT_MS, resetting the bus */
+void I2CQueue_CheckTimeout(void);
+
+/**
+ * @function I2CQueue_IsBusy()
+ * @param None
+ * @return TRUE while a job or a blocking transfer is using the bus */
+uint8_t I2CQueue_IsBusy(void);
+
+/**
+ * @function I2CQueue_Count()
+ * @param None
+ * @return Jobs waiting to start (the one running isn't counted) */
+uint8_t I2CQueue_Count(void);
+
+/**
+ * @function I2CQueue_GetResetCount()
+ * @param None
+ * @return Times the bus was reset because a job timed out */
+uint32_t I2CQueue_GetResetCount(void);
+
+#endif
@@ -0,0 +1,344 @@
+/*
+ * File:   ImuSampler.c
+ * Author: Derrick Lai
+ *
+ * Background BNO055 sampling, see ImuSampler.h.
+ *
+ * The timer interrupt and the I2C interrupts run at the same priority, so a tick never lands in the middle of
+ * the completion of the read before it. The samples are the producer side of the CircularBuffer (interrupts)
+ * and ImuSampler_Read() the consumer side (main loop), whole samples are always written and read together.
+ *
+ * Created on April 6, 2025
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <CircularBuffer.h>
+#include <BNO055.h>
+#include <ImuSampler.h>
+#ifndef IMU_SAMPLER_SIM_TEST // The simulation test stands in for the timer and the sensor.
+#include <timers.h>
+#include "stm32f4xx_hal.h"
+#else
+uint32_t TIMERS_GetMicroSeconds(void);
+#endif
+
+// Boolean defines for TRUE, FALSE, SUCCESS and ERROR
+#ifndef FALSE
+#define FALSE ((int8_t) 0)
+#define TRUE ((int8_t) 1)
+#endif
+#ifndef ERROR
+#define ERROR ((int8_t) -1)
+#define SUCCESS ((int8_t) 1)
+#endif
+
+// Same subpriority as the I2C interrupts (I2C.c), HAL_MspInit()'s NVIC_PRIORITYGROUP_0 has no preemption levels.
+#define IMU_SAMPLER_IRQ_PRIORITY 6
+
+// TIM11 counts at 1 MHz, or at 10 kHz when a sample period doesn't fit its 16-bit counter (under 16 Hz).
+#define IMU_SAMPLER_TICK_HZ 1000000
+#define IMU_SAMPLER_SLOW_TICK_HZ 10000
+#define IMU_SAMPLER_MAX_COUNT 0x10000
+
+CIRCULAR_BUFFER_DEFINE(sampleBuffer, IMU_SAMPLER_BUFFER_SIZE);
+
+static ImuSample pending; // Being filled in by the DMA, stamped when it was asked for
+static volatile uint8_t isReading = FALSE;
+static volatile uint32_t droppedCount = 0;
+static volatile uint32_t missedCount = 0;
+
+// Function prototypes for private functions.
+static void ImuSampler_Reset(void);
+static void ImuSampler_Tick(void);
+static void ImuSampler_FinishRead(int8_t status);
+static void ImuSampler_TimerSetup(uint32_t timerClock, uint16_t rate, uint32_t *prescaler, uint32_t *period);
+
+#ifndef IMU_SAMPLER_SIM_TEST
+static TIM_HandleTypeDef htim11;
+static uint8_t isRunning = FALSE;
+
+int8_t ImuSampler_Init(uint16_t rate) {
+    if (rate == 0 || rate > IMU_SAMPLER_MAX_RATE) {
+        return ERROR;
+    }
+    ImuSampler_Stop();
+    ImuSampler_Reset();
+
+    // TIM11 overflows once per sample.
+    __HAL_RCC_TIM11_CLK_ENABLE();
+    htim11.Instance = TIM11;
+    ImuSampler_TimerSetup(TIMERS_GetSystemClockFreq(), rate, &htim11.Init.Prescaler, &htim11.Init.Period);
+    htim11.Init.CounterMode = TIM_COUNTERMODE_UP;
+    htim11.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+    htim11.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+    if (HAL_TIM_Base_Init(&htim11) != HAL_OK) {
+        return ERROR;
+    }
+    HAL_NVIC_SetPriority(TIM1_TRG_COM_TIM11_IRQn, 0, IMU_SAMPLER_IRQ_PRIORITY);
+    HAL_NVIC_EnableIRQ(TIM1_TRG_COM_TIM11_IRQn);
+    if (HAL_TIM_Base_Start_IT(&htim11) != HAL_OK) {
+        return ERROR;
+    }
+    isRunning = TRUE;
+    return SUCCESS;
+}
+
+void ImuSampler_Stop(void) {
+    if (isRunning) {
+        HAL_TIM_Base_Stop_IT(&htim11);
+        isRunning = FALSE;
+    }
+}
+
+// TIM11 shares its vector with the TIM1 trigger interrupts, which nothing turns on. Only the update flag is
+// looked at, HAL_TIM_IRQHandler() would go to HAL_TIM_PeriodElapsedCallback(), which belongs to timers.c.
+void TIM1_TRG_COM_TIM11_IRQHandler(void) {
+    if (__HAL_TIM_GET_FLAG(&htim11, TIM_FLAG_UPDATE) != RESET) {
+        __HAL_TIM_CLEAR_FLAG(&htim11, TIM_FLAG_UPDATE);
+        ImuSampler_Tick();
+    }
+}
+#endif
+
+uint16_t ImuSampler_Read(ImuSample *samples, uint16_t maxSamples) {
+    uint16_t count = ImuSampler_Count();
+    if (count > maxSamples) {
+        count = maxSamples;
+    }
+    CircularBuffer_Read(&sampleBuffer, (uint8_t *) samples, count * sizeof(ImuSample));
+    return count;
+}
+
+uint16_t ImuSampler_Count(void) {
+    return CircularBuffer_Count(&sampleBuffer) / sizeof(ImuSample);
+}
+
+uint32_t ImuSampler_GetDroppedCount(void) {
+    return droppedCount;
+}
+
+uint32_t ImuSampler_GetMissedCount(void) {
+    return missedCount;
+}
+
+/**
+ * @function ImuSampler_Reset()
+ * @brief Empties the buffer and the counters, only while the timer is stopped */
+static void ImuSampler_Reset(void) {
+    CircularBuffer_Reset(&sampleBuffer);
+    isReading = FALSE;
+    droppedCount = 0;
+    missedCount = 0;
+}
+
+/**
+ * @function ImuSampler_Tick()
+ * @brief Timer interrupt: stamp the sample and start reading it */
+static void ImuSampler_Tick(void) {
+    // The last read is still going (a slow bus), it isn't started twice.
+    if (isReading) {
+        missedCount++;
+        return;
+    }
+    pending.time = TIMERS_GetMicroSeconds();
+    isReading = TRUE;
+    if (BNO055_ReadAllAsync(&pending.data, ImuSampler_FinishRead) != SUCCESS) {
+        // The I2C queue is full.
+        isReading = FALSE;
+        missedCount++;
+    }
+}
+
+/**
+ * @function ImuSampler_FinishRead(status)
+ * @brief I2C interrupt: the sample is in, keep it if there is room */
+static void ImuSampler_FinishRead(int8_t status) {
+    if (status != SUCCESS) {
+        missedCount++;
+    } else if (CircularBuffer_Free(&sampleBuffer) < sizeof(ImuSample)) {
+        droppedCount++;
+    } else {
+        CircularBuffer_Write(&sampleBuffer, (const uint8_t *) &pending, sizeof(ImuSample));
+    }
+    isReading = FALSE;
+}
+
+/**
+ * @function ImuSampler_TimerSetup(timerClock, rate, prescaler, period)
+ * @param timerClock - TIM11's clock in Hz
+ * @param rate - Samples per second, 1 to IMU_SAMPLER_MAX_RATE
+ * @param prescaler - Gets the PSC value
+ * @param period - Gets the ARR value, the sample period rounded to the nearest tick
+ * @return None
+ * @brief Both fit TIM11's 16-bit registers for every rate, the slow tick takes the rates under 16 Hz */
+static void ImuSampler_TimerSetup(uint32_t timerClock, uint16_t rate, uint32_t *prescaler, uint32_t *period) {
+    uint32_t tick = IMU_SAMPLER_TICK_HZ;
+    if ((tick + rate / 2) / rate > IMU_SAMPLER_MAX_COUNT) {
+        tick = IMU_SAMPLER_SLOW_TICK_HZ;
+    }
+    *prescaler = timerClock / tick - 1;
+    *period = (tick + rate / 2) / rate - 1;
+}
+
+
+//#define IMU_SAMPLER_SIM_TEST
+#ifdef IMU_SAMPLER_SIM_TEST // IMU SAMPLER SIMULATION
+// Runs on a host, a microsecond by microsecond simulation stands in for TIM11, the I2C bus and the BNO055:
+//   gcc -O2 -I. -DIMU_SAMPLER_SIM_TEST ImuSampler.c CircularBuffer.c -o imu_sim && ./imu_sim
+// The timer fires every 10 ms (100 Hz) up to 15 us late, reads take 1.9 ms plus up to 0.2 ms of clock
+// stretching, an OLED update sends 4 page bursts of 1.25 ms every 100 ms (a read queued during one goes
+// after it, as the I2C queue does), and the main loop reads a batch every 30 ms except for a 2 second stall.
+// SUCCESS - every timestamp is within the interrupt latency of its tick, samples arrive in order, no read
+// waits for more than one page, and every tick is accounted for as read or dropped (only during the stall).
+// Also checks the TIM11 setup for every rate: the registers fit 16 bits and the rate is right to 0.1%.
+
+#include <stdlib.h>
+
+#define SIM_DURATION_US 20000000
+#define SIM_PERIOD_US 10000
+#define SIM_MAX_LATENCY_US 15
+#define SIM_READ_US 1900
+#define SIM_OLED_PERIOD_US 100000
+#define SIM_OLED_US 5000
+#define SIM_OLED_PAGE_US 1250
+#define SIM_CONSUMER_PERIOD_US 30000
+#define SIM_STALL_START_US 8000000
+#define SIM_STALL_END_US 10000000
+
+static uint32_t simTime = 0;
+static unsigned int seed = 1;
+
+// The sensor: one read in flight, finishing at readDone.
+static uint8_t isBusReading = FALSE;
+static uint32_t readDone;
+static BNO055_Data *readData;
+static BNO055_Callback readCallback;
+static uint32_t readsStarted = 0;
+static uint32_t refusals = 0;
+static uint32_t maxReadUs = 0;
+
+uint32_t TIMERS_GetMicroSeconds(void) {
+    return simTime;
+}
+
+// When the bus is free for a read: at the end of the OLED page being sent, if there is one.
+static uint32_t BusFreeTime(void) {
+    uint32_t offset = simTime % SIM_OLED_PERIOD_US;
+    if (offset >= SIM_OLED_US) {
+        return simTime;
+    }
+    return simTime - offset + (offset / SIM_OLED_PAGE_US + 1) * SIM_OLED_PAGE_US;
+}
+
+int8_t BNO055_ReadAllAsync(BNO055_Data *data, BNO055_Callback callback) {
+    if (isBusReading) {
+        refusals++;
+        return ERROR;
+    }
+    isBusReading = TRUE;
+    readDone = BusFreeTime() + SIM_READ_US + rand_r(&seed) % 200;
+    if (readDone - simTime > maxReadUs) {
+        maxReadUs = readDone - simTime;
+    }
+    readData = data;
+    readCallback = callback;
+    return SUCCESS;
+}
+
+// TIM11's registers and the rate they give, for every rate ImuSampler_Init() takes.
+static int CheckTimerSetup(void) {
+    int errors = 0;
+    double worst = 0;
+    for (uint32_t rate = 1; rate <= IMU_SAMPLER_MAX_RATE; rate++) {
+        uint32_t prescaler, period;
+        ImuSampler_TimerSetup(84000000, rate, &prescaler, &period);
+        double actual = 84000000.0 / ((prescaler + 1.0) * (period + 1.0));
+        double error = actual > rate ? (actual - rate) / rate : (rate - actual) / rate;
+        worst = error > worst ? error : worst;
+        if (prescaler > 0xFFFF || period > 0xFFFF || error > 0.001) {
+            printf("  %lu Hz: PSC %lu ARR %lu gives %.3f Hz\r\n", (unsigned long) rate, (unsigned long) prescaler,
+                    (unsigned long) period, actual);
+            errors++;
+        }
+    }
+    printf("TIM11 setup for 1 to %d Hz: worst rate error %.3f%%, %d errors\r\n", IMU_SAMPLER_MAX_RATE,
+            100 * worst, errors);
+    return errors;
+}
+
+int main(void) {
+    ImuSample batch[16];
+    uint32_t ticks = 0, read = 0, maxJitter = 0, orderErrors = 0, lateDrops = 0;
+    uint32_t nextTick = SIM_PERIOD_US + rand_r(&seed) % (SIM_MAX_LATENCY_US + 1);
+    uint32_t tickNumber = 0;
+    int32_t lastSequence = -1;
+
+    ImuSampler_Reset();
+    for (simTime = 0; simTime < SIM_DURATION_US; simTime++) {
+        // The read finishing, its data numbers the sample so the order can be checked.
+        if (isBusReading && simTime == readDone) {
+            isBusReading = FALSE;
+            memset(readData, 0, sizeof(*readData));
+            readData->accelX = (int16_t) (readsStarted & 0xFFFF);
+            readData->accelY = (int16_t) (readsStarted >> 16);
+            readsStarted++;
+            readCallback(SUCCESS);
+        }
+
+        // The timer, late by the interrupt latency.
+        if (simTime == nextTick) {
+            ticks++;
+            ImuSampler_Tick();
+            tickNumber++;
+            nextTick = (tickNumber + 1) * SIM_PERIOD_US + rand_r(&seed) % (SIM_MAX_LATENCY_US + 1);
+        }
+
+        // The main loop.
+        if (simTime % SIM_CONSUMER_PERIOD_US == 0 && (simTime < SIM_STALL_START_US || simTime >= SIM_STALL_END_US)) {
+            uint32_t dropped = ImuSampler_GetDroppedCount();
+            uint16_t count;
+            while ((count = ImuSampler_Read(batch, 16)) > 0) {
+                for (int i = 0; i < count; i++) {
+                    int32_t sequence = (uint16_t) batch[i].data.accelX | ((uint16_t) batch[i].data.accelY << 16);
+                    uint32_t jitter = batch[i].time % SIM_PERIOD_US;
+                    if (jitter > maxJitter) {
+                        maxJitter = jitter;
+                    }
+                    orderErrors += sequence <= lastSequence;
+                    lastSequence = sequence;
+                }
+                read += count;
+            }
+            // Nothing should be dropped while the main loop keeps up.
+            if (simTime > SIM_STALL_END_US + SIM_CONSUMER_PERIOD_US || simTime < SIM_STALL_START_US) {
+                lateDrops += ImuSampler_GetDroppedCount() != dropped;
+            }
+        }
+    }
+    read += ImuSampler_Read(batch, 16);
+
+    uint32_t dropped = ImuSampler_GetDroppedCount();
+    uint32_t missed = ImuSampler_GetMissedCount();
+    uint32_t inFlight = isReading ? 1 : 0;
+    uint32_t capacity = IMU_SAMPLER_BUFFER_SIZE / sizeof(ImuSample);
+    uint32_t stallTicks = (SIM_STALL_END_US - SIM_STALL_START_US) / SIM_PERIOD_US;
+    int success = maxJitter <= SIM_MAX_LATENCY_US && orderErrors == 0 && lateDrops == 0 &&
+            read + dropped + missed + inFlight == ticks && missed == 0 && refusals == 0 &&
+            maxReadUs <= SIM_OLED_PAGE_US + SIM_READ_US + 200 &&
+            dropped + capacity >= stallTicks && dropped < stallTicks;
+    success &= CheckTimerSetup() == 0;
+
+    printf("%lu ticks: %lu read, %lu dropped, %lu missed, %lu in flight\r\n", (unsigned long) ticks,
+            (unsigned long) read, (unsigned long) dropped, (unsigned long) missed, (unsigned long) inFlight);
+    printf("Longest read %lu us including the wait for the OLED page (a page is %d us)\r\n",
+            (unsigned long) maxReadUs, SIM_OLED_PAGE_US);
+    printf("Buffer holds %lu samples, the 2 s stall was %lu ticks\r\n", (unsigned long) capacity,
+            (unsigned long) stallTicks);
+    printf("Timestamp jitter %lu us (max latency %d us), %lu out of order, %lu drops outside the stall\r\n",
+            (unsigned long) maxJitter, SIM_MAX_LATENCY_US, (unsigned long) orderErrors, (unsigned long) lateDrops);
+    printf("%s\r\n", success ? "SUCCESS" : "ERROR");
+    return !success;
+}
+#endif
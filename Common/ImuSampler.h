@@ -0,0 +1,76 @@
+/*
+ * File:   ImuSampler.h
+ * Author: Derrick Lai
+ *
+ * Samples the BNO055 in the background at a fixed rate.
+ *
+ * TIM11 interrupts at the sample rate and starts a BNO055_ReadAllAsync() burst, the DMA completion pushes
+ * the sample into a CircularBuffer. The main loop never touches the I2C bus for it, it just picks up whatever
+ * samples have arrived with ImuSampler_Read(), as many at a time as it likes.
+ *
+ * Each sample is stamped with TIMERS_GetMicroSeconds() when the timer fired, so the timestamps are as regular
+ * as the timer interrupt, not as the bus. The reads are queued at I2C_PRIORITY_HIGH, so an OLED update only
+ * holds one up for the page on the bus. A tick that can't start a read (the last one still going, or the
+ * I2C queue full) is skipped and counted as missed. A sample that finds the buffer full is dropped and
+ * counted, the samples already waiting are kept.
+ *
+ * Created on April 6, 2025
+ */
+
+#ifndef IMU_SAMPLER_H
+#define IMU_SAMPLER_H
+
+#include <stdint.h>
+#include <BNO055.h>
+
+// Buffer storage in bytes, must be a power of two (CircularBuffer). Holds 42 samples, 420 ms at 100 Hz.
+#define IMU_SAMPLER_BUFFER_SIZE 1024
+
+#define IMU_SAMPLER_MAX_RATE 1000 // Hz, an 18 byte burst takes about 2 ms at 100 kHz so more is pointless anyway
+
+typedef struct ImuSample {
+    uint32_t time; // TIMERS_GetMicroSeconds() when the sample was asked for
+    BNO055_Data data;
+} ImuSample;
+
+/**
+ * @function ImuSampler_Init(rate)
+ * @param rate - Samples per second, 1 to IMU_SAMPLER_MAX_RATE (TIM11 counts at 10 kHz instead of 1 MHz under
+ *               16 Hz, a period of a second doesn't fit its 16 bits at 1 MHz)
+ * @return SUCCESS or ERROR
+ * @brief Empties the buffer and starts sampling. BNO055_Init() and TIMER_Init() must have been called */
+int8_t ImuSampler_Init(uint16_t rate);
+
+/**
+ * @function ImuSampler_Stop()
+ * @param None
+ * @return None
+ * @brief Stops the timer, samples already in the buffer can still be read */
+void ImuSampler_Stop(void);
+
+/**
+ * @function ImuSampler_Read(samples, maxSamples)
+ * @param samples - Where to copy the samples to, oldest first
+ * @param maxSamples - Room in samples
+ * @return Number of samples copied, 0 if none have arrived. Never blocks */
+uint16_t ImuSampler_Read(ImuSample *samples, uint16_t maxSamples);
+
+/**
+ * @function ImuSampler_Count()
+ * @param None
+ * @return Number of samples waiting to be read */
+uint16_t ImuSampler_Count(void);
+
+/**
+ * @function ImuSampler_GetDroppedCount()
+ * @param None
+ * @return Samples thrown away because the buffer was full */
+uint32_t ImuSampler_GetDroppedCount(void);
+
+/**
+ * @function ImuSampler_GetMissedCount()
+ * @param None
+ * @return Ticks that couldn't start a read, or whose read failed */
+uint32_t ImuSampler_GetMissedCount(void);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * File:   Marquee.c
+ * Author: Derrick Lai
+ *
+ * Scrolling text line for the OLED, see Marquee.h.
+ *
+ * Created on April 2, 2025
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <Oled.h>
+#include <OledDriver.h>
+#include <Marquee.h>
+
+// Boolean defines for TRUE, FALSE, SUCCESS and ERROR
+#ifndef FALSE
+#define FALSE ((int8_t) 0)
+#define TRUE ((int8_t) 1)
+#endif
+#ifndef ERROR
+#define ERROR ((int8_t) -1)
+#define SUCCESS ((int8_t) 1)
+#endif
+
+// Function prototypes for private functions.
+static void Marquee_Draw(const Marquee *marquee);
+
+int8_t Marquee_Init(Marquee *marquee, uint8_t line, const char *text) {
+    if (marquee == NULL || text == NULL || line >= OLED_NUM_LINES) {
+        return ERROR;
+    }
+    marquee->line = line;
+    marquee->offset = 0;
+    marquee->length = OledRenderString(text, marquee->strip, MARQUEE_MAX_CHARS * ASCII_FONT_WIDTH);
+
+    // Text that fits is padded out to the whole line so it clears what was there before.
+    if (marquee->length <= OLED_DRIVER_PIXEL_COLUMNS) {
+        memset(&marquee->strip[marquee->length], 0, OLED_DRIVER_PIXEL_COLUMNS - marquee->length);
+        marquee->length = OLED_DRIVER_PIXEL_COLUMNS;
+    } else {
+        memset(&marquee->strip[marquee->length], 0, MARQUEE_GAP_CHARS * ASCII_FONT_WIDTH);
+        marquee->length += MARQUEE_GAP_CHARS * ASCII_FONT_WIDTH;
+    }
+    Marquee_Draw(marquee);
+    return SUCCESS;
+}
+
+void Marquee_Step(Marquee *marquee, uint16_t columns) {
+    if (!Marquee_IsScrolling(marquee)) {
+        return;
+    }
+    marquee->offset = (marquee->offset + columns) % marquee->length;
+    Marquee_Draw(marquee);
+}
+
+uint8_t Marquee_IsScrolling(const Marquee *marquee) {
+    return marquee->length > OLED_DRIVER_PIXEL_COLUMNS;
+}
+
+/**
+ * @function Marquee_Draw(marquee)
+ * @param marquee - Marquee to draw
+ * @return None
+ * @brief Copies the screen wide window of the strip at offset onto the line, wrapping round the strip end */
+static void Marquee_Draw(const Marquee *marquee) {
+    uint8_t *page = &rgbOledBmp[marquee->line * OLED_DRIVER_PIXEL_COLUMNS];
+    uint16_t first = marquee->length - marquee->offset;
+    if (first > OLED_DRIVER_PIXEL_COLUMNS) {
+        first = OLED_DRIVER_PIXEL_COLUMNS;
+    }
+    memcpy(page, &marquee->strip[marquee->offset], first);
+    memcpy(&page[first], marquee->strip, OLED_DRIVER_PIXEL_COLUMNS - first);
+    OledDriverMarkDirty(marquee->line, 0, OLED_DRIVER_PIXEL_COLUMNS - 1);
+}
+
+
+//#define MARQUEE_TEST
+#ifdef MARQUEE_TEST // MARQUEE TEST HARNESS
+// Runs on the board, or on a host against the simulated bus and SSD1306 at the end of I2C.c, which logs the
+// transactions of the first step:
+//   gcc -O2 -Wall -I. -DI2C_SIM -DMARQUEE_TEST Marquee.c Oled.c OledDriver.c I2C.c I2CQueue.c Ascii.c -o marquee && ./marquee
+// SUCCESS - every step leaves the line showing the right window of the title and the update sends that one
+// page and nothing else, 138 bus bytes, the line below (a short title) never changes. On the host the display
+// RAM also has to match the frame buffer after every step.
+#ifndef I2C_SIM
+#include <Board.h>
+#endif
+#include <I2C.h>
+
+#define TEST_STEPS 400
+#define STEP_BUS_BYTES (OLED_DRIVER_PIXEL_COLUMNS + 2 + 8) // A page burst and its window command
+
+int main(void) {
+    Marquee title, artist;
+    int errors = 0;
+
+    BOARD_Init();
+    OledInit();
+
+    Marquee_Init(&title, 0, "A Very Long Song Title That Does Not Fit (Remastered)");
+    Marquee_Init(&artist, 1, "Some Artist");
+    OledUpdate();
+    printf("Title %s, artist %s\r\n", Marquee_IsScrolling(&title) ? "scrolls" : "fits",
+            Marquee_IsScrolling(&artist) ? "scrolls" : "fits");
+
+    uint32_t bytes = I2C_GetBusByteCount();
+    for (int step = 1; step <= TEST_STEPS; step++) {
+        uint32_t stepBytes = I2C_GetBusByteCount();
+#ifdef I2C_SIM
+        I2C_SimSetLogging(step == 1);
+#endif
+        Marquee_Step(&title, 1);
+        Marquee_Step(&artist, 1);
+        OledUpdate();
+
+        // Only the title page may go out, a window command and one full page burst.
+        if (OledDriverGetLastUpdateSize() != OLED_DRIVER_PIXEL_COLUMNS ||
+                I2C_GetBusByteCount() - stepBytes != STEP_BUS_BYTES) {
+            errors++;
+        }
+        // Column x of the screen is column (step + x) of the strip, round the end.
+        for (int x = 0; x < OLED_DRIVER_PIXEL_COLUMNS; x++) {
+            if (rgbOledBmp[x] != title.strip[(step + x) % title.length]) {
+                errors++;
+            }
+            if (rgbOledBmp[OLED_DRIVER_PIXEL_COLUMNS + x] != artist.strip[x]) {
+                errors++;
+            }
+        }
+#ifdef I2C_SIM
+        if (memcmp(I2C_SimGetDisplayRam(), rgbOledBmp, OLED_DRIVER_BUFFER_SIZE) != 0) {
+            errors++;
+        }
+#endif
+    }
+    printf("%d steps, %lu bus bytes per step, %d errors, %s\r\n", TEST_STEPS,
+            (unsigned long) ((I2C_GetBusByteCount() - bytes) / TEST_STEPS), errors, errors == 0 ? "SUCCESS" : "ERROR");
+
+#ifdef I2C_SIM
+    return errors != 0;
+#else
+    while (1);
+#endif
+}
+#endif
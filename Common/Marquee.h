@@ -0,0 +1,66 @@
+/*
+ * File:   Marquee.h
+ * Author: Derrick Lai
+ *
+ * Scrolls a line of text that is too long for the OLED (song titles) across one text line of the screen.
+ *
+ * The text is rendered once, when the marquee is set up, into a strip of page columns (the format
+ * rgbOledBmp stores a page in) followed by a gap of blank characters. Each step just copies a screen wide
+ * window of that strip onto the line's page and marks the page dirty, so a step costs a 128 byte copy and
+ * the next update sends only that page.
+ *
+ * The SSD1306 horizontal scroll commands aren't used: they rotate what is already in the display RAM, so
+ * text wider than the screen would wrap around onto itself, and the RAM can't be safely written while a
+ * scroll is running, which would freeze every other line of the screen.
+ *
+ * Text that fits on the line is drawn once and never moves.
+ *
+ * Created on April 2, 2025
+ */
+
+#ifndef MARQUEE_H
+#define MARQUEE_H
+
+#include <stdint.h>
+#include <Ascii.h>
+#include <OledDriver.h>
+
+// Longest text a marquee holds, longer text is cut short.
+#define MARQUEE_MAX_CHARS 64
+
+// Blank characters between the end of the text and its start coming round again.
+#define MARQUEE_GAP_CHARS 3
+
+#define MARQUEE_STRIP_SIZE ((MARQUEE_MAX_CHARS + MARQUEE_GAP_CHARS) * ASCII_FONT_WIDTH)
+
+typedef struct Marquee {
+    uint8_t strip[MARQUEE_STRIP_SIZE]; // The text and its gap, rendered once as page columns
+    uint16_t length; // Columns used in strip
+    uint16_t offset; // Strip column shown at the left edge of the screen
+    uint8_t line; // Text line (page) the marquee is drawn on
+} Marquee;
+
+/**
+ * @function Marquee_Init(marquee, line, text)
+ * @param marquee - Marquee to set up
+ * @param line - Text line to draw on, 0 to OLED_NUM_LINES - 1
+ * @param text - Text to show, up to MARQUEE_MAX_CHARS characters (stops at a newline)
+ * @return SUCCESS or ERROR
+ * @brief Renders the text into the strip and draws its start on the line, replacing what was there */
+int8_t Marquee_Init(Marquee *marquee, uint8_t line, const char *text);
+
+/**
+ * @function Marquee_Step(marquee, columns)
+ * @param marquee - Marquee to move
+ * @param columns - Pixels to move the text left by
+ * @return None
+ * @brief Scrolls the text and redraws the line, does nothing when the text fits on it */
+void Marquee_Step(Marquee *marquee, uint16_t columns);
+
+/**
+ * @function Marquee_IsScrolling(marquee)
+ * @param marquee - Marquee to query
+ * @return TRUE if the text is too long to fit on the line and has to scroll */
+uint8_t Marquee_IsScrolling(const Marquee *marquee);
+
+#endif
@@ -7,6 +7,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <OledDriver.h>
 #include <Oled.h>
 #include <Ascii.h>
@@ -45,6 +46,7 @@ void OledSetPixel(int x, int y, OledColor color)
     } else {
         return;
     }
+    OledDriverMarkDirty(y / OLED_DRIVER_BUFFER_LINE_HEIGHT, x, x);
 }
 
 int OledGetPixel(int x, int y)
@@ -68,11 +70,19 @@ uint8_t OledDrawChar(int x, int y, char c)
         // We need to convert our signed char into an unsigned value to index into the ascii[] array.
         int charIndex = (int) (unsigned char) c;
 
+        // On a page boundary (every text line) the glyph columns are exactly the bytes to store.
+        if (y % OLED_DRIVER_BUFFER_LINE_HEIGHT == 0) {
+            int page = y / OLED_DRIVER_BUFFER_LINE_HEIGHT;
+            memcpy(&rgbOledBmp[page * OLED_DRIVER_PIXEL_COLUMNS + x], ascii[charIndex], ASCII_FONT_WIDTH);
+            OledDriverMarkDirty(page, x, x + ASCII_FONT_WIDTH - 1);
+            return FALSE;
+        }
+
         // Now first determine the columns and rows of the OLED bits that need to be modified
         int rowMin, rowMax, colMin, colMax;
         rowMin = y / ASCII_FONT_HEIGHT;
         int rowY = y % ASCII_FONT_HEIGHT;
-        rowMax = (y + ASCII_FONT_HEIGHT) / OLED_DRIVER_BUFFER_LINE_HEIGHT;
+        rowMax = (y + ASCII_FONT_HEIGHT - 1) / OLED_DRIVER_BUFFER_LINE_HEIGHT; // Same page when y is page aligned
         colMin = x;
         colMax = x + ASCII_FONT_WIDTH;
         {
@@ -101,6 +111,12 @@ uint8_t OledDrawChar(int x, int y, char c)
                 rgbOledBmp[rowMax * OLED_DRIVER_PIXEL_COLUMNS + oledCol] = newCharCol;
             }
         }
+
+        // Only the columns under the character need to be sent on the next update.
+        OledDriverMarkDirty(rowMin, colMin, colMax - 1);
+        if (rowMax > rowMin) {
+            OledDriverMarkDirty(rowMax, colMin, colMax - 1);
+        }
     }
 
     return FALSE;
@@ -115,42 +131,48 @@ void OledDrawString(const char *string)
     // Track the current line number we're in on the OLED. Valid values are [0, OLED_NUM_LINES).
     int line = 0;
 
-    // Track the current character we're writing to the OLED. Valid values are
-    // [0, OLED_CHARS_PER_LINE).
-    int column = 0;
-
     // Run through all characters. The maximum length can be the number of lines times the number
     // of characters per line + three newlines.
-    int i;
-    for (i = 0; string[i] != '\0' && i < (OLED_NUM_LINES * OLED_CHARS_PER_LINE + 3); ++i) {
+    const int maxLength = OLED_NUM_LINES * OLED_CHARS_PER_LINE + 3;
+    int i = 0;
+    while (string[i] != '\0' && i < maxLength && line < OLED_NUM_LINES) {
         // Move the cursor to the next line if a newline character is encountered. This allows for
         // early line ending.
         if (string[i] == '\n') {
             ++line;
-            column = 0;
+            ++i;
             continue;
-        } else {
-            // Reset to the start of the next line if we've hit the character limit of this line
-            // without seeing a newline.
-            if (column == OLED_CHARS_PER_LINE) {
-                ++line;
-                column = 0;
-            }
+        }
 
-            // Now if we're < OLED_NUM_LINES and < OLED_CHARS_PER_LINE we can proceed. The second
-            // check is implicitly handled by the above if-statement that forces a newline after
-            // encountering a full line of characters.
-            if (line == OLED_NUM_LINES) {
-                break;
-            }
+        // Text lines sit on pages, so the characters up to the end of the line (or the next
+        // newline) are rendered straight into the frame buffer in one go.
+        int room = OLED_CHARS_PER_LINE;
+        if (room > maxLength - i) {
+            room = maxLength - i;
+        }
+        int columns = OledRenderString(&string[i], &rgbOledBmp[line * OLED_DRIVER_PIXEL_COLUMNS],
+                room * ASCII_FONT_WIDTH);
+        OledDriverMarkDirty(line, 0, columns - 1);
+        i += columns / ASCII_FONT_WIDTH;
 
-            // Finally at this point, we can write characters to the OLED.
-            OledDrawChar(column * ASCII_FONT_WIDTH, line * ASCII_FONT_HEIGHT, string[i]);
-            ++column;
+        // A full line carries on at the start of the next one without needing a newline.
+        if (columns == OLED_CHARS_PER_LINE * ASCII_FONT_WIDTH && string[i] != '\n') {
+            ++line;
         }
     }
 }
 
+int OledRenderString(const char *string, uint8_t *columns, int maxColumns)
+{
+    int count = 0;
+    while (string[0] != '\0' && string[0] != '\n' && count + ASCII_FONT_WIDTH <= maxColumns) {
+        memcpy(&columns[count], ascii[(unsigned char) string[0]], ASCII_FONT_WIDTH);
+        count += ASCII_FONT_WIDTH;
+        string++;
+    }
+    return count;
+}
+
 void OledClear(OledColor p)
 {
     int i;
@@ -161,6 +183,7 @@ void OledClear(OledColor p)
             rgbOledBmp[i] = 0;
         }
     }
+    OledDriverMarkAllDirty();
 }
 
 void OledSetDisplayInverted(void)
@@ -188,6 +211,21 @@ void OledUpdate(void)
     OledDriverUpdateDisplay();
 }
 
+int8_t OledSwapBuffers(OledDriverCallback callback)
+{
+    return OledDriverSwapBuffers(callback);
+}
+
+uint8_t OledIsUpdating(void)
+{
+    return OledDriverIsUpdating();
+}
+
+uint8_t OledIsSwapPending(void)
+{
+    return OledDriverIsSwapPending();
+}
+
 
 
 //#define OLED_TEST
@@ -212,4 +250,543 @@ int main(void) {
     while(TRUE){}
 }
 
-#endif
\ No newline at end of file
+#endif
+
+
+//#define OLED_ASYNC_TEST
+#ifdef OLED_ASYNC_TEST // Compares the I2C cost of a refresh: byte at a time, blocking page bursts, DMA page bursts
+// Runs on the board, or on a host against the simulated bus and SSD1306 at the end of I2C.c:
+//   gcc -O2 -Wall -I. -DI2C_SIM -DOLED_ASYNC_TEST Oled.c OledDriver.c I2C.c I2CQueue.c Ascii.c -o oled_async && ./oled_async
+// SUCCESS - a full refresh in page bursts is 552 bus bytes, blocking or through the DMA: 4 pages of a 6 byte
+// window command and a 128 byte burst, each with its address and control byte. On the host the display RAM
+// also has to match rgbOledBmp after each of the three refreshes.
+#include <stdio.h>
+#include <string.h>
+#ifndef I2C_SIM
+#include <Board.h>
+#include <timers.h>
+#endif
+#include <I2C.h>
+#include <Oled.h>
+
+#define FULL_REFRESH_BUS_BYTES 552
+
+static volatile uint8_t isDone = FALSE;
+static volatile int8_t doneStatus = SUCCESS;
+static volatile uint32_t doneTime = 0;
+static int errors = 0;
+
+static void UpdateDone(int8_t status)
+{
+    doneStatus = status;
+    doneTime = TIMERS_GetMicroSeconds();
+    isDone = TRUE;
+}
+
+static void Check(int condition, const char *what)
+{
+    if (!condition) {
+        printf("  FAILED: %s\r\n", what);
+        errors++;
+    }
+}
+
+// Only the simulated display can be read back.
+static void CheckDisplay(const char *what)
+{
+#ifdef I2C_SIM
+    Check(memcmp(I2C_SimGetDisplayRam(), rgbOledBmp, OLED_DRIVER_BUFFER_SIZE) == 0, what);
+#else
+    (void) what;
+#endif
+}
+
+int main(void) {
+    BOARD_Init();
+    OledInit();
+    CheckDisplay("display RAM after OledInit()");
+
+    // 1) The old refresh: every command and every framebuffer byte a 3 byte transaction of its own.
+    OledDrawString("Hello world!\nOLED ASYNC TEST\ngo slugs");
+    uint32_t bytes = I2C_GetBusByteCount();
+    uint32_t start = TIMERS_GetMicroSeconds();
+    for (int page = 0; page < OLED_DRIVER_BUFFER_SIZE / OLED_DRIVER_PIXEL_COLUMNS; page++) {
+        const uint8_t window[] = {0x21, 0, OLED_DRIVER_PIXEL_COLUMNS - 1, 0x22, page, page};
+        for (size_t i = 0; i < sizeof(window); i++) {
+            I2C_WriteReg(0x3C, 0x80, window[i]);
+        }
+        for (int i = 0; i < OLED_DRIVER_PIXEL_COLUMNS; i++) {
+            I2C_WriteReg(0x3C, 0xC0, rgbOledBmp[page * OLED_DRIVER_PIXEL_COLUMNS + i]);
+        }
+    }
+    printf("Byte at a time:  %6lu bus bytes, %6lu us blocked\r\n",
+            (unsigned long) (I2C_GetBusByteCount() - bytes), (unsigned long) (TIMERS_GetMicroSeconds() - start));
+    CheckDisplay("display RAM after the byte at a time refresh");
+
+    // 2) OledUpdate(): a window command and one burst per page, still blocking.
+    OledClear(OLED_COLOR_WHITE);
+    OledDrawString("Page bursts\nblocking");
+    bytes = I2C_GetBusByteCount();
+    start = TIMERS_GetMicroSeconds();
+    OledUpdate();
+    bytes = I2C_GetBusByteCount() - bytes;
+    printf("Page bursts:     %6lu bus bytes, %6lu us blocked\r\n", (unsigned long) bytes,
+            (unsigned long) (TIMERS_GetMicroSeconds() - start));
+    Check(bytes == FULL_REFRESH_BUS_BYTES, "blocking refresh bus bytes");
+    CheckDisplay("display RAM after the blocking refresh");
+
+    // 3) OledSwapBuffers(): same bursts through the DMA, the main loop keeps going.
+    uint32_t loops = 0;
+    OledClear(OLED_COLOR_BLACK);
+    OledDrawString("Page bursts\nthrough the DMA");
+    bytes = I2C_GetBusByteCount();
+    start = TIMERS_GetMicroSeconds();
+    int8_t started = OledSwapBuffers(UpdateDone);
+    uint32_t returned = TIMERS_GetMicroSeconds();
+    while (!isDone) {
+        I2C_CheckTimeout();
+        loops++;
+    }
+    bytes = I2C_GetBusByteCount() - bytes;
+    printf("Async bursts:    %6lu bus bytes, %6lu us blocked, done after %lu us (%lu main loop passes)\r\n",
+            (unsigned long) bytes, (unsigned long) (returned - start), (unsigned long) (doneTime - start),
+            (unsigned long) loops);
+    Check(started == SUCCESS && doneStatus == SUCCESS, "DMA refresh status");
+    Check(bytes == FULL_REFRESH_BUS_BYTES, "DMA refresh bus bytes");
+    CheckDisplay("display RAM after the DMA refresh");
+
+    printf("%d errors, %s\r\n", errors, errors == 0 ? "SUCCESS" : "ERROR");
+#ifdef I2C_SIM
+    return errors != 0;
+#else
+    while(TRUE){}
+#endif
+}
+
+#endif
+
+
+//#define OLED_DIRTY_TEST
+#ifdef OLED_DIRTY_TEST // Bytes sent per update when only part of a now playing screen changes
+// Runs on the board, or on a host against the simulated bus and SSD1306 at the end of I2C.c:
+//   gcc -O2 -Wall -I. -DI2C_SIM -DOLED_DIRTY_TEST Oled.c OledDriver.c I2C.c I2CQueue.c Ascii.c -o oled_dirty && ./oled_dirty
+// SUCCESS - each update sends exactly the changed columns, a window command (8 bus bytes) and a burst per page
+// touched: 512/1/6/7/0 display bytes and 552/11/16/27/0 bus bytes. On the host the display RAM also has to
+// match rgbOledBmp after every update.
+#include <stdio.h>
+#include <string.h>
+#ifndef I2C_SIM
+#include <Board.h>
+#endif
+#include <I2C.h>
+#include <Oled.h>
+
+static int errors = 0;
+
+static void CheckUpdate(const char *name, uint32_t displayBytes, uint32_t busBytes)
+{
+    uint32_t bytes = I2C_GetBusByteCount();
+    OledUpdate();
+    bytes = I2C_GetBusByteCount() - bytes;
+    printf("%-22s %4lu display bytes, %4lu bus bytes\r\n", name, (unsigned long) OledDriverGetLastUpdateSize(),
+            (unsigned long) bytes);
+    if (OledDriverGetLastUpdateSize() != displayBytes || bytes != busBytes) {
+        printf("  FAILED: expected %lu display bytes, %lu bus bytes\r\n", (unsigned long) displayBytes,
+                (unsigned long) busBytes);
+        errors++;
+    }
+#ifdef I2C_SIM
+    if (memcmp(I2C_SimGetDisplayRam(), rgbOledBmp, OLED_DRIVER_BUFFER_SIZE) != 0) {
+        printf("  FAILED: display RAM doesn't match the frame buffer\r\n");
+        errors++;
+    }
+#endif
+}
+
+int main(void) {
+    BOARD_Init();
+    OledInit();
+
+    // Whole screen: title, artist, time and an empty progress bar outline on the bottom page.
+    OledClear(OLED_COLOR_BLACK);
+    OledDrawString("Now playing\nSome Song\n1:23 / 3:45");
+    for (int x = 0; x < OLED_DRIVER_PIXEL_COLUMNS; x++) {
+        OledSetPixel(x, 28, OLED_COLOR_WHITE);
+    }
+    CheckUpdate("Full screen:", 512, 552);
+
+    // The progress bar moves by one pixel.
+    OledSetPixel(40, 30, OLED_COLOR_WHITE);
+    CheckUpdate("Progress bar +1 px:", 1, 11);
+
+    // The time ticks over, only the last digit changes.
+    OledDrawChar(3 * ASCII_FONT_WIDTH, 2 * ASCII_FONT_HEIGHT, '4');
+    CheckUpdate("Time 1:23 -> 1:24:", 6, 16);
+
+    // Both in the same frame.
+    OledSetPixel(41, 30, OLED_COLOR_WHITE);
+    OledDrawChar(3 * ASCII_FONT_WIDTH, 2 * ASCII_FONT_HEIGHT, '5');
+    CheckUpdate("Bar and time:", 7, 27);
+
+    // Nothing changed.
+    CheckUpdate("No change:", 0, 0);
+
+    printf("%d errors, %s\r\n", errors, errors == 0 ? "SUCCESS" : "ERROR");
+#ifdef I2C_SIM
+    return errors != 0;
+#else
+    while(TRUE){}
+#endif
+}
+
+#endif
+
+
+//#define OLED_DOUBLE_BUFFER_TEST
+#ifdef OLED_DOUBLE_BUFFER_TEST // Frames per second of an animation, blocking updates vs drawing during the transfer
+// Runs on the board, or on a host against the simulated bus and SSD1306 at the end of I2C.c:
+//   gcc -O2 -Wall -I. -DI2C_SIM -DOLED_DOUBLE_BUFFER_TEST Oled.c OledDriver.c I2C.c I2CQueue.c Ascii.c -o oled_fps && ./oled_fps
+// There the bus runs at 100 kHz, 90 us a byte, so a full frame (552 bus bytes) is 49.7 ms on the bus. DMA
+// transfers finish on the simulated clock, and drawing takes no simulated time, only the work does.
+// SUCCESS - on the host the blocking rate is one frame per bus time plus work and the double buffered one a
+// frame per the longer of the two (within 5%), and the display RAM matches rgbOledBmp at the end of each run.
+#include <stdio.h>
+#include <string.h>
+#ifndef I2C_SIM
+#include <Board.h>
+#include <timers.h>
+#endif
+#include <I2C.h>
+#include <Oled.h>
+
+#define TEST_DURATION_MS 3000
+#define SIM_FRAME_US (552 * 90)
+
+// Time spent working out each frame (reading sensors, an FFT, ...) on top of drawing it.
+static const uint32_t frameWorkUs[] = {0, 20000, 40000};
+
+static volatile uint32_t framesSent = 0;
+static int errors = 0;
+
+static void FrameSent(int8_t status)
+{
+    if (status == SUCCESS) {
+        framesSent++;
+    }
+}
+
+// A frame of a level meter: the whole screen changes, like a spectrum display would.
+static void DrawFrame(uint32_t frame, uint32_t workUs)
+{
+    char text[OLED_CHARS_PER_LINE + 1];
+    uint32_t start = TIMERS_GetMicroSeconds();
+    while (TIMERS_GetMicroSeconds() - start < workUs);
+
+    OledClear(OLED_COLOR_BLACK);
+    sprintf(text, "Frame %lu", (unsigned long) (frame % 100000));
+    OledDrawString(text);
+    for (int x = 0; x < OLED_DRIVER_PIXEL_COLUMNS; x++) {
+        int height = (x * 7 + frame * 3) % 24;
+        for (int y = OLED_DRIVER_PIXEL_ROWS - 1; y >= OLED_DRIVER_PIXEL_ROWS - height; y--) {
+            OledSetPixel(x, y, OLED_COLOR_WHITE);
+        }
+    }
+}
+
+// The frames a run should have managed on the simulated bus, one every frameUs.
+static void CheckRun(const char *what, uint32_t frames, uint32_t frameUs)
+{
+#ifdef I2C_SIM
+    uint32_t expected = TEST_DURATION_MS * 1000 / frameUs;
+    if (frames + expected / 20 + 1 < expected || frames > expected + expected / 20 + 1) {
+        printf("  FAILED: %s, %lu frames, expected %lu\r\n", what, (unsigned long) frames, (unsigned long) expected);
+        errors++;
+    }
+    if (memcmp(I2C_SimGetDisplayRam(), rgbOledBmp, OLED_DRIVER_BUFFER_SIZE) != 0) {
+        printf("  FAILED: %s, display RAM doesn't match the frame buffer\r\n", what);
+        errors++;
+    }
+#else
+    (void) what;
+    (void) frames;
+    (void) frameUs;
+#endif
+}
+
+int main(void) {
+    BOARD_Init();
+    OledInit();
+
+    // Draw one frame on its own to know what the drawing costs.
+    uint32_t start = TIMERS_GetMicroSeconds();
+    DrawFrame(0, 0);
+    printf("Drawing a frame: %lu us\r\n", (unsigned long) (TIMERS_GetMicroSeconds() - start));
+
+    for (size_t i = 0; i < sizeof(frameWorkUs) / sizeof(frameWorkUs[0]); i++) {
+        uint32_t work = frameWorkUs[i];
+
+        // 1) Draw, then block while it's sent.
+        uint32_t frames = 0;
+        start = TIMERS_GetMilliSeconds();
+        while (TIMERS_GetMilliSeconds() - start < TEST_DURATION_MS) {
+            DrawFrame(frames++, work);
+            OledUpdate();
+        }
+        printf("%5lu us work: blocking %3lu.%lu fps", (unsigned long) work,
+                (unsigned long) (frames * 1000 / TEST_DURATION_MS),
+                (unsigned long) ((frames * 10000 / TEST_DURATION_MS) % 10));
+        CheckRun("blocking", frames, SIM_FRAME_US + work);
+
+        // 2) Draw the next frame while the last one is sent, swap as soon as the back buffer is free.
+        frames = 0;
+        framesSent = 0;
+        start = TIMERS_GetMilliSeconds();
+        while (TIMERS_GetMilliSeconds() - start < TEST_DURATION_MS) {
+            if (!OledIsSwapPending()) {
+                DrawFrame(frames++, work);
+                OledSwapBuffers(FrameSent);
+            }
+        }
+        uint32_t sent = framesSent;
+        while (OledIsUpdating()) {
+            I2C_CheckTimeout();
+        }
+        printf(", double buffered %3lu.%lu fps\r\n", (unsigned long) (sent * 1000 / TEST_DURATION_MS),
+                (unsigned long) ((sent * 10000 / TEST_DURATION_MS) % 10));
+        CheckRun("double buffered", sent, work > SIM_FRAME_US ? work : SIM_FRAME_US);
+    }
+
+    printf("%d errors, %s\r\n", errors, errors == 0 ? "SUCCESS" : "ERROR");
+#ifdef I2C_SIM
+    return errors != 0;
+#else
+    while(TRUE){}
+#endif
+}
+
+#endif
+
+
+//#define OLED_TEXT_TEST
+#ifdef OLED_TEXT_TEST // Cost of redrawing a full screen of text, glyph by glyph vs whole lines at once
+// Runs on the board, or on a host against the simulated bus and SSD1306 at the end of I2C.c, timed with the
+// host's clock (the simulated one doesn't see CPU time):
+//   gcc -O2 -Wall -I. -DI2C_SIM -DOLED_TEXT_TEST Oled.c OledDriver.c I2C.c I2CQueue.c Ascii.c -o oled_text && ./oled_text
+// SUCCESS - after each way of drawing, every pixel under the text matches the font, and on the host the display
+// RAM matches rgbOledBmp after the final update.
+#include <stdio.h>
+#include <string.h>
+#ifndef I2C_SIM
+#include <Board.h>
+#include <timers.h>
+#else
+#include <time.h>
+#endif
+#include <I2C.h>
+#include <Oled.h>
+
+#define TEST_REDRAWS 1000
+
+static const char *screen = "Now playing: Some So\nng by Some Artist On\nSome Album (Deluxe)\n1:23 / 3:45   vol 12";
+
+static uint32_t NowMicros(void)
+{
+#ifdef I2C_SIM
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else
+    return TIMERS_GetMicroSeconds();
+#endif
+}
+
+// Pixels of the glyph drawn at x, y that don't match the font.
+static int WrongPixels(char c, int x, int y)
+{
+    int wrong = 0;
+    for (int i = 0; i < ASCII_FONT_WIDTH; i++) {
+        for (int j = 0; j < ASCII_FONT_HEIGHT; j++) {
+            int expected = (ascii[(unsigned char) c][i] >> j) & 0x01;
+            if (OledGetPixel(x + i, y + j) != expected) {
+                wrong++;
+            }
+        }
+    }
+    return wrong;
+}
+
+// Pixels of a screen of characters, 'A' + col on every line, that don't match the font.
+static int WrongColumnsPixels(int lines, int yOffset)
+{
+    int wrong = 0;
+    for (int line = 0; line < lines; line++) {
+        for (int col = 0; col < OLED_CHARS_PER_LINE; col++) {
+            wrong += WrongPixels('A' + col, col * ASCII_FONT_WIDTH, line * ASCII_FONT_HEIGHT + yOffset);
+        }
+    }
+    return wrong;
+}
+
+int main(void) {
+    int errors = 0, wrong;
+
+    BOARD_Init();
+    OledInit();
+
+    // 1) One character at a time, half way down a page: the masked read-modify-write path.
+    uint32_t start = NowMicros();
+    for (int n = 0; n < TEST_REDRAWS; n++) {
+        for (int line = 0; line < OLED_NUM_LINES - 1; line++) {
+            for (int col = 0; col < OLED_CHARS_PER_LINE; col++) {
+                OledDrawChar(col * ASCII_FONT_WIDTH, line * ASCII_FONT_HEIGHT + 4, 'A' + col);
+            }
+        }
+    }
+    uint32_t time = NowMicros() - start;
+    wrong = WrongColumnsPixels(OLED_NUM_LINES - 1, 4);
+    errors += wrong;
+    printf("Unaligned chars: %7lu us for %d screens, %d pixels wrong\r\n", (unsigned long) time, TEST_REDRAWS,
+            wrong);
+
+    // 2) One character at a time on the text lines, each glyph copied straight in.
+    start = NowMicros();
+    for (int n = 0; n < TEST_REDRAWS; n++) {
+        for (int line = 0; line < OLED_NUM_LINES; line++) {
+            for (int col = 0; col < OLED_CHARS_PER_LINE; col++) {
+                OledDrawChar(col * ASCII_FONT_WIDTH, line * ASCII_FONT_HEIGHT, 'A' + col);
+            }
+        }
+    }
+    time = NowMicros() - start;
+    wrong = WrongColumnsPixels(OLED_NUM_LINES, 0);
+    errors += wrong;
+    printf("Aligned chars:   %7lu us for %d screens, %d pixels wrong\r\n", (unsigned long) time, TEST_REDRAWS,
+            wrong);
+
+    // 3) OledDrawString(): each line rendered in one go.
+    OledClear(OLED_COLOR_BLACK);
+    start = NowMicros();
+    for (int n = 0; n < TEST_REDRAWS; n++) {
+        OledDrawString(screen);
+    }
+    time = NowMicros() - start;
+    wrong = 0;
+    int line = 0, col = 0;
+    for (const char *c = screen; *c != '\0'; c++) {
+        if (*c == '\n') {
+            line++;
+            col = 0;
+            continue;
+        }
+        wrong += WrongPixels(*c, col * ASCII_FONT_WIDTH, line * ASCII_FONT_HEIGHT);
+        col++;
+    }
+    errors += wrong;
+    printf("OledDrawString:  %7lu us for %d screens, %d pixels wrong\r\n", (unsigned long) time, TEST_REDRAWS,
+            wrong);
+
+    OledUpdate();
+#ifdef I2C_SIM
+    if (memcmp(I2C_SimGetDisplayRam(), rgbOledBmp, OLED_DRIVER_BUFFER_SIZE) != 0) {
+        printf("  FAILED: display RAM doesn't match the frame buffer\r\n");
+        errors++;
+    }
+#endif
+    printf("%d errors, %s\r\n", errors, errors == 0 ? "SUCCESS" : "ERROR");
+#ifdef I2C_SIM
+    return errors != 0;
+#else
+    while(TRUE){}
+#endif
+}
+
+#endif
+
+
+//#define OLED_SPEED_TEST
+#ifdef OLED_SPEED_TEST // Full frame update time at each I2C bus speed
+// Runs on the board, or on a host against the simulated bus and SSD1306 at the end of I2C.c, with 300 ns of
+// rise time on every bit like the board's pull-ups give:
+//   gcc -O2 -Wall -I. -DI2C_SIM -DOLED_SPEED_TEST Oled.c OledDriver.c I2C.c I2CQueue.c Ascii.c -o oled_speed && ./oled_speed
+// SUCCESS - on the host each speed gets the bit rate and frame time the CCR divider and the rise time give
+// (552 bus bytes of 9 bits each), Fast-mode Plus is refused, and the display RAM matches rgbOledBmp.
+#include <stdio.h>
+#include <string.h>
+#ifndef I2C_SIM
+#include <Board.h>
+#include <timers.h>
+#endif
+#include <I2C.h>
+#include <Oled.h>
+
+#define SPEED_TEST_FRAMES 20
+#define SIM_RISE_NS 300
+
+typedef struct {
+    const char *name;
+    uint32_t speed;
+    I2C_DutyCycle dutyCycle;
+    uint32_t simBitRate; // What the host run has to get, 0 if refused
+    uint32_t simFrameUs;
+} BusSpeed;
+
+static const BusSpeed speeds[] = {
+    {"Standard 100 kHz", I2C_SPEED_STANDARD, I2C_DUTY_2, 100000, 51170}, // 10 us + 300 ns a bit
+    {"Fast 400 kHz 2:1", I2C_SPEED_FAST, I2C_DUTY_2, 400000, 13910}, // 2.5 us + 300 ns
+    {"Fast 400 kHz 16:9", I2C_SPEED_FAST, I2C_DUTY_16_9, 336000, 16277}, // 2.976 us + 300 ns
+    {"Fast-mode Plus 1 MHz", 1000000, I2C_DUTY_2, 0, 0}, // Refused, the F411 has no Fm+ peripheral
+};
+
+int main(void) {
+    int errors = 0;
+
+    BOARD_Init();
+    OledInit();
+    OledDrawString("Hello world!\nOLED SPEED TEST\ngo slugs");
+#ifdef I2C_SIM
+    I2C_SimSetRiseTime(SIM_RISE_NS);
+#endif
+
+    for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+        if (I2C_InitSpeed(speeds[i].speed, speeds[i].dutyCycle) != SUCCESS) {
+            printf("%-21s refused\r\n", speeds[i].name);
+#ifdef I2C_SIM
+            errors += speeds[i].simBitRate != 0;
+#endif
+            continue;
+        }
+
+        // Every page is dirty, so each update sends the whole 512 byte frame.
+        uint32_t start = TIMERS_GetMicroSeconds();
+        for (int frame = 0; frame < SPEED_TEST_FRAMES; frame++) {
+            OledDriverMarkAllDirty();
+            OledUpdate();
+        }
+        uint32_t frameUs = (TIMERS_GetMicroSeconds() - start) / SPEED_TEST_FRAMES;
+        printf("%-21s %6lu Hz on the bus, %6lu us per full frame, %3lu fps\r\n", speeds[i].name,
+                (unsigned long) I2C_GetBitRate(), (unsigned long) frameUs, (unsigned long) (1000000 / frameUs));
+#ifdef I2C_SIM
+        // A microsecond either way for the clock reads and the rounding.
+        if (I2C_GetBitRate() != speeds[i].simBitRate || frameUs + 1 < speeds[i].simFrameUs ||
+                frameUs > speeds[i].simFrameUs + 1) {
+            printf("  FAILED: expected %lu Hz, %lu us\r\n", (unsigned long) speeds[i].simBitRate,
+                    (unsigned long) speeds[i].simFrameUs);
+            errors++;
+        }
+        if (memcmp(I2C_SimGetDisplayRam(), rgbOledBmp, OLED_DRIVER_BUFFER_SIZE) != 0) {
+            printf("  FAILED: display RAM doesn't match the frame buffer\r\n");
+            errors++;
+        }
+#endif
+    }
+
+    I2C_InitSpeed(I2C_SPEED_STANDARD, I2C_DUTY_2);
+    printf("%d errors, %s\r\n", errors, errors == 0 ? "SUCCESS" : "ERROR");
+#ifdef I2C_SIM
+    return errors != 0;
+#else
+    while(TRUE){}
+#endif
+}
+
+#endif
@@ -35,7 +35,11 @@
 
 #include <Ascii.h>
 #include <OledDriver.h>
+#ifndef I2C_SIM
 #include <Board.h>
+#else
+#include <I2C.h> // The host simulation stands in for the board.
+#endif
 
 /**
  * Define constants for available colors for the OLED: either white or black.
@@ -102,6 +106,17 @@ uint8_t OledDrawChar(int x, int y, char c);
  */
 void OledDrawString(const char *string);
 
+/**
+ * Renders a string straight into columns of page bytes, the format rgbOledBmp stores each 8 pixel
+ * high page in, so the result can be copied onto any page (or kept off-screen) as it is. Each
+ * character is its ASCII_FONT_WIDTH glyph columns from Ascii.h, back to back.
+ * @param string The characters to render, stops at the first null or newline.
+ * @param columns Where to write the columns.
+ * @param maxColumns The room in columns, only whole characters are rendered.
+ * @return The number of columns written, a multiple of ASCII_FONT_WIDTH.
+ */
+int OledRenderString(const char *string, uint8_t *columns, int maxColumns);
+
 /**
  * Writes the specified color pixels to the entire frame buffer.
  * @note OledUpdate() must be called before the OLED will actually display these changes.
@@ -140,8 +155,9 @@ void OledOff(void);
  * changes the display: OledSetPixel(), OledDrawChar(), OledDrawString(), and OledClear().
  *
  * This function is very slow and so shouldn't be called too often or the OLED might look dim or
- * even show no data at all. This is because it uses a blocking SPI interface to push out the entire
- * screen of pixel data every time it's called. Like I said, very slow function!
+ * even show no data at all. This is because it uses a blocking I2C interface to push out the entire
+ * screen of pixel data every time it's called. Like I said, very slow function! OledSwapBuffers()
+ * sends the same data without blocking.
  *
  * For example, the following code example shows Hello World I'm Workin! on the OLED with each word
  * on its own line:
@@ -151,4 +167,32 @@ void OledOff(void);
  */
 void OledUpdate(void);
 
+/**
+ * Same as OledUpdate(), but returns straight away and sends the frame in the background over the
+ * I2C DMA. The frame drawn so far becomes the front buffer and drawing carries on in the back one,
+ * so the next frame can be drawn while this one is being sent. callback (can be NULL) runs from an
+ * interrupt once the whole frame is out.
+ *
+ * It's fine to call while the last frame is still going out: the swap is queued and happens as soon
+ * as it's done. Until then the back buffer holds the queued frame, so wait for OledIsSwapPending()
+ * to clear before drawing again. For example, draw as many frames as the bus can carry:
+ *   if (!OledIsSwapPending()) {
+ *       OledDrawString("Now playing\n...");
+ *       OledSwapBuffers(NULL);
+ *   }
+ *
+ * @return SUCCESS, or ERROR if a swap is already queued.
+ */
+int8_t OledSwapBuffers(OledDriverCallback callback);
+
+/**
+ * @return TRUE while an OledSwapBuffers() frame is still sending.
+ */
+uint8_t OledIsUpdating(void);
+
+/**
+ * @return TRUE while an OledSwapBuffers() is waiting for the frame before it, don't draw until it clears.
+ */
+uint8_t OledIsSwapPending(void);
+
 #endif
\ No newline at end of file
@@ -11,10 +11,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#ifndef I2C_SIM // The host simulation in I2C.c stands in for the board.
 #include <Board.h>
+#include <timers.h>
+#endif
 #include <I2C.h>
 #include <OledDriver.h>
-#include <timers.h>
+#include <Profile.h>
 
 #define OLED_ADDRESS 0x3C // I2C address for Oled device
 
@@ -32,6 +36,8 @@
 typedef enum {
     OLED_COMMAND_SET_DISPLAY_LOWER_COLUMN_0 = 0x00,
     OLED_COMMAND_SET_DISPLAY_UPPER_COLUMN_0 = 0x10,
+    OLED_COMMAND_SET_MEMORY_ADDRESSING_MODE = 0x20,
+    OLED_COMMAND_SET_COLUMN = 0x21,
     OLED_COMMAND_SET_PAGE = 0x22,
     OLED_COMMAND_SET_CHARGE_PUMP = 0x8D,
     OLED_COMMAND_SET_SEGMENT_REMAP = 0xA1,
@@ -50,22 +56,61 @@ typedef enum {
     OLED_SETTING_ENABLE_CHARGE_PUMP = 0x14,
     OLED_SETTING_MAXIMUM_PRECHARGE = 0xF1,
     OLED_SETTING_SEQUENTIAL_COM_NON_INTERLEAVED = 0x20,
-    OLED_SETTING_REVERSE_ROW_ORDERING = 0xC8
+    OLED_SETTING_REVERSE_ROW_ORDERING = 0xC8,
+    OLED_SETTING_HORIZONTAL_ADDRESSING = 0x00
 } OledSetting;
 
 #define OLED_DRIVER_PAGES 4
 
+// Bytes in the command that points the display at a page: column window start/end, page window start/end.
+#define OLED_WINDOW_COMMAND_SIZE 6
+
 /**
- * This array is the off-screen frame buffer used for rendering.
- * It isn't possible to read back from the OLED display device,
- * so display data is rendered into this off-screen buffer and then
- * copied to the display.
- * @note Any time this is updated, An `OledDriverUpdateDisplay()` call must be performed.
+ * The off-screen frame buffers. It isn't possible to read back from the OLED display device, so
+ * display data is rendered into rgbOledBmp (the back buffer) and then copied to the display from
+ * oledFront. A swap exchanges the two, so the next frame can be drawn while the last one is still
+ * going out over the I2C DMA.
+ * @note Any time rgbOledBmp is updated, An `OledDriverUpdateDisplay()` call must be performed.
  */
-uint8_t rgbOledBmp[OLED_DRIVER_BUFFER_SIZE];
+static uint8_t oledBuffers[2][OLED_DRIVER_BUFFER_SIZE];
+uint8_t *rgbOledBmp = oledBuffers[0];
+static uint8_t *oledFront = oledBuffers[1];
+
+// Columns of each page changed since they were last sent, inclusive. A page is clean when start > end.
+// OledDriverInitDisplay() marks everything dirty since the display RAM holds garbage at power up.
+static uint8_t dirtyStart[OLED_DRIVER_PAGES];
+static uint8_t dirtyEnd[OLED_DRIVER_PAGES];
+
+// The spans being sent by the current update, taken from dirtyStart/dirtyEnd when it starts so that
+// drawing during an asynchronous update only ever touches the live copy.
+static uint8_t updateStart[OLED_DRIVER_PAGES];
+static uint8_t updateEnd[OLED_DRIVER_PAGES];
+static uint32_t updateBytes = 0; // Display data bytes sent by the last update.
+
+// Asynchronous update state. Each dirty page takes two transfers: its window command, then its data.
+// Each is queued from the callback of the one before, so other I2C jobs can go in between.
+static volatile uint8_t isUpdating = FALSE;
+static uint8_t updatePage;
+static OledDriverCallback updateCallback = NULL;
+static uint8_t windowCommand[OLED_WINDOW_COMMAND_SIZE]; // Must outlive the DMA transfer, so not on the stack.
+
+// A swap asked for while an update was running. The update's completion interrupt does it.
+static volatile uint8_t isSwapPending = FALSE;
+static OledDriverCallback pendingCallback = NULL;
+
+// Profiling zones, empty unless built with PROFILE_ENABLED (see Profile.h).
+PROFILE_ZONE(updateDisplayZone, "OledDriverUpdateDisplay");
 
 // Function prototypes for private functions.
 void DelayMs(uint32_t ms);
+static void OledDriverTakeDirtySpans(void);
+static void OledDriverSwap(void);
+static void OledDriverStartUpdate(OledDriverCallback callback);
+static void OledDriverSetWindow(uint8_t *command, uint8_t page);
+static void OledDriverSendWindow(void);
+static void OledDriverSendPage(int8_t status);
+static void OledDriverNextPage(int8_t status);
+static void OledDriverFinishUpdate(int8_t status);
 
 /**
  * Initialize the STM32 to communicate with the OLED display through the SSD1306
@@ -100,8 +145,15 @@ void OledDriverInitDisplay(void)
     I2C_WriteReg(OLED_ADDRESS, COMMAND, OLED_COMMAND_SET_COM_PINS_CONFIG);
     I2C_WriteReg(OLED_ADDRESS, COMMAND, OLED_SETTING_SEQUENTIAL_COM_NON_INTERLEAVED);
 
+    // Horizontal addressing, so a burst of data fills the column/page window set before it.
+    I2C_WriteReg(OLED_ADDRESS, COMMAND, OLED_COMMAND_SET_MEMORY_ADDRESSING_MODE);
+    I2C_WriteReg(OLED_ADDRESS, COMMAND, OLED_SETTING_HORIZONTAL_ADDRESSING);
+
     // And turn on the display.
     I2C_WriteReg(OLED_ADDRESS, COMMAND, OLED_COMMAND_DISPLAY_ON);
+
+    // Whatever is in the display RAM now doesn't match the frame buffer, the next update sends it all.
+    OledDriverMarkAllDirty();
 }
 
 /**
@@ -132,28 +184,262 @@ void OledDriverDisableDisplay(void)
     I2C_WriteReg(OLED_ADDRESS, COMMAND, OLED_COMMAND_DISPLAY_OFF);
 }
 
+/**
+ * Mark columns colStart to colEnd (inclusive) of a page as changed.
+ */
+void OledDriverMarkDirty(int page, int colStart, int colEnd)
+{
+    if (page < 0 || page >= OLED_DRIVER_PAGES || colEnd < colStart) {
+        return;
+    }
+    if (colStart < 0) {
+        colStart = 0;
+    }
+    if (colEnd > OLED_DRIVER_PIXEL_COLUMNS - 1) {
+        colEnd = OLED_DRIVER_PIXEL_COLUMNS - 1;
+    }
+
+    // Grow the page's span to cover the new columns (a clean page has start > end, so it just takes them).
+    if (dirtyStart[page] > dirtyEnd[page]) {
+        dirtyStart[page] = colStart;
+        dirtyEnd[page] = colEnd;
+        return;
+    }
+    if (colStart < dirtyStart[page]) {
+        dirtyStart[page] = colStart;
+    }
+    if (colEnd > dirtyEnd[page]) {
+        dirtyEnd[page] = colEnd;
+    }
+}
+
+/**
+ * Mark the whole frame buffer as changed.
+ */
+void OledDriverMarkAllDirty(void)
+{
+    int page;
+    for (page = 0; page < OLED_DRIVER_PAGES; page++) {
+        dirtyStart[page] = 0;
+        dirtyEnd[page] = OLED_DRIVER_PIXEL_COLUMNS - 1;
+    }
+}
+
+/**
+ * Display data bytes sent by the last update (the window commands aren't counted).
+ */
+uint32_t OledDriverGetLastUpdateSize(void)
+{
+    return updateBytes;
+}
+
 /**
  * Update the display with the contents of rgb0ledBmp.
  */
 void OledDriverUpdateDisplay(void)
 {
-    uint8_t *pb = rgbOledBmp;
+    uint8_t command[OLED_WINDOW_COMMAND_SIZE];
     int page;
+    PROFILE_BEGIN(updateDisplayZone);
+
+    // Let a running (and any queued) asynchronous update finish first, the two would fight over the window.
+    while (isUpdating) {
+        I2C_CheckTimeout();
+    }
+
+    OledDriverSwap();
     for (page = 0; page < OLED_DRIVER_PAGES; page++) {
+        if (updateStart[page] > updateEnd[page]) {
+            continue;
+        }
+
+        // Point the display at the changed columns of this page.
+        OledDriverSetWindow(command, page);
+        I2C_WriteBytes(OLED_ADDRESS, COMMAND_STREAM, command, OLED_WINDOW_COMMAND_SIZE);
 
-        // Set the desired page.
-        I2C_WriteReg(OLED_ADDRESS, COMMAND, OLED_COMMAND_SET_PAGE);
-        I2C_WriteReg(OLED_ADDRESS, COMMAND, page);
+        // Write them to the OLED in one burst.
+        I2C_WriteBytes(OLED_ADDRESS, DATA_STREAM, &oledFront[page * OLED_DRIVER_PIXEL_COLUMNS + updateStart[page]],
+                updateEnd[page] - updateStart[page] + 1);
+    }
+    PROFILE_END(updateDisplayZone);
+}
 
-        // Set the starting column back to the origin.
-        I2C_WriteReg(OLED_ADDRESS, COMMAND, OLED_COMMAND_SET_DISPLAY_LOWER_COLUMN_0);
-        I2C_WriteReg(OLED_ADDRESS, COMMAND, OLED_COMMAND_SET_DISPLAY_UPPER_COLUMN_0);
+/**
+ * Swap the back buffer to the front and send it, or queue the swap if an update is running.
+ */
+int8_t OledDriverSwapBuffers(OledDriverCallback callback)
+{
+    int8_t result = SUCCESS;
+    uint8_t isStarting = FALSE;
 
-        // Write this entire column to the OLED.
-        for (int i = 0; i < OLED_DRIVER_PIXEL_COLUMNS; i++) {
-            I2C_WriteReg(OLED_ADDRESS, DATA, *pb);
-            pb++;
+    // The completion interrupt checks isSwapPending, so decide and flag in one go.
+    __disable_irq();
+    if (isSwapPending) {
+        result = ERROR;
+    } else if (isUpdating) {
+        pendingCallback = callback;
+        isSwapPending = TRUE;
+    } else {
+        isUpdating = TRUE;
+        isStarting = TRUE;
+    }
+    __enable_irq();
+
+    if (isStarting) {
+        OledDriverStartUpdate(callback);
+    }
+    return result;
+}
+
+/**
+ * @return TRUE while an asynchronous display update is running.
+ */
+uint8_t OledDriverIsUpdating(void)
+{
+    return isUpdating;
+}
+
+/**
+ * @return TRUE while a swap is queued behind the running update.
+ */
+uint8_t OledDriverIsSwapPending(void)
+{
+    return isSwapPending;
+}
+
+/**
+ * Move the dirty spans into the ones this update sends, and start collecting new ones.
+ */
+static void OledDriverTakeDirtySpans(void)
+{
+    int page;
+    updateBytes = 0;
+    for (page = 0; page < OLED_DRIVER_PAGES; page++) {
+        updateStart[page] = dirtyStart[page];
+        updateEnd[page] = dirtyEnd[page];
+        if (updateStart[page] <= updateEnd[page]) {
+            updateBytes += updateEnd[page] - updateStart[page] + 1;
         }
+        dirtyStart[page] = OLED_DRIVER_PIXEL_COLUMNS - 1;
+        dirtyEnd[page] = 0;
+    }
+}
+
+/**
+ * Make the back buffer the front one and take its dirty spans for sending.
+ */
+static void OledDriverSwap(void)
+{
+    uint8_t *buffer = oledFront;
+    int page;
+
+    oledFront = rgbOledBmp;
+    rgbOledBmp = buffer;
+    OledDriverTakeDirtySpans();
+
+    // The new back buffer is a frame behind, and only differs in the spans just taken. Copy those
+    // over so drawing carries on from the frame being sent.
+    for (page = 0; page < OLED_DRIVER_PAGES; page++) {
+        if (updateStart[page] <= updateEnd[page]) {
+            uint16_t offset = page * OLED_DRIVER_PIXEL_COLUMNS + updateStart[page];
+            memcpy(&rgbOledBmp[offset], &oledFront[offset], updateEnd[page] - updateStart[page] + 1);
+        }
+    }
+}
+
+/**
+ * Swap and send the first dirty page, the rest of the update runs from the I2C completion interrupts.
+ * With nothing to send the update finishes right here.
+ */
+static void OledDriverStartUpdate(OledDriverCallback callback)
+{
+    updateCallback = callback;
+    OledDriverSwap();
+    updatePage = 0;
+    OledDriverNextPage(SUCCESS);
+}
+
+/**
+ * Fill in the command that limits the display RAM window to the span being sent on one page.
+ */
+static void OledDriverSetWindow(uint8_t *command, uint8_t page)
+{
+    command[0] = OLED_COMMAND_SET_COLUMN;
+    command[1] = updateStart[page];
+    command[2] = updateEnd[page];
+    command[3] = OLED_COMMAND_SET_PAGE;
+    command[4] = page;
+    command[5] = page;
+}
+
+/**
+ * Point the display at the span of updatePage.
+ */
+static void OledDriverSendWindow(void)
+{
+    OledDriverSetWindow(windowCommand, updatePage);
+    if (I2C_WriteBytesAsync(OLED_ADDRESS, COMMAND_STREAM, windowCommand, OLED_WINDOW_COMMAND_SIZE,
+            I2C_PRIORITY_LOW, OledDriverSendPage) == ERROR) {
+        OledDriverFinishUpdate(ERROR);
+    }
+}
+
+/**
+ * I2C callback: the window is set, stream the span's data.
+ */
+static void OledDriverSendPage(int8_t status)
+{
+    if (status == ERROR) {
+        OledDriverFinishUpdate(status);
+        return;
+    }
+
+    // Move on before starting the transfer, its callback looks for the page after this one.
+    uint8_t page = updatePage++;
+    if (I2C_WriteBytesAsync(OLED_ADDRESS, DATA_STREAM,
+            &oledFront[page * OLED_DRIVER_PIXEL_COLUMNS + updateStart[page]],
+            updateEnd[page] - updateStart[page] + 1, I2C_PRIORITY_LOW, OledDriverNextPage) == ERROR) {
+        OledDriverFinishUpdate(ERROR);
+    }
+}
+
+/**
+ * Send the next dirty page, or finish if there are none left. Also the I2C callback after a page's data.
+ */
+static void OledDriverNextPage(int8_t status)
+{
+    if (status == ERROR) {
+        OledDriverFinishUpdate(status);
+        return;
+    }
+
+    while (updatePage < OLED_DRIVER_PAGES && updateStart[updatePage] > updateEnd[updatePage]) {
+        updatePage++;
+    }
+    if (updatePage == OLED_DRIVER_PAGES) {
+        OledDriverFinishUpdate(SUCCESS);
+        return;
+    }
+    OledDriverSendWindow();
+}
+
+/**
+ * The update is over, let the caller know and start on the queued swap if there is one.
+ */
+static void OledDriverFinishUpdate(int8_t status)
+{
+    OledDriverCallback callback = updateCallback;
+    updateCallback = NULL;
+    if (callback != NULL) {
+        callback(status);
+    }
+
+    // isUpdating stays set across a queued swap so the blocking update keeps waiting.
+    if (isSwapPending) {
+        isSwapPending = FALSE;
+        OledDriverStartUpdate(pendingCallback);
+    } else {
+        isUpdating = FALSE;
     }
 }
 
@@ -26,12 +26,31 @@
 #define OLED_DRIVER_BUFFER_SIZE     ((OLED_DRIVER_PIXEL_COLUMNS * OLED_DRIVER_PIXEL_ROWS) / 8)
 
 /**
- * This array is the off-screen frame buffer used for rendering. It isn't possible to read back from
+ * This is the off-screen (back) frame buffer used for rendering. It isn't possible to read back from
  * the OLED display device, so display data is rendered into this off-screen buffer and then copied
  * to the display. The high-order bits equate to the lower pixel rows.
- * @note Any time this is updated, An `OledDriverUpdateDisplay()` call must be performed.
+ * @note Any time this is updated, An `OledDriverUpdateDisplay()` call must be performed. Updates only
+ *       send the columns marked with `OledDriverMarkDirty()`, the Oled.c drawing functions do that
+ *       for you, code writing here directly has to do it itself.
+ * @note It points at one of two buffers and changes on every update, don't keep a copy of it.
  */
-extern uint8_t rgbOledBmp[OLED_DRIVER_BUFFER_SIZE];
+extern uint8_t *rgbOledBmp;
+
+/**
+ * Mark columns colStart to colEnd (inclusive) of one page (8 pixel rows) as changed, so the next
+ * update sends them. Each page keeps a single span that grows to cover every column marked.
+ */
+void OledDriverMarkDirty(int page, int colStart, int colEnd);
+
+/**
+ * Mark the whole frame buffer as changed, the next update sends every page.
+ */
+void OledDriverMarkAllDirty(void);
+
+/**
+ * @return The number of display data bytes the last update sent (at most OLED_DRIVER_BUFFER_SIZE).
+ */
+uint32_t OledDriverGetLastUpdateSize(void);
 
 /**
  * Initialize the STM32 to communicate with the OLED display through the SSD1306 (I2C)
@@ -51,10 +70,42 @@ void OledDriverInitDisplay(void);
 void OledDriverDisableDisplay(void);
 
 /**
- * Update the display with the contents of rgb0ledBmp.
+ * Called from interrupt context when an asynchronous display update is done.
+ * status is SUCCESS, or ERROR if a transfer failed (the rest of the update is skipped).
+ */
+typedef void (*OledDriverCallback)(int8_t status);
+
+/**
+ * Update the display with the contents of rgb0ledBmp. Only the dirty span of each page is sent, as a
+ * single I2C burst into a column window, blocking until they have all been sent.
  */
 void OledDriverUpdateDisplay(void);
 
+/**
+ * Swap rgbOledBmp to the front and start sending it, returning straight away. The dirty spans are
+ * streamed one after the other by the I2C DMA from the front buffer, and callback (can be NULL) runs
+ * once the last one is out (right away if nothing changed). The new back buffer already holds the
+ * frame being sent, so drawing the next one can start at once.
+ *
+ * Called while an update is running, the swap is queued and done by that update's completion
+ * interrupt, which then sends this frame straight after it.
+ * @note Don't draw while OledDriverIsSwapPending(), the queued frame is still in rgbOledBmp.
+ * The transfers are queued at I2C_PRIORITY_LOW, so sensor reads go out between the pages.
+ * @return SUCCESS, or ERROR if a swap is already queued. A transfer that can't be queued (the I2C
+ * queue is full) doesn't show up here, it ends the update and callback gets ERROR.
+ */
+int8_t OledDriverSwapBuffers(OledDriverCallback callback);
+
+/**
+ * @return TRUE while an asynchronous display update is running.
+ */
+uint8_t OledDriverIsUpdating(void);
+
+/**
+ * @return TRUE while a swap is queued behind the running update.
+ */
+uint8_t OledDriverIsSwapPending(void);
+
 /**
  * Set the LCD to display pixel values as the opposite of how they are actually stored in NVRAM. So
  * pixels set to black (0) will display as white, and pixels set to white (1) will display as black.
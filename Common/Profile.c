@@ -0,0 +1,315 @@
+/*
+ * File:   Profile.c
+ * Author: Derrick Lai
+ *
+ * Cycle counting profiler, see Profile.h.
+ *
+ * Created on April 15, 2025
+ */
+
+#ifdef PROFILE_TEST
+#define PROFILE_ENABLED // The test is of the profiler, it has to be in
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <Profile.h>
+
+// Boolean defines for TRUE, FALSE, SUCCESS and ERROR
+#ifndef FALSE
+#define FALSE ((int8_t) 0)
+#define TRUE ((int8_t) 1)
+#endif
+#ifndef ERROR
+#define ERROR ((int8_t) -1)
+#define SUCCESS ((int8_t) 1)
+#endif
+
+#define PROFILE_CALIBRATION_RUNS 16
+
+// The counter and the critical sections: the DWT cycle counter and PRIMASK on the STM32, nanoseconds and
+// nothing on a host (single threaded).
+#if defined(__arm__)
+#include "stm32f4xx_hal.h"
+#define PROFILE_COUNT() (DWT->CYCCNT)
+#define PROFILE_CLOCK_HZ() SystemCoreClock
+#define PROFILE_UNIT "cycles"
+
+static inline uint32_t Profile_Lock(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+
+static inline void Profile_Unlock(uint32_t primask) {
+    __set_PRIMASK(primask);
+}
+#else
+#include <time.h>
+#define PROFILE_COUNT() Profile_HostCount()
+#define PROFILE_CLOCK_HZ() 1000000000UL
+#define PROFILE_UNIT "ns"
+
+static inline uint32_t Profile_HostCount(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+static inline uint32_t Profile_Lock(void) {
+    return 0;
+}
+
+static inline void Profile_Unlock(uint32_t primask) {
+    (void) primask;
+}
+#endif
+
+static Profile_Zone *zones = NULL;
+static uint32_t nestedCycles = 0; // Time of every finished zone that isn't inside another finished one
+static uint32_t overhead = 0; // Of an empty zone, taken off every run
+
+// Function prototypes for private functions.
+static uint8_t Profile_Bucket(uint32_t cycles);
+
+int8_t Profile_Init(void) {
+#ifdef PROFILE_ENABLED
+#if defined(__arm__)
+    // Without resetting the count, TIMERS_GetCycles() depends on it.
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+    Profile_Zone calibration = { .name = "calibration" };
+    overhead = 0;
+    for (uint8_t i = 0; i < PROFILE_CALIBRATION_RUNS; i++) {
+        PROFILE_BEGIN(calibration);
+        PROFILE_END(calibration);
+    }
+    overhead = calibration.min;
+
+    // It was listed by its first run, it is about to go out of scope.
+    uint32_t primask = Profile_Lock();
+    Profile_Zone **zone = &zones;
+    while (*zone != NULL && *zone != &calibration) {
+        zone = &(*zone)->next;
+    }
+    if (*zone != NULL) {
+        *zone = calibration.next;
+    }
+    Profile_Unlock(primask);
+    return SUCCESS;
+#else
+    return ERROR;
+#endif
+}
+
+Profile_Mark Profile_Begin(void) {
+    uint32_t primask = Profile_Lock();
+    Profile_Mark mark = { PROFILE_COUNT(), nestedCycles };
+    Profile_Unlock(primask);
+    return mark;
+}
+
+void Profile_End(Profile_Zone *zone, Profile_Mark mark) {
+    uint32_t primask = Profile_Lock();
+    uint32_t inclusive = PROFILE_COUNT() - mark.start;
+    uint32_t nested = nestedCycles - mark.nested;
+    // Whoever this ran inside takes off all of it, the zones inside it included.
+    nestedCycles = mark.nested + inclusive;
+
+    inclusive = inclusive > overhead ? inclusive - overhead : 0;
+    uint32_t own = inclusive > nested ? inclusive - nested : 0;
+    if (!zone->isListed) {
+        zone->next = zones;
+        zones = zone;
+        zone->isListed = TRUE;
+    }
+    if (zone->count == 0 || own < zone->min) {
+        zone->min = own;
+    }
+    zone->max = own > zone->max ? own : zone->max;
+    zone->count++;
+    zone->total += own;
+    zone->totalInclusive += inclusive;
+    zone->histogram[Profile_Bucket(own)]++;
+    Profile_Unlock(primask);
+}
+
+void Profile_Report(void) {
+#ifdef PROFILE_ENABLED
+    uint32_t clock = PROFILE_CLOCK_HZ();
+    printf("Zone                         runs        min       mean        max  mean incl.  max us  (%s)\r\n",
+            PROFILE_UNIT);
+    for (Profile_Zone *next = zones; next != NULL; next = next->next) {
+        Profile_Zone zone;
+        uint32_t primask = Profile_Lock();
+        zone = *next;
+        Profile_Unlock(primask);
+        if (zone.count == 0) {
+            continue;
+        }
+
+        printf("%-26s %6lu %10lu %10lu %10lu %11lu %7lu\r\n", zone.name, (unsigned long) zone.count,
+                (unsigned long) zone.min, (unsigned long) (zone.total / zone.count), (unsigned long) zone.max,
+                (unsigned long) (zone.totalInclusive / zone.count),
+                (unsigned long) ((uint64_t) zone.max * 1000000 / clock));
+        // The histogram as the bucket's upper bound (a power of 2) and the runs in it.
+        printf("   ");
+        for (uint8_t i = 0; i < PROFILE_BUCKETS; i++) {
+            if (zone.histogram[i] != 0) {
+                printf(i < PROFILE_BUCKETS - 1 ? " <2^%d:%lu" : " >=2^%d:%lu", i < PROFILE_BUCKETS - 1 ? i + 6 : i + 5,
+                        (unsigned long) zone.histogram[i]);
+            }
+        }
+        printf("\r\n");
+    }
+#else
+    printf("Profiling is compiled out, build with -DPROFILE_ENABLED\r\n");
+#endif
+}
+
+void Profile_Reset(void) {
+    uint32_t primask = Profile_Lock();
+    for (Profile_Zone *zone = zones; zone != NULL; zone = zone->next) {
+        zone->count = 0;
+        zone->min = 0;
+        zone->max = 0;
+        zone->total = 0;
+        zone->totalInclusive = 0;
+        memset(zone->histogram, 0, sizeof(zone->histogram));
+    }
+    Profile_Unlock(primask);
+}
+
+/**
+ * @function Profile_Bucket(cycles)
+ * @param cycles - A run's own time
+ * @return Its histogram bucket */
+static uint8_t Profile_Bucket(uint32_t cycles) {
+    uint8_t log2 = 31 - __builtin_clz(cycles | 1);
+    if (log2 < 6) {
+        return 0;
+    }
+    return log2 - 5 < PROFILE_BUCKETS ? log2 - 5 : PROFILE_BUCKETS - 1;
+}
+
+
+//#define PROFILE_TEST
+#ifdef PROFILE_TEST // PROFILE TEST HARNESS
+// Runs on a host, where the counter is clock_gettime() in nanoseconds:
+//   gcc -O2 -I. -DPROFILE_TEST Profile.c -o profile_test && ./profile_test
+// Zones spin for known times: a task of 20 us with a 10 us interrupt in the middle of every run, zones nested
+// three deep and an empty zone. The host can be preempted, so only the minimums are held to the spin times
+// (a run can be longer, never shorter), and the report is printed to look at.
+// SUCCESS - each zone's own time starts at what it spun for: the interrupt's and the inner zones' time is
+// taken off the ones they ran in, but not from their time including them, and the histograms count every run.
+
+#define TASK_NS 20000
+#define ISR_NS 10000
+#define NEST_NS 5000
+#define RUNS 1000
+#define SLACK_NS 2000 // A spin overshoots by a clock read or so, a preemption is caught by the maximum only
+
+PROFILE_ZONE(taskZone, "task");
+PROFILE_ZONE(isrZone, "interrupt");
+PROFILE_ZONE(outerZone, "outer");
+PROFILE_ZONE(middleZone, "middle");
+PROFILE_ZONE(innerZone, "inner");
+PROFILE_ZONE(emptyZone, "empty");
+
+static int errors = 0;
+
+static void Check(int condition, const char *what) {
+    if (!condition) {
+        printf("  FAILED: %s\n", what);
+        errors++;
+    }
+}
+
+static void Spin(uint32_t ns) {
+    uint32_t start = PROFILE_COUNT();
+    while (PROFILE_COUNT() - start < ns);
+}
+
+static void Interrupt(void) {
+    PROFILE_BEGIN(isrZone);
+    Spin(ISR_NS);
+    PROFILE_END(isrZone);
+}
+
+static void Task(void) {
+    PROFILE_BEGIN(taskZone);
+    Spin(TASK_NS / 2);
+    Interrupt();
+    Spin(TASK_NS / 2);
+    PROFILE_END(taskZone);
+}
+
+static void Nested(void) {
+    PROFILE_BEGIN(outerZone);
+    Spin(NEST_NS);
+    {
+        PROFILE_BEGIN(middleZone);
+        Spin(NEST_NS);
+        {
+            PROFILE_BEGIN(innerZone);
+            Spin(NEST_NS);
+            PROFILE_END(innerZone);
+        }
+        PROFILE_END(middleZone);
+    }
+    PROFILE_END(outerZone);
+}
+
+// The zone's own time starts at ns, and so does its time with the zones inside it added.
+static void CheckZone(const Profile_Zone *zone, uint32_t ns, uint32_t inclusiveNs) {
+    uint32_t histogramRuns = 0;
+    for (uint8_t i = 0; i < PROFILE_BUCKETS; i++) {
+        histogramRuns += zone->histogram[i];
+    }
+    printf("%s: min %lu, mean own %lu, mean with nested %lu ns\n", zone->name, (unsigned long) zone->min,
+            (unsigned long) (zone->total / zone->count), (unsigned long) (zone->totalInclusive / zone->count));
+    Check(zone->count == RUNS && histogramRuns == RUNS, "runs");
+    Check(zone->min + SLACK_NS / 4 >= ns && zone->min <= ns + SLACK_NS, "own time");
+    Check(zone->totalInclusive / zone->count + SLACK_NS / 4 >= inclusiveNs, "time with the nested zones");
+    Check(zone->min <= zone->total / zone->count && zone->total / zone->count <= zone->max, "min, mean, max");
+    Check(zone->histogram[Profile_Bucket(zone->min)] != 0 && zone->histogram[Profile_Bucket(zone->max)] != 0,
+            "histogram buckets");
+}
+
+int main(void) {
+    Check(Profile_Init() == SUCCESS, "init");
+    printf("Empty zone overhead %lu ns\n", (unsigned long) overhead);
+    Check(zones == NULL, "calibration zone left listed");
+
+    for (int i = 0; i < RUNS; i++) {
+        Task();
+        Nested();
+        PROFILE_BEGIN(emptyZone);
+        PROFILE_END(emptyZone);
+    }
+    Profile_Report();
+
+    CheckZone(&taskZone, TASK_NS, TASK_NS + ISR_NS);
+    CheckZone(&isrZone, ISR_NS, ISR_NS);
+    CheckZone(&outerZone, NEST_NS, 3 * NEST_NS);
+    CheckZone(&middleZone, NEST_NS, 2 * NEST_NS);
+    CheckZone(&innerZone, NEST_NS, NEST_NS);
+    Check(emptyZone.min <= SLACK_NS / 4, "empty zone");
+
+    // Bucket edges.
+    Check(Profile_Bucket(0) == 0 && Profile_Bucket(63) == 0 && Profile_Bucket(64) == 1 &&
+            Profile_Bucket(127) == 1 && Profile_Bucket(128) == 2, "low buckets");
+    Check(Profile_Bucket((1UL << 24) - 1) == PROFILE_BUCKETS - 2 && Profile_Bucket(1UL << 24) == PROFILE_BUCKETS - 1
+            && Profile_Bucket(UINT32_MAX) == PROFILE_BUCKETS - 1, "high buckets");
+
+    Profile_Reset();
+    Check(taskZone.count == 0 && taskZone.histogram[Profile_Bucket(TASK_NS)] == 0 && taskZone.isListed, "reset");
+    Task();
+    Check(taskZone.count == 1 && zones != NULL, "runs again after a reset");
+
+    printf("%d errors, %s\n", errors, errors == 0 ? "SUCCESS" : "ERROR");
+    return errors != 0;
+}
+#endif
@@ -0,0 +1,106 @@
+/*
+ * File:   Profile.h
+ * Author: Derrick Lai
+ *
+ * Cycle counting profiler: how long a piece of code takes, run after run, in CPU clock cycles.
+ *
+ * A zone is a named stretch of code marked with PROFILE_BEGIN() and PROFILE_END() in the same block:
+ *   PROFILE_ZONE(updateZone, "OledDriverUpdateDisplay");
+ *   void OledDriverUpdateDisplay(void) {
+ *       PROFILE_BEGIN(updateZone);
+ *       ...
+ *       PROFILE_END(updateZone);
+ *   }
+ * Every run adds to the zone's count, min, max, mean and a histogram of powers of two, and
+ * Profile_Report() prints them all to the console (printf, USART2 as Board.c's Serial_Begin() sets it up).
+ *
+ * Zones nest, and interrupts that have zones of their own can come in the middle of another: a zone's
+ * numbers are its own time, with the time of the zones that ran inside it (called or interrupting) taken
+ * off, so a task's figures don't move with the interrupts that happened to hit it. The time including them
+ * is kept as well for the mean. Time in interrupts without a zone counts to the zone they interrupted.
+ *
+ * Profiling is compiled in only with PROFILE_ENABLED defined (build_flags = -DPROFILE_ENABLED in
+ * platformio.ini). Without it the macros are empty: nothing is added to the code, the zones take no RAM, and
+ * Profile_Report() just says so.
+ *
+ * The counter is the DWT cycle counter on the STM32, the one TIMER_Init() starts. On a host it is
+ * clock_gettime() in nanoseconds, so the same zones and reports work in the host simulations, in
+ * nanoseconds instead of cycles.
+ *
+ * Created on April 15, 2025
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#define PROFILE_BUCKETS 20 // Bucket n counts runs under 2^(n + 6) cycles not in a lower one, the last the rest
+
+typedef struct Profile_Zone {
+    const char *name;
+    struct Profile_Zone *next; // All the zones that have run, for the report
+    uint8_t isListed;
+    uint32_t count;
+    uint32_t min; // Cycles, own time
+    uint32_t max;
+    uint64_t total;
+    uint64_t totalInclusive; // With the zones that ran inside it
+    uint32_t histogram[PROFILE_BUCKETS];
+} Profile_Zone;
+
+// Where a run of a zone started, kept on the stack between PROFILE_BEGIN() and PROFILE_END().
+typedef struct Profile_Mark {
+    uint32_t start;
+    uint32_t nested; // The nested zone time so far, the zone's run takes off what is added to it
+} Profile_Mark;
+
+#ifdef PROFILE_ENABLED
+#define PROFILE_ZONE(zone, zoneName) static Profile_Zone zone = { .name = zoneName }
+#define PROFILE_BEGIN(zone) Profile_Mark zone##Mark = Profile_Begin()
+#define PROFILE_END(zone) Profile_End(&zone, zone##Mark)
+#else
+#define PROFILE_ZONE(zone, zoneName)
+#define PROFILE_BEGIN(zone)
+#define PROFILE_END(zone)
+#endif
+
+/**
+ * @function Profile_Init()
+ * @param None
+ * @return SUCCESS or ERROR if profiling is compiled out
+ * @brief Starts the cycle counter if TIMER_Init() hasn't and measures the cost of an empty zone, which is
+ *        taken off every run */
+int8_t Profile_Init(void);
+
+/**
+ * @function Profile_Begin()
+ * @param None
+ * @return The mark for Profile_End()
+ * @brief Use PROFILE_BEGIN() */
+Profile_Mark Profile_Begin(void);
+
+/**
+ * @function Profile_End(zone, mark)
+ * @param zone - Zone the run belongs to
+ * @param mark - From the Profile_Begin() of this run
+ * @return None
+ * @brief Use PROFILE_END(). Adds the run to the zone, safe in interrupts. */
+void Profile_End(Profile_Zone *zone, Profile_Mark mark);
+
+/**
+ * @function Profile_Report()
+ * @param None
+ * @return None
+ * @brief Prints every zone that has run, a line of numbers and a line of histogram each. The numbers are
+ *        copied out first, the printing (slow, blocking) doesn't hold up interrupts. */
+void Profile_Report(void);
+
+/**
+ * @function Profile_Reset()
+ * @param None
+ * @return None
+ * @brief Zeroes every zone's numbers */
+void Profile_Reset(void);
+
+#endif
@@ -0,0 +1,516 @@
+/*
+ * File:   Scheduler.c
+ * Author: Derrick Lai
+ *
+ * Cooperative task scheduler, see Scheduler.h.
+ *
+ * Created on April 14, 2025
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <Scheduler.h>
+
+// Boolean defines for TRUE, FALSE, SUCCESS and ERROR
+#ifndef FALSE
+#define FALSE ((int8_t) 0)
+#define TRUE ((int8_t) 1)
+#endif
+#ifndef ERROR
+#define ERROR ((int8_t) -1)
+#define SUCCESS ((int8_t) 1)
+#endif
+
+// Critical sections, PRIMASK on the Cortex-M4. The host test is single threaded.
+#if defined(__arm__)
+static inline uint32_t Scheduler_Lock(void) {
+    uint32_t primask;
+    __asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask) :: "memory");
+    return primask;
+}
+
+static inline void Scheduler_Unlock(uint32_t primask) {
+    __asm volatile ("msr primask, %0" :: "r" (primask) : "memory");
+}
+#else
+#ifdef SCHEDULER_TEST
+static void SimInterruptWindow(void);
+#endif
+
+static inline uint32_t Scheduler_Lock(void) {
+#ifdef SCHEDULER_TEST
+    SimInterruptWindow(); // The last moment an interrupt can get in before the lock
+#endif
+    return 0;
+}
+
+static inline void Scheduler_Unlock(uint32_t primask) {
+    (void) primask;
+}
+#endif
+
+typedef struct Task {
+    Scheduler_Function function;
+    volatile uint32_t events; // Signalled and not run with yet
+    volatile uint64_t signalTime; // When the first of them came
+    uint64_t due; // Timer, SCHEDULER_NEVER when there is none
+    uint32_t period; // 0 for a one-shot
+    Scheduler_Stats stats;
+} Task;
+
+static const Scheduler_Driver *driver = NULL;
+static Task tasks[SCHEDULER_MAX_TASKS];
+static uint8_t numTasks = 0;
+static uint64_t idleTime = 0;
+
+// Function prototypes for private functions.
+static void Scheduler_Sleep(void);
+
+void Scheduler_Init(const Scheduler_Driver *newDriver) {
+    driver = newDriver;
+    numTasks = 0;
+    idleTime = 0;
+}
+
+int8_t Scheduler_AddTask(Scheduler_Function function) {
+    if (function == NULL || numTasks >= SCHEDULER_MAX_TASKS) {
+        return ERROR;
+    }
+    Task *task = &tasks[numTasks];
+    memset(task, 0, sizeof(*task));
+    task->function = function;
+    task->due = SCHEDULER_NEVER;
+    return numTasks++;
+}
+
+int8_t Scheduler_Every(int8_t task, uint32_t period) {
+    if (task < 0 || task >= numTasks || period == 0) {
+        return ERROR;
+    }
+    tasks[task].period = period;
+    tasks[task].due = driver->microseconds() + period;
+    return SUCCESS;
+}
+
+int8_t Scheduler_After(int8_t task, uint32_t delay) {
+    if (task < 0 || task >= numTasks) {
+        return ERROR;
+    }
+    tasks[task].period = 0;
+    tasks[task].due = driver->microseconds() + delay;
+    return SUCCESS;
+}
+
+void Scheduler_Stop(int8_t task) {
+    if (task >= 0 && task < numTasks) {
+        tasks[task].due = SCHEDULER_NEVER;
+    }
+}
+
+void Scheduler_Signal(int8_t task, uint32_t events) {
+    if (task < 0 || task >= numTasks || events == 0) {
+        return;
+    }
+    uint32_t primask = Scheduler_Lock();
+    if (tasks[task].events == 0) {
+        tasks[task].signalTime = driver->microseconds();
+    }
+    tasks[task].events |= events;
+    Scheduler_Unlock(primask);
+}
+
+uint8_t Scheduler_RunOnce(void) {
+    uint8_t ran = 0;
+    uint64_t now = driver->microseconds();
+
+    for (uint8_t i = 0; i < numTasks; i++) {
+        Task *task = &tasks[i];
+
+        uint32_t primask = Scheduler_Lock();
+        uint32_t events = task->events;
+        uint64_t readyTime = task->signalTime;
+        task->events = 0;
+        Scheduler_Unlock(primask);
+
+        // The timer moves on before the task runs, so the task can set itself a new one.
+        if (task->due <= now) {
+            if (events == 0 || task->due < readyTime) {
+                readyTime = task->due;
+            }
+            events |= SCHEDULER_EVENT_TIMER;
+            if (task->period == 0) {
+                task->due = SCHEDULER_NEVER;
+            } else {
+                task->due += task->period;
+                if (task->due <= now) {
+                    uint32_t missed = (uint32_t) ((now - task->due) / task->period) + 1;
+                    task->due += (uint64_t) missed * task->period;
+                    task->stats.overruns += missed;
+                }
+            }
+        }
+        if (events == 0) {
+            continue;
+        }
+
+        uint64_t start = driver->microseconds();
+        task->function(events);
+        uint64_t end = driver->microseconds();
+
+        uint32_t latency = (uint32_t) (start - readyTime);
+        uint32_t runTime = (uint32_t) (end - start);
+        task->stats.runs++;
+        task->stats.totalLatency += latency;
+        task->stats.maxLatency = latency > task->stats.maxLatency ? latency : task->stats.maxLatency;
+        task->stats.maxRunTime = runTime > task->stats.maxRunTime ? runTime : task->stats.maxRunTime;
+        ran++;
+    }
+
+    if (ran == 0) {
+        Scheduler_Sleep();
+    }
+    return ran;
+}
+
+void Scheduler_Run(void) {
+    while (TRUE) {
+        Scheduler_RunOnce();
+    }
+}
+
+int8_t Scheduler_GetStats(int8_t task, Scheduler_Stats *stats) {
+    if (task < 0 || task >= numTasks || stats == NULL) {
+        return ERROR;
+    }
+    *stats = tasks[task].stats;
+    return SUCCESS;
+}
+
+uint64_t Scheduler_GetIdleTime(void) {
+    return idleTime;
+}
+
+void Scheduler_ResetStats(void) {
+    for (uint8_t i = 0; i < numTasks; i++) {
+        memset(&tasks[i].stats, 0, sizeof(tasks[i].stats));
+    }
+    idleTime = 0;
+}
+
+/**
+ * @function Scheduler_Sleep()
+ * @param None
+ * @return None
+ * @brief Sleeps until the nearest timer, unless a task has been signalled or a timer is already due */
+static void Scheduler_Sleep(void) {
+    uint64_t wakeTime = SCHEDULER_NEVER;
+    uint8_t isSignalled = FALSE;
+
+    // Interrupts stay off from the last look at the events into the sleep, a signal from now on is pending
+    // and wakes the sleep straight away.
+    uint32_t primask = Scheduler_Lock();
+    for (uint8_t i = 0; i < numTasks; i++) {
+        isSignalled |= tasks[i].events != 0;
+        wakeTime = tasks[i].due < wakeTime ? tasks[i].due : wakeTime;
+    }
+    uint64_t start = driver->microseconds();
+    if (!isSignalled && wakeTime > start) {
+        driver->sleep(wakeTime);
+        idleTime += driver->microseconds() - start;
+    }
+    Scheduler_Unlock(primask);
+}
+
+
+//#define SCHEDULER_TEST
+#ifdef SCHEDULER_TEST // SCHEDULER TEST HARNESS
+// No hardware dependencies, the clock is simulated: sleeping jumps it to the wake up time or the next simulated
+// interrupt, and a task's work moves it on by what that work costs, with the interrupts that come due in the
+// meantime run at their own time. So this runs on a host and every run schedules the same way:
+//   gcc -O2 -I. -DSCHEDULER_TEST Scheduler.c -o scheduler_test && ./scheduler_test
+// The tasks are the player's, with made up costs: BLE woken by its receive interrupt, buttons polled every
+// 5 ms, the volume pot every 50 ms, the OLED redrawn when one of those changes something and again once the
+// frame before it is out, an FFT on every 8 ms audio block, and a one-shot timeout that sets itself again.
+// SUCCESS - the periodic tasks run exactly once a period with no drift, the one-shots on time, every signal
+// is followed by a run of its task, no task waits longer than the work of the others in one pass, and the
+// loop sleeps for all the time nothing needs the CPU.
+
+#include <stdlib.h>
+
+#define SIM_SECONDS 10
+#define SIM_US ((uint64_t) SIM_SECONDS * 1000000)
+
+#define BUTTONS_PERIOD 5000
+#define VOLUME_PERIOD 50000
+#define FFT_PERIOD 8000
+#define TIMEOUT_DELAY 250000
+
+#define BLE_COST 60
+#define BUTTONS_COST 5
+#define VOLUME_COST 20
+#define OLED_COST 400
+#define OLED_FRAME_US 14000 // I2C DMA time of a frame
+#define FFT_COST 1500
+
+// Simulated interrupt sources, the time each one next fires.
+enum {IRQ_BLE, IRQ_OLED, NUM_IRQS};
+
+static uint64_t now = 0;
+static uint64_t irqTime[NUM_IRQS];
+static unsigned int seed = 1;
+static int errors = 0;
+static unsigned long sleeps = 0, emptyWakes = 0;
+
+static int8_t bleTask, buttonsTask, volumeTask, oledTask, fftTask, timeoutTask;
+static uint64_t pendingSince[SCHEDULER_MAX_TASKS]; // Oldest signal the task hasn't run since, 0 if none
+static uint32_t signalsSent = 0;
+static uint64_t busyTime = 0;
+
+static void Check(int condition, const char *what) {
+    if (!condition) {
+        printf("  FAILED: %s\n", what);
+        errors++;
+    }
+}
+
+static uint64_t SimMicroseconds(void) {
+    return now;
+}
+
+static void SimSignal(int8_t task, uint32_t events) {
+    if (pendingSince[task] == 0) {
+        pendingSince[task] = now;
+    }
+    signalsSent++;
+    Scheduler_Signal(task, events);
+}
+
+// An interrupt can come at any point the loop isn't locked, the harness tries the worst ones: just before the
+// loop's locks, between the pass that found nothing to do and the sleep in particular. Sometimes the BLE
+// interrupt comes right then instead of when it was due.
+static uint8_t isInIrq = FALSE;
+
+static void RunIrq(uint8_t irq);
+
+static void SimInterruptWindow(void) {
+    if (!isInIrq && driver != NULL && rand_r(&seed) % 64 == 0) {
+        irqTime[IRQ_BLE] = now;
+        RunIrq(IRQ_BLE);
+    }
+}
+
+static void RunIrq(uint8_t irq) {
+    isInIrq = TRUE;
+    now = irqTime[irq];
+    if (irq == IRQ_BLE) {
+        irqTime[irq] = now + 1000 + rand_r(&seed) % 40000; // A burst every 1 to 41 ms
+        SimSignal(bleTask, 1);
+    } else {
+        irqTime[irq] = SCHEDULER_NEVER;
+        SimSignal(oledTask, 1);
+    }
+    isInIrq = FALSE;
+}
+
+// The next interrupt due at or before time, NUM_IRQS if none.
+static uint8_t NextIrq(uint64_t time) {
+    uint8_t next = NUM_IRQS;
+    for (uint8_t i = 0; i < NUM_IRQS; i++) {
+        if (irqTime[i] <= time && (next == NUM_IRQS || irqTime[i] < irqTime[next])) {
+            next = i;
+        }
+    }
+    return next;
+}
+
+// A pending interrupt wakes the sleep straight away (and runs once interrupts are back on, which makes no
+// difference here).
+static void SimSleep(uint64_t wakeTime) {
+    sleeps++;
+    uint8_t irq = NextIrq(wakeTime);
+    if (irq != NUM_IRQS) {
+        RunIrq(irq);
+    } else if (wakeTime != SCHEDULER_NEVER) {
+        now = wakeTime;
+    } else {
+        now = SIM_US; // Nothing will ever wake it
+    }
+    uint8_t isAnySignalled = FALSE;
+    for (uint8_t i = 0; i < SCHEDULER_MAX_TASKS; i++) {
+        isAnySignalled |= pendingSince[i] != 0;
+    }
+    emptyWakes += !isAnySignalled && irq == NUM_IRQS && wakeTime == SCHEDULER_NEVER;
+}
+
+static const Scheduler_Driver simDriver = { SimMicroseconds, SimSleep };
+
+// A task's work: the clock moves on, interrupts fire on the way.
+static void Work(uint32_t cost) {
+    uint64_t end = now + cost;
+    uint8_t irq;
+    while ((irq = NextIrq(end)) != NUM_IRQS) {
+        RunIrq(irq);
+    }
+    now = end;
+    busyTime += cost;
+}
+
+// Each task records its runs: the start times of the timer runs and how long signals waited.
+typedef struct {
+    uint32_t timerRuns;
+    uint64_t lastTimerRun;
+    uint64_t maxSignalWait;
+} Record;
+
+static Record records[SCHEDULER_MAX_TASKS];
+
+static void Ran(int8_t task, uint32_t events) {
+    if (events & SCHEDULER_EVENT_TIMER) {
+        records[task].timerRuns++;
+        records[task].lastTimerRun = now;
+    }
+    if (events & ~SCHEDULER_EVENT_TIMER) {
+        Check(pendingSince[task] != 0, "signal events without a signal");
+        uint64_t wait = now - pendingSince[task];
+        records[task].maxSignalWait = wait > records[task].maxSignalWait ? wait : records[task].maxSignalWait;
+    }
+    pendingSince[task] = 0;
+}
+
+static uint8_t isOledBusy = FALSE, isOledDirty = FALSE;
+
+static void BleTask(uint32_t events) {
+    Ran(bleTask, events);
+    Work(BLE_COST);
+}
+
+static void ButtonsTask(uint32_t events) {
+    Ran(buttonsTask, events);
+    Work(BUTTONS_COST);
+    if (rand_r(&seed) % 50 == 0) { // A press, the screen shows it
+        isOledDirty = TRUE;
+        SimSignal(oledTask, 2);
+    }
+}
+
+static void VolumeTask(uint32_t events) {
+    Ran(volumeTask, events);
+    Work(VOLUME_COST);
+    if (rand_r(&seed) % 4 == 0) {
+        isOledDirty = TRUE;
+        SimSignal(oledTask, 2);
+    }
+}
+
+// Redraws when something changed and the last frame has gone out, the frame's DMA interrupt signals it.
+static void OledTask(uint32_t events) {
+    Ran(oledTask, events);
+    if (events & 1) {
+        isOledBusy = FALSE;
+    }
+    if (isOledDirty && !isOledBusy) {
+        Work(OLED_COST);
+        isOledDirty = FALSE;
+        isOledBusy = TRUE;
+        irqTime[IRQ_OLED] = now + OLED_FRAME_US;
+    }
+}
+
+static void FftTask(uint32_t events) {
+    Ran(fftTask, events);
+    Work(FFT_COST);
+}
+
+static uint64_t timeoutSetAt, timeoutWorstLate = 0;
+static uint32_t timeoutRuns = 0;
+
+static void TimeoutTask(uint32_t events) {
+    Ran(timeoutTask, events);
+    uint64_t late = now - (timeoutSetAt + TIMEOUT_DELAY);
+    timeoutWorstLate = late > timeoutWorstLate ? late : timeoutWorstLate;
+    timeoutRuns++;
+    timeoutSetAt = now;
+    Scheduler_After(timeoutTask, TIMEOUT_DELAY);
+}
+
+static void Noop(uint32_t events) {
+    (void) events;
+}
+
+int main(void) {
+    for (uint8_t i = 0; i < NUM_IRQS; i++) {
+        irqTime[i] = SCHEDULER_NEVER;
+    }
+    Scheduler_Init(&simDriver);
+    bleTask = Scheduler_AddTask(BleTask);
+    buttonsTask = Scheduler_AddTask(ButtonsTask);
+    volumeTask = Scheduler_AddTask(VolumeTask);
+    oledTask = Scheduler_AddTask(OledTask);
+    fftTask = Scheduler_AddTask(FftTask);
+    timeoutTask = Scheduler_AddTask(TimeoutTask);
+
+    Scheduler_Every(buttonsTask, BUTTONS_PERIOD);
+    Scheduler_Every(volumeTask, VOLUME_PERIOD);
+    Scheduler_Every(fftTask, FFT_PERIOD);
+    timeoutSetAt = now;
+    Scheduler_After(timeoutTask, TIMEOUT_DELAY);
+    irqTime[IRQ_BLE] = 3000;
+
+    unsigned long passes = 0;
+    while (now < SIM_US) {
+        Scheduler_RunOnce();
+        passes++;
+    }
+
+    // A pass can hold a task up by at most the work of all the others.
+    uint32_t worstWait = BLE_COST + BUTTONS_COST + VOLUME_COST + OLED_COST + FFT_COST;
+    static const char *names[] = {"BLE", "buttons", "volume", "OLED", "FFT", "timeout"};
+    static const uint32_t periods[] = {0, BUTTONS_PERIOD, VOLUME_PERIOD, 0, FFT_PERIOD, 0};
+    printf("%lu passes, %lu sleeps, %u signals in %d s\n", passes, sleeps, signalsSent, SIM_SECONDS);
+    printf("Task      runs   latency avg/max (us)   run max (us)   overruns\n");
+    for (int8_t t = 0; t <= timeoutTask; t++) {
+        Scheduler_Stats stats = {0};
+        Scheduler_GetStats(t, &stats);
+        printf("%-8s %5lu   %8.1f / %5lu     %10lu   %8lu\n", names[t], (unsigned long) stats.runs,
+                stats.runs ? (double) stats.totalLatency / stats.runs : 0.0, (unsigned long) stats.maxLatency,
+                (unsigned long) stats.maxRunTime, (unsigned long) stats.overruns);
+        Check(stats.maxLatency <= worstWait, "a task waited longer than one pass of the others");
+        Check(records[t].maxSignalWait <= worstWait, "a signal waited longer than one pass of the others");
+        Check(stats.overruns == 0, "a periodic task missed a period");
+        if (periods[t] != 0) {
+            // Run k is due at k periods, the last one inside the run is the (SIM_US / period)th.
+            uint32_t expected = (uint32_t) ((now - 1) / periods[t]);
+            Check(records[t].timerRuns == expected || records[t].timerRuns == expected - 1, "periodic runs");
+            Check(records[t].lastTimerRun >= (uint64_t) records[t].timerRuns * periods[t] &&
+                    records[t].lastTimerRun <= (uint64_t) records[t].timerRuns * periods[t] + worstWait,
+                    "periodic task drifted");
+        }
+    }
+    Check(pendingSince[bleTask] == 0 || now - pendingSince[bleTask] <= worstWait, "BLE signal never ran");
+    printf("Timeout: %lu one-shots, worst %lu us late\n", (unsigned long) timeoutRuns,
+            (unsigned long) timeoutWorstLate);
+    Check(timeoutRuns >= SIM_US / (TIMEOUT_DELAY + worstWait) && timeoutWorstLate <= worstWait, "one-shot timing");
+
+    uint64_t idle = Scheduler_GetIdleTime();
+    printf("Idle %.1f%% (%llu us), busy %llu us, %lu wake ups with nothing to do\n", 100.0 * idle / now,
+            (unsigned long long) idle, (unsigned long long) busyTime, emptyWakes);
+    Check(idle + busyTime == now, "time neither asleep nor working, the loop spun");
+    Check(emptyWakes == 0, "woke up with nothing to do");
+
+    // The edges.
+    Scheduler_Init(&simDriver);
+    for (int i = 0; i < SCHEDULER_MAX_TASKS; i++) {
+        Check(Scheduler_AddTask(Noop) == i, "add task");
+    }
+    Check(Scheduler_AddTask(Noop) == ERROR, "too many tasks");
+    Check(Scheduler_AddTask(NULL) == ERROR, "no function");
+    Check(Scheduler_Every(0, 0) == ERROR, "no period");
+    Check(Scheduler_Every(SCHEDULER_MAX_TASKS, 1000) == ERROR, "no such task");
+    Scheduler_Signal(0, 0);
+    Check(Scheduler_RunOnce() == 0, "nothing to run");
+
+    printf("%d errors, %s\n", errors, errors == 0 ? "SUCCESS" : "ERROR");
+    return errors != 0;
+}
+#endif
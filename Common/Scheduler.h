@@ -0,0 +1,132 @@
+/*
+ * File:   Scheduler.h
+ * Author: Derrick Lai
+ *
+ * Cooperative task scheduler, the main loop of the player.
+ *
+ * A task is a function that runs to completion and returns. It runs when it is given events: from its timer
+ * (periodic or one-shot, SCHEDULER_EVENT_TIMER) or from Scheduler_Signal(), which interrupts and callbacks
+ * use to wake it with their own event bits. Every pass of the loop runs each task that has events, lowest
+ * task number first, with all the events it got since it last ran. A long task delays the others, it can't
+ * be preempted, so tasks should do a bounded piece of work and come back later for the rest.
+ *
+ * There is no scheduler tick. When nothing has events the loop sleeps until the nearest timer is due, or an
+ * interrupt signals something sooner. The sleep is entered with interrupts off after a last look at the
+ * events, so a signal can't slip in between the look and the sleep and be missed until the next wake up.
+ *
+ * Each task keeps its latency (from its timer being due or its first pending signal to the task running),
+ * its run time and the number of runs, so the cost of a task on the others can be measured.
+ *
+ * This file has no hardware dependencies, the clock and the sleep come from a Scheduler_Driver
+ * (TIMERS_GetMicroSeconds64() and TIMERS_Sleep() on the STM32, a simulated clock in the SCHEDULER_TEST
+ * harness).
+ *
+ * Created on April 14, 2025
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#define SCHEDULER_MAX_TASKS 16
+#define SCHEDULER_EVENT_TIMER 0x80000000UL // The task's timer is due, the other bits are for Scheduler_Signal()
+#define SCHEDULER_NEVER UINT64_MAX // No timer is set
+
+typedef void (*Scheduler_Function)(uint32_t events);
+
+typedef struct Scheduler_Driver {
+    uint64_t (*microseconds)(void); // Monotonic clock, safe to call from interrupts
+    void (*sleep)(uint64_t wakeTime); // Called with interrupts off: sleep until an interrupt is pending or
+                                      // wakeTime (SCHEDULER_NEVER for no timer), returning with them still off
+} Scheduler_Driver;
+
+typedef struct Scheduler_Stats {
+    uint32_t runs;
+    uint32_t maxLatency; // Microseconds from being ready to running
+    uint64_t totalLatency; // ... over all the runs, for the average
+    uint32_t maxRunTime; // Microseconds
+    uint32_t overruns; // Periods skipped because the task ran too late to catch up
+} Scheduler_Stats;
+
+/**
+ * @function Scheduler_Init(driver)
+ * @param driver - Clock and sleep, must stay valid
+ * @return None
+ * @brief Removes every task */
+void Scheduler_Init(const Scheduler_Driver *driver);
+
+/**
+ * @function Scheduler_AddTask(function)
+ * @param function - Called with the task's events when it has some
+ * @return The task number, or ERROR if there are SCHEDULER_MAX_TASKS already
+ * @brief The task does nothing until it is given a timer or signalled. Tasks added first run first. */
+int8_t Scheduler_AddTask(Scheduler_Function function);
+
+/**
+ * @function Scheduler_Every(task, period)
+ * @param task - From Scheduler_AddTask()
+ * @param period - Microseconds, more than 0
+ * @return SUCCESS or ERROR
+ * @brief Runs the task every period from now on, first one period from now. The runs keep to the period
+ *        (no drift), a task that falls more than a period behind skips the periods it missed. */
+int8_t Scheduler_Every(int8_t task, uint32_t period);
+
+/**
+ * @function Scheduler_After(task, delay)
+ * @param task - From Scheduler_AddTask()
+ * @param delay - Microseconds
+ * @return SUCCESS or ERROR
+ * @brief Runs the task once, delay from now, replacing any timer it had */
+int8_t Scheduler_After(int8_t task, uint32_t delay);
+
+/**
+ * @function Scheduler_Stop(task)
+ * @param task - From Scheduler_AddTask()
+ * @return None
+ * @brief Stops the task's timer, signals still run it */
+void Scheduler_Stop(int8_t task);
+
+/**
+ * @function Scheduler_Signal(task, events)
+ * @param task - From Scheduler_AddTask()
+ * @param events - Bits to give the task, added to any it hasn't run with yet
+ * @return None
+ * @brief Wakes the task on the next pass of the loop, safe to call from interrupts */
+void Scheduler_Signal(int8_t task, uint32_t events);
+
+/**
+ * @function Scheduler_RunOnce()
+ * @param None
+ * @return The number of tasks that ran, 0 if the loop slept instead
+ * @brief One pass of the loop: runs every task that has events, or sleeps if none has */
+uint8_t Scheduler_RunOnce(void);
+
+/**
+ * @function Scheduler_Run()
+ * @param None
+ * @return Never
+ * @brief The main loop, Scheduler_RunOnce() forever */
+void Scheduler_Run(void);
+
+/**
+ * @function Scheduler_GetStats(task, stats)
+ * @param task - From Scheduler_AddTask()
+ * @param stats - Gets the task's numbers since it was added or the last Scheduler_ResetStats()
+ * @return SUCCESS or ERROR */
+int8_t Scheduler_GetStats(int8_t task, Scheduler_Stats *stats);
+
+/**
+ * @function Scheduler_GetIdleTime()
+ * @param None
+ * @return Microseconds spent asleep since Scheduler_Init() or the last Scheduler_ResetStats() */
+uint64_t Scheduler_GetIdleTime(void);
+
+/**
+ * @function Scheduler_ResetStats()
+ * @param None
+ * @return None
+ * @brief Zeroes every task's stats and the idle time */
+void Scheduler_ResetStats(void);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * File:   Spectrum.c
+ * Author: Derrick Lai
+ *
+ * Spectrum analyzer bars for the OLED, see Spectrum.h.
+ *
+ * Created on April 11, 2025
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <OledDriver.h>
+#include <Spectrum.h>
+
+// Boolean defines for TRUE, FALSE, SUCCESS and ERROR
+#ifndef FALSE
+#define FALSE ((int8_t) 0)
+#define TRUE ((int8_t) 1)
+#endif
+#ifndef ERROR
+#define ERROR ((int8_t) -1)
+#define SUCCESS ((int8_t) 1)
+#endif
+
+#define SPECTRUM_PAGES (OLED_DRIVER_PIXEL_ROWS / OLED_DRIVER_BUFFER_LINE_HEIGHT)
+
+uint8_t Spectrum_Height(uint16_t level) {
+    if (level < 2) {
+        return 0;
+    }
+    // Whole doublings from the top bit, plus one for the bit below it (half way, in decibels close enough).
+    uint8_t top = 15;
+    while (!(level & (1U << top))) {
+        top--;
+    }
+    uint8_t height = 2 * top + ((level >> (top - 1)) & 1);
+    return height > OLED_DRIVER_PIXEL_ROWS ? OLED_DRIVER_PIXEL_ROWS : height;
+}
+
+void Spectrum_Draw(const uint16_t *bands, uint8_t numBands) {
+    if (numBands == 0 || numBands > FFT_MAX_BANDS) {
+        return;
+    }
+    uint8_t pitch = OLED_DRIVER_PIXEL_COLUMNS / numBands;
+    uint8_t width = pitch > 1 ? pitch - 1 : 1;
+    uint8_t left = (OLED_DRIVER_PIXEL_COLUMNS - pitch * numBands) / 2; // Centers the bars
+
+    memset(rgbOledBmp, 0, OLED_DRIVER_BUFFER_SIZE);
+    for (uint8_t b = 0; b < numBands; b++) {
+        uint8_t top = OLED_DRIVER_PIXEL_ROWS - Spectrum_Height(bands[b]); // First lit row
+        uint8_t x = left + b * pitch;
+        // Bits go down a page from bit 0, so rows top and below are the bits from (top - first row) up.
+        for (uint8_t page = top / OLED_DRIVER_BUFFER_LINE_HEIGHT; page < SPECTRUM_PAGES; page++) {
+            int16_t first = top - page * OLED_DRIVER_BUFFER_LINE_HEIGHT;
+            uint8_t column = first <= 0 ? 0xFF : (uint8_t) (0xFF << first);
+            memset(&rgbOledBmp[page * OLED_DRIVER_PIXEL_COLUMNS + x], column, width);
+        }
+    }
+    OledDriverMarkAllDirty();
+}
+
+
+//#define SPECTRUM_TEST
+#ifdef SPECTRUM_TEST // SPECTRUM ANALYZER TEST HARNESS
+// Captures ADC_0 (a microphone or line-in biased to mid-scale) at 32 kHz and shows its spectrum as 32 bars, a
+// new frame whenever the last one has gone out over I2C, printing the frame rate and the time Fft_Bands()
+// takes every second.
+// SUCCESS - a whistle or a tone generator lights one bar that moves right as the pitch goes up, the bars
+// drop to the bottom row in silence, and Fft_Bands() stays well inside a block (8 ms at 32 kHz).
+#include <Board.h>
+#include <ADC.h>
+#include <Oled.h>
+#include <timers.h>
+
+#define TEST_RATE 32000
+#define TEST_BANDS 32
+
+static uint16_t block[ADC_CAPTURE_BLOCK_SIZE];
+static volatile uint8_t isBlockReady = FALSE;
+
+// Keeps the newest block, the FFT runs in the main loop, not in the DMA interrupt.
+static void Capture(const uint16_t *samples, uint16_t length) {
+    if (!isBlockReady) {
+        memcpy(block, samples, length * sizeof(samples[0]));
+        isBlockReady = TRUE;
+    }
+}
+
+int main(void) {
+    static Fft fft;
+    uint16_t bands[TEST_BANDS];
+    uint32_t frames = 0, fftMicros = 0, worstMicros = 0;
+
+    BOARD_Init();
+    OledInit();
+    if (Fft_Init(&fft, ADC_CAPTURE_BLOCK_SIZE, TEST_BANDS) == ERROR || ADC_Init() == ERROR ||
+            ADC_StartCapture(ADC_0, TEST_RATE, Capture) == ERROR) {
+        printf("Spectrum init error\r\n");
+        while (1);
+    }
+    printf("%u point FFT at %lu Hz, %lu Hz per bin\r\n", fft.size, ADC_GetCaptureRate(),
+            ADC_GetCaptureRate() / fft.size);
+
+    uint32_t second = TIMERS_GetMilliSeconds();
+    while (1) {
+        if (isBlockReady && !OledIsSwapPending()) {
+            uint32_t start = TIMERS_GetMicroSeconds();
+            Fft_Bands(&fft, block, bands);
+            uint32_t micros = TIMERS_GetMicroSeconds() - start;
+            isBlockReady = FALSE;
+            fftMicros += micros;
+            worstMicros = micros > worstMicros ? micros : worstMicros;
+
+            Spectrum_Draw(bands, TEST_BANDS);
+            OledSwapBuffers(NULL);
+            frames++;
+        }
+        if (TIMERS_GetMilliSeconds() - second >= 1000) {
+            second += 1000;
+            printf("%lu fps, Fft_Bands() %lu us average, %lu us worst\r\n", frames,
+                    frames ? fftMicros / frames : 0, worstMicros);
+            frames = fftMicros = worstMicros = 0;
+        }
+    }
+}
+#endif
@@ -0,0 +1,41 @@
+/*
+ * File:   Spectrum.h
+ * Author: Derrick Lai
+ *
+ * Spectrum analyzer bars for the OLED, drawn from the band levels Fft_Bands() gives.
+ *
+ * Each band gets an equal share of the screen width, one blank column between bars. A bar's height goes
+ * with the level in decibels, 3 dB to the pixel: a full-scale sine from the 12-bit ADC reaches 23 rows of the
+ * 32 and the ADC's own noise stays on the bottom row or two.
+ *
+ * The bars are written straight into rgbOledBmp a whole column byte at a time, a page at a time, rather than
+ * pixel by pixel: a column of a bar is the same in every page it fully covers, so each bar works out at most
+ * one partial byte and copies the rest.
+ *
+ * Created on April 11, 2025
+ */
+
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include <stdint.h>
+#include <Fft.h>
+#include <OledDriver.h>
+
+/**
+ * @function Spectrum_Height(level)
+ * @param level - A band level from Fft_Bands()
+ * @return Bar height in pixels, 2 for every doubling of the level: 0 for 0 and 1 (rounding noise), 2 for 2,
+ *         23 for 4095, never more than OLED_DRIVER_PIXEL_ROWS */
+uint8_t Spectrum_Height(uint16_t level);
+
+/**
+ * @function Spectrum_Draw(bands, numBands)
+ * @param bands - Band levels from Fft_Bands(), lowest band first, drawn left to right
+ * @param numBands - How many, up to FFT_MAX_BANDS
+ * @return None
+ * @brief Replaces the whole screen with the bars and marks it dirty, ready for OledUpdate() or
+ *        OledSwapBuffers() */
+void Spectrum_Draw(const uint16_t *bands, uint8_t numBands);
+
+#endif
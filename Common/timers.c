@@ -20,11 +20,36 @@
 #define SUCCESS ((int8_t) 1)
 #endif
 
+// TIM2 counts microseconds, up to this and back to 0 every tick.
+#define TIMERS_TICK_US 1000
+
+#ifndef TIMERS_SIM_TEST
+#define TIMERS_COUNT() (TIM2->CNT)
+#define TIMERS_IS_TICK_PENDING() (__HAL_TIM_GET_FLAG(&htim2, TIM_FLAG_UPDATE) != RESET)
+#define TIMERS_CYCLES() (DWT->CYCCNT)
+#else
+// The simulation steps its clock at every register read, see TIMERS_SIM_TEST.
+static uint32_t SimCount(void);
+static uint8_t SimIsTickPending(void);
+static uint32_t SimCycles(void);
+#define TIMERS_COUNT() SimCount()
+#define TIMERS_IS_TICK_PENDING() SimIsTickPending()
+#define TIMERS_CYCLES() SimCycles()
+#endif
+
+#ifndef TIMERS_SIM_TEST
 static uint8_t init_status = FALSE;
+#endif
+
+// Written only by the tick interrupt. ms also tells readers a tick happened while they read.
+static volatile uint32_t ms; //millisecond count
+static volatile uint32_t msHigh; //millisecond count, top word
+static volatile uint32_t cyclesHigh; //cycle count at the last tick, top word
+static volatile uint32_t cyclesAtTick; //cycle count at the last tick
 
-static uint32_t us; //microsecond count
-static uint32_t ms; //millisecond count
+static void TIMERS_Tick(void);
 
+#ifndef TIMERS_SIM_TEST
 /**
  * @function TIMER_Init(void)
  * @param None
@@ -52,18 +77,24 @@ char TIMER_Init(void) {
         {
             return ERROR;
         }
-        sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
+        sMasterConfig.MasterOutputTrigger = TIM_TRGO_UPDATE; // TRGO every 1ms, triggers the ADC scans
         sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
         if (HAL_TIMEx_MasterConfigSynchronization(&htim2, &sMasterConfig) != HAL_OK)
         {
             return ERROR;
         }
 
+        // The cycle counter, started from 0 with the clock.
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
         HAL_TIM_Base_Start_IT(&htim2); // start interrupt
         init_status = TRUE;
     }
     return SUCCESS;
 }
+#endif
 
 /**
  * @function TIMERS_GetMilliSeconds(void)
@@ -79,10 +110,95 @@ uint32_t TIMERS_GetMilliSeconds(void) {
  * @function TIMERS_GetMicroSeconds(void)
  * @param None
  * @return current microsecond count
- * @brief ^
+ * @brief The low 32 bits of TIMERS_GetMicroSeconds64()
  * @author Adam Korycki, 2023.09.29 */
 uint32_t TIMERS_GetMicroSeconds(void) {
-    return us + TIM2->CNT; // (ms*1000) + (current value of 1Mhz counter)
+    return (uint32_t) TIMERS_GetMicroSeconds64();
+}
+
+/**
+ * @function TIMERS_GetMicroSeconds64(void)
+ * @param None
+ * @return Microseconds since TIMER_Init(), never goes backwards */
+uint64_t TIMERS_GetMicroSeconds64(void) {
+    uint32_t low, high, count;
+    do {
+        low = ms;
+        high = msHigh;
+        count = TIMERS_COUNT();
+        if (TIMERS_IS_TICK_PENDING()) {
+            // Rolled over and the tick hasn't counted it (count may be from either side), read again after.
+            count = TIMERS_COUNT() + TIMERS_TICK_US;
+        }
+    } while (low != ms); // A tick came in, the words may be from either side of it
+    return ((((uint64_t) high << 32) | low) * TIMERS_TICK_US) + count;
+}
+
+/**
+ * @function TIMERS_GetCycles(void)
+ * @param None
+ * @return CPU clock cycles since TIMER_Init(), never goes backwards */
+uint64_t TIMERS_GetCycles(void) {
+    uint32_t tick, high, last, now;
+    do {
+        tick = ms;
+        now = TIMERS_CYCLES();
+        high = cyclesHigh;
+        last = cyclesAtTick;
+    } while (tick != ms); // A tick came in, the words may be from after now
+    if (now < last) {
+        high++; // Wrapped since the last tick
+    }
+    return ((uint64_t) high << 32) | now;
+}
+
+/**
+ * @function TIMERS_Tick(void)
+ * @param None
+ * @return None
+ * @brief Counts a millisecond and notes the cycle counter, from the TIM2 update interrupt */
+static void TIMERS_Tick(void) {
+    uint32_t cycles = TIMERS_CYCLES();
+    if (cycles < cyclesAtTick) {
+        cyclesHigh++;
+    }
+    cyclesAtTick = cycles;
+    if (++ms == 0) { // Every 49.7 days
+        msHigh++;
+    }
+}
+
+#ifndef TIMERS_SIM_TEST
+/**
+ * @function TIMERS_Sleep(wakeTime)
+ * @param wakeTime - TIMERS_GetMicroSeconds64() time to be up by
+ * @return None
+ * @brief Sleeps the core (WFI) until an interrupt is pending or wakeTime, whichever is first. Call it with
+ *        interrupts off: they stay off, a pending one just ends the sleep, and it runs once the caller turns
+ *        them back on. The tick wakes it every millisecond anyway, a wakeTime inside the current one sets
+ *        TIM2 channel 1 to compare at it so the sleep doesn't run on to the tick. */
+void TIMERS_Sleep(uint64_t wakeTime) {
+    uint64_t now = TIMERS_GetMicroSeconds64();
+    if (wakeTime <= now) {
+        return;
+    }
+    uint32_t wakeCount = (uint32_t) (wakeTime % TIMERS_TICK_US);
+    uint8_t isCompareSet = FALSE, isPast = FALSE;
+    if (wakeTime - now < TIMERS_TICK_US && wakeCount > TIMERS_COUNT()) { // Before the tick rolls the count over
+        __HAL_TIM_SET_COMPARE(&htim2, TIM_CHANNEL_1, wakeCount);
+        __HAL_TIM_CLEAR_FLAG(&htim2, TIM_FLAG_CC1);
+        __HAL_TIM_ENABLE_IT(&htim2, TIM_IT_CC1);
+        isCompareSet = TRUE;
+        isPast = TIMERS_COUNT() >= wakeCount; // Went by while it was set up, there may be no match to wake on
+    }
+    if (!isPast) {
+        __DSB();
+        __WFI();
+    }
+    if (isCompareSet) {
+        __HAL_TIM_DISABLE_IT(&htim2, TIM_IT_CC1);
+        __HAL_TIM_CLEAR_FLAG(&htim2, TIM_FLAG_CC1);
+    }
 }
 
 /**
@@ -98,10 +214,10 @@ uint32_t TIMERS_GetSystemClockFreq(void) {
 /* timer callback */
 void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim) {
     if (htim == &htim2) {
-        ms++;     // update millisecond count
-        us+=1000; // update microsecond count
+        TIMERS_Tick();
     }
 }
+#endif
 
 //#define TIMERS_TEST
 #ifdef TIMERS_TEST // TIMERS TEST HARNESS
@@ -124,4 +240,186 @@ int main(void) {
         HAL_Delay(1);
     }
 }
-#endif
\ No newline at end of file
+#endif
+
+//#define TIMERS_SIM_TEST
+#ifdef TIMERS_SIM_TEST // TIMERS SIMULATED ROLLOVER TEST
+// Runs on a host. TIM2's counter and update flag and the cycle counter are worked out from a simulated CPU
+// clock (84 MHz), which moves on by a set number of cycles at every register read, and the tick "interrupt"
+// (TIMERS_Tick()) runs as soon as a rollover happens, unless the reader has interrupts off: just before the
+// read (so after whatever the reader loaded last) or just after it.
+//   gcc -O2 -I. -DTIMERS_SIM_TEST timers.c -o timers_sim && ./timers_sim
+// Each read is started a cycle later than the last one around a tick, so the rollover lands before, between
+// and after every register read in turn, with and without the interrupt held off. That is done around the
+// first tick, the 32-bit cycle counter wrapping, the old 32-bit microsecond count wrapping (71 minutes) and the
+// 32-bit millisecond count wrapping (49.7 days). Then a random walk over several cycle counter wraps.
+// SUCCESS - every time read lies between the true time at the start and at the end of the read, for both
+// clocks, while the old us + TIM2->CNT read is off by a millisecond for some of the same reads.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SIM_CLOCK_MHZ 84
+#define SIM_TICK_CYCLES ((uint64_t) SIM_CLOCK_MHZ * TIMERS_TICK_US)
+#define SIM_READS 6 // At most as many register reads in one call
+#define SIM_RANDOM_CALLS 2000000
+
+static uint64_t simTime; // True time, in CPU cycles since TIMER_Init()
+static uint64_t simTicks; // Ticks the interrupt has counted
+static uint32_t simStep; // Cycles each register read moves the clock on by
+static uint8_t isMasked;
+static uint8_t isTickBeforeRead; // Else after it
+static uint8_t isInTick;
+
+// Moves the clock on by a read, then the tick interrupt runs if it's due and allowed to.
+static void SimRead(void) {
+    simTime += simStep;
+    while (!isMasked && simTicks < simTime / SIM_TICK_CYCLES) {
+        simTicks++;
+        isInTick = TRUE;
+        TIMERS_Tick();
+        isInTick = FALSE;
+    }
+}
+
+static uint32_t SimCount(void) {
+    if (isTickBeforeRead) {
+        SimRead();
+    }
+    uint32_t count = (uint32_t) ((simTime / SIM_CLOCK_MHZ) % TIMERS_TICK_US);
+    if (!isTickBeforeRead) {
+        SimRead();
+    }
+    return count;
+}
+
+static uint8_t SimIsTickPending(void) {
+    if (isTickBeforeRead) {
+        SimRead();
+    }
+    uint8_t isPending = simTicks < simTime / SIM_TICK_CYCLES;
+    if (!isTickBeforeRead) {
+        SimRead();
+    }
+    return isPending;
+}
+
+static uint32_t SimCycles(void) {
+    if (isInTick) {
+        return (uint32_t) simTime;
+    }
+    if (isTickBeforeRead) {
+        SimRead();
+    }
+    uint32_t cycles = (uint32_t) simTime;
+    if (!isTickBeforeRead) {
+        SimRead();
+    }
+    return cycles;
+}
+
+// Sets the clock to time, with the ticks up to lag cycles ago counted, the tick words as the interrupt left them.
+static void SimStart(uint64_t time, uint64_t lag) {
+    simTime = time;
+    simTicks = (time - lag) / SIM_TICK_CYCLES;
+    ms = (uint32_t) simTicks;
+    msHigh = (uint32_t) (simTicks >> 32);
+    cyclesAtTick = (uint32_t) (simTicks * SIM_TICK_CYCLES);
+    cyclesHigh = (uint32_t) ((simTicks * SIM_TICK_CYCLES) >> 32);
+}
+
+// The read this replaces: the microseconds at the last tick, then the counter.
+static uint32_t OldMicroSeconds(void) {
+    uint32_t us = ms * TIMERS_TICK_US;
+    return us + SimCount();
+}
+
+static unsigned long errors = 0, oldErrors = 0, calls = 0;
+
+// Reads all three clocks (each from time), checks each against the true time during its read.
+static void Check(uint64_t time, uint64_t lag) {
+    uint64_t start;
+
+    SimStart(time, lag);
+    start = simTime;
+    uint64_t micros = TIMERS_GetMicroSeconds64();
+    errors += micros < start / SIM_CLOCK_MHZ || micros > simTime / SIM_CLOCK_MHZ;
+
+    SimStart(time, lag);
+    start = simTime;
+    uint64_t cycles = TIMERS_GetCycles();
+    errors += cycles < start || cycles > simTime;
+
+    SimStart(time, lag);
+    start = simTime;
+    uint32_t old = OldMicroSeconds();
+    oldErrors += old - (uint32_t) (start / SIM_CLOCK_MHZ) > (uint32_t) (simTime / SIM_CLOCK_MHZ - start / SIM_CLOCK_MHZ);
+    calls++;
+}
+
+int main(void) {
+    static const struct {
+        const char *name;
+        uint64_t time;
+    } moments[] = {
+        {"first tick", SIM_TICK_CYCLES},
+        {"cycle counter wrap", 1ULL << 32},
+        {"tick after it", (((1ULL << 32) / SIM_TICK_CYCLES) + 1) * SIM_TICK_CYCLES},
+        {"32-bit us wrap", ((1ULL << 32) / TIMERS_TICK_US + 1) * SIM_TICK_CYCLES},
+        {"32-bit ms wrap", (1ULL << 32) * SIM_TICK_CYCLES},
+    };
+    static const uint32_t steps[] = {1, 13, SIM_CLOCK_MHZ, 1000};
+
+    for (uint8_t m = 0; m < sizeof(moments) / sizeof(moments[0]); m++) {
+        unsigned long before = errors, oldBefore = oldErrors, callsBefore = calls;
+        for (uint8_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+            simStep = steps[s];
+            int64_t span = (int64_t) SIM_READS * simStep;
+            for (int64_t offset = -span; offset <= span; offset++) {
+                for (isTickBeforeRead = FALSE; isTickBeforeRead <= TRUE; isTickBeforeRead++) {
+                    isMasked = FALSE;
+                    Check(moments[m].time + offset, 0);
+                    // Interrupts off for the whole read and a while before it, the tick may be pending already.
+                    isMasked = TRUE;
+                    Check(moments[m].time + offset, span);
+                }
+            }
+        }
+        printf("%-20s %7lu reads: %lu wrong, old us + CNT read %lu wrong\r\n", moments[m].name,
+                calls - callsBefore, errors - before, oldErrors - oldBefore);
+    }
+
+    // Random walk across three cycle counter wraps, reading both clocks at random moments.
+    unsigned int seed = 1;
+    unsigned long walkErrors = 0;
+    uint64_t lastMicros = 0, lastCycles = 0;
+    isMasked = FALSE;
+    simStep = 0;
+    SimStart(0, 0);
+    for (unsigned long i = 0; i < SIM_RANDOM_CALLS; i++) {
+        simStep = 1 + rand_r(&seed) % 200;
+        SimRead(); // Time goes by, the ticks keep up
+        simStep = rand_r(&seed) % 100;
+        isMasked = rand_r(&seed) % 4 == 0;
+        isTickBeforeRead = rand_r(&seed) % 2;
+        uint64_t start = simTime;
+        uint64_t micros = TIMERS_GetMicroSeconds64();
+        uint64_t cycles = TIMERS_GetCycles();
+        walkErrors += micros < start / SIM_CLOCK_MHZ || micros > simTime / SIM_CLOCK_MHZ || micros < lastMicros;
+        walkErrors += cycles < start || cycles > simTime || cycles < lastCycles;
+        lastMicros = micros;
+        lastCycles = cycles;
+        isMasked = FALSE;
+        simStep = 0;
+        SimRead(); // Any tick held off runs now
+        simTime += rand_r(&seed) % 20000;
+    }
+    errors += walkErrors;
+    printf("Random walk: %d reads over %.0f s (%lu cycle counter wraps), %lu wrong\r\n", SIM_RANDOM_CALLS,
+            simTime / (SIM_CLOCK_MHZ * 1e6), (unsigned long) (simTime >> 32), walkErrors);
+
+    int success = errors == 0 && oldErrors > 0;
+    printf("%s\r\n", success ? "SUCCESS" : "ERROR");
+    return !success;
+}
+#endif
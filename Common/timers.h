@@ -3,17 +3,30 @@
  * Author: Adam Korycki
  *
  * Created on September 29, 2023
+ *
+ * TIM2 ticks every millisecond (its update also triggers the ADC scans), the microsecond clock is the tick
+ * count plus TIM2's 1 MHz counter. The tick count is 64 bits, kept as two words the tick interrupt writes,
+ * and a reader takes the words and the counter again if a tick lands while it reads them. If the counter has
+ * rolled over but the tick interrupt hasn't run yet (the reader has interrupts off, or is itself an
+ * interrupt), the pending update flag says so and the reader adds the missing millisecond itself. That works
+ * because TIM2 has the highest interrupt priority: nothing that reads the time can interrupt the tick halfway.
+ *
+ * For finer timing the DWT cycle counter runs from TIMER_Init(), one count per CPU clock (11.9 ns at 84 MHz).
+ * It is 32 bits and wraps every 51 s, so each tick notes where it was and the reader extends it to 64 bits.
+ * Nothing may write DWT->CYCCNT after TIMER_Init(), use differences of TIMERS_GetCycles() instead.
  */
 
 #ifndef TIMERS_H
 #define	TIMERS_H
 
 #include <stdint.h>
+#ifndef TIMERS_SIM_TEST // The simulated rollover test runs on a host, without the HAL.
 #include "stm32f4xx_hal.h"
 #include <stm32f4xx_hal_rcc.h>
 #include <stm32f4xx_hal_tim.h>
 
 TIM_HandleTypeDef htim2;
+#endif
 
 /**
  * @function TIMER_Init(void)
@@ -35,10 +48,35 @@ uint32_t TIMERS_GetMilliSeconds(void);
  * @function TIMERS_GetMicroSeconds(void)
  * @param None
  * @return current microsecond count
- * @brief ^
+ * @brief The low 32 bits of TIMERS_GetMicroSeconds64(), wraps every 71 minutes, fine for differences
+ *        shorter than that
  * @author Adam Korycki, 2023.09.29 */
 uint32_t TIMERS_GetMicroSeconds(void);
 
+/**
+ * @function TIMERS_GetMicroSeconds64(void)
+ * @param None
+ * @return Microseconds since TIMER_Init(), never goes backwards
+ * @brief Safe anywhere, interrupts included, as long as the tick interrupt is never held off for a whole
+ *        millisecond */
+uint64_t TIMERS_GetMicroSeconds64(void);
+
+/**
+ * @function TIMERS_GetCycles(void)
+ * @param None
+ * @return CPU clock cycles since TIMER_Init(), never goes backwards
+ * @brief The DWT cycle counter extended to 64 bits. Safe anywhere, as long as the tick interrupt is never
+ *        held off for 51 s */
+uint64_t TIMERS_GetCycles(void);
+
+/**
+ * @function TIMERS_Sleep(wakeTime)
+ * @param wakeTime - TIMERS_GetMicroSeconds64() time to be up by
+ * @return None
+ * @brief Sleeps the core until an interrupt is pending or wakeTime. Call with interrupts off, they are still
+ *        off after, so nothing that comes in before the sleep is missed by it. The Scheduler_Driver sleep. */
+void TIMERS_Sleep(uint64_t wakeTime);
+
 /**
  * @function TIMERS_GetSystemClockFreq(void)
  * @param None
@@ -15,14 +15,37 @@
  * Libraries
  *****************************************************************************/
 #include <stdint.h>
+#ifndef BLE_SIM // The simulated UART at the end of bluefruit_ble_uart.c stands in for the HAL.
 #include "stm32f4xx_hal.h"
 #include "stm32f4xx_hal_uart.h"
+#else
+typedef enum {
+    HAL_UART_STATE_READY = 0x20,
+    HAL_UART_STATE_BUSY_TX = 0x21,
+    HAL_UART_STATE_BUSY_RX = 0x22
+} HAL_UART_StateTypeDef;
+
+typedef struct {
+    void *Instance;
+    volatile HAL_UART_StateTypeDef gState; // Transmission, BUSY_TX while a DMA transfer is in flight
+    volatile HAL_UART_StateTypeDef RxState; // Reception, BUSY_RX while the DMA is receiving
+} UART_HandleTypeDef;
+#endif
 
 /******************************************************************************
  * Defines
  *****************************************************************************/
 UART_HandleTypeDef huart6; // The UART6 for the Bluetooth Low Energy
 
+// Packet framing, must match protocol.py on the PC
+#define BLE_PACKET_HEAD 0xCC
+#define BLE_PACKET_TAIL 0xB9
+#define BLE_MAX_PAYLOAD_LENGTH 127 // Data bytes after the ID
+#define BLE_PACKET_OVERHEAD 7 // HEAD, LENGTH, ID, TAIL, CHECKSUM, '\r', '\n'
+
+// Called with the ID and the data bytes that followed it, the data is only valid during the call.
+typedef void (*BLE_PacketHandler)(uint8_t id, const uint8_t *payload, uint8_t length);
+
 
 /******************************************************************************
  * Functions
@@ -52,14 +75,83 @@ int8_t BLE_GetChar(unsigned char* data);
  * @author Derrick Lai, 2025.03.09 */
 int8_t BLE_PutChar(uint8_t data);
 
+/**
+ * @Function BLE_SendPacket()
+ * @param id - Message ID (see events.py on the PC)
+ * @param payload - Data bytes that follow the ID, can be NULL if length is 0
+ * @param length - Number of data bytes, at most BLE_MAX_PAYLOAD_LENGTH
+ * @return SUCCESS or ERROR if the TX buffer doesn't have room for the whole packet
+ * @brief  Frames the payload and queues it for transmission, the checksum is computed for you.
+ * @author Derrick Lai, 2025.03.20 */
+int8_t BLE_SendPacket(uint8_t id, const uint8_t *payload, uint8_t length);
+
 /**
  * @Function BLE_RunLoop()
  * @param None
  * @return None
- * @brief  This function should continously runs in a while loop every tick. Necessary to keep the UART running. DO NOT APPLY DELAY, IT MUST RUN CONTINOUSLY.
+ * @brief  Starts sending what BLE_PutChar()/BLE_SendPacket() queued and hands received packets to their handlers.
+ *         It has nothing to do in between, so it doesn't have to run continuously: call it after queueing
+ *         something to send and after the BLE_SetRxCallback() callback reports bytes (a Scheduler task
+ *         signalled from both, see player_tasks.c), or just every pass of a polling loop.
  * @author Derrick Lai, 2025.03.09 */
 void BLE_RunLoop();
 
+/**
+ * @Function BLE_RegisterPacketHandler()
+ * @param id - Packet ID to handle (see events.py on the PC)
+ * @param handler - Called from BLE_RunLoop() for every valid packet with that ID, NULL to unregister
+ * @return SUCCESS or ERROR
+ * @brief  Turns on the packet parser. Once a handler is registered BLE_RunLoop() consumes the received bytes,
+ *         so BLE_GetChar() no longer returns anything.
+ * @author Derrick Lai, 2025.03.20 */
+int8_t BLE_RegisterPacketHandler(uint8_t id, BLE_PacketHandler handler);
+
+/**
+ * @Function BLE_SetRxCallback()
+ * @param callback - Function called with the number of bytes delivered, NULL to disable
+ * @return None
+ * @brief  Registers a callback that is called once per received burst (when the line goes idle). Runs in interrupt context.
+ * @author Derrick Lai, 2025.03.09 */
+void BLE_SetRxCallback(void (*callback)(uint16_t));
 
+/**
+ * @Function BLE_GetRxLostCount()
+ * @param None
+ * @return Number of received bytes dropped because the RX buffer was full
+ * @brief  Used to check whether the main loop keeps up with the incoming data.
+ * @author Derrick Lai, 2025.03.09 */
+uint32_t BLE_GetRxLostCount(void);
+
+#ifdef BLE_SIM
+/* Host builds (gcc -DBLE_SIM): the UART and its DMA are simulated at the end of bluefruit_ble_uart.c, which also
+ * stands in for the board and timer modules. */
+int8_t BOARD_Init(void);
+char TIMER_Init(void);
+
+/**
+ * @Function BLE_SimCompleteTx()
+ * @param None
+ * @return Number of bytes the transfer sent, 0 if none was in flight
+ * @brief  Finishes the DMA transfer in flight: its bytes go out on the simulated wire (read from the TX buffer only
+ *         now, like the DMA does) and HAL_UART_TxCpltCallback() runs. */
+uint16_t BLE_SimCompleteTx(void);
+
+/**
+ * @Function BLE_SimReadWire()
+ * @param data - Where to copy the bytes
+ * @param size - Room in data
+ * @return Number of bytes copied
+ * @brief  Takes the bytes that went out on the simulated wire since the last call, in the order they were sent. */
+uint16_t BLE_SimReadWire(uint8_t *data, uint16_t size);
+
+/**
+ * @Function BLE_SimFailTx()
+ * @param None
+ * @return Number of bytes that went out before the error, 0 if no transfer was in flight
+ * @brief  Ends the DMA transfer in flight halfway with a DMA error, the way the HAL's UART_DMAError does: the
+ *         transmission and the reception are both stopped and HAL_UART_ErrorCallback() runs instead of
+ *         HAL_UART_TxCpltCallback(). */
+uint16_t BLE_SimFailTx(void);
+#endif
 
 #endif
\ No newline at end of file
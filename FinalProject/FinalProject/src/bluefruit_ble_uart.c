@@ -18,9 +18,14 @@
 /******************************************************************************
  * User Libraries
  *****************************************************************************/
+#ifndef BLE_SIM // The simulated UART at the end of this file stands in for the board.
 #include "Board.h"
 #include "leds.h"
 #include "timers.h"
+#endif
+#include "CircularBuffer.h"
+#include "Checksum.h"
+#include "Profile.h"
 #include "bluefruit_ble_uart.h"
 
 /******************************************************************************
@@ -43,38 +48,122 @@
 #define SUCCESS ((int8_t) 1)
 #endif
 
-#define BUFFER_SIZE 16
+#define TX_BUFFER_SIZE 256 // Must be a power of two, large enough for a full packet (BLE_MAX_PAYLOAD_LENGTH + BLE_PACKET_OVERHEAD)
+#define RX_BUFFER_SIZE 256 // Must be a power of two, at least BLE_RX_DMA_SIZE so a whole burst fits
 #define BLE_BAUD_RATE 9600 // Baud rate, always 9600 for Bluefruit
 
+// DMA mapping for USART6 TX (RM0383 Table 28: DMA2 request mapping)
+#define BLE_TX_DMA_STREAM DMA2_Stream6
+#define BLE_TX_DMA_CHANNEL DMA_CHANNEL_5
+#define BLE_TX_DMA_IRQn DMA2_Stream6_IRQn
+
+// DMA mapping for USART6 RX, it runs in circular mode and never stops
+#define BLE_RX_DMA_STREAM DMA2_Stream1
+#define BLE_RX_DMA_CHANNEL DMA_CHANNEL_5
+#define BLE_RX_DMA_IRQn DMA2_Stream1_IRQn
+#define BLE_RX_DMA_SIZE 64 // Landing area for the DMA, bytes are moved into rx_buffer on every idle line
+
+#ifdef BLE_SIM
+// Mock HAL, the parts of it this file uses (see BLE_SIM at the end of the file)
+typedef enum {
+    HAL_OK,
+    HAL_ERROR,
+    HAL_BUSY,
+    HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef struct {
+    volatile uint32_t Counter; // NDTR, the bytes left before the end of the buffer
+} DMA_HandleTypeDef;
+
+#define USART6 ((void *) 0x40011400UL)
+#define DMA_IT_HT 0x08
+#define __HAL_DMA_DISABLE_IT(handle, interrupt)
+#define __HAL_DMA_GET_COUNTER(handle) ((handle)->Counter)
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart);
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+#endif
+
 /******************************************************************************
  * Privates
  *****************************************************************************/
 static uint8_t global_ble_uart_status = FALSE; // Initialization status of the BLE UART.
 
-// Initially both TRUE so that buffers have time to fill. Except for RX, it will run as it will just wait for an incoming character.
-static uint8_t is_tx_buffer_yielded = TRUE; // If the buffer is full, the callback won't continue to call the function to fill the buffer.
-static uint8_t is_rx_buffer_yielded = TRUE;
-static uint8_t tx_char, rx_char; // Used to hold the characters loaded from either the buffers or registers.
+// Initially TRUE so that the buffer has time to fill.
+static volatile uint8_t is_tx_buffer_yielded = TRUE; // If the buffer is full, the callback won't continue to call the function to fill the buffer.
+static uint16_t tx_span_length = 0; // Number of bytes handed to the DMA for the transmission currently in flight.
+static uint32_t tx_transfer_count = 0; // Number of HAL transmit calls made, used to measure the cost per packet.
 
-typedef struct CircularBuffer {
-    char data[BUFFER_SIZE]; // Starting address of the buffer
-    int tail; // Where to write to the buffer
-    int head; // Where to read from the buffer
-    int full; // Whether if the buffer is full.
-    int empty; // Whether if the buffer is empty
-}CircularBuffer;
+#ifndef BLE_SIM
+static DMA_HandleTypeDef hdma_usart6_tx; // DMA stream that drains the TX buffer into the USART6 data register.
+#endif
+static DMA_HandleTypeDef hdma_usart6_rx; // DMA stream that fills rx_dma_buffer from the USART6 data register.
 
+static uint8_t rx_dma_buffer[BLE_RX_DMA_SIZE]; // Written by the DMA in a circle, read up to the DMA position on every RX event.
+static uint16_t rx_dma_position = 0; // Where the last RX event left off in rx_dma_buffer.
+static uint32_t rx_lost_count = 0; // Bytes dropped because rx_buffer was full when they arrived.
+static void (*rx_callback)(uint16_t) = NULL; // Called once per received burst with the number of bytes delivered.
 
-struct CircularBuffer tx_buffer;
-struct CircularBuffer rx_buffer;
+/*
+Packet parser, the same state machine as Protocol.__update_fsm on the PC.
+AWAIT_HEAD - Checks for the head byte to begin packet building.
+AWAIT_LENGTH - Wait for the next byte, assuming its the length (ID + data).
+AWAIT_ID - The first byte of the payload is the ID.
+AWAIT_PAYLOAD - Takes data bytes until LENGTH bytes of payload have been received.
+AWAIT_TAIL - The byte right after the payload has to be the tail.
+AWAIT_CHKSUM - Waits for the checksum to compare with the computed checksum.
+AWAIT_END_RC - Waits for the return carriage '\r' in the first part to signify the end of transmission.
+AWAIT_END_NL - Waits for the newline '\n' as the final part, then the packet is handed to its handler.
+Unlike the PC, the payload is bounded by LENGTH instead of ending at the first tail byte, so data bytes equal to 0xB9 are fine.
+*/
+typedef enum {
+    AWAIT_HEAD,
+    AWAIT_LENGTH,
+    AWAIT_ID,
+    AWAIT_PAYLOAD,
+    AWAIT_TAIL,
+    AWAIT_CHKSUM,
+    AWAIT_END_RC,
+    AWAIT_END_NL
+} PacketStates;
+
+static struct {
+    PacketStates state;
+    uint8_t length; // Payload length from the LENGTH byte (ID + data)
+    uint8_t id;
+    uint8_t count; // Data bytes received so far
+    uint8_t checksum; // Running checksum of the ID and data
+    uint8_t data[BLE_MAX_PAYLOAD_LENGTH];
+} parser = {AWAIT_HEAD};
+
+static BLE_PacketHandler packet_handlers[256]; // Indexed by packet ID, NULL if nobody registered for that ID
+static uint8_t is_parser_enabled = FALSE; // Set once a handler is registered, from then on the parser owns rx_buffer
+static uint32_t packet_count = 0; // Packets that passed every check
+static uint32_t packet_error_count = 0; // Frames dropped for a bad length, tail, checksum or end bytes
+
+// TX: written by the main loop, read by the DMA/TxCplt interrupt. RX: written by the RX interrupt, read by the main loop.
+CIRCULAR_BUFFER_DEFINE(tx_buffer, TX_BUFFER_SIZE);
+CIRCULAR_BUFFER_DEFINE(rx_buffer, RX_BUFFER_SIZE);
+
+// Profiling zones, empty unless built with PROFILE_ENABLED (see Profile.h).
+PROFILE_ZONE(runLoopZone, "BLE_RunLoop");
+PROFILE_ZONE(rxEventZone, "HAL_UARTEx_RxEventCallback");
 
 
 uint8_t led_count = 0;
 /******************************************************************************
  * Declarations
  *****************************************************************************/
-uint8_t ReadFromBuffer(struct CircularBuffer *buffer, uint8_t *data);
-uint8_t WriteToBuffer(struct CircularBuffer *buffer, uint8_t data);
+static void BLE_StartTxSpan(void);
+static void BLE_ParseBytes(const uint8_t *data, uint16_t length);
+static void BLE_ReleaseTxSpan(void);
+static int8_t BLE_StartRxDMA(void);
+static void BLE_ProcessRxDMA(uint16_t position);
 
 /******************************************************************************
  * Main
@@ -94,6 +183,7 @@ int8_t BLE_UART_Init() {
     // Initialize the properties for the UART6
     // You have to set 'huart6'? Is this because the 'stm32f4xx_it.c' file declared this UART6?
     huart6.Instance = USART6;
+#ifndef BLE_SIM // The simulated UART needs no setting up.
     huart6.Init.BaudRate = BLE_BAUD_RATE;
     huart6.Init.WordLength = UART_WORDLENGTH_8B;
     huart6.Init.StopBits = UART_STOPBITS_1;
@@ -102,12 +192,49 @@ int8_t BLE_UART_Init() {
     huart6.Init.HwFlowCtl = UART_HWCONTROL_CTS; // CTS control is present for the Bluefruit
     huart6.Init.OverSampling = UART_OVERSAMPLING_16;
 
-    // Interrupts
-    __HAL_UART_ENABLE_IT(&huart6, UART_IT_RXNE); // Enable Receive interrupt
-    __HAL_UART_ENABLE_IT(&huart6, UART_IT_TC);   // Enable Transmit complete interrupt
-    
-    // Priorities
-    HAL_NVIC_SetPriority(USART6_IRQn, 5, 0);
+    // DMA for transmission, each contiguous span of the TX buffer is sent with a single transfer
+    __HAL_RCC_DMA2_CLK_ENABLE();
+    hdma_usart6_tx.Instance = BLE_TX_DMA_STREAM;
+    hdma_usart6_tx.Init.Channel = BLE_TX_DMA_CHANNEL;
+    hdma_usart6_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_usart6_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart6_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart6_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart6_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart6_tx.Init.Mode = DMA_NORMAL;
+    hdma_usart6_tx.Init.Priority = DMA_PRIORITY_LOW;
+    hdma_usart6_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_usart6_tx) != HAL_OK) {
+        return ERROR;
+    }
+    __HAL_LINKDMA(&huart6, hdmatx, hdma_usart6_tx);
+
+    // The levels are subpriorities: HAL_MspInit() sets NVIC_PRIORITYGROUP_0, where the preemption argument is ignored.
+    HAL_NVIC_SetPriority(BLE_TX_DMA_IRQn, 0, 5);
+    HAL_NVIC_EnableIRQ(BLE_TX_DMA_IRQn);
+
+    // DMA for reception, circular so that the whole burst lands in memory without a per-byte interrupt
+    hdma_usart6_rx.Instance = BLE_RX_DMA_STREAM;
+    hdma_usart6_rx.Init.Channel = BLE_RX_DMA_CHANNEL;
+    hdma_usart6_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_usart6_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart6_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart6_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart6_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart6_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_usart6_rx.Init.Priority = DMA_PRIORITY_HIGH;
+    hdma_usart6_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_usart6_rx) != HAL_OK) {
+        return ERROR;
+    }
+    __HAL_LINKDMA(&huart6, hdmarx, hdma_usart6_rx);
+
+    HAL_NVIC_SetPriority(BLE_RX_DMA_IRQn, 0, 5);
+    HAL_NVIC_EnableIRQ(BLE_RX_DMA_IRQn);
+
+    // The USART6 interrupt only carries the idle line, the end of a transmission and errors: the HAL turns IDLEIE and
+    // TCIE on and off itself for the DMA transfers. RXNE stays off, a per-byte interrupt would race the RX DMA for DR.
+    HAL_NVIC_SetPriority(USART6_IRQn, 0, 5);
     HAL_NVIC_EnableIRQ(USART6_IRQn);
 
 
@@ -115,28 +242,17 @@ int8_t BLE_UART_Init() {
     if (HAL_UART_Init(&huart6) != HAL_OK) {
         return ERROR;
     }
+#endif
 
     // Update new status
     global_ble_uart_status = TRUE;
 
     // Initialize the circular buffers
-    // Transmit buffer
-    tx_buffer.tail = 0;
-    tx_buffer.head = 0;
-    tx_buffer.empty = 1;
-    tx_buffer.full = 0;
-
-    // Receive buffer
-    rx_buffer.tail = 0;
-    rx_buffer.head = 0;
-    rx_buffer.empty = 1;
-    rx_buffer.full = 0;
-
-    // Call the initial transmit and receiver functions
-    // HAL_UART_Transmit_IT(&huart6, &tx_char, 1);
-    // HAL_UART_Receive_IT(&huart6, &rx_char, 1);
+    CircularBuffer_Reset(&tx_buffer);
+    CircularBuffer_Reset(&rx_buffer);
 
-    return SUCCESS;
+    // Start the reception, it keeps running in the background from now on.
+    return BLE_StartRxDMA();
 }
 
 // PutChar for sending packets (transmissions), GetChar for receiving packets for state machine.
@@ -148,19 +264,13 @@ int8_t BLE_UART_Init() {
  * @author Derrick Lai, 2025.03.09 */
 int8_t BLE_GetChar(unsigned char* data) {
 
-    // If the RX buffer is empty, then return ERROR as nothing can be retrieved.
-    if (rx_buffer.empty) {
-        return ERROR;
-    }
-
     // If the data is null, return ERROR
     if (data == NULL) {
         return ERROR;
     }
 
-    // Read from the RX buffer
-    ReadFromBuffer(&rx_buffer, data);
-    return SUCCESS;
+    // Read from the RX buffer, ERROR if it is empty as nothing can be retrieved.
+    return CircularBuffer_Get(&rx_buffer, data);
 }
 
 /**
@@ -171,15 +281,64 @@ int8_t BLE_GetChar(unsigned char* data) {
  * @author Derrick Lai, 2025.03.09 */
 int8_t BLE_PutChar(uint8_t data) {
 
-    // If the TX buffer is full, then return error
-    if (tx_buffer.full) {
+    // Put the character into the transmit buffer, ERROR if it is full
+    return CircularBuffer_Put(&tx_buffer, data);
+}
+
+/**
+ * @Function BLE_SendPacket()
+ * @param id - Message ID, the first byte of the payload
+ * @param payload - Data bytes that follow the ID, can be NULL if length is 0
+ * @param length - Number of data bytes, at most BLE_MAX_PAYLOAD_LENGTH
+ * @return SUCCESS or ERROR
+ * @brief  Builds a full packet (HEAD, LENGTH, ID, payload, TAIL, CHECKSUM, \r\n) directly in the TX buffer.
+ *         The space is reserved up front and the frame is only published once it is complete, so a full buffer
+ *         returns ERROR without ever putting half a frame on the wire.
+ * @author Derrick Lai, 2025.03.20 */
+int8_t BLE_SendPacket(uint8_t id, const uint8_t *payload, uint8_t length) {
+
+    // Invalid payloads can't be framed
+    if (length > BLE_MAX_PAYLOAD_LENGTH || (length > 0 && payload == NULL)) {
         return ERROR;
     }
 
-    // Put the character into the transmit buffer
-    WriteToBuffer(&tx_buffer, data);
-
+    // Reserve room for the entire frame, otherwise don't send any of it
+    uint16_t frame_length = length + BLE_PACKET_OVERHEAD;
+    if (CircularBuffer_Free(&tx_buffer) < frame_length) {
+        return ERROR;
+    }
 
+    // The free space is at most two spans, the one up to the end of the array and the one at the start of it.
+    uint8_t *span;
+    uint16_t span_length = CircularBuffer_WriteSpan(&tx_buffer, &span);
+    if (span_length >= frame_length) {
+        span_length = frame_length;
+    }
+    uint8_t *wrapped = tx_buffer.data;
+
+    // Copy the frame in, computing the checksum along the way (the ID is part of the checksum).
+    uint16_t index = 0;
+    uint8_t checksum = CHECKSUM_UPDATE(0, id);
+#define BLE_STAGE(byte) do { \
+        if (index < span_length) { span[index] = (byte); } else { wrapped[index - span_length] = (byte); } \
+        index++; \
+    } while (0)
+
+    BLE_STAGE(BLE_PACKET_HEAD);
+    BLE_STAGE(length + 1);
+    BLE_STAGE(id);
+    for (uint8_t i = 0; i < length; i++) {
+        BLE_STAGE(payload[i]);
+        checksum = CHECKSUM_UPDATE(checksum, payload[i]);
+    }
+    BLE_STAGE(BLE_PACKET_TAIL);
+    BLE_STAGE(checksum);
+    BLE_STAGE('\r');
+    BLE_STAGE('\n');
+#undef BLE_STAGE
+
+    // Publish the whole frame at once.
+    CircularBuffer_CommitWrite(&tx_buffer, frame_length);
     return SUCCESS;
 }
 
@@ -187,22 +346,67 @@ int8_t BLE_PutChar(uint8_t data) {
  * @Function BLE_RunLoop()
  * @param None
  * @return None
- * @brief  This function should continously runs in a while loop every tick. Necessary to keep the UART running. DO NOT APPLY DELAY, IT MUST RUN CONTINOUSLY.
+ * @brief  Starts sending what BLE_PutChar()/BLE_SendPacket() queued and hands received packets to their handlers.
+ *         It has nothing to do in between, so it doesn't have to run continuously: call it after queueing
+ *         something to send and after the BLE_SetRxCallback() callback reports bytes (a Scheduler task
+ *         signalled from both, see player_tasks.c), or just every pass of a polling loop.
  * @author Derrick Lai, 2025.03.09 */
 void BLE_RunLoop() {
+    PROFILE_BEGIN(runLoopZone);
 
     // If the transmit yield flag is raised, then check if the buffer is still empty. If it isn't, unraise the flag and begin a transmission.
-    if (is_tx_buffer_yielded && !tx_buffer.empty) {
+    if (is_tx_buffer_yielded && CircularBuffer_Count(&tx_buffer) > 0) {
         is_tx_buffer_yielded = FALSE;
-        ReadFromBuffer(&tx_buffer, &tx_char);
-        HAL_UART_Transmit_IT(&huart6, &tx_char, 1);
+        BLE_StartTxSpan();
     }
 
-    // If the receive yield flag is raised, then check to see if the buffer is still full, if it isn't then unraise the flag and begin the reception process.
-    if (is_rx_buffer_yielded && !rx_buffer.full) {
-        is_rx_buffer_yielded = FALSE;
-        HAL_UART_Receive_IT(&huart6, &rx_char, 1);
+    // Feed the packet parser straight from the RX buffer, one contiguous span at a time.
+    if (is_parser_enabled) {
+        uint8_t *span;
+        uint16_t span_length;
+        while ((span_length = CircularBuffer_ReadSpan(&rx_buffer, &span)) > 0) {
+            BLE_ParseBytes(span, span_length);
+            CircularBuffer_ConsumeRead(&rx_buffer, span_length);
+        }
     }
+    PROFILE_END(runLoopZone);
+}
+
+/**
+ * @Function BLE_RegisterPacketHandler()
+ * @param id - Packet ID to handle
+ * @param handler - Called from BLE_RunLoop() with every valid packet carrying that ID, NULL to unregister
+ * @return SUCCESS or ERROR
+ * @brief  Registering the first handler turns on the packet parser. From then on BLE_RunLoop() consumes the
+ *         RX buffer itself, so BLE_GetChar() won't return anything.
+ * @author Derrick Lai, 2025.03.20 */
+int8_t BLE_RegisterPacketHandler(uint8_t id, BLE_PacketHandler handler) {
+    packet_handlers[id] = handler;
+    if (handler != NULL) {
+        is_parser_enabled = TRUE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * @Function BLE_SetRxCallback()
+ * @param callback - Function called from the interrupt with the number of bytes delivered, NULL to disable
+ * @return None
+ * @brief  Registers a callback for received bursts. It is called once per idle line (end of a frame), not per byte.
+ *         It runs in interrupt context, so keep it short and read the bytes with BLE_GetChar() from the main loop.
+ * @author Derrick Lai, 2025.03.09 */
+void BLE_SetRxCallback(void (*callback)(uint16_t)) {
+    rx_callback = callback;
+}
+
+/**
+ * @Function BLE_GetRxLostCount()
+ * @param None
+ * @return Number of received bytes that were dropped
+ * @brief  Bytes are dropped when they arrive while the RX buffer is full, the main loop isn't calling BLE_GetChar() fast enough.
+ * @author Derrick Lai, 2025.03.09 */
+uint32_t BLE_GetRxLostCount(void) {
+    return rx_lost_count;
 }
 
  /******************************************************************************
@@ -210,61 +414,169 @@ void BLE_RunLoop() {
  *****************************************************************************/
 
 /**
- * @Function ReadFromBuffer()
+ * @Function BLE_StartTxSpan()
  * @param None
- * @return SUCCESS or ERROR
- * @brief  Reads a character from the buffer
+ * @return None
+ * @brief  Hands the contiguous run of bytes from the head of the TX buffer to the DMA. If the data wraps around
+ *         the end of the array, only the part up to the end is sent, the rest goes out on the next transfer.
+ *         The head is not moved until the transfer completes, so the writer can't overwrite bytes in flight.
  * @author Derrick Lai, 2025.03.09 */
-uint8_t ReadFromBuffer(struct CircularBuffer *buffer, uint8_t *data) {
-
-    // If the buffer is empty, then nothing can be read, return ERROR
-    if (buffer->empty) {
-        return ERROR;
+static void BLE_StartTxSpan(void) {
+    uint8_t *span;
+
+    // The length is only recorded once the transfer is running, HAL_UART_ErrorCallback() takes a span that is
+    // recorded while the UART isn't transmitting for one that was aborted. The completion can't come first, the
+    // first byte alone takes over a millisecond at 9600 baud.
+    uint16_t length = CircularBuffer_ReadSpan(&tx_buffer, &span);
+    tx_transfer_count++;
+    if (HAL_UART_Transmit_DMA(&huart6, span, length) == HAL_OK) {
+        tx_span_length = length;
+    } else {
+        is_tx_buffer_yielded = TRUE; // BLE_RunLoop() tries again
     }
+}
 
-    // Otherwise, read the value from the buffer and set to the data pointer.
-    *data = buffer->data[buffer->head];
-
-    // Increment the head and update new value
-    buffer->head = (buffer->head + 1) % BUFFER_SIZE;
-
-    // If the buffer is now empty (head and tail equal), set the status
-    buffer->empty = (buffer->head == buffer->tail);
-
-    // Set buffer full status to 0 (you can't read from an empty buffer)
-    buffer->full = 0;
-
-    //  Return status
-    return SUCCESS;
+/**
+ * @Function BLE_ParseBytes()
+ * @param data - Received bytes
+ * @param length - Number of bytes
+ * @return None
+ * @brief  Runs the bytes through the packet state machine. Whenever a frame fails a check it is dropped and the
+ *         parser goes back to waiting for a head byte.
+ * @author Derrick Lai, 2025.03.20 */
+static void BLE_ParseBytes(const uint8_t *data, uint16_t length) {
+    for (uint16_t i = 0; i < length; i++) {
+        uint8_t char_byte = data[i];
+
+        switch (parser.state) {
+            case AWAIT_HEAD:
+                if (char_byte == BLE_PACKET_HEAD) {
+                    parser.state = AWAIT_LENGTH;
+                }
+                break;
+
+            case AWAIT_LENGTH:
+                // The payload holds at least the ID, and no more than the ID plus BLE_MAX_PAYLOAD_LENGTH bytes.
+                if (char_byte == 0 || char_byte > BLE_MAX_PAYLOAD_LENGTH + 1) {
+                    packet_error_count++;
+                    parser.state = AWAIT_HEAD;
+                    break;
+                }
+                parser.length = char_byte;
+                parser.state = AWAIT_ID;
+                break;
+
+            case AWAIT_ID:
+                parser.id = char_byte;
+                parser.count = 0;
+                parser.checksum = CHECKSUM_UPDATE(0, char_byte);
+                parser.state = (parser.length == 1) ? AWAIT_TAIL : AWAIT_PAYLOAD;
+                break;
+
+            case AWAIT_PAYLOAD: {
+                // Copy as much of the payload as this call has in one go, then checksum the whole span.
+                uint16_t needed = (parser.length - 1) - parser.count;
+                uint16_t available = length - i;
+                uint16_t take = (needed < available) ? needed : available;
+                memcpy(&parser.data[parser.count], &data[i], take);
+                parser.checksum = Checksum_Compute(&data[i], take, parser.checksum);
+                parser.count += take;
+                i += take - 1;
+                if (parser.count == parser.length - 1) {
+                    parser.state = AWAIT_TAIL;
+                }
+                break;
+            }
+
+            case AWAIT_TAIL:
+                parser.state = (char_byte == BLE_PACKET_TAIL) ? AWAIT_CHKSUM : AWAIT_HEAD;
+                packet_error_count += (parser.state == AWAIT_HEAD);
+                break;
+
+            case AWAIT_CHKSUM:
+                parser.state = (char_byte == parser.checksum) ? AWAIT_END_RC : AWAIT_HEAD;
+                packet_error_count += (parser.state == AWAIT_HEAD);
+                break;
+
+            case AWAIT_END_RC:
+                parser.state = (char_byte == '\r') ? AWAIT_END_NL : AWAIT_HEAD;
+                packet_error_count += (parser.state == AWAIT_HEAD);
+                break;
+
+            case AWAIT_END_NL:
+                // In every case, transition will be directly back to the head
+                parser.state = AWAIT_HEAD;
+                if (char_byte != '\n') {
+                    packet_error_count++;
+                    break;
+                }
+                packet_count++;
+                if (packet_handlers[parser.id] != NULL) {
+                    packet_handlers[parser.id](parser.id, parser.data, parser.count);
+                }
+                break;
+        }
+    }
 }
 
 /**
- * @Function WriteToBuffer()
+ * @Function BLE_StartRxDMA()
  * @param None
  * @return SUCCESS or ERROR
- * @brief  Reads a character from the buffer
+ * @brief  Starts the circular DMA reception with the idle line interrupt. The half transfer interrupt is turned off
+ *         so that a frame is only reported once the line goes idle (or the DMA wraps around).
  * @author Derrick Lai, 2025.03.09 */
-uint8_t WriteToBuffer(struct CircularBuffer *buffer, uint8_t data) {
-
-    // If the buffer is full, then return an ERROR
-    if (buffer->full) {
+static int8_t BLE_StartRxDMA(void) {
+    rx_dma_position = 0;
+    if (HAL_UARTEx_ReceiveToIdle_DMA(&huart6, rx_dma_buffer, BLE_RX_DMA_SIZE) != HAL_OK) {
         return ERROR;
     }
-    
-    // Write to the tail
-    buffer->data[buffer->tail] = data;
+    __HAL_DMA_DISABLE_IT(&hdma_usart6_rx, DMA_IT_HT);
+    return SUCCESS;
+}
 
-    // Increment the tail
-    buffer->tail = (buffer->tail + 1) % BUFFER_SIZE;
+/**
+ * @Function BLE_ProcessRxDMA()
+ * @param position - Where the DMA write pointer is in rx_dma_buffer (0 to BLE_RX_DMA_SIZE)
+ * @return None
+ * @brief  Moves everything between the last position and the DMA write pointer into the RX buffer, then notifies the app.
+ * @author Derrick Lai, 2025.03.09 */
+static void BLE_ProcessRxDMA(uint16_t position) {
+    uint16_t delivered = 0;
+
+    // The write pointer only moves forward, so if it is behind the last position the DMA wrapped around.
+    // Copy up to the end of the DMA buffer first, then from the start up to the write pointer.
+    if (position < rx_dma_position) {
+        uint16_t length = BLE_RX_DMA_SIZE - rx_dma_position;
+        uint16_t written = CircularBuffer_Write(&rx_buffer, &rx_dma_buffer[rx_dma_position], length);
+        delivered += written;
+        rx_lost_count += length - written;
+        rx_dma_position = 0;
+    }
+    if (position > rx_dma_position) {
+        uint16_t length = position - rx_dma_position;
+        uint16_t written = CircularBuffer_Write(&rx_buffer, &rx_dma_buffer[rx_dma_position], length);
+        delivered += written;
+        rx_lost_count += length - written;
+    }
 
-    // Check if the buffer is full (if head and tail are equal, which means we've circled back).
-    buffer->full = (buffer->head == buffer->tail);
+    // The DMA reports the end of the buffer as BLE_RX_DMA_SIZE, which is where it circles back to 0.
+    rx_dma_position = (position == BLE_RX_DMA_SIZE) ? 0 : position;
 
-    // Set buffer empty status to 0 (you can't be empty after just writing to it)
-    buffer->empty = 0;
+    if (rx_callback != NULL && delivered > 0) {
+        rx_callback(delivered);
+    }
+}
 
-    // Return status
-    return SUCCESS;
+/**
+ * @Function BLE_ReleaseTxSpan()
+ * @param None
+ * @return None
+ * @brief  Frees the bytes of the last DMA transfer from the TX buffer by moving the head past them.
+ * @author Derrick Lai, 2025.03.09 */
+static void BLE_ReleaseTxSpan(void) {
+    CircularBuffer_ConsumeRead(&tx_buffer, tx_span_length);
+    tx_span_length = 0;
 }
 
  /******************************************************************************
@@ -278,7 +590,18 @@ uint8_t WriteToBuffer(struct CircularBuffer *buffer, uint8_t data) {
 //     HAL_UART_IRQHandler(&huart6);
 // }
 
-// This callback is triggered when a character has been successfully transmitted by a HAL_UART_Transmit_IT() call.
+// The DMA streams are private to this library, so their handlers live here instead of stm32f4xx_it.c
+#ifndef BLE_SIM // The simulated DMA calls the callbacks below itself.
+void DMA2_Stream6_IRQHandler(void) {
+    HAL_DMA_IRQHandler(&hdma_usart6_tx);
+}
+
+void DMA2_Stream1_IRQHandler(void) {
+    HAL_DMA_IRQHandler(&hdma_usart6_rx);
+}
+#endif
+
+// This callback is triggered when a span of the TX buffer has been successfully transmitted by a HAL_UART_Transmit_DMA() call.
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
 
     // Only run the callback if it applies for the UART6
@@ -286,42 +609,64 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
         return;
     }
 
-    // After transmitting a character, we want to keep transmitting until the tx_buffer has nothing left to transmit.
+    // The span that was just sent can now be released from the buffer.
+    BLE_ReleaseTxSpan();
+
+    // After transmitting a span, we want to keep transmitting until the tx_buffer has nothing left to transmit.
     // If the buffer is empty, there are no characters to transmit, we have to wait until there is.
-    if (tx_buffer.empty) {
+    if (CircularBuffer_Count(&tx_buffer) == 0) {
         is_tx_buffer_yielded = TRUE;
 
     } else {
-        // If the tx_buffer is not empty, then read from it, and transfer that character.
-        ReadFromBuffer(&tx_buffer, &tx_char);
-        HAL_UART_Transmit_IT(&huart6, &tx_char, 1); // Send the characater as a pointer, the size is just 1 byte.
-        //led_count++;
+        // If the tx_buffer is not empty, then send the next contiguous span (this is the part after a wraparound).
+        BLE_StartTxSpan();
     }
 }
 
-// This callback is triggered when a character has been successfully received by a HAL_UART_Receive_IT() call.
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
+// This callback is triggered by HAL_UARTEx_ReceiveToIdle_DMA() when the line goes idle or the DMA wraps around.
+// Size is the position of the DMA write pointer in rx_dma_buffer, not the number of new bytes.
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size) {
 
     // Only run the callback if it applies for the UART6
     if (huart->Instance != USART6) {
         return;
     }
 
-    // After a character has been received, we want to place it into the receive buffer to future processing.
-    WriteToBuffer(&rx_buffer, rx_char);
+    PROFILE_BEGIN(rxEventZone);
+    BLE_ProcessRxDMA(Size);
+    PROFILE_END(rxEventZone);
+}
 
-    // If the receive buffer is full after placing that character, we will have to take in characters later, raise the flag to do so.
-    if (rx_buffer.full) {
-        is_rx_buffer_yielded = TRUE;
-    } else {
-        // Otherwise, if there is still space, continue the process by reading a character from the receive buffer.
-        HAL_UART_Receive_IT(&huart6, &rx_char, 1); // I think since it assumes the message is an array, we have to convert the unsigned char to a pointer.
+// This callback is triggered on overrun/noise/framing errors and DMA errors. HAL aborts the reception when that happens,
+// and a DMA error (UART_DMAError) ends the transmission as well, without calling HAL_UART_TxCpltCallback().
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+
+    // Only run the callback if it applies for the UART6
+    if (huart->Instance != USART6) {
+        return;
+    }
+
+    // A span still in flight while the UART isn't transmitting was aborted. Release it (the bytes are dropped, the
+    // PC's parser throws the broken frame away) and let BLE_RunLoop() start on what comes after it.
+    if (huart->gState != HAL_UART_STATE_BUSY_TX && tx_span_length > 0) {
+        BLE_ReleaseTxSpan();
+        is_tx_buffer_yielded = TRUE;
+    }
+
+    // Deliver what the DMA wrote since the last RX event before starting over at the start of rx_dma_buffer. After a
+    // DMA error on the TX stream the RX stream is still running, it has to be stopped before it can be started again.
+    if (huart->RxState != HAL_UART_STATE_BUSY_RX) {
+        BLE_ProcessRxDMA(BLE_RX_DMA_SIZE - __HAL_DMA_GET_COUNTER(&hdma_usart6_rx));
+        HAL_UART_AbortReceive(huart);
+        BLE_StartRxDMA();
     }
 }
 
 /*
+HAL_UART_Transmit_DMA(UART6, Message To Send, Message Size) -> The DMA copies the whole message into the TRANSMIT REGISTER, TxCplt Callback is called once at the end.
 HAL_UART_Transmit_IT(UART6, Message To Send, Message Size) -> This sends the message into the TRANSMIT REGISTER, after the entire message is sent TxCplt Callback is called.
 HAL_UART_Receive_IT(UART6, Message Holder, Messasge Size) -> This takes bytes from the RECEIVE REGISTER and fills up the Message Holder for however long Message Size is.
+HAL_UARTEx_ReceiveToIdle_DMA(UART6, Message Holder, Message Size) -> The DMA fills up the Message Holder in a circle, RxEvent Callback is called when the line goes idle.
 */
 
 /******************************************************************************
@@ -391,4 +736,692 @@ int main() {
     return 1;
 }
 
-#endif
\ No newline at end of file
+#endif
+
+//#define BLE_TX_DMA_TEST
+#ifdef BLE_TX_DMA_TEST
+// Sends numbered packets one at a time so that they walk around the TX buffer, then fills the whole buffer while a
+// transfer is in flight. Runs on the board, or on a host against the simulated UART at the end of this file:
+//   gcc -O2 -Wall -I../include -I../../../Common -DBLE_SIM -DBLE_TX_DMA_TEST bluefruit_ble_uart.c
+//       ../../../Common/CircularBuffer.c ../../../Common/Checksum.c -o ble_tx_dma && ./ble_tx_dma
+// SUCCESS - every packet goes out in one HAL transmit call, two when it wraps around the end of the TX buffer, and
+// the full buffer in at most three. On the host the bytes on the wire also have to be the ones queued, in order, and
+// after a DMA error in the middle of a transfer the rest of the buffer still goes out.
+#define TX_PACKETS 60 // Walks around the TX buffer more than twice
+#define TX_PACKET_LENGTH 11
+#define TX_DRAIN_LIMIT 1000 // Passes of the loop before a transfer that never finishes counts as a failure
+
+static int errors = 0;
+static uint8_t queued[TX_PACKETS * TX_PACKET_LENGTH + TX_BUFFER_SIZE]; // Everything put in the TX buffer, in order
+static uint16_t queued_length = 0;
+
+static void Check(int condition, const char *what) {
+    if (!condition) {
+        printf("  FAILED: %s\r\n", what);
+        errors++;
+    }
+}
+
+// Packet number n with ID 0x00, its data bytes are n and its complement so that the order shows on the wire.
+static void MakePacket(uint8_t n, uint8_t *packet) {
+    const uint8_t payload[] = {0x00, n, (uint8_t) ~n, 0x7D, 0x96};
+    packet[0] = BLE_PACKET_HEAD;
+    packet[1] = sizeof(payload);
+    memcpy(&packet[2], payload, sizeof(payload));
+    packet[7] = BLE_PACKET_TAIL;
+    packet[8] = Checksum_Compute(payload, sizeof(payload), 0);
+    packet[9] = '\r';
+    packet[10] = '\n';
+}
+
+static int8_t Queue(uint8_t data) {
+    if (BLE_PutChar(data) == ERROR) {
+        return ERROR;
+    }
+    queued[queued_length++] = data;
+    return SUCCESS;
+}
+
+// Runs the loop until the TX buffer is empty and the last transfer is done, on the host finishing the transfers.
+static void Drain(void) {
+    int passes = 0;
+    while ((CircularBuffer_Count(&tx_buffer) > 0 || !is_tx_buffer_yielded) && passes++ < TX_DRAIN_LIMIT) {
+        BLE_RunLoop();
+#ifdef BLE_SIM
+        BLE_SimCompleteTx();
+#endif
+    }
+    Check(passes < TX_DRAIN_LIMIT, "TX buffer drained");
+}
+
+#ifdef BLE_SIM
+// The wire has to carry exactly what was queued since the last check.
+static void CheckWire(const char *name) {
+    static uint8_t sent[sizeof(queued)];
+    uint16_t sent_length = BLE_SimReadWire(sent, sizeof(sent));
+    printf("%s: %u bytes queued, %u on the wire\r\n", name, queued_length, sent_length);
+    Check(sent_length == queued_length && memcmp(sent, queued, queued_length) == 0, "bytes and order on the wire");
+    queued_length = 0;
+}
+#endif
+
+int main() {
+
+    // Initialization
+    BOARD_Init();
+    TIMER_Init();
+
+    if (BLE_UART_Init() == ERROR) {
+        printf("BLE UART failed to initialize\r\n");
+        while (TRUE);
+    }
+
+    // One packet at a time, each starts where the last one ended.
+    uint8_t packet[TX_PACKET_LENGTH];
+    int wrapped = 0;
+    for (int n = 0; n < TX_PACKETS; n++) {
+        uint16_t position = tx_buffer.tail & (TX_BUFFER_SIZE - 1);
+        int is_wrapping = position + TX_PACKET_LENGTH > TX_BUFFER_SIZE;
+        uint32_t calls_before = tx_transfer_count;
+        MakePacket(n, packet);
+        for (int i = 0; i < TX_PACKET_LENGTH; i++) {
+            Check(Queue(packet[i]) == SUCCESS, "room for a packet");
+        }
+        Drain();
+        wrapped += is_wrapping;
+        Check(tx_transfer_count - calls_before == (is_wrapping ? 2 : 1), "HAL calls for a packet");
+    }
+    printf("%d packets, %d wrapped around the TX buffer\r\n", TX_PACKETS, wrapped);
+    Check(wrapped == TX_PACKETS * TX_PACKET_LENGTH / TX_BUFFER_SIZE, "packets that wrapped");
+#ifdef BLE_SIM
+    CheckWire("One at a time");
+#endif
+
+    // Start a transfer, then fill the rest of the buffer behind it. The bytes in flight can't be overwritten, so the
+    // buffer takes exactly its size and the first packet has to go out intact.
+    uint32_t calls_before = tx_transfer_count;
+    MakePacket(0xA5, packet);
+    for (int i = 0; i < TX_PACKET_LENGTH; i++) {
+        Queue(packet[i]);
+    }
+    BLE_RunLoop();
+    uint16_t filled = TX_PACKET_LENGTH;
+    while (Queue(filled) == SUCCESS) { // A count, so that a byte out of place shows
+        filled++;
+    }
+    printf("Filled %u bytes behind the transfer in flight\r\n", filled);
+    Check(filled == TX_BUFFER_SIZE, "TX buffer capacity");
+    Drain();
+    printf("Full buffer sent with %lu HAL calls\r\n", (unsigned long) (tx_transfer_count - calls_before));
+    Check(tx_transfer_count - calls_before <= 3, "HAL calls for a full buffer");
+#ifdef BLE_SIM
+    CheckWire("Full buffer");
+
+    // A DMA error halfway through the first of two packets: the HAL ends the transfer without TxCplt, and the reception
+    // with it. The rest of the span in flight is dropped, the next packet still goes out and the reception runs again.
+    MakePacket(0xE1, packet);
+    for (int i = 0; i < TX_PACKET_LENGTH; i++) {
+        Queue(packet[i]);
+    }
+    BLE_RunLoop();
+    uint16_t span = tx_span_length;
+    MakePacket(0xE2, packet);
+    for (int i = 0; i < TX_PACKET_LENGTH; i++) {
+        Queue(packet[i]);
+    }
+    uint16_t sent = BLE_SimFailTx();
+    Check(tx_span_length == 0 && is_tx_buffer_yielded, "aborted span released");
+    Check(huart6.RxState == HAL_UART_STATE_BUSY_RX, "reception restarted after a TX error");
+    Drain();
+    memmove(&queued[sent], &queued[span], queued_length - span);
+    queued_length -= span - sent;
+    CheckWire("DMA error");
+#endif
+
+    printf("%s\r\n", errors == 0 ? "SUCCESS" : "ERROR");
+#ifdef BLE_SIM
+    return errors != 0;
+#else
+    while (TRUE);
+    return 1;
+#endif
+}
+#endif
+
+
+//#define BLE_RX_DMA_TEST
+#ifdef BLE_RX_DMA_TEST
+// Stands in for the RX DMA: writes frames into rx_dma_buffer and raises the RX events at the write pointer the way
+// the HAL reports them. Runs on the board (the real reception is stopped) or on a host with the simulated UART:
+//   gcc -O2 -Wall -I../include -I../../../Common -DBLE_SIM -DBLE_RX_DMA_TEST bluefruit_ble_uart.c
+//       ../../../Common/CircularBuffer.c ../../../Common/Checksum.c -o ble_rx_dma && ./ble_rx_dma
+// SUCCESS - every frame is read back whole and in order, with one callback per idle line and one more when the frame
+// crosses the end of the DMA buffer. A frame ending right at the end takes one. Left undrained, the RX buffer keeps
+// its first RX_BUFFER_SIZE bytes and the rest are counted as lost, with no callback once nothing gets through. An
+// overrun error delivers the bytes the DMA wrote before it and starts the reception over at the start of the DMA
+// buffer (host only). An idle line that finds the DMA past the end still delivers the bytes in order.
+#define RX_FRAME_LENGTH 11
+
+static int errors = 0;
+static uint32_t callback_count = 0;
+static uint32_t callback_bytes = 0;
+
+static void Check(int condition, const char *what) {
+    if (!condition) {
+        printf("  FAILED: %s\r\n", what);
+        errors++;
+    }
+}
+
+void CountRxCallback(uint16_t length) {
+    callback_count++;
+    callback_bytes += length;
+}
+
+// Copies a frame into rx_dma_buffer from the last event on. The DMA reports the end of the buffer (transfer complete,
+// Size = BLE_RX_DMA_SIZE) with RX_EVENT_END before it goes on at the start, and the idle line at the new write pointer
+// with RX_EVENT_IDLE. Returns the number of events raised.
+#define RX_EVENT_IDLE 0x1
+#define RX_EVENT_END 0x2
+
+int SimulateRxFrame(const uint8_t *frame, int length, uint8_t events_raised) {
+    int events = 0;
+    uint16_t write_pointer = rx_dma_position;
+    for (int i = 0; i < length; i++) {
+        rx_dma_buffer[write_pointer] = frame[i];
+        write_pointer++;
+        if (write_pointer == BLE_RX_DMA_SIZE) {
+            if (events_raised & RX_EVENT_END) {
+                HAL_UARTEx_RxEventCallback(&huart6, BLE_RX_DMA_SIZE);
+                events++;
+            }
+            write_pointer = 0;
+        }
+    }
+#ifdef BLE_SIM
+    hdma_usart6_rx.Counter = BLE_RX_DMA_SIZE - write_pointer;
+#endif
+    if (events_raised & RX_EVENT_IDLE) {
+        HAL_UARTEx_RxEventCallback(&huart6, write_pointer);
+        events++;
+    }
+    return events;
+}
+
+// Frame number n, a count starting at n so that a byte out of place shows.
+static void MakeFrame(uint8_t n, uint8_t *frame, int length) {
+    for (int i = 0; i < length; i++) {
+        frame[i] = n + i;
+    }
+}
+
+// Reads everything there is and checks it against the frame.
+static void CheckRead(const uint8_t *frame, int length, const char *what) {
+    uint8_t x;
+    int read = 0;
+    int wrong = 0;
+    while (BLE_GetChar(&x) == SUCCESS) {
+        wrong += (read >= length || x != frame[read]);
+        read++;
+    }
+    Check(read == length && wrong == 0, what);
+}
+
+int main() {
+
+    // Initialization
+    BOARD_Init();
+    TIMER_Init();
+
+    if (BLE_UART_Init() == ERROR) {
+        printf("BLE UART failed to initialize\r\n");
+        while (TRUE);
+    }
+
+    // Stop the real DMA, the test drives the write pointer by itself.
+    HAL_UART_AbortReceive(&huart6);
+    BLE_SetRxCallback(CountRxCallback);
+
+    // Idle line after every frame, drained every time. 20 frames wrap around the DMA buffer three times.
+    uint8_t frame[RX_BUFFER_SIZE + 4 * RX_FRAME_LENGTH];
+    int wraps = 0;
+    for (int round = 0; round < 20; round++) {
+        uint16_t start = rx_dma_position;
+        int is_crossing = start + RX_FRAME_LENGTH > BLE_RX_DMA_SIZE;
+        callback_count = 0;
+        MakeFrame(round, frame, RX_FRAME_LENGTH);
+        SimulateRxFrame(frame, RX_FRAME_LENGTH, RX_EVENT_IDLE | RX_EVENT_END);
+        wraps += is_crossing;
+        Check(callback_count == (is_crossing ? 2 : 1), "callbacks per frame");
+        CheckRead(frame, RX_FRAME_LENGTH, "frame read back");
+    }
+    printf("20 frames, %d crossed the end of the DMA buffer\r\n", wraps);
+    Check(wraps == 20 * RX_FRAME_LENGTH / BLE_RX_DMA_SIZE, "frames crossing the end");
+
+    // A frame that ends right at the end of the DMA buffer: the transfer complete event delivers it, the idle line at
+    // 0 right after has nothing new. The next frame starts at the start of the buffer.
+    int length = BLE_RX_DMA_SIZE - rx_dma_position;
+    callback_count = 0;
+    MakeFrame(0x40, frame, length);
+    Check(SimulateRxFrame(frame, length, RX_EVENT_IDLE | RX_EVENT_END) == 2, "events for a frame ending at the end");
+    Check(callback_count == 1 && rx_dma_position == 0, "callbacks for a frame ending at the end");
+    CheckRead(frame, length, "frame ending at the end read back");
+
+    // A burst longer than the DMA buffer, with no idle line until its end: one callback per pass through the buffer.
+    callback_count = 0;
+    MakeFrame(0x80, frame, 2 * BLE_RX_DMA_SIZE + RX_FRAME_LENGTH);
+    SimulateRxFrame(frame, 2 * BLE_RX_DMA_SIZE + RX_FRAME_LENGTH, RX_EVENT_IDLE | RX_EVENT_END);
+    Check(callback_count == 3, "callbacks for a long burst");
+    CheckRead(frame, 2 * BLE_RX_DMA_SIZE + RX_FRAME_LENGTH, "long burst read back");
+    Check(BLE_GetRxLostCount() == 0, "nothing lost while drained");
+
+    // Now don't drain, everything beyond the RX buffer size has to be counted as lost and only what fits is kept.
+    int rounds = RX_BUFFER_SIZE / RX_FRAME_LENGTH + 4;
+    int full_rounds = 0;
+    callback_bytes = 0;
+    for (int round = 0; round < rounds; round++) {
+        int is_full = CircularBuffer_Free(&rx_buffer) == 0;
+        callback_count = 0;
+        MakeFrame(round * RX_FRAME_LENGTH, &frame[round * RX_FRAME_LENGTH], RX_FRAME_LENGTH);
+        SimulateRxFrame(&frame[round * RX_FRAME_LENGTH], RX_FRAME_LENGTH, RX_EVENT_IDLE | RX_EVENT_END);
+        full_rounds += is_full;
+        Check(!is_full || callback_count == 0, "no callback once full");
+    }
+    uint32_t expected_lost = rounds * RX_FRAME_LENGTH - RX_BUFFER_SIZE;
+    printf("Without draining: %lu bytes lost (expected %lu), %lu reported, %d frames found the buffer full\r\n",
+            (unsigned long) BLE_GetRxLostCount(), (unsigned long) expected_lost, (unsigned long) callback_bytes,
+            full_rounds);
+    Check(BLE_GetRxLostCount() == expected_lost, "bytes lost");
+    Check(callback_bytes == RX_BUFFER_SIZE && full_rounds == 3, "bytes reported to the callback");
+    CheckRead(frame, RX_BUFFER_SIZE, "bytes kept in the full buffer");
+
+    uint32_t lost_before = BLE_GetRxLostCount();
+#ifdef BLE_SIM
+    // Overrun error halfway through a frame: the HAL aborts the reception (it is stopped already), the callback
+    // delivers the 5 bytes the DMA counter says came in and starts the reception over at 0. Only the simulated DMA
+    // counter follows the test's writes, so this is host only.
+    MakeFrame(0xC0, frame, RX_FRAME_LENGTH + 5);
+    SimulateRxFrame(frame, 5, RX_EVENT_END);
+    callback_count = 0;
+    HAL_UART_ErrorCallback(&huart6);
+    HAL_UART_AbortReceive(&huart6);
+    Check(callback_count == 1 && rx_dma_position == 0, "reception restarted");
+    SimulateRxFrame(&frame[5], RX_FRAME_LENGTH, RX_EVENT_IDLE | RX_EVENT_END);
+    CheckRead(frame, RX_FRAME_LENGTH + 5, "bytes around an overrun");
+    Check(BLE_GetRxLostCount() == lost_before, "lost count after an overrun");
+#endif
+
+    // The idle line can find the DMA already past the end, its transfer complete not handled yet: the bytes up to the
+    // end go first, then the ones from the start. With room for only 20 of them left, the rest of both parts are lost.
+    uint8_t filler[RX_BUFFER_SIZE - 20];
+    MakeFrame(0x11, filler, sizeof(filler));
+    CircularBuffer_Write(&rx_buffer, filler, sizeof(filler));
+    length = BLE_RX_DMA_SIZE - rx_dma_position + 7;
+    MakeFrame(0xE0, frame, length);
+    callback_count = 0;
+    SimulateRxFrame(frame, length, RX_EVENT_IDLE);
+    Check(callback_count == 1 && rx_dma_position == 7, "late transfer complete");
+    Check(BLE_GetRxLostCount() - lost_before == (uint32_t) length - 20, "bytes lost across the end");
+    memmove(&frame[sizeof(filler)], frame, 20);
+    memcpy(frame, filler, sizeof(filler));
+    CheckRead(frame, RX_BUFFER_SIZE, "bytes kept across the end");
+
+    printf("%s\r\n", errors == 0 ? "SUCCESS" : "ERROR");
+#ifdef BLE_SIM
+    return errors != 0;
+#else
+    while (TRUE);
+    return 1;
+#endif
+}
+#endif
+
+
+//#define BLE_PACKET_BENCHMARK
+#ifdef BLE_PACKET_BENCHMARK
+// Compares the time it takes to queue the same packet with eleven BLE_PutChar() calls (checksum included) against a
+// single BLE_SendPacket() call, in batches of 20 packets (220 bytes of the TX buffer) per path. On the board the time
+// is in CPU cycles from the DWT counter. It also runs on a host with the simulated UART, in nanoseconds from
+// clock_gettime(), averaged over BENCHMARK_RUNS batches:
+//   gcc -O2 -Wall -I../include -I../../../Common -DBLE_SIM -DBLE_PACKET_BENCHMARK bluefruit_ble_uart.c
+//       ../../../Common/CircularBuffer.c ../../../Common/Checksum.c -o ble_packet && ./ble_packet
+// SUCCESS - BLE_SendPacket() takes less time, and both packets look identical on the PC (on the host, both batches
+// put the same bytes on the wire, the known packet with its 0x1D checksum).
+#define BENCHMARK_BATCH 20
+#define BENCHMARK_PACKET_LENGTH 11
+
+#ifdef BLE_SIM
+#include <time.h>
+
+#define BENCHMARK_RUNS 100000
+#define BENCHMARK_UNIT "ns"
+
+static uint32_t BenchmarkNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+#else
+// TIMER_Init() has the DWT cycle counter running, don't reset it (TIMERS_GetCycles() extends it).
+#define BENCHMARK_UNIT "cycles"
+#define BenchmarkNow() (DWT->CYCCNT)
+#endif
+
+static const uint8_t data[] = {0x00, 0x25, 0x7D, 0x96};
+static const uint8_t known_packet[] = {0xCC, 0x05, 0x00, 0x00, 0x25, 0x7D, 0x96, 0xB9, 0x1D, '\r', '\n'};
+
+static void Drain(void) {
+    while (CircularBuffer_Count(&tx_buffer) > 0 || !is_tx_buffer_yielded) {
+        BLE_RunLoop();
+#ifdef BLE_SIM
+        BLE_SimCompleteTx();
+#endif
+    }
+}
+
+#ifdef BLE_SIM
+// Both paths have to have sent the known packet BENCHMARK_BATCH times.
+static int WrongBatches(void) {
+    uint8_t sent[BENCHMARK_BATCH * BENCHMARK_PACKET_LENGTH + 1];
+    uint16_t sent_length = BLE_SimReadWire(sent, sizeof(sent));
+    int wrong = sent_length != BENCHMARK_BATCH * BENCHMARK_PACKET_LENGTH;
+    for (int n = 0; n < BENCHMARK_BATCH && !wrong; n++) {
+        wrong = memcmp(&sent[n * BENCHMARK_PACKET_LENGTH], known_packet, BENCHMARK_PACKET_LENGTH) != 0;
+    }
+    return wrong;
+}
+#endif
+
+// Queues a batch each way and returns the time each took, the TX buffer is drained before each.
+static int MeasureBatch(uint32_t *per_byte_time, uint32_t *packet_time) {
+    int wrong = 0;
+
+    // Per byte path
+    Drain();
+    uint32_t start = BenchmarkNow();
+    for (int n = 0; n < BENCHMARK_BATCH; n++) {
+        uint8_t checksum = CHECKSUM_UPDATE(0, 0x00);
+        BLE_PutChar(BLE_PACKET_HEAD);
+        BLE_PutChar(sizeof(data) + 1);
+        BLE_PutChar(0x00);
+        for (size_t i = 0; i < sizeof(data); i++) {
+            BLE_PutChar(data[i]);
+            checksum = CHECKSUM_UPDATE(checksum, data[i]);
+        }
+        BLE_PutChar(BLE_PACKET_TAIL);
+        BLE_PutChar(checksum);
+        BLE_PutChar('\r');
+        BLE_PutChar('\n');
+    }
+    *per_byte_time = BenchmarkNow() - start;
+    Drain();
+#ifdef BLE_SIM
+    wrong += WrongBatches();
+#endif
+
+    // Packet path
+    start = BenchmarkNow();
+    for (int n = 0; n < BENCHMARK_BATCH; n++) {
+        BLE_SendPacket(0x00, data, sizeof(data));
+    }
+    *packet_time = BenchmarkNow() - start;
+    Drain();
+#ifdef BLE_SIM
+    wrong += WrongBatches();
+#endif
+    return wrong;
+}
+
+int main() {
+
+    // Initialization
+    BOARD_Init();
+    TIMER_Init();
+
+    if (BLE_UART_Init() == ERROR) {
+        printf("BLE UART failed to initialize\r\n");
+        while (TRUE);
+    }
+
+    uint32_t per_byte_time, packet_time;
+#ifdef BLE_SIM
+    uint64_t per_byte_total = 0, packet_total = 0;
+    int wrong = 0;
+    for (int run = 0; run < BENCHMARK_RUNS; run++) {
+        wrong += MeasureBatch(&per_byte_time, &packet_time);
+        per_byte_total += per_byte_time;
+        packet_total += packet_time;
+    }
+    double per_byte_mean = (double) per_byte_total / BENCHMARK_RUNS / BENCHMARK_BATCH;
+    double packet_mean = (double) packet_total / BENCHMARK_RUNS / BENCHMARK_BATCH;
+    printf("Per packet over %d batches: PutChar %.1f %s, SendPacket %.1f %s, %d wrong batches\r\n", BENCHMARK_RUNS,
+            per_byte_mean, BENCHMARK_UNIT, packet_mean, BENCHMARK_UNIT, wrong);
+    int errors = (wrong != 0) + (packet_mean >= per_byte_mean);
+    printf("%s\r\n", errors == 0 ? "SUCCESS" : "ERROR");
+    return errors != 0;
+#else
+    while (TRUE) {
+        MeasureBatch(&per_byte_time, &packet_time);
+        printf("Per packet: PutChar %lu %s, SendPacket %lu %s\r\n", per_byte_time / BENCHMARK_BATCH, BENCHMARK_UNIT,
+                packet_time / BENCHMARK_BATCH, BENCHMARK_UNIT);
+        HAL_Delay(1000);
+    }
+    return 1;
+#endif
+}
+#endif
+
+
+//#define BLE_PARSER_TEST
+#ifdef BLE_PARSER_TEST
+// Feeds the parser a stream of random packets cut into random chunk sizes, with some bytes corrupted or dropped.
+// Nothing in it needs the board, it runs on a host with the simulated UART:
+//   gcc -O2 -Wall -I../include -I../../../Common -DBLE_SIM -DBLE_PARSER_TEST bluefruit_ble_uart.c
+//       ../../../Common/CircularBuffer.c ../../../Common/Checksum.c -o ble_parser && ./ble_parser
+// SUCCESS - no corrupted packet is delivered, delivered packets have the right contents, and the only clean packets
+// missed are ones swallowed while the parser was still inside a damaged frame: they start within a longest frame
+// (the LENGTH can be up to 128) of the end of a damaged one.
+#define PARSER_PACKETS 10000
+#define MAX_FRAME_LENGTH (BLE_MAX_PAYLOAD_LENGTH + BLE_PACKET_OVERHEAD)
+
+static uint32_t delivered_count = 0;
+static uint32_t mismatch_count = 0;
+static uint8_t expected_id;
+static uint8_t expected_data[BLE_MAX_PAYLOAD_LENGTH];
+static uint8_t expected_length;
+
+void CheckPacket(uint8_t id, const uint8_t *payload, uint8_t length) {
+    delivered_count++;
+    if (id != expected_id || length != expected_length || memcmp(payload, expected_data, length) != 0) {
+        mismatch_count++;
+    }
+}
+
+int main() {
+
+    // Initialization
+    BOARD_Init();
+    TIMER_Init();
+
+    for (int id = 0; id < 256; id++) {
+        BLE_RegisterPacketHandler(id, CheckPacket);
+    }
+
+    uint8_t frame[BLE_MAX_PAYLOAD_LENGTH + BLE_PACKET_OVERHEAD];
+    uint32_t clean_count = 0;
+    uint32_t swallowed_count = 0;
+    uint32_t unexplained_count = 0;
+    uint32_t since_damaged = MAX_FRAME_LENGTH; // Bytes fed since the end of the last damaged frame
+    uint32_t farthest_swallowed = 0;
+    srand(121);
+    for (int n = 0; n < PARSER_PACKETS; n++) {
+
+        // Random packet, framed the same way BLE_SendPacket does it.
+        expected_id = rand();
+        expected_length = rand() % (BLE_MAX_PAYLOAD_LENGTH + 1);
+        uint8_t checksum = CHECKSUM_UPDATE(0, expected_id);
+        int frame_length = 0;
+        frame[frame_length++] = BLE_PACKET_HEAD;
+        frame[frame_length++] = expected_length + 1;
+        frame[frame_length++] = expected_id;
+        for (int i = 0; i < expected_length; i++) {
+            expected_data[i] = rand();
+            frame[frame_length++] = expected_data[i];
+            checksum = CHECKSUM_UPDATE(checksum, expected_data[i]);
+        }
+        frame[frame_length++] = BLE_PACKET_TAIL;
+        frame[frame_length++] = checksum;
+        frame[frame_length++] = '\r';
+        frame[frame_length++] = '\n';
+
+        // One in four packets gets a flipped byte or loses a byte.
+        int corrupted = (rand() % 4) == 0;
+        if (corrupted) {
+            int position = rand() % frame_length;
+            if (rand() & 1) {
+                frame[position] ^= 1 << (rand() % 8);
+            } else {
+                memmove(&frame[position], &frame[position + 1], frame_length - position - 1);
+                frame_length--;
+            }
+        } else {
+            clean_count++;
+        }
+
+        // Deliver in random chunk sizes, like bursts coming off the DMA.
+        uint32_t delivered_before = delivered_count;
+        int sent = 0;
+        while (sent < frame_length) {
+            int chunk = 1 + rand() % 16;
+            if (chunk > frame_length - sent) {
+                chunk = frame_length - sent;
+            }
+            BLE_ParseBytes(&frame[sent], chunk);
+            sent += chunk;
+        }
+
+        if (corrupted && delivered_count != delivered_before) {
+            mismatch_count++;
+        } else if (!corrupted && delivered_count == delivered_before) {
+            swallowed_count++;
+            unexplained_count += since_damaged >= MAX_FRAME_LENGTH;
+            farthest_swallowed = (since_damaged > farthest_swallowed) ? since_damaged : farthest_swallowed;
+        }
+        since_damaged = corrupted ? 0 : since_damaged + frame_length;
+    }
+
+    printf("%d packets, %lu clean, %lu delivered, %lu swallowed (farthest %lu bytes after a damaged frame), "
+           "%lu mismatches, %lu packet errors\r\n", PARSER_PACKETS, (unsigned long) clean_count,
+           (unsigned long) delivered_count, (unsigned long) swallowed_count, (unsigned long) farthest_swallowed,
+           (unsigned long) mismatch_count, (unsigned long) packet_error_count);
+    int errors = (mismatch_count != 0) + (unexplained_count != 0) + (delivered_count != clean_count - swallowed_count);
+    printf("%s\r\n", errors == 0 ? "SUCCESS" : "ERROR");
+#ifdef BLE_SIM
+    return errors != 0;
+#else
+    while (TRUE);
+    return 1;
+#endif
+}
+#endif
+
+
+//#define BLE_SIM
+#ifdef BLE_SIM // BLE SIMULATED UART
+/* Not a test on its own, it is built into the host runs of the harnesses above, from this directory:
+ *   gcc -O2 -Wall -I../include -I../../../Common -DBLE_SIM -DBLE_TX_DMA_TEST bluefruit_ble_uart.c
+ *       ../../../Common/CircularBuffer.c ../../../Common/Checksum.c -o ble_tx_dma && ./ble_tx_dma
+ *
+ * The HAL calls above land on a mock UART. A DMA transmission stays in flight until BLE_SimCompleteTx() ends it:
+ * only then are its bytes read from memory onto the wire, so bytes overwritten while in flight show up there, and
+ * HAL_UART_TxCpltCallback() runs the way the DMA interrupt would call it. BLE_SimFailTx() ends it with a DMA error
+ * instead. gState and RxState follow the HAL's, so starting a transmission while one is in flight fails with
+ * HAL_BUSY. The reception is only started, the harnesses stand in for its DMA: they write rx_dma_buffer, set the
+ * counter in hdma_usart6_rx and raise HAL_UARTEx_RxEventCallback() themselves (see BLE_RX_DMA_TEST).
+ */
+#define SIM_WIRE_SIZE 4096 // Bytes sent and not read yet, more than that are dropped
+
+static uint8_t *sim_tx_data = NULL; // The transmission in flight
+static uint16_t sim_tx_length = 0;
+static uint8_t sim_wire[SIM_WIRE_SIZE];
+static uint16_t sim_wire_length = 0;
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size) {
+    if (huart->gState == HAL_UART_STATE_BUSY_TX) {
+        return HAL_BUSY;
+    }
+    if (huart != &huart6 || pData == NULL || Size == 0) {
+        return HAL_ERROR;
+    }
+    sim_tx_data = pData;
+    sim_tx_length = Size;
+    huart->gState = HAL_UART_STATE_BUSY_TX;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size) {
+    if (huart->RxState == HAL_UART_STATE_BUSY_RX) {
+        return HAL_BUSY;
+    }
+    if (huart != &huart6 || pData == NULL || Size == 0) {
+        return HAL_ERROR;
+    }
+    hdma_usart6_rx.Counter = Size;
+    huart->RxState = HAL_UART_STATE_BUSY_RX;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart) {
+    huart->RxState = HAL_UART_STATE_READY;
+    return HAL_OK;
+}
+
+// Moves the first length bytes of the transfer in flight onto the wire and ends the transfer.
+static uint16_t SimEndTx(uint16_t length) {
+    for (uint16_t i = 0; i < length && sim_wire_length < SIM_WIRE_SIZE; i++) {
+        sim_wire[sim_wire_length++] = sim_tx_data[i];
+    }
+    sim_tx_data = NULL;
+    sim_tx_length = 0;
+    huart6.gState = HAL_UART_STATE_READY;
+    return length;
+}
+
+uint16_t BLE_SimCompleteTx(void) {
+    if (huart6.gState != HAL_UART_STATE_BUSY_TX) {
+        return 0;
+    }
+    uint16_t length = SimEndTx(sim_tx_length);
+    HAL_UART_TxCpltCallback(&huart6);
+    return length;
+}
+
+uint16_t BLE_SimFailTx(void) {
+    if (huart6.gState != HAL_UART_STATE_BUSY_TX) {
+        return 0;
+    }
+    uint16_t length = SimEndTx(sim_tx_length / 2);
+    if (huart6.RxState == HAL_UART_STATE_BUSY_RX) {
+        huart6.RxState = HAL_UART_STATE_READY; // UART_EndRxTransfer(), the RX stream itself is left running
+    }
+    HAL_UART_ErrorCallback(&huart6);
+    return length;
+}
+
+uint16_t BLE_SimReadWire(uint8_t *data, uint16_t size) {
+    uint16_t length = (sim_wire_length < size) ? sim_wire_length : size;
+    memcpy(data, sim_wire, length);
+    memmove(sim_wire, &sim_wire[length], sim_wire_length - length);
+    sim_wire_length -= length;
+    return length;
+}
+
+// The board and timer modules, nothing to set up.
+int8_t BOARD_Init(void) {
+    return SUCCESS;
+}
+
+char TIMER_Init(void) {
+    return SUCCESS;
+}
+#endif
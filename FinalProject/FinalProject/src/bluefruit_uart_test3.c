@@ -12,17 +12,68 @@
 #include "uart.h"
 #include "timers.h"
 #include "leds.h"
+#include "Scheduler.h"
 #include "bluefruit_ble_uart.h"
 
+#define MAIN
+#ifdef MAIN
+
 /******************************************************************************
  * User Defines
  *****************************************************************************/
+#define PACKET_PERIOD_US 1000000
+
+static const Scheduler_Driver boardScheduler = { TIMERS_GetMicroSeconds64, TIMERS_Sleep };
+static int8_t bleTask;
+
+// From the RX interrupt: bytes came in, BLE_RunLoop() has something to do.
+static void BleReceived(uint16_t length) {
+    Scheduler_Signal(bleTask, 1);
+}
+
+static void BleTask(uint32_t events) {
+    BLE_RunLoop();
+    //set_leds(tx_buffer.tail);
+
+    // If a character is present, print it out...?
+    // uint8_t x;
+    // uint8_t status = BLE_GetChar(&x);
+    // if (status == SUCCESS) {
+    //     //printf("h\n");
+    //     printf("Msg: %c\n", x); // UART is set to have just a newline ending, so don't need to put it there, '\n'
+    // }
+}
+
+// Transmission Test (Packets)
+static void PacketTask(uint32_t events) {
+    printf("Sending packet from STM32.\n");
+
+    // Every second, construct a packet with a known checksum and send it.
+    // Let's do: 0x8400257D96 → 0xE6 (Known Checksum) This is from ECE121's Lab 1 Checksum Example
+    // 0x84 0x00 0x25 0x7D 0x96
+    /*
+    AWAIT_HEAD - Checks for the head byte to begin packet building.
+    AWAIT_LENGTH - Wait for the next byte, assuming its the length.
+    AWAIT_PAYLOAD - Will keep taking data bytes in this state until it receives a tail.
+    AWAIT_CHKSUM - Waits for the checksum to compare with the computed checksum.
+    AWAIT_END_RC - Waits for the return carriage '\r' in the first part to signify the end of transmission.
+    AWAIT_END_NL - Waits for the newline '\n' as the final part to represent end of transmission and to form the full packet.
+    */
+
+    // ID 0x00 with the data 0x00 0x25 0x7D 0x96, the packet gets the known checksum 0x1D.
+    // (0xE6 was the old known checksum when the ID was 0x84)
+    uint8_t id = 0x00;
+    uint8_t data[] = {0x00, 0x25, 0x7D, 0x96};
+    if (BLE_SendPacket(id, data, sizeof(data)) == ERROR) {
+        printf("TX buffer full, packet dropped.\n");
+    } else {
+        Scheduler_Signal(bleTask, 2); // Start sending it
+    }
+}
 
 /******************************************************************************
  * Main
  *****************************************************************************/
-#define MAIN
-#ifdef MAIN
 int main() {
 
     // Initialization
@@ -36,76 +87,14 @@ int main() {
     }
 
     printf("Reception Test:\n");
-    int previous = 0;
-    while (TRUE) {
-        BLE_RunLoop();
-        //set_leds(tx_buffer.tail);
-
-        // If a character is present, print it out...?
-        // uint8_t x;
-        // uint8_t status = BLE_GetChar(&x);
-        // if (status == SUCCESS) {
-        //     //printf("h\n");
-        //     printf("Msg: %c\n", x); // UART is set to have just a newline ending, so don't need to put it there, '\n'
-        // }
-
-        // Transmission Test (Packets)
-        int delta = TIMERS_GetMilliSeconds() - previous;
-        if (delta > 1000) {
-
-            printf("Sending packet from STM32.\n");
-
-            // Every second, construct a packet with a known checksum and send it.
-            // Let's do: 0x8400257D96 → 0xE6 (Known Checksum) This is from ECE121's Lab 1 Checksum Example
-            // 0x84 0x00 0x25 0x7D 0x96
-            /*
-            AWAIT_HEAD - Checks for the head byte to begin packet building.
-            AWAIT_LENGTH - Wait for the next byte, assuming its the length.
-            AWAIT_PAYLOAD - Will keep taking data bytes in this state until it receives a tail.
-            AWAIT_CHKSUM - Waits for the checksum to compare with the computed checksum.
-            AWAIT_END_RC - Waits for the return carriage '\r' in the first part to signify the end of transmission.
-            AWAIT_END_NL - Waits for the newline '\n' as the final part to represent end of transmission and to form the full packet.
-            */
-
-            // Head
-            uint8_t head = 0xCC;
-            BLE_PutChar(head);
-
-            // Length
-            uint8_t length = 5;
-            BLE_PutChar(length);
-
-            // Payload
-            uint8_t id = 0x00;
-            //uint8_t d1 = 0x84; //0x84
-            BLE_PutChar(id);
-
-            uint8_t d2 = 0x00; //0x00
-            BLE_PutChar(d2);
-
-            uint8_t d3 = 0x25; //0x25
-            BLE_PutChar(d3);
-
-            uint8_t d4 = 0x7D; //0x7D
-            BLE_PutChar(d4);
-
-            uint8_t d5 = 0x96; //0x96
-            BLE_PutChar(d5);
-
-            uint8_t tail = 0xB9;
-            BLE_PutChar(tail);
-
-            uint8_t checksum = 0x1D; //0xE6; // Old known checksum when ID was 0x84
-            BLE_PutChar(checksum);
-
-            uint8_t RC = '\r';
-            uint8_t NL = '\n';
-            BLE_PutChar(RC);
-            BLE_PutChar(NL);
-            
-            previous = TIMERS_GetMilliSeconds();
-        }
-    }
+
+    // BLE runs when bytes come in or a packet is queued, the packet goes out every second, the core sleeps
+    // in between.
+    Scheduler_Init(&boardScheduler);
+    bleTask = Scheduler_AddTask(BleTask);
+    Scheduler_Every(Scheduler_AddTask(PacketTask), PACKET_PERIOD_US);
+    BLE_SetRxCallback(BleReceived);
+    Scheduler_Run();
 
     return 1;
 }
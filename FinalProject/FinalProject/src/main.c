@@ -4,9 +4,59 @@
 #include <Board.h>
 #include "uart.h"
 #include "timers.h"
+#include "Scheduler.h"
 
 //#define MAIN
 #ifdef MAIN
+#define COUNTER_PERIOD_US 100000
+
+static const Scheduler_Driver boardScheduler = { TIMERS_GetMicroSeconds64, TIMERS_Sleep };
+
+// Sends the counter out of UART1 and prints what comes back on UART6, every 100 ms.
+static void CounterTask(uint32_t events) {
+    static int counter = 0;
+
+    // char tx[50] = "Hello\r\n";
+    // if (Uart1_tx(tx, strlen(tx) - 1) == SUCCESS) {
+    //     char rx[50];
+    //     Uart6_rx(rx, strlen(tx) - 1);
+    //     printf("%s", rx);
+    //     //printf("%d\n", strlen(x));
+    // }
+
+    // So far, it seems like the counter is working? There's a weird space though
+    // char tx[50];
+    // sprintf(tx, "Counter: %d\r\n", counter);
+    // if (Uart1_tx(tx, strlen(tx)) == SUCCESS) {
+    //     char rx[50];
+    //     Uart6_rx(rx, strlen(tx));
+    //     printf("%s", rx);
+    //     //printf("%d\n", strlen(x));
+    // }
+    // counter++;
+
+
+    // Seperate transmit and receive.
+    // One part will handle transmission and error handling.
+    // The other receive part will check if reception was correct.
+    char tx[50];
+    sprintf(tx, "Counter: %d\r\n", counter);
+    if (Uart1_tx(tx, strlen(tx)) == ERROR) {
+        return;
+    }
+
+    //DelayMicros(100000);
+
+    char rx[50];
+    if (Uart6_rx(rx, strlen(tx)) == SUCCESS) {
+        rx[strlen(tx)] = '\0'; // Add termination bit at the end to prevent overflow
+        printf("%s", rx);
+        //printf("%d\n", counter);
+        counter++;
+    }
+    //printf("%d\n", strlen(x));
+}
+
 int main(void) {
 
     int baud_rate = 115200;
@@ -21,54 +71,9 @@ int main(void) {
         return;
     }
     
-    //char tx[50];
-    int counter = 0;
-    while (TRUE) {
-
-        if (TIMERS_GetMilliSeconds() % 100 != 0) {
-            continue;
-        } 
-        
-        // char tx[50] = "Hello\r\n";
-        // if (Uart1_tx(tx, strlen(tx) - 1) == SUCCESS) {
-        //     char rx[50];
-        //     Uart6_rx(rx, strlen(tx) - 1);
-        //     printf("%s", rx);
-        //     //printf("%d\n", strlen(x));
-        // }
-
-        // So far, it seems like the counter is working? There's a weird space though
-        // char tx[50];
-        // sprintf(tx, "Counter: %d\r\n", counter);
-        // if (Uart1_tx(tx, strlen(tx)) == SUCCESS) {
-        //     char rx[50];
-        //     Uart6_rx(rx, strlen(tx));
-        //     printf("%s", rx);
-        //     //printf("%d\n", strlen(x));
-        // }
-        // counter++;
-
-
-        // Seperate transmit and receive.
-        // One part will handle transmission and error handling.
-        // The other receive part will check if reception was correct.
-        char tx[50];
-        sprintf(tx, "Counter: %d\r\n", counter);
-        if (Uart1_tx(tx, strlen(tx)) == ERROR) {
-            continue;
-        }
-
-        //DelayMicros(100000);
-        
-        char rx[50];
-        if (Uart6_rx(rx, strlen(tx)) == SUCCESS) {
-            rx[strlen(tx)] = '\0'; // Add termination bit at the end to prevent overflow
-            printf("%s", rx);
-            //printf("%d\n", counter);
-            counter++;
-        }
-        //printf("%d\n", strlen(x));
-        
-    }
+    // The counter runs every 100 ms and the core sleeps in between, rather than spinning on the millisecond count.
+    Scheduler_Init(&boardScheduler);
+    Scheduler_Every(Scheduler_AddTask(CounterTask), COUNTER_PERIOD_US);
+    Scheduler_Run();
 }
 #endif
\ No newline at end of file
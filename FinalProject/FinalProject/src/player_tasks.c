@@ -0,0 +1,191 @@
+/******************************************************************************
+ * Player tasks: the remote's main loop on the Scheduler.
+ *
+ * BLE, the buttons, the volume pot and the OLED each run as a task instead of
+ * being polled from one busy loop. BLE runs when its receive interrupt says
+ * bytes came in or a packet was queued to send, the buttons and the pot are
+ * read on timers, and the OLED redraws when one of them changed something,
+ * once the frame before has gone out. Between all that the core sleeps.
+ *
+ * Every second the latency of each task (from due or signalled to running),
+ * its longest run and the share of the time asleep are printed, and the
+ * profiling zones when built with -DPROFILE_ENABLED.
+ *****************************************************************************/
+
+/******************************************************************************
+ * Libraries
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/******************************************************************************
+ * User Libraries
+ *****************************************************************************/
+#include "Board.h"
+#include "timers.h"
+#include "leds.h"
+#include "buttons.h"
+#include "ADC.h"
+#include "Oled.h"
+#include "Scheduler.h"
+#include "Profile.h"
+#include "bluefruit_ble_uart.h"
+
+//#define PLAYER_TASKS
+#ifdef PLAYER_TASKS
+
+/******************************************************************************
+ * User Defines
+ *****************************************************************************/
+#define SONG_SKIP_NEXT 5 // Events.SONG_SKIP_NEXT in events.py
+
+#define BUTTONS_PERIOD_US 10000 // Also the debounce, a state has to hold for two reads
+#define VOLUME_PERIOD_US 50000
+#define STATS_PERIOD_US 1000000
+#define VOLUME_STEPS 100
+#define VOLUME_HYSTERESIS 20 // ADC counts, keeps the pot's noise off the screen
+
+// Event bits for Scheduler_Signal(), the timer one is SCHEDULER_EVENT_TIMER.
+#define EVENT_BLE_RX 0x1 // BLE: bytes came in
+#define EVENT_BLE_TX 0x2 // BLE: a packet was queued
+#define EVENT_OLED_CHANGED 0x1 // OLED: something on it changed
+#define EVENT_OLED_SENT 0x2 // OLED: the last frame is out
+
+static const Scheduler_Driver boardScheduler = { TIMERS_GetMicroSeconds64, TIMERS_Sleep };
+
+static int8_t bleTask, buttonsTask, volumeTask, oledTask, statsTask;
+
+// What the screen shows, written by the tasks, drawn by the OLED task.
+static uint8_t volume = 0;
+static uint8_t skips = 0;
+static uint32_t received = 0; // BLE bytes, nothing on the PC talks back yet
+
+/******************************************************************************
+ * Interrupt callbacks, they only wake the tasks
+ *****************************************************************************/
+static void BleReceived(uint16_t length) {
+    Scheduler_Signal(bleTask, EVENT_BLE_RX);
+}
+
+static void OledSent(int8_t status) {
+    Scheduler_Signal(oledTask, EVENT_OLED_SENT);
+}
+
+/******************************************************************************
+ * Tasks
+ *****************************************************************************/
+static void BleTask(uint32_t events) {
+    BLE_RunLoop();
+    unsigned char c;
+    while (BLE_GetChar(&c) == SUCCESS) {
+        received++;
+    }
+}
+
+static void Send(uint8_t id, const uint8_t *payload, uint8_t length) {
+    if (BLE_SendPacket(id, payload, length) == SUCCESS) {
+        Scheduler_Signal(bleTask, EVENT_BLE_TX);
+    }
+}
+
+// Button 0 skips the song on release, once the state has held for two reads.
+static void ButtonsTask(uint32_t events) {
+    static uint8_t last = 0xF, stable = 0xF;
+    uint8_t state = buttons_state() & 0xF;
+    if (state == last && state != stable) {
+        if ((state & 0x1) && !(stable & 0x1)) {
+            Send(SONG_SKIP_NEXT, NULL, 0);
+            skips++;
+            set_leds(skips);
+            Scheduler_Signal(oledTask, EVENT_OLED_CHANGED);
+        }
+        stable = state;
+    }
+    last = state;
+}
+
+static void VolumeTask(uint32_t events) {
+    static uint16_t lastReading = 0xFFFF;
+    uint16_t reading = ADC_Read(POT);
+    if (lastReading != 0xFFFF && abs((int) reading - (int) lastReading) < VOLUME_HYSTERESIS) {
+        return;
+    }
+    lastReading = reading;
+    uint8_t newVolume = (uint32_t) reading * VOLUME_STEPS / 4095;
+    if (newVolume != volume) {
+        volume = newVolume;
+        Scheduler_Signal(oledTask, EVENT_OLED_CHANGED);
+    }
+}
+
+// Draws only when something changed and the back buffer is free, a change while a frame is queued waits for
+// that frame to go out.
+static void OledTask(uint32_t events) {
+    static uint8_t isChanged = FALSE;
+    isChanged |= (events & EVENT_OLED_CHANGED) != 0;
+    if (!isChanged || OledIsSwapPending()) {
+        return;
+    }
+    char text[64];
+    sprintf(text, "Volume %3d%%\nSkipped %d", volume, skips);
+    OledClear(OLED_COLOR_BLACK);
+    OledDrawString(text);
+    if (OledSwapBuffers(OledSent) == SUCCESS) {
+        isChanged = FALSE;
+    }
+}
+
+static void StatsTask(uint32_t events) {
+    static const char *names[] = {"BLE", "buttons", "volume", "OLED", "stats"};
+    printf("Task     runs  latency avg/max (us)  run max (us)\r\n");
+    for (int8_t task = bleTask; task <= statsTask; task++) {
+        Scheduler_Stats stats;
+        Scheduler_GetStats(task, &stats);
+        printf("%-7s %5lu  %8lu / %6lu  %12lu\r\n", names[task], stats.runs,
+                stats.runs ? (uint32_t) (stats.totalLatency / stats.runs) : 0, stats.maxLatency, stats.maxRunTime);
+    }
+    printf("Idle %lu%%, %lu RX bytes, %lu lost\r\n\r\n",
+            (uint32_t) (Scheduler_GetIdleTime() * 100 / STATS_PERIOD_US), received, BLE_GetRxLostCount());
+    Scheduler_ResetStats();
+#ifdef PROFILE_ENABLED
+    Profile_Report();
+    Profile_Reset();
+#endif
+}
+
+/******************************************************************************
+ * Main
+ *****************************************************************************/
+int main() {
+
+    // Initialization
+    BOARD_Init();
+    TIMER_Init();
+    LEDS_Init();
+    BUTTONS_Init();
+    OledInit();
+    Profile_Init();
+
+    if (BLE_UART_Init() == ERROR || ADC_Init() == ERROR) {
+        set_leds(0xFF);
+        while (TRUE);
+    }
+
+    // Task order is priority order within a pass, BLE first so received bytes never wait on a redraw.
+    Scheduler_Init(&boardScheduler);
+    bleTask = Scheduler_AddTask(BleTask);
+    buttonsTask = Scheduler_AddTask(ButtonsTask);
+    volumeTask = Scheduler_AddTask(VolumeTask);
+    oledTask = Scheduler_AddTask(OledTask);
+    statsTask = Scheduler_AddTask(StatsTask);
+
+    BLE_SetRxCallback(BleReceived);
+    Scheduler_Every(buttonsTask, BUTTONS_PERIOD_US);
+    Scheduler_Every(volumeTask, VOLUME_PERIOD_US);
+    Scheduler_Every(statsTask, STATS_PERIOD_US);
+    Scheduler_Signal(oledTask, EVENT_OLED_CHANGED);
+
+    Scheduler_Run();
+}
+#endif
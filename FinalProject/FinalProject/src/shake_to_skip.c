@@ -0,0 +1,83 @@
+/******************************************************************************
+ * Shake-to-skip: shaking the remote skips to the next song.
+ *
+ * The BNO055 is sampled at 100 Hz with one DMA burst per sample
+ * (BNO055_ReadAllAsync), so the main loop never waits on the I2C bus, and
+ * every sample goes through the shake detector in Gesture.c. A shake sends a
+ * SONG_SKIP_NEXT packet to the PC.
+ *****************************************************************************/
+
+/******************************************************************************
+ * Libraries
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/******************************************************************************
+ * User Libraries
+ *****************************************************************************/
+#include "Board.h"
+#include "timers.h"
+#include "leds.h"
+#include "BNO055.h"
+#include "Gesture.h"
+#include "bluefruit_ble_uart.h"
+
+//#define SHAKE_TO_SKIP
+#ifdef SHAKE_TO_SKIP
+
+/******************************************************************************
+ * User Defines
+ *****************************************************************************/
+#define SONG_SKIP_NEXT 5 // Events.SONG_SKIP_NEXT in events.py
+#define SAMPLE_PERIOD_MS 10
+
+static BNO055_Data sample; // Written by the DMA completion, not on the stack
+static volatile uint8_t isSampleReady = FALSE;
+
+static void SampleDone(int8_t status) {
+    if (status == SUCCESS) {
+        isSampleReady = TRUE;
+    }
+}
+
+/******************************************************************************
+ * Main
+ *****************************************************************************/
+int main() {
+
+    // Initialization
+    BOARD_Init();
+    TIMER_Init();
+    LEDS_Init();
+
+    if (BLE_UART_Init() == ERROR || BNO055_Init() == ERROR) {
+        set_leds(0xFF);
+        while (TRUE);
+    }
+    Gesture_Init();
+
+    uint32_t lastSample = TIMERS_GetMilliSeconds();
+    uint32_t sampleTime = lastSample;
+    uint8_t skips = 0;
+    while (TRUE) {
+        BLE_RunLoop();
+
+        // Start the next burst on time, the bus may still be busy with someone else's transfer.
+        uint32_t now = TIMERS_GetMilliSeconds();
+        if (now - lastSample >= SAMPLE_PERIOD_MS && BNO055_ReadAllAsync(&sample, SampleDone) == SUCCESS) {
+            lastSample = now;
+            sampleTime = now;
+        }
+
+        if (isSampleReady) {
+            isSampleReady = FALSE;
+            if (Gesture_Update(&sample, sampleTime) == GESTURE_SHAKE) {
+                BLE_SendPacket(SONG_SKIP_NEXT, NULL, 0);
+                set_leds(++skips);
+            }
+        }
+    }
+}
+#endif
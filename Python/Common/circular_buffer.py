@@ -4,11 +4,135 @@ Author: Derrick Lai
 Date: 2025-03-11
 Description: This class is returns a Circular buffer object.
 
-
+The buffer holds whole items (BluefruitComm puts one notification per item), so the lock is taken once per notification
+rather than once per byte. It has a fixed capacity, and what happens when it is full is chosen up front:
+BLOCK - put() waits until the reader makes room (don't use this from the asyncio loop, it would stall the BLE callbacks).
+DROP_OLDEST - the oldest item is thrown away to make room, the newest data always gets through.
+DROP_NEWEST - the new item is thrown away (what the old receive Queue did), counted in dropped_count.
 """
+# =============================================
+#                   IMPORTS
+# =============================================
+import threading
+from collections import deque
+from enum import Enum
+
 # =============================================
 #                   CLASSES
 # =============================================
+class OverflowPolicy(Enum):
+    BLOCK = 0
+    DROP_OLDEST = 1
+    DROP_NEWEST = 2
+
 class CircularBuffer:
-    def __init__(self):
-        pass
\ No newline at end of file
+    def __init__(self, capacity : int, overflow_policy : OverflowPolicy = OverflowPolicy.DROP_NEWEST):
+        """
+        @name: __init__
+        @param capacity: Maximum number of items held at once.
+        @param overflow_policy: What put() does when the buffer is full (see OverflowPolicy).
+        @return: None
+        @brief: Creates an empty buffer, safe to use between threads.
+        """
+        if capacity <= 0:
+            raise ValueError("The circular buffer capacity must be at least 1.")
+        
+        self.capacity = capacity
+        self.overflow_policy = overflow_policy
+        self._items = deque()
+        self._lock = threading.Lock()
+        self._not_empty = threading.Condition(self._lock)
+        self._not_full = threading.Condition(self._lock)
+        
+        # Counters (read them through get_stats())
+        self._put_count = 0 # Items accepted
+        self._put_bytes = 0 # Bytes in the items accepted (for bytes-like items)
+        self._dropped_count = 0 # New items thrown away (DROP_NEWEST, or a BLOCK put that timed out)
+        self._dropped_bytes = 0
+        self._overwritten_count = 0 # Old items thrown away to make room (DROP_OLDEST)
+        self._overwritten_bytes = 0
+        self._high_water = 0 # Most items held at once
+    
+    def put(self, item, timeout : float = None) -> bool:
+        """
+        @name: put
+        @param item: The item to add.
+        @param timeout: BLOCK policy only, the most seconds to wait for room (None waits forever).
+        @return: True if the item was added, False if it was dropped.
+        @brief: Adds an item, applying the overflow policy when the buffer is full.
+        """
+        size = len(item) if hasattr(item, "__len__") else 0
+        with self._lock:
+            if len(self._items) >= self.capacity:
+                if self.overflow_policy == OverflowPolicy.BLOCK:
+                    if not self._not_full.wait_for(lambda: len(self._items) < self.capacity, timeout=timeout):
+                        self._dropped_count += 1
+                        self._dropped_bytes += size
+                        return False
+                elif self.overflow_policy == OverflowPolicy.DROP_OLDEST:
+                    oldest = self._items.popleft()
+                    self._overwritten_count += 1
+                    self._overwritten_bytes += len(oldest) if hasattr(oldest, "__len__") else 0
+                else:
+                    self._dropped_count += 1
+                    self._dropped_bytes += size
+                    return False
+            
+            self._items.append(item)
+            self._put_count += 1
+            self._put_bytes += size
+            self._high_water = max(self._high_water, len(self._items))
+            self._not_empty.notify()
+            return True
+    
+    def get(self, block : bool = False, timeout : float = None):
+        """
+        @name: get
+        @param block: If True, sleep until an item arrives instead of returning None straight away.
+        @param timeout: When blocking, the most seconds to wait (None waits forever).
+        @return: The oldest item, or None if there is none (within the timeout).
+        @brief: Removes and returns the oldest item.
+        """
+        with self._lock:
+            if not self._items:
+                if not block or not self._not_empty.wait_for(lambda: len(self._items) > 0, timeout=timeout):
+                    return None
+            item = self._items.popleft()
+            self._not_full.notify()
+            return item
+    
+    def clear(self):
+        """
+        @name: clear
+        @brief: Throws away every item held (the counters are kept).
+        """
+        with self._lock:
+            self._items.clear()
+            self._not_full.notify_all()
+    
+    def __len__(self):
+        with self._lock:
+            return len(self._items)
+    
+    def empty(self) -> bool:
+        return len(self) == 0
+    
+    def full(self) -> bool:
+        return len(self) >= self.capacity
+    
+    def get_stats(self) -> dict:
+        """
+        @name: get_stats
+        @return: A dictionary of the counters, taken all at once so they agree with each other.
+        """
+        with self._lock:
+            return {
+                "put_count": self._put_count,
+                "put_bytes": self._put_bytes,
+                "dropped_count": self._dropped_count,
+                "dropped_bytes": self._dropped_bytes,
+                "overwritten_count": self._overwritten_count,
+                "overwritten_bytes": self._overwritten_bytes,
+                "high_water": self._high_water,
+                "length": len(self._items),
+            }
@@ -0,0 +1,292 @@
+/*
+ * File:   packet_native.c
+ * Author: Derrick Lai
+ *
+ * Python extension for the parts of protocol.py that are too slow to run a byte at a time in Python.
+ * The checksum is the same C code the STM32 uses (Common/Checksum.c), so both sides can't drift apart.
+ *
+ * Decoder is the packet state machine from Protocol, taking whole BLE notifications at a time and
+ * returning the finished packets as immutable Packet tuples. It follows the same rules as the STM32
+ * parser (BLE_ParseBytes() in bluefruit_ble_uart.c): the payload is LENGTH bytes long, and any frame that
+ * fails a check is dropped while the decoder goes back to waiting for a head byte.
+ *
+ * Build (from the Python folder):
+ *   python setup.py build_ext --inplace
+ *
+ * protocol.py falls back to the pure Python code when this module isn't built.
+ *
+ * Created on March 22, 2025
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include <string.h>
+#include "Checksum.h"
+
+// Must match protocol.py and bluefruit_ble_uart.h
+#define PACKET_HEAD 0xCC
+#define PACKET_TAIL 0xB9
+#define PACKET_MAX_PAYLOAD 128 // ID plus up to 127 bytes of data
+
+typedef enum {
+    AWAIT_HEAD,
+    AWAIT_LENGTH,
+    AWAIT_PAYLOAD,
+    AWAIT_TAIL,
+    AWAIT_CHKSUM,
+    AWAIT_END_RC,
+    AWAIT_END_NL
+} PacketStates;
+
+typedef struct {
+    PyObject_HEAD
+    PacketStates state;
+    uint8_t length;
+    uint8_t count;
+    uint8_t checksum;
+    uint8_t payload[PACKET_MAX_PAYLOAD];
+    unsigned long long packet_count;
+    unsigned long long error_count;
+} DecoderObject;
+
+// Packet(head, length, payload, checksum, tail), same order as the lists Protocol used to build.
+static PyStructSequence_Field packet_fields[] = {
+    {"head", "Head byte (0xCC)"},
+    {"length", "Length byte, the number of payload bytes (ID included)"},
+    {"payload", "Payload as bytes, payload[0] is the ID"},
+    {"checksum", "Checksum byte"},
+    {"tail", "Tail byte (0xB9)"},
+    {NULL, NULL}
+};
+
+static PyStructSequence_Desc packet_desc = {
+    "packet_native.Packet",
+    "A received packet, immutable.",
+    packet_fields,
+    5
+};
+
+static PyTypeObject *PacketType = NULL;
+
+/**
+ * @function checksum(data, initial=0)
+ * @param data - Any bytes-like object (bytes, bytearray, memoryview) holding the payload, ID first
+ * @param initial - Checksum of the bytes before these
+ * @return (int) The checksum of the payload
+ * @brief Whole payload checksum, same as calling Protocol.__compute_iterative_checksum on every byte */
+static PyObject *packet_native_checksum(PyObject *self, PyObject *args) {
+    Py_buffer data;
+    unsigned char initial = 0;
+
+    if (!PyArg_ParseTuple(args, "y*|b", &data, &initial)) {
+        return NULL;
+    }
+
+    uint8_t checksum;
+    Py_BEGIN_ALLOW_THREADS
+    checksum = Checksum_Compute((const uint8_t *) data.buf, (uint32_t) data.len, initial);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&data);
+
+    return PyLong_FromLong(checksum);
+}
+
+/**
+ * @function Decoder_MakePacket(self)
+ * @return A new Packet for the frame that just finished, NULL with an exception set on failure */
+static PyObject *Decoder_MakePacket(DecoderObject *self) {
+    PyObject *packet = PyStructSequence_New(PacketType);
+    if (packet == NULL) {
+        return NULL;
+    }
+    PyObject *payload = PyBytes_FromStringAndSize((const char *) self->payload, self->length);
+    if (payload == NULL) {
+        Py_DECREF(packet);
+        return NULL;
+    }
+    PyStructSequence_SET_ITEM(packet, 0, PyLong_FromLong(PACKET_HEAD));
+    PyStructSequence_SET_ITEM(packet, 1, PyLong_FromLong(self->length));
+    PyStructSequence_SET_ITEM(packet, 2, payload);
+    PyStructSequence_SET_ITEM(packet, 3, PyLong_FromLong(self->checksum));
+    PyStructSequence_SET_ITEM(packet, 4, PyLong_FromLong(PACKET_TAIL));
+    return packet;
+}
+
+/**
+ * @function Decoder.feed(data)
+ * @param data - Any bytes-like object, normally a whole BLE notification
+ * @return (list) The packets completed by these bytes, empty if none
+ * @brief Runs the bytes through the state machine. A packet can be split across any number of calls. */
+static PyObject *Decoder_feed(DecoderObject *self, PyObject *arg) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    PyObject *packets = PyList_New(0);
+    if (packets == NULL) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    const uint8_t *data = (const uint8_t *) view.buf;
+    Py_ssize_t length = view.len;
+
+    for (Py_ssize_t i = 0; i < length; i++) {
+        uint8_t char_byte = data[i];
+
+        switch (self->state) {
+            case AWAIT_HEAD:
+                if (char_byte == PACKET_HEAD) {
+                    self->state = AWAIT_LENGTH;
+                }
+                break;
+
+            case AWAIT_LENGTH:
+                if (char_byte == 0 || char_byte > PACKET_MAX_PAYLOAD) {
+                    self->error_count++;
+                    self->state = AWAIT_HEAD;
+                    break;
+                }
+                self->length = char_byte;
+                self->count = 0;
+                self->checksum = 0;
+                self->state = AWAIT_PAYLOAD;
+                break;
+
+            case AWAIT_PAYLOAD: {
+                // Copy as much of the payload as this notification has, then checksum it in one go.
+                Py_ssize_t needed = self->length - self->count;
+                Py_ssize_t available = length - i;
+                Py_ssize_t take = (needed < available) ? needed : available;
+                memcpy(&self->payload[self->count], &data[i], take);
+                self->checksum = Checksum_Compute(&data[i], (uint32_t) take, self->checksum);
+                self->count += (uint8_t) take;
+                i += take - 1;
+                if (self->count == self->length) {
+                    self->state = AWAIT_TAIL;
+                }
+                break;
+            }
+
+            case AWAIT_TAIL:
+                self->state = (char_byte == PACKET_TAIL) ? AWAIT_CHKSUM : AWAIT_HEAD;
+                self->error_count += (self->state == AWAIT_HEAD);
+                break;
+
+            case AWAIT_CHKSUM:
+                self->state = (char_byte == self->checksum) ? AWAIT_END_RC : AWAIT_HEAD;
+                self->error_count += (self->state == AWAIT_HEAD);
+                break;
+
+            case AWAIT_END_RC:
+                self->state = (char_byte == '\r') ? AWAIT_END_NL : AWAIT_HEAD;
+                self->error_count += (self->state == AWAIT_HEAD);
+                break;
+
+            case AWAIT_END_NL: {
+                // In every case, transition will be directly back to the head
+                self->state = AWAIT_HEAD;
+                if (char_byte != '\n') {
+                    self->error_count++;
+                    break;
+                }
+                PyObject *packet = Decoder_MakePacket(self);
+                if (packet == NULL || PyList_Append(packets, packet) < 0) {
+                    Py_XDECREF(packet);
+                    Py_DECREF(packets);
+                    PyBuffer_Release(&view);
+                    return NULL;
+                }
+                Py_DECREF(packet);
+                self->packet_count++;
+                break;
+            }
+        }
+    }
+
+    PyBuffer_Release(&view);
+    return packets;
+}
+
+/**
+ * @function Decoder.reset()
+ * @brief Drops any partial packet, the counters are kept */
+static PyObject *Decoder_reset(DecoderObject *self, PyObject *Py_UNUSED(ignored)) {
+    self->state = AWAIT_HEAD;
+    self->count = 0;
+    Py_RETURN_NONE;
+}
+
+static int Decoder_init(DecoderObject *self, PyObject *args, PyObject *kwds) {
+    static char *keywords[] = {NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "", keywords)) {
+        return -1;
+    }
+    self->state = AWAIT_HEAD;
+    self->count = 0;
+    self->packet_count = 0;
+    self->error_count = 0;
+    return 0;
+}
+
+static PyMethodDef Decoder_methods[] = {
+    {"feed", (PyCFunction) Decoder_feed, METH_O, "feed(data) -> list of Packet\nRuns received bytes through the packet state machine."},
+    {"reset", (PyCFunction) Decoder_reset, METH_NOARGS, "reset()\nDrops any partial packet."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef Decoder_members[] = {
+    {"packet_count", T_ULONGLONG, offsetof(DecoderObject, packet_count), READONLY, "Number of packets decoded"},
+    {"error_count", T_ULONGLONG, offsetof(DecoderObject, error_count), READONLY, "Number of frames dropped by a failed check"},
+    {NULL, 0, 0, 0, NULL}
+};
+
+static PyTypeObject DecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "packet_native.Decoder",
+    .tp_doc = "Packet decoder, feed() it received bytes and it returns the finished packets.",
+    .tp_basicsize = sizeof(DecoderObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Decoder_init,
+    .tp_methods = Decoder_methods,
+    .tp_members = Decoder_members,
+};
+
+static PyMethodDef packet_native_methods[] = {
+    {"checksum", packet_native_checksum, METH_VARARGS, "checksum(data, initial=0) -> int\nChecksum of a whole payload."},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef packet_native_module = {
+    PyModuleDef_HEAD_INIT,
+    "packet_native",
+    "Native helpers for protocol.py (checksum shared with the STM32, packet decoder).",
+    -1,
+    packet_native_methods
+};
+
+PyMODINIT_FUNC PyInit_packet_native(void) {
+    PyObject *module = PyModule_Create(&packet_native_module);
+    if (module == NULL) {
+        return NULL;
+    }
+
+    PacketType = PyStructSequence_NewType(&packet_desc);
+    if (PacketType == NULL || PyType_Ready(&DecoderType) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(PacketType);
+    Py_INCREF(&DecoderType);
+    if (PyModule_AddObject(module, "Packet", (PyObject *) PacketType) < 0 ||
+        PyModule_AddObject(module, "Decoder", (PyObject *) &DecoderType) < 0) {
+        Py_DECREF(PacketType);
+        Py_DECREF(&DecoderType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
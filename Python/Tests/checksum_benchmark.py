@@ -0,0 +1,92 @@
+"""
+checksum_benchmark.py
+Author: Derrick Lai
+Date: 2025-03-22
+Description: Compares the checksum throughput of the pure Python per-byte loop (what Protocol used to do) against the
+native module built from Common/Checksum.c, for payloads of 1 to 127 bytes. Both are also checked against each other.
+
+Build the native module first (from the Python folder):
+    python setup.py build_ext --inplace
+"""
+# =============================================
+#                   IMPORTS
+# =============================================
+import sys
+import os
+import random
+import time
+
+# Get the main directory
+parent_dir = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+sys.path.insert(0, parent_dir)
+try:
+    import packet_native
+except ImportError:
+    packet_native = None
+
+# =============================================
+#                   CONSTANTS
+# =============================================
+PAYLOAD_LENGTHS = [1, 2, 4, 8, 16, 32, 64, 127]
+BYTES_PER_RUN = 2_000_000 # Roughly how many bytes each measurement checksums
+
+# =============================================
+#                     MAIN
+# =============================================
+def python_checksum(payload):
+    """
+    @name: python_checksum
+    @param payload: List of ints
+    @return: The checksum
+    @brief: The byte at a time loop, written the same way as Protocol.__compute_iterative_checksum
+    """
+    checksum = 0
+    for byte in payload:
+        checksum = (checksum >> 1) + (checksum << 7)
+        checksum += byte
+        checksum &= 0xFF
+    return checksum
+
+def measure(function, payload, iterations):
+    """
+    @name: measure
+    @return: Megabytes per second
+    """
+    start = time.perf_counter()
+    for _ in range(iterations):
+        function(payload)
+    elapsed = time.perf_counter() - start
+    return (iterations * len(payload)) / elapsed / 1e6
+
+def main():
+    if packet_native is None:
+        print("The native module isn't built, run \"python setup.py build_ext --inplace\" in the Python folder first.")
+        return
+    
+    # Known packet from the STM32 test (ID 0x00, data 0x00 0x25 0x7D 0x96 -> 0x1D)
+    assert packet_native.checksum(bytes([0x00, 0x00, 0x25, 0x7D, 0x96])) == 0x1D
+    
+    # Agreement on random payloads
+    random.seed(121)
+    for _ in range(10000):
+        payload = bytes(random.randrange(256) for _ in range(random.randint(0, 127)))
+        initial = random.randrange(256)
+        expected = initial
+        for byte in payload:
+            expected = ((expected >> 1) + (expected << 7) + byte) & 0xFF
+        assert packet_native.checksum(payload, initial) == expected
+    print("Native and Python checksums agree.\n")
+    
+    print(f"{'bytes':>6} {'python MB/s':>12} {'native MB/s':>12} {'speedup':>8}")
+    for length in PAYLOAD_LENGTHS:
+        payload = bytes(random.randrange(256) for _ in range(length))
+        iterations = max(BYTES_PER_RUN // length // 10, 1000)
+        python_rate = measure(python_checksum, list(payload), iterations)
+        native_rate = measure(packet_native.checksum, payload, iterations * 10)
+        print(f"{length:>6} {python_rate:>12.2f} {native_rate:>12.2f} {native_rate / python_rate:>7.1f}x")
+
+# =============================================
+#                    DRIVER
+# =============================================
+if __name__ == "__main__":
+    main()
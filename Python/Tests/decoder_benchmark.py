@@ -0,0 +1,90 @@
+"""
+decoder_benchmark.py
+Author: Derrick Lai
+Date: 2025-03-23
+Description: Compares the packets per second of the pure Python PacketDecoder against the compiled packet_native.Decoder.
+The stream is cut into 20 byte notifications (the default BLE payload size) like the Bluefruit sends them, and a few
+packets are corrupted so the error paths are exercised. Both decoders must return exactly the same packets.
+
+Build the native module first (from the Python folder):
+    python setup.py build_ext --inplace
+"""
+# =============================================
+#                   IMPORTS
+# =============================================
+import sys
+import os
+import random
+import time
+
+# Get the main directory
+parent_dir = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+sys.path.insert(0, parent_dir)
+import protocol
+from protocol import PacketDecoder, HEAD, TAIL, CARRIAGE, NEWLINE
+
+# =============================================
+#                   CONSTANTS
+# =============================================
+NUM_PACKETS = 20000
+NOTIFICATION_SIZE = 20
+CORRUPT_ONE_IN = 50
+
+# =============================================
+#                     MAIN
+# =============================================
+def make_stream():
+    """
+    @name: make_stream
+    @return: (list of notifications, number of packets left intact)
+    @brief: Builds random packets (1 to 127 data bytes), corrupts a few of them and cuts the stream into notifications.
+    """
+    random.seed(121)
+    stream = bytearray()
+    intact = 0
+    for _ in range(NUM_PACKETS):
+        payload = bytes(random.randrange(256) for _ in range(random.randint(1, 128)))
+        frame = bytearray([HEAD, len(payload)]) + payload
+        frame += bytes([TAIL, protocol.compute_checksum(payload), CARRIAGE, NEWLINE])
+        if random.randrange(CORRUPT_ONE_IN) == 0:
+            frame[random.randrange(2, len(frame))] ^= 0x5A
+        else:
+            intact += 1
+        stream += frame
+    notifications = [bytes(stream[i:i + NOTIFICATION_SIZE]) for i in range(0, len(stream), NOTIFICATION_SIZE)]
+    return notifications, intact
+
+def measure(decoder, notifications):
+    """
+    @name: measure
+    @return: (packets decoded, seconds taken)
+    """
+    packets = list()
+    start = time.perf_counter()
+    for message in notifications:
+        packets.extend(decoder.feed(message))
+    return packets, time.perf_counter() - start
+
+def main():
+    notifications, intact = make_stream()
+    print(f"{NUM_PACKETS} packets ({intact} intact) in {len(notifications)} notifications of {NOTIFICATION_SIZE} bytes\n")
+    
+    python_packets, python_time = measure(PacketDecoder(), notifications)
+    print(f"Python decoder: {len(python_packets) / python_time:>12.0f} packets/s")
+    
+    if protocol.packet_native is None:
+        print("The native module isn't built, run \"python setup.py build_ext --inplace\" in the Python folder first.")
+        return
+    
+    native_packets, native_time = measure(protocol.packet_native.Decoder(), notifications)
+    print(f"Native decoder: {len(native_packets) / native_time:>12.0f} packets/s ({python_time / native_time:.1f}x)")
+    
+    # Both decoders must agree packet for packet (compare as plain tuples, the two Packet types are different classes)
+    same = [tuple(p) for p in python_packets] == [tuple(p) for p in native_packets]
+    print(f"\nDecoded {len(native_packets)} packets, decoders agree: {same}")
+
+# =============================================
+#                    DRIVER
+# =============================================
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,86 @@
+"""
+latency_benchmark.py
+Author: Derrick Lai
+Date: 2025-03-24
+Description: Measures the idle CPU use of the receive chain (BluefruitComm -> Protocol -> EventHandler) and the end to end
+latency from the STM32 sending a packet to its event callback running. The Bluefruit is replaced by a SimulatedTransport
+with no added latency, so what is measured is the PC side alone and no radio is needed.
+"""
+# =============================================
+#                   IMPORTS
+# =============================================
+import sys
+import os
+import statistics
+import threading
+import time
+
+# Get the main directory
+parent_dir = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+sys.path.insert(0, parent_dir)
+from protocol import HEAD, TAIL, CARRIAGE, NEWLINE, compute_checksum
+from event_handler import EventHandler
+from events import Events
+from transport import SimulatedTransport
+
+# =============================================
+#                   CONSTANTS
+# =============================================
+IDLE_SECONDS = 3.0
+NUM_EVENTS = 500
+EVENT_INTERVAL = 0.005 # Seconds between notifications
+MAX_PACKET_QUEUE_SIZE = 16
+
+# =============================================
+#                     MAIN
+# =============================================
+def make_packet(sequence : int) -> bytes:
+    """
+    @name: make_packet
+    @return: An EXAMPLE_EVENT packet carrying the sequence number
+    """
+    payload = bytes([Events.EXAMPLE_EVENT.value, sequence >> 8, sequence & 0xFF])
+    return bytes([HEAD, len(payload)]) + payload + bytes([TAIL, compute_checksum(payload), CARRIAGE, NEWLINE])
+
+def main():
+    sent_times = dict()
+    latencies = list()
+    done = threading.Event()
+    
+    def event_cb(payload):
+        sequence = (payload[1] << 8) | payload[2]
+        latencies.append(time.perf_counter() - sent_times[sequence])
+        if len(latencies) == NUM_EVENTS:
+            done.set()
+    
+    link = SimulatedTransport()
+    event_handler = EventHandler("00:00:00:00:00:00", MAX_PACKET_QUEUE_SIZE, transport=link)
+    event_handler.on_event(Events.EXAMPLE_EVENT, event_cb)
+    
+    # Idle CPU: nothing is arriving, the process should be asleep.
+    time.sleep(0.5)
+    cpu_start, wall_start = time.process_time(), time.perf_counter()
+    time.sleep(IDLE_SECONDS)
+    idle_cpu = (time.process_time() - cpu_start) / (time.perf_counter() - wall_start) * 100
+    print(f"Idle CPU: {idle_cpu:.2f}% of one core over {IDLE_SECONDS:.0f} s")
+    
+    # Latency: one packet per notification, spaced out so every event wakes the chain up from sleep.
+    for sequence in range(NUM_EVENTS):
+        sent_times[sequence] = time.perf_counter()
+        link.send(make_packet(sequence))
+        time.sleep(EVENT_INTERVAL)
+    
+    if not done.wait(timeout=5):
+        print(f"Only {len(latencies)} of {NUM_EVENTS} events arrived")
+        return
+    
+    latencies_us = sorted(latency * 1e6 for latency in latencies)
+    print(f"Notification -> event callback latency over {NUM_EVENTS} events:")
+    print(f"  min {latencies_us[0]:.0f} us, median {statistics.median(latencies_us):.0f} us, "
+          f"p99 {latencies_us[int(len(latencies_us) * 0.99)]:.0f} us, max {latencies_us[-1]:.0f} us")
+
+# =============================================
+#                    DRIVER
+# =============================================
+if __name__ == "__main__":
+    main()
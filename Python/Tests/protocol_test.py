@@ -162,7 +162,7 @@ def main():
 
     # Keep waiting for a packet (Reception Test) -> Note: The packets are all in integer form.
     while True:
-        packet = protocol.get_packet()
+        packet = protocol.get_packet(block=True)
         
         if packet:
             print(packet)
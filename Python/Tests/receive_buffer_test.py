@@ -0,0 +1,96 @@
+"""
+receive_buffer_test.py
+Author: Derrick Lai
+Date: 2025-03-25
+Description: Checks the overflow policies of Common/circular_buffer.py and compares the cost of handing notifications
+downstream a whole notification at a time against the old one Queue.put() per byte.
+"""
+# =============================================
+#                   IMPORTS
+# =============================================
+import sys
+import os
+import threading
+import time
+from queue import Queue
+
+# Get the main directory
+parent_dir = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+sys.path.insert(0, parent_dir)
+from Common.circular_buffer import CircularBuffer, OverflowPolicy
+
+# =============================================
+#                   CONSTANTS
+# =============================================
+NUM_NOTIFICATIONS = 50000
+NOTIFICATION_SIZE = 20
+
+# =============================================
+#                     MAIN
+# =============================================
+def policy_test():
+    # DROP_NEWEST: the fourth put is refused and counted
+    buffer = CircularBuffer(3, OverflowPolicy.DROP_NEWEST)
+    results = [buffer.put(bytes([i]) * 4) for i in range(4)]
+    stats = buffer.get_stats()
+    assert results == [True, True, True, False]
+    assert stats["dropped_count"] == 1 and stats["dropped_bytes"] == 4 and stats["high_water"] == 3
+    assert buffer.get() == bytes([0]) * 4
+    
+    # DROP_OLDEST: the oldest is thrown away, the newest always gets in
+    buffer = CircularBuffer(3, OverflowPolicy.DROP_OLDEST)
+    for i in range(5):
+        assert buffer.put(bytes([i]))
+    assert [buffer.get() for _ in range(3)] == [bytes([2]), bytes([3]), bytes([4])]
+    assert buffer.get_stats()["overwritten_count"] == 2
+    assert buffer.get() is None
+    
+    # BLOCK: a put into a full buffer waits for the reader, or gives up after its timeout
+    buffer = CircularBuffer(1, OverflowPolicy.BLOCK)
+    buffer.put(b"a")
+    assert buffer.put(b"b", timeout=0.05) is False
+    threading.Timer(0.05, buffer.get).start()
+    assert buffer.put(b"c", timeout=1.0) is True
+    assert buffer.get() == b"c" and buffer.get_stats()["dropped_count"] == 1
+    
+    # Blocking get wakes up when something arrives
+    threading.Timer(0.05, buffer.put, args=(b"d",)).start()
+    assert buffer.get(block=True, timeout=1.0) == b"d"
+    assert buffer.get(block=True, timeout=0.05) is None
+    print("Overflow policies: PASS")
+
+def handoff_benchmark():
+    notification = bytes(range(NOTIFICATION_SIZE))
+    total_bytes = NUM_NOTIFICATIONS * NOTIFICATION_SIZE
+    
+    # Old: every byte goes through its own locked put and get
+    queue = Queue()
+    start = time.perf_counter()
+    for _ in range(NUM_NOTIFICATIONS):
+        for byte in list(notification):
+            queue.put(byte)
+        while not queue.empty():
+            queue.get()
+    per_byte = time.perf_counter() - start
+    
+    # New: one put and one get per notification
+    buffer = CircularBuffer(16, OverflowPolicy.BLOCK)
+    start = time.perf_counter()
+    for _ in range(NUM_NOTIFICATIONS):
+        buffer.put(bytes(notification))
+        buffer.get()
+    per_notification = time.perf_counter() - start
+    
+    print(f"Per byte Queue:            {total_bytes / per_byte / 1e6:6.2f} MB/s")
+    print(f"Per notification buffer:   {total_bytes / per_notification / 1e6:6.2f} MB/s "
+          f"({per_byte / per_notification:.0f}x, {NOTIFICATION_SIZE} byte notifications)")
+
+def main():
+    policy_test()
+    handoff_benchmark()
+
+# =============================================
+#                    DRIVER
+# =============================================
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,169 @@
+"""
+transport_benchmark.py
+Author: Derrick Lai
+Date: 2025-03-26
+Description: Load tests the PC side of the link with a SimulatedTransport instead of the Bluefruit, so it runs on any PC.
+1) Throughput - packets are sent as fast as the simulated link allows and read back through Protocol.
+2) Latency - EXAMPLE_EVENT packets over a link paced like the Bluefruit (9600 baud UART, 20 byte notifications, a BLE
+   connection interval of latency), timed from send to the EventHandler callback.
+3) Noisy link - bytes are corrupted and notifications dropped, every packet that gets through must be intact.
+4) Loopback - packets written with Protocol.send_packet come back and must decode to the same payload.
+"""
+# =============================================
+#                   IMPORTS
+# =============================================
+import sys
+import os
+import random
+import statistics
+import threading
+import time
+
+# Get the main directory
+parent_dir = os.path.abspath(os.path.join(os.path.dirname(__file__), ".."))
+sys.path.insert(0, parent_dir)
+from protocol import Protocol, HEAD, TAIL, CARRIAGE, NEWLINE, compute_checksum
+from event_handler import EventHandler
+from events import Events
+from transport import SimulatedTransport, DEFAULT_MTU
+
+# =============================================
+#                   CONSTANTS
+# =============================================
+MAC_ADDRESS = "00:00:00:00:00:00"
+THROUGHPUT_PACKETS = 20000
+THROUGHPUT_BANDWIDTH = None # No pacing, to find how fast the PC side can go
+LATENCY_EVENTS = 200
+BLUEFRUIT_BANDWIDTH = 960 # 9600 baud UART, 10 bits per byte
+BLUEFRUIT_LATENCY = 0.0075 # One 7.5 ms connection interval
+NOISY_PACKETS = 5000
+RANDOM_PACKET_MAX = 69 # Longest make_packet(random_payload()), 63 byte payload and 6 bytes of framing
+NOISY_CORRUPTION_RATE = 0.0005
+NOISY_DROP_RATE = 0.01
+LOOPBACK_PACKETS = 1000
+
+# =============================================
+#                     MAIN
+# =============================================
+def make_packet(payload : bytes) -> bytes:
+    """
+    @name: make_packet
+    @param payload: ID first
+    @return: The framed packet, the same bytes the STM32's BLE_SendPacket() produces
+    """
+    return bytes([HEAD, len(payload)]) + payload + bytes([TAIL, compute_checksum(payload), CARRIAGE, NEWLINE])
+
+def random_payload(rng : random.Random, sequence : int) -> bytes:
+    """
+    @name: random_payload
+    @return: An ID, a 2 byte sequence number and 0 to 60 random data bytes
+    """
+    data = bytes(rng.randrange(256) for _ in range(rng.randint(0, 60)))
+    return bytes([rng.randrange(8), sequence >> 8 & 0xFF, sequence & 0xFF]) + data
+
+def burst_buffer_size(packets : int) -> int:
+    """
+    @name: burst_buffer_size
+    @return: Notifications in a burst of that many random packets at most, a receive buffer this big drops none of them
+    """
+    return packets * RANDOM_PACKET_MAX // DEFAULT_MTU + 1
+
+def throughput_test():
+    rng = random.Random(1)
+    link = SimulatedTransport(bandwidth=THROUGHPUT_BANDWIDTH)
+    protocol = Protocol(MAC_ADDRESS, THROUGHPUT_PACKETS, receive_buffer_size=burst_buffer_size(THROUGHPUT_PACKETS),
+                        transport=link)
+    time.sleep(0.2)
+    
+    payloads = [random_payload(rng, i) for i in range(THROUGHPUT_PACKETS)]
+    stream = b"".join(make_packet(payload) for payload in payloads)
+    
+    start = time.perf_counter()
+    link.send(stream)
+    received = 0
+    while received < THROUGHPUT_PACKETS:
+        packet = protocol.get_packet(block=True, timeout=5)
+        if packet is None:
+            break
+        assert packet.payload == payloads[received]
+        received += 1
+    elapsed = time.perf_counter() - start
+    
+    print(f"Throughput: {received}/{THROUGHPUT_PACKETS} packets, {len(stream)} bytes in {elapsed:.2f} s -> "
+          f"{received / elapsed:.0f} packets/s, {len(stream) / elapsed / 1000:.0f} kB/s "
+          f"({link.notification_count} notifications)")
+
+def latency_test():
+    link = SimulatedTransport(bandwidth=BLUEFRUIT_BANDWIDTH, latency=BLUEFRUIT_LATENCY)
+    sent_times = dict()
+    latencies = list()
+    done = threading.Event()
+    
+    def event_cb(payload):
+        latencies.append(time.perf_counter() - sent_times[(payload[1] << 8) | payload[2]])
+        if len(latencies) == LATENCY_EVENTS:
+            done.set()
+    
+    event_handler = EventHandler(MAC_ADDRESS, 16, transport=link)
+    event_handler.on_event(Events.EXAMPLE_EVENT, event_cb)
+    time.sleep(0.2)
+    
+    # 10 byte packets, one every 20 ms keeps the 960 B/s link about half busy
+    for sequence in range(LATENCY_EVENTS):
+        sent_times[sequence] = time.perf_counter()
+        link.send(make_packet(bytes([Events.EXAMPLE_EVENT.value, sequence >> 8, sequence & 0xFF])))
+        time.sleep(0.02)
+    done.wait(timeout=5)
+    
+    latencies_ms = sorted(latency * 1000 for latency in latencies)
+    print(f"Latency at {BLUEFRUIT_BANDWIDTH} B/s + {BLUEFRUIT_LATENCY * 1000:.1f} ms: {len(latencies_ms)}/{LATENCY_EVENTS} events, "
+          f"min {latencies_ms[0]:.1f} ms, median {statistics.median(latencies_ms):.1f} ms, "
+          f"p99 {latencies_ms[int(len(latencies_ms) * 0.99)]:.1f} ms, max {latencies_ms[-1]:.1f} ms")
+
+def noisy_test():
+    rng = random.Random(2)
+    link = SimulatedTransport(corruption_rate=NOISY_CORRUPTION_RATE, drop_rate=NOISY_DROP_RATE, seed=3)
+    protocol = Protocol(MAC_ADDRESS, NOISY_PACKETS, receive_buffer_size=burst_buffer_size(NOISY_PACKETS), transport=link)
+    time.sleep(0.2)
+    
+    payloads = {i: random_payload(rng, i) for i in range(NOISY_PACKETS)}
+    link.send(b"".join(make_packet(payload) for payload in payloads.values()))
+    
+    received = 0
+    bad = 0
+    while True:
+        packet = protocol.get_packet(block=True, timeout=1)
+        if packet is None:
+            break
+        received += 1
+        bad += (packet.payload != payloads[(packet.payload[1] << 8) | packet.payload[2]])
+    
+    print(f"Noisy link ({NOISY_CORRUPTION_RATE} byte corruption, {NOISY_DROP_RATE} notification drop): "
+          f"{received}/{NOISY_PACKETS} packets delivered, {bad} bad, {protocol.decoder.error_count} frames rejected, "
+          f"{link.corrupted_bytes} bytes corrupted, {link.dropped_notifications} notifications dropped")
+
+def loopback_test():
+    rng = random.Random(4)
+    link = SimulatedTransport(loopback=True)
+    protocol = Protocol(MAC_ADDRESS, LOOPBACK_PACKETS, transport=link)
+    time.sleep(0.2)
+    
+    payloads = [random_payload(rng, i) for i in range(LOOPBACK_PACKETS)]
+    good = 0
+    for payload in payloads:
+        protocol.send_packet(list(payload))
+        packet = protocol.get_packet(block=True, timeout=1)
+        good += (packet is not None and packet.payload == payload)
+    print(f"Loopback: {good}/{LOOPBACK_PACKETS} packets came back intact")
+
+def main():
+    throughput_test()
+    latency_test()
+    noisy_test()
+    loopback_test()
+
+# =============================================
+#                    DRIVER
+# =============================================
+if __name__ == "__main__":
+    main()
@@ -24,60 +24,61 @@ https://stackoverflow.com/questions/58795086/python-convert-a-byte-array-back-to
 # =============================================
 import asyncio
 import threading
-from queue import Queue
-from bleak import BleakScanner, BleakClient
+from Common.circular_buffer import CircularBuffer, OverflowPolicy
+from transport import Transport, BleakTransport
 
 # =============================================
 #                   CONSTANTS
 # =============================================
-'''
-# UUID RX of the Adafruit Bluetooth BLE
-# https://learn.adafruit.com/introducing-the-adafruit-bluefruit-le-uart-friend/uart-service
-# Base UUID: 6E400001-B5A3-F393-E0A9-E50E24DCCA9E
-# Note: The '0001' part is very important, it is the base address, it is the default and does nothing,
-# change it to '0x0002' for it to transmit from computer to Adafruit BLE?
-# So TX UUID: 6E400002-B5A3-F393-E0A9-E50E24DCCA9E
-# RX UUID: 6E400003-B5A3-F393-E0A9-E50E24DCCA9E
-#
-# As for the MAC Address, this is found from BleakScanner.discover(), which provides a list of devices with the MAC address and name.
-'''
+# The MAC address is found from BleakScanner.discover(), which provides a list of devices with the MAC address and name.
+# The UUIDs of the Bluefruit's UART service are in transport.py.
 ADAFRUIT_BLE_MAC_ADDR = "C0:9E:48:AC:35:03"
-ADAFRUIT_BLE_TX_UUID = "6e400002-b5a3-f393-e0a9-e50e24dcca9e"
-ADAFRUIT_BLE_RX_UUID = "6e400003-b5a3-f393-e0a9-e50e24dcca9e"
 
-MAX_BUFFER_SIZE = 16 # Maximum size of the circular buffer for incoming messages
+MAX_BUFFER_SIZE = 16 # Maximum number of incoming notifications held in the buffer
 # =============================================
 #                   CLASSES
 # =============================================
 class BluefruitComm:
-    def __init__(self, mac_address):
+    def __init__(self, mac_address, buffer_size : int = MAX_BUFFER_SIZE, overflow_policy : OverflowPolicy = OverflowPolicy.DROP_NEWEST,
+                 transport : Transport = None):
         """
         @name: __init__
         @param mac_address: The mac address of the Bluefruit you're using.
+        @param transport: The link to use (see transport.py). Defaults to a BleakTransport to mac_address, pass a
+        SimulatedTransport to run without the Bluefruit.
+        @param buffer_size: Number of notifications the receive buffer holds.
+        @param overflow_policy: What happens to a notification that arrives while the receive buffer is full.
+        DROP_NEWEST (default) or DROP_OLDEST, both counted by the buffer. BLOCK raises a ValueError: a BLE notification
+        can't be pushed back on, and a put that waits inside the notify callback would stall the event loop instead.
+        Make the buffer big enough for the longest burst if nothing may be lost.
         @param event_loop: The asyncio event loop for running co-routines
         @param queue: The queue used to store packets for transmission
         @return: None
         @brief: This is just an initialization function.
         """
-        # Take MAC address and set up a client
+        # The notify callback runs on the event loop, it must never wait for room.
+        if overflow_policy == OverflowPolicy.BLOCK:
+            raise ValueError("The BLOCK overflow policy would stall the BLE event loop, use DROP_NEWEST or DROP_OLDEST.")
+        
+        # Take MAC address and set up the link
         self.mac_address = mac_address
-        self._client = BleakClient(mac_address)
+        self._transport = transport if transport is not None else BleakTransport(mac_address)
         self._client_connected = False
         
-        # Queue to store received messages/characters (we don't have to worry about memory, so no need for circular buffer)
-        self.receive_buffer = Queue(maxsize=MAX_BUFFER_SIZE)
+        # Buffer of received notifications, one item (and one lock) per notification. The counters tell what was dropped.
+        self.receive_buffer = CircularBuffer(buffer_size, overflow_policy)
         
         # Set up the event loop and queue (for outgoing messages) to prepare to be used by a thread (multithreading is used to contain this thread)
         self.event_loop = asyncio.new_event_loop()
         self.packet_queue = asyncio.Queue()
         
         # Create a thread to run the event loop and start the thread
+        self._loop_started = threading.Event()
         self._thread = threading.Thread(target=self.start_event_loop, daemon=True)
         self._thread.start()
         
         # Blocking Code: Wait until the event loop is running, it must run before co-routines can be submitted
-        while (not self.event_loop.is_running()):
-            pass
+        self._loop_started.wait()
         
         # Start the co-routines for the asynchronous functions (Note: This must be done after thread has been created, or else it may run in the wrong thread)
         asyncio.run_coroutine_threadsafe(self.connect(), self.event_loop)
@@ -90,8 +91,9 @@ class BluefruitComm:
         @return: None
         @brief: Starts up a permanent event loop.
         """
-        # Start the event loop and leave it to run forever
+        # Start the event loop and leave it to run forever (the first callback tells __init__ that it is running)
         asyncio.set_event_loop(self.event_loop)
+        self.event_loop.call_soon(self._loop_started.set)
         self.event_loop.run_forever()
     
     async def connect(self):
@@ -102,18 +104,11 @@ class BluefruitComm:
         @brief: Establishes a connection with the Bluefruit
         """
         print("Attempting connection to Bluefruit...")
-        # Connect with the Bluefruit
-        try:
-            await self._client.connect()
-        except Exception as e:
-            print(f"Error occured during connection attempt: {e}")
-            
-        if (self._client.is_connected):
+        # Connect with the Bluefruit, incoming notifications go to on_tx_notify
+        if (await self._transport.connect(self.on_tx_notify)):
             # Set connection flag to True
             self._client_connected = True
             print(f"Connected to Bluefruit with address {self.mac_address}")
-            # Establish a connection with incoming message events (you're sending it to the Bluefruit's Receive).
-            await self._client.start_notify(ADAFRUIT_BLE_RX_UUID, self.on_tx_notify)
         else:
             print(f"Failed to make a connection with the Bluefruit")
     
@@ -124,8 +119,8 @@ class BluefruitComm:
         @return: None
         @brief: Disconnect the Bluefruit from the device.
         """
-        # Disconnect the Bluetooth Bleak client (since it is an async function, it must be done inside an event loop)
-        asyncio.run_coroutine_threadsafe(self._client.disconnect(), self.event_loop)
+        # Disconnect the link (since it is an async function, it must be done inside an event loop)
+        asyncio.run_coroutine_threadsafe(self._transport.disconnect(), self.event_loop)
         
         # Kill the co-routines
         self.event_loop.close()
@@ -138,17 +133,10 @@ class BluefruitComm:
         @brief: When a message has been received by the PC, place it into the buffer
         """
          
-        # The message sent is a byte array. If the character is not ASCII, the byte array will represent it as a hex '\0x84' for example.
-        # However, if it is an ASCII character, such as 0x25, it will automaticalily convert to ASCII, to '%' for example.
-        # Convert the byte values into raw integer values, go through each value and send it into the buffer
-        for byte in list(message):
-            
-            # Drop characters if buffer is full.
-            if self.receive_buffer.full():
-                break
-            
-            # Send to the buffer
-            self.receive_buffer.put(byte)
+        # The message sent is a byte array holding however many bytes the notification carried. Keep it whole, the
+        # protocol decodes a notification at a time instead of a byte at a time.
+        # If the buffer is full, the overflow policy decides what gets dropped (and counts it).
+        self.receive_buffer.put(bytes(message))
     
     async def process_tx_queue(self):
         """
@@ -159,36 +147,50 @@ class BluefruitComm:
         """
         while True:
             # If the client isn't connected, then no messages should be processed, wait until the client is connected.
-            if (not self._client.is_connected):
+            if (not self._transport.is_connected):
                 await asyncio.sleep(1)
                 continue
             
             # Wait until the packet queue has a messsage
             packet_msg = await self.packet_queue.get()
             
-            # Transmit the packet (defaults to UTF-8, GATT takes in bytes)
-            await self._client.write_gatt_char(ADAFRUIT_BLE_TX_UUID, packet_msg.encode())
+            # Transmit the packet (GATT takes in bytes)
+            await self._transport.write(bytes(packet_msg))
             # print("Message transmitted...")
         
-    def get_message(self) -> str:
+    def get_message(self, block : bool = False, timeout : float = None) -> bytes:
         """
         @name: get_message
+        @param block: If True, sleep until a notification arrives instead of returning None straight away.
+        @param timeout: When blocking, the most seconds to wait (None waits forever).
+        @return: One whole notification as bytes, or None if there is nothing (within the timeout).
+        @brief: Reads from the receive buffer to obtain data, one whole notification as bytes.
+        Note: Indexing or iterating the bytes gives integers. Follow ASCII convention to figure out the characters.
+        """
+        # The thread sleeps inside the buffer until on_tx_notify puts something in, so waiting costs no CPU.
+        return self.receive_buffer.get(block=block, timeout=timeout)
+    
+    @property
+    def transport(self) -> Transport:
+        """
+        @name: transport
+        @return: The link in use, e.g. to call send() on a SimulatedTransport.
+        """
+        return self._transport
+    
+    def get_receive_stats(self) -> dict:
+        """
+        @name: get_receive_stats
         @param None
-        @return: None
-        @brief: Reads from the receive buffer to obtain data, should be one byte.
-        Note: This byte of data is in integer form. Follow ASCII convention to figure out the character.
+        @return: The receive buffer counters (put_count, dropped_count, overwritten_count, their byte totals, high_water).
+        @brief: Use this to tell whether notifications are being lost because the protocol can't keep up.
         """
-        # If the receive queue is empty, return None
-        if self.receive_buffer.empty():
-            return None
-        
-        # Return the item
-        return self.receive_buffer.get()
+        return self.receive_buffer.get_stats()
     
     def send_message(self, protocol_packet) -> None:
         """
         @name: send_message
-        @param protocol_packet: The fully assembled protocol packet that is ready to be transmitted.
+        @param protocol_packet: The fully assembled protocol packet that is ready to be transmitted, as bytes.
         @return: None
         @brief: Sends a message by placing it onto the queue.
         """
@@ -21,16 +21,17 @@ from events import Events
 #                   CLASSES
 # =============================================
 class EventHandler:
-    def __init__(self, mac_address, max_packet_queue_size):
+    def __init__(self, mac_address, max_packet_queue_size, transport = None):
         """
         @name: __init__
         @param mac_address: The mac address of the Bluefruit you're using.
         @param max_packet_queue_size: The maximum number of packets that can be in the buffer at once.
+        @param transport: The link to use, see BluefruitComm (None for the real Bluefruit).
         @return: None
         @brief: This is just an initialization function.
         """
         # Set up the protocol
-        self._protocol = Protocol(mac_address, max_packet_queue_size)
+        self._protocol = Protocol(mac_address, max_packet_queue_size, transport=transport)
         self._event_dict = dict() # Dictionary to store the events
         self._event_callback_dict = dict() # Dictionary to store callback functions
         
@@ -51,8 +52,8 @@ class EventHandler:
         @brief: This function parses the packets and raise events that corresponds to the packet ID
         """
         while True:
-            # Grab the packet, if there is none, ignore
-            packet = self._protocol.get_packet()
+            # Sleep until a packet arrives
+            packet = self._protocol.get_packet(block=True)
             if (packet is None):
                 continue
             
@@ -76,6 +77,14 @@ class EventHandler:
             # Call the callback function, sending in the payload as the arguments
             event_cb(packet_payload)
     
+    @property
+    def protocol(self) -> Protocol:
+        """
+        @name: protocol
+        @return: The protocol underneath, for sending packets and reading its statistics.
+        """
+        return self._protocol
+    
     def on_event(self, event : Enum, event_callback):
         """
         @name: on_event
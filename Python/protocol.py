@@ -38,10 +38,18 @@ https://www.freecodecamp.org/news/python-switch-statement-switch-case-example/
 # =============================================
 import asyncio
 import threading
-import copy
-from queue import Queue
+from collections import namedtuple
+from queue import Queue, Empty
 from enum import Enum
-from ble_comm import BluefruitComm
+from ble_comm import BluefruitComm, MAX_BUFFER_SIZE
+from transport import Transport
+from Common.circular_buffer import OverflowPolicy
+
+# Optional native module (build with "python setup.py build_ext --inplace"), shares its checksum code with the STM32.
+try:
+    import packet_native
+except ImportError:
+    packet_native = None
 
 # =============================================
 #                   CONSTANTS
@@ -52,6 +60,27 @@ TAIL = 185 # Equals 0xB9
 CARRIAGE = 13 # Equals 0x0D or '\r'
 NEWLINE = 10 # Equals 0x0A or '\n'
 
+# =============================================
+#                   FUNCTIONS
+# =============================================
+def compute_checksum(payload, initial : int = 0):
+    """
+    @name: compute_checksum
+    @param payload: The whole payload (ID first), as a list of ints, bytes or bytearray.
+    @param initial: The checksum of any bytes before the payload (0 to start).
+    @return: The checksum of the payload as an int.
+    @brief: Same result as running PacketDecoder.compute_iterative_checksum over every byte, but done in one call
+    to Common/Checksum.c when the native module is built.
+    """
+    if packet_native is not None:
+        return packet_native.checksum(bytes(payload), initial)
+    
+    # Pure Python fallback: rotate right by one and add the byte, keeping the bottom 8 bits.
+    checksum = initial
+    for byte in payload:
+        checksum = ((checksum >> 1) + (checksum << 7) + byte) & 0xFF
+    return checksum
+
 # =============================================
 #                   CLASSES
 # =============================================
@@ -60,7 +89,8 @@ NEWLINE = 10 # Equals 0x0A or '\n'
 @brief: These are the enums that will be used for the state machine to process and form packets. Here is a brief summary of the FSM.
 AWAIT_HEAD - Checks for the head byte to begin packet building.
 AWAIT_LENGTH - Wait for the next byte, assuming its the length.
-AWAIT_PAYLOAD - Will keep taking data bytes in this state until it receives a tail.
+AWAIT_PAYLOAD - Will keep taking data bytes in this state until it has LENGTH bytes (ID included).
+AWAIT_TAIL - Waits for the tail byte that closes the payload.
 AWAIT_CHKSUM - Waits for the checksum to compare with the computed checksum.
 AWAIT_END_RC - Waits for the return carriage '\r' in the first part to signify the end of transmission.
 AWAIT_END_NL - Waits for the newline '\n' as the final part to represent end of transmission and to form the full packet.
@@ -70,109 +100,72 @@ class PacketStates(Enum):
     AWAIT_LENGTH = 1,
     AWAIT_ID = 2,
     AWAIT_PAYLOAD = 3,
-    AWAIT_CHKSUM = 4,
-    AWAIT_END_RC = 5,
-    AWAIT_END_NL = 6
+    AWAIT_TAIL = 4,
+    AWAIT_CHKSUM = 5,
+    AWAIT_END_RC = 6,
+    AWAIT_END_NL = 7
 
-class Protocol:
-    def __init__(self, mac_address, max_queue_size):
+"""
+@class: Packet
+@brief: A received packet, immutable so it can be handed to other threads without copying. The fields are in the same
+order as the lists the protocol used to build, so packet[2][0] is still the ID.
+head - The head byte (0xCC)
+length - The length byte, number of payload bytes (ID included)
+payload - The payload as bytes, payload[0] is the ID
+checksum - The checksum byte
+tail - The tail byte (0xB9)
+"""
+if packet_native is not None:
+    Packet = packet_native.Packet
+    make_packet = lambda *fields: Packet(fields) # Struct sequences are built from a single tuple
+else:
+    Packet = namedtuple("Packet", ["head", "length", "payload", "checksum", "tail"])
+    make_packet = Packet
+
+class PacketDecoder:
+    def __init__(self):
         """
         @name: __init__
-        @param mac_address: The mac address of the Bluefruit that you want to connect to.
-        @return: None
-        @brief: Initializing to set up Bluefruit transmission/reception and a thread to process received characters for forming packets.
-        """
-        # Initialize the Bluefruit Client (for transmission and reception)
-        self.bf_client = BluefruitComm(mac_address=mac_address)
-        self.packet_queue = Queue(maxsize=max_queue_size)
-        
-        # Set up a thread to pull characters
-        self._thread = threading.Thread(target=self.__receive_characters, daemon=True)
-        self._thread.start()
-        
-        # State control for FSM (Initial starts starts by waiting for the head)
-        self._temp_packet = list() # Packet will be stored in a list, payload will be another list inside.
-        self._current_state = PacketStates.AWAIT_HEAD
-        self._current_chk_sum = 0
-        
-    def get_packet(self):
-        """
-        @name: get_packet
         @param None
         @return: None
-        @brief: Returns a fully-formed packet from the queue if there is one, otherwise, it will return None.
+        @brief: Pure Python packet decoder, used when the native module (packet_native.Decoder) isn't built.
+        Both have the same interface: feed() takes received bytes and returns the finished packets.
         """
-        # Return none if empty.
-        if self.packet_queue.empty():
-            return None
-        
-        # Return the first item from the queue
-        return self.packet_queue.get()
+        self.packet_count = 0
+        self.error_count = 0
+        self._packets = list()
+        self.reset()
     
-    def send_packet(self, data : list):
+    def reset(self):
         """
-        @name: get_packet
-        @param data : The data payload (stored in a list, each value should be a single character (byte))
+        @name: reset
+        @param None
         @return: None
-        @brief: Returns a fully-formed packet from the queue if there is one, otherwise, it will return None.
+        @brief: Drops any partial packet, the counters are kept.
         """
-        # Assemble the packet in list form.
-        packet_to_send = list()
-        
-        # Set the head (we're sending the ASCII ints directly. On the plus side, GATT doesn't have to encode the strings)
-        packet_to_send.append(HEAD)
-        
-        # Set the length (the length of the data array in the form of a string)
-        packet_to_send.append(len(data))
-        
-        # Append the payload, also calculate the checksum
-        checksum = 0
-        for byte in data:
-            packet_to_send.append(byte)
-            checksum = self.__compute_iterative_checksum(byte, checksum) # The checksum takes in an integer
-        
-        # Set the tail
-        packet_to_send.append(TAIL)
-        
-        # Set the checksum (convert to a equivalent character first)
-        packet_to_send.append(checksum)
-        
-        # Set the two end bytes, the return carriage '\r' and newline 'n', convert to char first.
-        packet_to_send.append(CARRIAGE)
-        packet_to_send.append(NEWLINE)
-        
-        # Convert each item into a character
-        for i in range(len(packet_to_send)):
-            byte = packet_to_send[i]
-            packet_to_send[i] = chr(byte)
-        
-        # Join the string and send the entire packet as a message
-        packet_str = "".join(packet_to_send)
-        self.bf_client.send_message(packet_str)
-
+        self._current_state = PacketStates.AWAIT_HEAD
+        self._length = 0
+        self._payload = bytearray()
+        self._current_chk_sum = 0
     
-    def __receive_characters(self):
+    def feed(self, data) -> list:
         """
-        @name: __receive_characters
-        @param mac_address: None
-        @return: None
-        @brief: Checks the BluefruitComm's receive buffer for incoming ASCII integers, and if there is, 
-        takes the character to update the FSM used to build the packet.
+        @name: feed
+        @param data: Received bytes (bytes, bytearray or a list of ints), a packet can be split across any number of calls.
+        @return: A list of the packets completed by these bytes, empty if none.
+        @brief: Runs every byte through the state machine.
         """
-        # print("Receiving Characters...")
-        while (True):
-            # Read from the buffer, if there is nothing, wait until the next iteration
-            byte_int = self.bf_client.get_message()
-            if byte_int is None:
-                continue
-            
-            # Otherwise, update the FSM with the character
-            # print("Received the character: ", byte_int)
-            self.__update_fsm(byte_int)
+        for char_byte in data:
+            self.__update_fsm(char_byte)
+        
+        packets = self._packets
+        self._packets = list()
+        return packets
     
-    def __compute_iterative_checksum(self, char_byte : int, previous_chk_sum : int):
+    @staticmethod
+    def compute_iterative_checksum(char_byte : int, previous_chk_sum : int):
         """
-        @name: __compute_iterative_checksum
+        @name: compute_iterative_checksum
         @param char_byte: The new character (represented in ASCII integer form) to compute the new checksum on.
         @param: previous_chk_sum: The previously calculated checksum.
         @return: None
@@ -191,114 +184,183 @@ class Protocol:
         
         return checksum
     
-    def __update_fsm(self, char_byte : str):
+    def __drop_packet(self):
+        """
+        @name: __drop_packet
+        @param None
+        @return: None
+        @brief: A check failed, count it and go back to waiting for a head.
+        """
+        self.error_count += 1
+        self._current_state = PacketStates.AWAIT_HEAD
+    
+    def __update_fsm(self, char_byte : int):
         """
         @name: __update_fsm
         @param char_byte -> A character (byte) that is part of the packet. The state machine will determine how its assembled. Note: Represented as an INT
         @return: None
-        @brief: Starts the event loop necessary to run the thread that is in charge of receiving messages and building the
-        packets.
+        @brief: Advances the packet state machine by one byte. Same rules as the STM32 parser (BLE_ParseBytes), the payload is
+        LENGTH bytes long and any frame that fails a check is dropped.
         """
-        # Check the state and perform the actions based on the state.
-        # Convert the char into a byte format.
         match self._current_state:
             
             case PacketStates.AWAIT_HEAD:
-                # If the incoming character matches the head, insert to packet and transition to next state.
+                # If the incoming character matches the head, transition to next state.
                 if (char_byte == HEAD):
-                    self._temp_packet.append(char_byte)
                     self._current_state = PacketStates.AWAIT_LENGTH
-                    
-                # print("Head State")
             
             case PacketStates.AWAIT_LENGTH:
-                # Take in the next character and include to packet, transition to next state.
-                # Assume every character is the length (the checksum will validate this later)
-                self._temp_packet.append(char_byte)
+                # The payload holds at least the ID, and no more than 128 bytes (the checksum will validate the rest later)
+                if (char_byte == 0 or char_byte > 128):
+                    self.__drop_packet()
+                    return
+                self._length = char_byte
                 self._current_state = PacketStates.AWAIT_ID
-                
-                # print("Length State")
             
             case PacketStates.AWAIT_ID:
-                # Assume the next character is the ID, insert to payload data, then add to checksum for validation.
-                payload_data = list()
-                self._temp_packet.append(payload_data)
-                payload_data.append(char_byte)
-                
-                # Append an integer (representing the checksum value) to the packet, it starts at 0
-                check_sum = 0
-                self._temp_packet.append(check_sum)
-                
-                # Checksum calculations, then replace old checksum with the new value.
-                new_checksum = self.__compute_iterative_checksum(char_byte, check_sum)
-                self._temp_packet[3] = new_checksum # The 3rd index (4th) item inserted is the checksum value.
-                
-                # Transition to next state
-                self._current_state = PacketStates.AWAIT_PAYLOAD
-                
-                # print("ID State")
+                # The ID is the first byte of the payload, it is part of the checksum.
+                self._payload = bytearray((char_byte,))
+                self._current_chk_sum = self.compute_iterative_checksum(char_byte, 0)
+                self._current_state = PacketStates.AWAIT_TAIL if (self._length == 1) else PacketStates.AWAIT_PAYLOAD
             
             case PacketStates.AWAIT_PAYLOAD:
-                
-                # print("Payload State")
-                # Transition condition: If we received a tail value, transition states and exit.
-                if (char_byte == TAIL):
-                    self._temp_packet.append(char_byte)
-                    self._current_state = PacketStates.AWAIT_CHKSUM
+                # Keep taking payload values until we have LENGTH of them, update checksum
+                self._payload.append(char_byte)
+                self._current_chk_sum = self.compute_iterative_checksum(char_byte, self._current_chk_sum)
+                if (len(self._payload) == self._length):
+                    self._current_state = PacketStates.AWAIT_TAIL
+            
+            case PacketStates.AWAIT_TAIL:
+                if (char_byte != TAIL):
+                    self.__drop_packet()
                     return
-                
-                # Keep assuming that the new character given is a payload value, update checksum
-                payload_data : list = self._temp_packet[2] # 3rd item in packet is the payload list.
-                payload_data.append(char_byte)
-                new_checksum : int = self.__compute_iterative_checksum(char_byte, self._temp_packet[3])
-                self._temp_packet[3] = new_checksum
+                self._current_state = PacketStates.AWAIT_CHKSUM
             
             case PacketStates.AWAIT_CHKSUM:
-                
-                # print("Checksum State")
-                
                 # The next character is the value of the checksum, try to match the value with the calculated
                 # checksum from the sent payload. If the values don't match, then the packet is invalid.
-                # If this is the case, than clear the list and wait for a head.
-                calc_checksum = self._temp_packet[3]
-                
-                if (calc_checksum != char_byte):
-                    self._temp_packet.clear()
-                    self._current_state = PacketStates.AWAIT_HEAD
+                if (self._current_chk_sum != char_byte):
+                    self.__drop_packet()
                     return
-                    
-                # If the checksum matches, transition to the next state.
                 self._current_state = PacketStates.AWAIT_END_RC
-                
             
             case PacketStates.AWAIT_END_RC:
-                
-                # print("Return Carriage State")
                 # If the new incoming character isn't a return carriage, then assume loss in transition
                 # and try to restart the packet
                 if (char_byte != CARRIAGE):
-                    self._temp_packet.clear()
-                    self._current_state = PacketStates.AWAIT_HEAD
+                    self.__drop_packet()
                     return
-                
-                # Return carriage is given, transition to the next state
                 self._current_state = PacketStates.AWAIT_END_NL
             
             case PacketStates.AWAIT_END_NL:
-                
-                # print("New Line State")
-                # In every case, transition will be directly back to the head
-                self._current_state = PacketStates.AWAIT_HEAD
-                
                 # Same principle applies as AWAIT_END_RC. The incoming character must be a new line, or else
                 # a loss in transition is assume, packet will restart in this case
                 if (char_byte != NEWLINE):
-                    self._temp_packet.clear()
+                    self.__drop_packet()
                     return
                 
-                # The packet is completed, send the packet to the queue for processing, then clear the array
-                if (not self.packet_queue.full()):
-                    self.packet_queue.put(copy.deepcopy(self._temp_packet))
-                    self._temp_packet.clear()
+                # In every case, transition will be directly back to the head
+                self._current_state = PacketStates.AWAIT_HEAD
+                self._packets.append(make_packet(HEAD, self._length, bytes(self._payload), self._current_chk_sum, TAIL))
+                self.packet_count += 1
             case _:
-                raise("The protocol state machine has reached an undefined state!")
\ No newline at end of file
+                raise Exception("The protocol state machine has reached an undefined state!")
+
+class Protocol:
+    def __init__(self, mac_address, max_queue_size, receive_buffer_size : int = MAX_BUFFER_SIZE,
+                 receive_overflow_policy : OverflowPolicy = OverflowPolicy.DROP_NEWEST, transport : Transport = None):
+        """
+        @name: __init__
+        @param mac_address: The mac address of the Bluefruit that you want to connect to.
+        @param max_queue_size: Number of decoded packets held for get_packet().
+        @param receive_buffer_size: Number of notifications BluefruitComm holds before its overflow policy kicks in.
+        @param receive_overflow_policy: See BluefruitComm.
+        @param transport: The link to use, see BluefruitComm (None for the real Bluefruit).
+        @return: None
+        @brief: Initializing to set up Bluefruit transmission/reception and a thread to process received characters for forming packets.
+        """
+        # Initialize the Bluefruit Client (for transmission and reception)
+        self.bf_client = BluefruitComm(mac_address=mac_address, buffer_size=receive_buffer_size,
+                                       overflow_policy=receive_overflow_policy, transport=transport)
+        self.packet_queue = Queue(maxsize=max_queue_size)
+        
+        # Packet decoder, the compiled one if it has been built (see setup.py), otherwise the Python one.
+        self._decoder = packet_native.Decoder() if packet_native is not None else PacketDecoder()
+        
+        # Set up a thread to pull characters
+        self._thread = threading.Thread(target=self.__receive_characters, daemon=True)
+        self._thread.start()
+        
+    def get_packet(self, block : bool = False, timeout : float = None):
+        """
+        @name: get_packet
+        @param block: If True, sleep until a packet arrives instead of returning None straight away.
+        @param timeout: When blocking, the most seconds to wait (None waits forever).
+        @return: The oldest packet, or None if there is none (within the timeout).
+        @brief: Returns a fully-formed packet from the queue if there is one, otherwise, it will return None.
+        """
+        try:
+            return self.packet_queue.get(block=block, timeout=timeout)
+        except Empty:
+            return None
+    
+    def send_packet(self, data : list):
+        """
+        @name: send_packet
+        @param data : The data payload (stored in a list, each value should be a single character (byte)), ID first
+        @return: None
+        @brief: Frames the payload into a packet and hands it to the Bluefruit for transmission.
+        """
+        # Assemble the packet in list form.
+        packet_to_send = list()
+        
+        # Set the head (we're sending the ASCII ints directly. On the plus side, GATT doesn't have to encode the strings)
+        packet_to_send.append(HEAD)
+        
+        # Set the length (the length of the data array in the form of a string)
+        packet_to_send.append(len(data))
+        
+        # Append the payload, also calculate the checksum over the whole payload in one call
+        packet_to_send.extend(data)
+        checksum = compute_checksum(data)
+        
+        # Set the tail
+        packet_to_send.append(TAIL)
+        
+        # Set the checksum (convert to a equivalent character first)
+        packet_to_send.append(checksum)
+        
+        # Set the two end bytes, the return carriage '\r' and newline 'n', convert to char first.
+        packet_to_send.append(CARRIAGE)
+        packet_to_send.append(NEWLINE)
+        
+        # Send the entire packet as raw bytes (a str would be UTF-8 encoded, turning every byte above 0x7F into two)
+        self.bf_client.send_message(bytes(packet_to_send))
+
+    
+    def __receive_characters(self):
+        """
+        @name: __receive_characters
+        @param mac_address: None
+        @return: None
+        @brief: Checks the BluefruitComm's receive buffer for incoming notifications, and if there is one, runs all of its
+        bytes through the decoder at once and queues the finished packets.
+        """
+        while (True):
+            # Sleep until a notification arrives (no polling, the thread uses no CPU while the link is quiet)
+            message = self.bf_client.get_message(block=True)
+            if message is None:
+                continue
+            
+            # Otherwise, decode the whole notification. Packets are immutable, so they are queued as is.
+            for packet in self._decoder.feed(message):
+                if (not self.packet_queue.full()):
+                    self.packet_queue.put(packet)
+    
+    @property
+    def decoder(self):
+        """
+        @name: decoder
+        @return: The packet decoder in use, for its packet_count and error_count.
+        """
+        return self._decoder
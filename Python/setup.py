@@ -0,0 +1,38 @@
+"""
+setup.py
+Author: Derrick Lai
+Date: 2025-03-22
+Description: Builds the optional native module used by protocol.py. The checksum is compiled from the same source
+as the STM32 firmware (Common/Checksum.c).
+
+Usage (from this folder):
+    python setup.py build_ext --inplace
+"""
+# =============================================
+#                   IMPORTS
+# =============================================
+import os
+from setuptools import setup, Extension
+
+# =============================================
+#                   CONSTANTS
+# =============================================
+HERE = os.path.dirname(os.path.abspath(__file__))
+COMMON_DIR = os.path.relpath(os.path.join(HERE, "..", "Common"), HERE)
+
+# =============================================
+#                    SETUP
+# =============================================
+packet_native = Extension(
+    "packet_native",
+    sources=[os.path.join("Native", "packet_native.c"), os.path.join(COMMON_DIR, "Checksum.c")],
+    include_dirs=[COMMON_DIR],
+    extra_compile_args=["-O2"] if os.name != "nt" else ["/O2"],
+)
+
+setup(
+    name="packet_native",
+    version="1.0",
+    description="Native helpers for the Bluetooth MP3 player protocol",
+    ext_modules=[packet_native],
+)
@@ -0,0 +1,237 @@
+"""
+transport.py
+Author: Derrick Lai
+Date: 2025-03-26
+Description: The link underneath BluefruitComm. BluefruitComm only needs to connect, get notified of incoming bytes and
+write outgoing bytes, so the link is kept behind this small interface:
+
+    await transport.connect(on_notify)   -> True if connected, on_notify(sender, data) is called for every notification
+    await transport.write(data)          -> sends bytes to the STM32
+    await transport.disconnect()
+    transport.is_connected
+
+BleakTransport talks to the real Adafruit Bluefruit LE UART Friend. SimulatedTransport stands in for it so the protocol and
+event layers can be load tested on any PC without a radio. It cuts the STM32's byte stream into MTU sized notifications,
+paces them at a set bandwidth, delays them by a set latency, and can corrupt bytes or drop whole notifications.
+
+Sources:
+https://bleak.readthedocs.io/en/latest/api/client.html
+https://learn.adafruit.com/introducing-the-adafruit-bluefruit-le-uart-friend/uart-service
+"""
+# =============================================
+#                   IMPORTS
+# =============================================
+import asyncio
+import random
+import threading
+import time
+
+# =============================================
+#                   CONSTANTS
+# =============================================
+'''
+# UUID RX of the Adafruit Bluetooth BLE
+# https://learn.adafruit.com/introducing-the-adafruit-bluefruit-le-uart-friend/uart-service
+# Base UUID: 6E400001-B5A3-F393-E0A9-E50E24DCCA9E
+# Note: The '0001' part is very important, it is the base address, it is the default and does nothing,
+# change it to '0x0002' for it to transmit from computer to Adafruit BLE?
+# So TX UUID: 6E400002-B5A3-F393-E0A9-E50E24DCCA9E
+# RX UUID: 6E400003-B5A3-F393-E0A9-E50E24DCCA9E
+#
+# As for the MAC Address, this is found from BleakScanner.discover(), which provides a list of devices with the MAC address and name.
+'''
+ADAFRUIT_BLE_TX_UUID = "6e400002-b5a3-f393-e0a9-e50e24dcca9e"
+ADAFRUIT_BLE_RX_UUID = "6e400003-b5a3-f393-e0a9-e50e24dcca9e"
+
+DEFAULT_MTU = 20 # Bytes per notification with the default ATT MTU of 23
+
+# =============================================
+#                   CLASSES
+# =============================================
+class Transport:
+    """
+    @class: Transport
+    @brief: Interface every transport implements. All the coroutines run on BluefruitComm's event loop.
+    """
+    @property
+    def is_connected(self) -> bool:
+        raise NotImplementedError
+    
+    async def connect(self, on_notify) -> bool:
+        raise NotImplementedError
+    
+    async def disconnect(self):
+        raise NotImplementedError
+    
+    async def write(self, data : bytes):
+        raise NotImplementedError
+
+class BleakTransport(Transport):
+    def __init__(self, mac_address):
+        """
+        @name: __init__
+        @param mac_address: The mac address of the Bluefruit you're using.
+        @return: None
+        @brief: Transport over a real BLE connection with the Bluefruit.
+        """
+        # Imported here so the simulated transport works on machines without bleak installed
+        from bleak import BleakClient
+        self.mac_address = mac_address
+        self._client = BleakClient(mac_address)
+    
+    @property
+    def is_connected(self) -> bool:
+        return self._client.is_connected
+    
+    async def connect(self, on_notify) -> bool:
+        """
+        @name: connect
+        @param on_notify: Called with (sender, bytearray) for every notification from the Bluefruit.
+        @return: True if connected.
+        @brief: Establishes a connection with the Bluefruit and subscribes to its RX characteristic.
+        """
+        try:
+            await self._client.connect()
+        except Exception as e:
+            print(f"Error occured during connection attempt: {e}")
+        
+        if (not self._client.is_connected):
+            return False
+        
+        # Establish a connection with incoming message events (you're sending it to the Bluefruit's Receive).
+        await self._client.start_notify(ADAFRUIT_BLE_RX_UUID, on_notify)
+        return True
+    
+    async def disconnect(self):
+        await self._client.disconnect()
+    
+    async def write(self, data : bytes):
+        await self._client.write_gatt_char(ADAFRUIT_BLE_TX_UUID, data)
+
+class SimulatedTransport(Transport):
+    def __init__(self, mtu : int = DEFAULT_MTU, bandwidth : float = None, latency : float = 0.0,
+                 corruption_rate : float = 0.0, drop_rate : float = 0.0, loopback : bool = False, seed : int = None):
+        """
+        @name: __init__
+        @param mtu: Most bytes carried by one notification.
+        @param bandwidth: Bytes per second from the STM32 to the PC (None for no limit).
+        @param latency: Seconds between a notification leaving the STM32 and reaching the PC.
+        @param corruption_rate: Chance that any byte has a bit flipped.
+        @param drop_rate: Chance that a whole notification is lost.
+        @param loopback: If True, everything written by the PC is sent straight back as if the STM32 echoed it.
+        @param seed: Seed for the corruption/drop randomness (None for random).
+        @return: None
+        @brief: A Bluefruit that only exists in software. Call send() (from any thread) to play the STM32's part.
+        """
+        self.mtu = mtu
+        self.bandwidth = bandwidth
+        self.latency = latency
+        self.corruption_rate = corruption_rate
+        self.drop_rate = drop_rate
+        self.loopback = loopback
+        self._random = random.Random(seed)
+        
+        self._connected = False
+        self._on_notify = None
+        self._loop = None
+        self._outgoing = None
+        self._delivery_task = None
+        self._link_free_at = 0.0 # When the simulated link finishes sending what has been queued so far
+        self._lock = threading.Lock()
+        
+        # Statistics
+        self.sent_bytes = 0
+        self.notification_count = 0
+        self.dropped_notifications = 0
+        self.corrupted_bytes = 0
+        self.written = list() # Everything the PC wrote, in order
+    
+    @property
+    def is_connected(self) -> bool:
+        return self._connected
+    
+    async def connect(self, on_notify) -> bool:
+        """
+        @name: connect
+        @param on_notify: Called with (sender, bytearray) for every notification.
+        @return: True
+        @brief: "Connects" straight away and starts delivering notifications on the running event loop.
+        """
+        self._on_notify = on_notify
+        self._loop = asyncio.get_running_loop()
+        self._outgoing = asyncio.Queue()
+        self._delivery_task = self._loop.create_task(self.__deliver())
+        self._connected = True
+        return True
+    
+    async def disconnect(self):
+        self._connected = False
+        if self._delivery_task is not None:
+            self._delivery_task.cancel()
+    
+    async def write(self, data : bytes):
+        """
+        @name: write
+        @param data: Bytes the PC sends to the STM32.
+        @return: None
+        @brief: Records the bytes, and echoes them back when loopback is on.
+        """
+        self.written.append(bytes(data))
+        if self.loopback:
+            self.send(data)
+    
+    def send(self, data : bytes):
+        """
+        @name: send
+        @param data: Bytes the STM32 transmits over its UART.
+        @return: None
+        @brief: Cuts the bytes into notifications and schedules each one to arrive after the link has had time to send it
+        (bandwidth) plus the latency. Safe to call from any thread once connected.
+        """
+        if not self._connected:
+            return
+        
+        with self._lock:
+            now = time.perf_counter()
+            for i in range(0, len(data), self.mtu):
+                chunk = bytes(data[i:i + self.mtu])
+                
+                # The link sends one notification after the other, so each one waits for the one before to finish.
+                start = max(now, self._link_free_at)
+                self._link_free_at = start + (len(chunk) / self.bandwidth if self.bandwidth else 0.0)
+                arrival = self._link_free_at + self.latency
+                
+                self.sent_bytes += len(chunk)
+                if self.drop_rate and self._random.random() < self.drop_rate:
+                    self.dropped_notifications += 1
+                    continue
+                if self.corruption_rate:
+                    chunk = self.__corrupt(chunk)
+                self._loop.call_soon_threadsafe(self._outgoing.put_nowait, (arrival, chunk))
+    
+    def __corrupt(self, chunk : bytes) -> bytes:
+        """
+        @name: __corrupt
+        @return: The chunk with random bit flips, each byte has corruption_rate chance of being hit.
+        """
+        corrupted = bytearray(chunk)
+        for i in range(len(corrupted)):
+            if self._random.random() < self.corruption_rate:
+                corrupted[i] ^= 1 << self._random.randrange(8)
+                self.corrupted_bytes += 1
+        return bytes(corrupted)
+    
+    async def __deliver(self):
+        """
+        @name: __deliver
+        @brief: Hands every notification to on_notify once its arrival time has come, in order.
+        """
+        while True:
+            arrival, chunk = await self._outgoing.get()
+            delay = arrival - time.perf_counter()
+            if delay > 0:
+                await asyncio.sleep(delay)
+            self.notification_count += 1
+            result = self._on_notify("simulated", bytearray(chunk))
+            if asyncio.iscoroutine(result):
+                await result